@@ -0,0 +1,168 @@
+
+//
+// dispatch.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "vm.h"
+#include "object.h"
+#include "opcodes.h"
+
+/*
+ * Constant n as an RK operand.
+ */
+
+#define KN(n) RKASK(n)
+
+/*
+ * Emit an instruction.
+ */
+
+#define emit(op, a, b, c) \
+  kv_push(luna_instruction_t, vm->main->code, ABC(op, a, b, c));
+
+/*
+ * Iterations.
+ */
+
+#define ARITH_RUNS 200000
+#define LOOP_COUNT 20000000
+
+/*
+ * Alloc a vm with the given `constants`.
+ */
+
+static luna_vm_t *
+vm_new(luna_value_t *constants, int nconstants) {
+  luna_vm_t *vm = malloc(sizeof(luna_vm_t));
+  vm->trace = NULL;
+  kv_init(vm->registers);
+  vm->sched = NULL;
+  vm->main = malloc(sizeof(luna_activation_t));
+  vm->main->nregisters = 4;
+  kv_init(vm->main->code);
+  kv_init(vm->main->lines);
+  luna_vec_init(&vm->main->constants);
+  for (int n = 0; n < nconstants; ++n) {
+    luna_vec_push(&vm->main->constants, constants[n]);
+  }
+  return vm;
+}
+
+/*
+ * Straight-line arithmetic, evaluated ARITH_RUNS times.
+ */
+
+static luna_value_t arith_constants[] = {
+  luna_value_int(3),
+  luna_value_int(7),
+  luna_value_int(2),
+  luna_value_int(5)
+};
+
+static luna_vm_t *
+arith_program() {
+  luna_vm_t *vm = vm_new(arith_constants, 4);
+
+  emit(LOADK, 0, 0, 0);
+  for (int n = 0; n < 200; ++n) {
+    emit(ADD, 1, 0, KN(1));
+    emit(MUL, 2, 1, KN(2));
+    emit(SUB, 3, 2, 0);
+    emit(BIT_XOR, 0, 3, KN(3));
+    emit(MOD, 0, 0, KN(1));
+  }
+  emit(HALT, 0, 0, 0);
+  vm->main->ip = vm->main->code.a;
+
+  return vm;
+}
+
+/*
+ * Counting loop of LOOP_COUNT iterations.
+ */
+
+static luna_value_t loop_constants[] = {
+  luna_value_int(LOOP_COUNT),
+  luna_value_int(0),
+  luna_value_int(3),
+  luna_value_int(2),
+  luna_value_int(1)
+};
+
+static luna_vm_t *
+loop_program() {
+  luna_vm_t *vm = vm_new(loop_constants, 5);
+
+  emit(LOADK, 0, 0, 0);       // n = LOOP_COUNT
+  emit(LOADK, 1, 1, 0);       // acc = 0
+  emit(ADD, 1, 1, KN(2));     // loop: acc += 3
+  emit(MUL, 2, 1, KN(3));     // tmp = acc * 2
+  emit(SUB, 0, 0, KN(4));     // n -= 1
+  emit(LT, 0, KN(1), 0);      // 0 < n ?
+  emit(JMP, 0, 1, 0);         // exit
+  emit(JMP, 0, -6, 0);        // loop
+  emit(MOVE, 0, 1, 0);
+  emit(HALT, 0, 0, 0);
+  vm->main->ip = vm->main->code.a;
+
+  return vm;
+}
+
+/*
+ * The same loop with a fused compare-and-branch.
+ */
+
+static luna_vm_t *
+branch_program() {
+  luna_vm_t *vm = vm_new(loop_constants, 5);
+
+  emit(LOADK, 0, 0, 0);       // n = LOOP_COUNT
+  emit(LOADK, 1, 1, 0);       // acc = 0
+  emit(ADD, 1, 1, KN(2));     // loop: acc += 3
+  emit(MUL, 2, 1, KN(3));     // tmp = acc * 2
+  emit(SUB, 0, 0, KN(4));     // n -= 1
+  emit(JLT, -4, KN(1), 0);    // 0 < n ? loop
+  emit(MOVE, 0, 1, 0);
+  emit(HALT, 0, 0, 0);
+  vm->main->ip = vm->main->code.a;
+
+  return vm;
+}
+
+/*
+ * Run `vm` `n` times and report instructions per second.
+ */
+
+static void
+bench(const char *name, luna_vm_t *vm, int n, double ops) {
+  clock_t start = clock();
+  for (int j = 0; j < n; ++j) luna_eval(vm);
+  double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+  printf("  \e[90m%-8s\e[0m %8.3fs \e[36m%8.1f\e[90m Mops/s\e[0m\n"
+    , name
+    , secs
+    , ops * n / secs / 1e6);
+}
+
+/*
+ * Run the dispatch benchmarks.
+ */
+
+int
+main(int argc, const char **argv){
+#ifdef LUNA_NO_COMPUTED_GOTO
+  printf("\n  \e[36mdispatch: switch\e[0m\n\n");
+#else
+  printf("\n  \e[36mdispatch: computed goto\e[0m\n\n");
+#endif
+  bench("arith", arith_program(), ARITH_RUNS, 200 * 5 + 2);
+  bench("loop", loop_program(), 1, LOOP_COUNT * 6.0);
+  bench("branch", branch_program(), 1, LOOP_COUNT * 4.0);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,156 @@
+
+//
+// grep.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "search.h"
+#include "stream.h"
+#include "object.h"
+#include "state.h"
+
+/*
+ * Synthetic log size.
+ */
+
+#define LOG_SIZE (64 << 20)
+
+/*
+ * Lines the synthetic log is built from.
+ */
+
+static const char *log_lines[] = {
+  "127.0.0.1 - - [10/Oct/2013:13:55:36] \"GET /index.html HTTP/1.1\" 200 2326\n",
+  "10.0.0.12 - - [10/Oct/2013:13:55:37] \"POST /api/users HTTP/1.1\" 201 112\n",
+  "10.0.0.12 - - [10/Oct/2013:13:55:38] \"GET /static/app.js HTTP/1.1\" 304 0\n",
+  "192.168.1.7 - - [10/Oct/2013:13:55:39] \"GET /favicon.ico HTTP/1.1\" 404 209\n",
+  "127.0.0.1 - - [10/Oct/2013:13:55:40] \"GET /api/search?q=luna HTTP/1.1\" 200 5120\n",
+  NULL
+};
+
+/*
+ * Needles, from rare to on every line.
+ */
+
+static const char *needles[] = {
+  "x",
+  "timeout",
+  "favicon",
+  "HTTP/1.1",
+  "\"GET /api/search?q=luna HTTP/1.1\" 200 5120",
+  "[10/Oct/2013:13:55:41] \"GET /index.html HTTP/1.1\" 500",
+  NULL
+};
+
+/*
+ * Build a log of roughly LOG_SIZE bytes, with
+ * a rare line every 8192.
+ */
+
+static char *
+log_new(size_t *len) {
+  char *buf = malloc(LOG_SIZE + 256);
+  size_t n = 0;
+
+  for (int i = 0; n < LOG_SIZE; ++i) {
+    const char *line = i % 8192
+      ? log_lines[i % 5]
+      : "10.0.0.3 - - [10/Oct/2013:13:55:41] \"GET /slow HTTP/1.1\" 504 timeout\n";
+    size_t len = strlen(line);
+    memcpy(buf + n, line, len);
+    n += len;
+  }
+
+  *len = n;
+  return buf;
+}
+
+/*
+ * Collect the lines of `buf` containing `needle` with
+ * memmem() on each, as grep() used to, returning the
+ * bytes collected.
+ */
+
+static long
+per_line(const char *buf, size_t len, const char *needle) {
+  const char *end = buf + len;
+  size_t n = strlen(needle);
+  char *out = malloc(len);
+  long count = 0;
+  const char *nl;
+  while (buf < end && (nl = memchr(buf, '\n', end - buf))) {
+    if (memmem(buf, nl - buf, needle, n)) {
+      memcpy(out + count, buf, nl + 1 - buf);
+      count += nl + 1 - buf;
+    }
+    buf = nl + 1;
+  }
+  free(out);
+  return count;
+}
+
+/*
+ * Collect the lines of `buf` containing `needle`
+ * with a stream, returning the bytes collected.
+ */
+
+static long
+streamed(const char *buf, size_t len, const char *needle) {
+  luna_string_t *pattern = luna_string_new((char *) needle, strlen(needle));
+  luna_stream_t *stream = luna_stream_new(LUNA_NULL, 0);
+  luna_stream_grep(stream, luna_value_object(pattern));
+  for (size_t i = 0; i < len; i += LUNA_STREAM_CHUNK) {
+    size_t n = len - i < LUNA_STREAM_CHUNK ? len - i : LUNA_STREAM_CHUNK;
+    luna_stream_push(stream, buf + i, n);
+  }
+  luna_stream_end(stream);
+  long count = kv_size(stream->out);
+  luna_stream_free(stream);
+  free(pattern);
+  return count;
+}
+
+/*
+ * Report the throughput of `fn`.
+ */
+
+static double
+run(const char *name, long (*fn)(const char *, size_t, const char *)
+  , const char *buf, size_t len, const char *needle) {
+  clock_t start = clock();
+  long count = fn(buf, len, needle);
+  double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+  printf("  \e[90m%-8s\e[0m %8.3fs \e[36m%8.1f\e[90m MB/s \e[90m%10ld\e[0m\n"
+    , name
+    , secs
+    , len / secs / (1 << 20)
+    , count);
+  return secs;
+}
+
+/*
+ * Run the grep benchmarks.
+ */
+
+int
+main(int argc, const char **argv){
+  size_t len;
+  char *buf = log_new(&len);
+
+  printf("\n  \e[36mgrep\e[0m\n");
+  for (const char **needle = needles; *needle; ++needle) {
+    printf("\n  \e[90m'%s'\e[0m\n", *needle);
+    double before = run("lines", per_line, buf, len, *needle);
+    double after = run("stream", streamed, buf, len, *needle);
+    printf("  \e[90mspeedup\e[0m  \e[36m%7.1fx\e[0m\n", before / after);
+  }
+  printf("\n");
+
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,173 @@
+//
+// io.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "parser.h"
+#include "codegen.h"
+#include "reactor.h"
+#include "state.h"
+
+/*
+ * Files each phase operates on.
+ */
+
+#define FILES 2000
+
+/*
+ * Phases, forking one task per file.
+ */
+
+static const char *phases[] = {
+  "write", "t%d = write('/tmp/luna-bench-io-%d', 'hello world') &\n",
+  "stat", "t%d = stat('/tmp/luna-bench-io-%d') &\n",
+  "cat", "t%d = cat('/tmp/luna-bench-io-%d') &\n",
+  "rm", "t%d = rm('/tmp/luna-bench-io-%d') &\n",
+  NULL
+};
+
+static luna_state_t state;
+
+/*
+ * Wall clock seconds.
+ */
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Compile `fmt` for each file, joining them all.
+ */
+
+static luna_vm_t *
+compile(const char *fmt) {
+  char *source = malloc(FILES * 96);
+  char *p = source;
+  for (int i = 0; i < FILES; ++i) p += sprintf(p, fmt, i, i);
+  for (int i = 0; i < FILES; ++i) p += sprintf(p, "join(t%d)\n", i);
+
+  luna_lexer_t lex;
+  luna_parser_t parser;
+  luna_ast_t ast;
+  luna_codegen_t gen;
+  luna_ast_init(&ast);
+  luna_lexer_init(&lex, source, "io", &state);
+  luna_parser_init(&parser, &lex, &ast);
+  luna_node_id_t root = luna_parse(&parser);
+  luna_codegen_init(&gen, &ast, &state);
+  luna_vm_t *vm = root ? luna_gen(&gen, root) : NULL;
+  luna_ast_free(&ast);
+  free(source);
+
+  if (!vm) {
+    fprintf(stderr, "io: failed to compile %s\n", fmt);
+    exit(1);
+  }
+
+  return vm;
+}
+
+/*
+ * Run phase `name` with plain blocking system calls,
+ * one file after another, returning the calls made.
+ */
+
+static long
+blocking(const char *name) {
+  char path[64], buf[64];
+  struct stat st;
+  long calls = 0;
+
+  for (int i = 0; i < FILES; ++i) {
+    snprintf(path, sizeof(path), "/tmp/luna-bench-io-%d", i);
+    int fd;
+    switch (name[0]) {
+      case 'w':
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        write(fd, "hello world", 11);
+        close(fd);
+        calls += 3;
+        break;
+      case 's':
+        stat(path, &st);
+        calls += 1;
+        break;
+      case 'c':
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        while (read(fd, buf, sizeof(buf)) > 0) ++calls;
+        close(fd);
+        calls += 3;
+        break;
+      case 'r':
+        unlink(path);
+        calls += 1;
+        break;
+    }
+  }
+
+  return calls;
+}
+
+/*
+ * Run every phase on `backend`, "blocking" for plain
+ * system calls, and report wall time and system calls.
+ */
+
+static void
+bench(const char *backend) {
+  for (const char **phase = phases; *phase; phase += 2) {
+    long calls;
+    double secs;
+
+    if (!strcmp("blocking", backend)) {
+      double start = now();
+      calls = blocking(phase[0]);
+      secs = now() - start;
+    } else {
+      setenv("LUNA_IO", backend, 1);
+      luna_vm_t *vm = compile(phase[1]);
+      double start = now();
+      luna_eval(vm);
+      secs = now() - start;
+      calls = vm->sched->reactor->aio.syscalls;
+      if (strcmp(backend, LUNA_AIO_URING == vm->sched->reactor->aio.backend ? "uring" : "threads")) {
+        printf("  \e[90m%-8s unavailable\e[0m\n", backend);
+        return;
+      }
+    }
+
+    printf("  \e[90m%-8s %-5s\e[0m %8.3fs \e[36m%8.1f\e[90m kops/s \e[36m%8ld\e[90m syscalls\e[0m\n"
+      , backend
+      , phase[0]
+      , secs
+      , FILES / secs / 1e3
+      , calls);
+  }
+}
+
+/*
+ * Run the file I/O benchmarks.
+ */
+
+int
+main(int argc, const char **argv){
+  luna_state_init(&state);
+  printf("\n  \e[36mio: %d files per phase\e[0m\n\n", FILES);
+  bench("blocking");
+  bench("uring");
+  bench("threads");
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,119 @@
+
+//
+// lexer.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lexer.h"
+#include "state.h"
+
+/*
+ * Synthetic source size.
+ */
+
+#define SOURCE_SIZE (32 << 20)
+
+/*
+ * Statements the synthetic sources are built from.
+ */
+
+static const char *mixed_lines[] = {
+  "let count = 0\n",
+  "while count < 1000\n",
+  "  count += 1 # bump\n",
+  "  total = total + count * 2.5\n",
+  "end\n",
+  "if total >= 100 and not done\n",
+  "  name = 'luna \\t lexer'\n",
+  "else\n",
+  "  return 0x1f ** 2\n",
+  "end\n",
+  NULL
+};
+
+static const char *keyword_lines[] = {
+  "if a end unless b end while c end until d end\n",
+  "def foo for let return type else and not\n",
+  "iff ends lets fore deft unles whiles types\n",
+  NULL
+};
+
+static const char *comment_lines[] = {
+  "# a long comment describing what the following block does, in detail\n",
+  "                  long_identifier_name_for_a_value = another_long_identifier_name\n",
+  "\t\t\t\t\t\t\t\tcount = 1234567890 # trailing comment after the statement\n",
+  NULL
+};
+
+/*
+ * Build a source of roughly SOURCE_SIZE bytes
+ * by repeating `lines`.
+ */
+
+static char *
+source_new(const char **lines) {
+  char *buf = malloc(SOURCE_SIZE + 256);
+  size_t len = 0;
+
+  while (len < SOURCE_SIZE) {
+    for (const char **line = lines; *line; ++line) {
+      size_t n = strlen(*line);
+      memcpy(buf + len, *line, n);
+      len += n;
+    }
+  }
+
+  buf[len] = 0;
+  return buf;
+}
+
+/*
+ * Scan `source` to the end and report tokens per second.
+ */
+
+static void
+bench(const char *name, const char **lines) {
+  char *source = source_new(lines);
+  size_t len = strlen(source);
+  luna_state_t state;
+  luna_state_init(&state);
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, source, name, &state);
+
+  long ntokens = 0;
+  clock_t start = clock();
+  while (luna_scan(&lex)) ++ntokens;
+  double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  if (lex.error) {
+    fprintf(stderr, "%s: %s on line %d\n", name, lex.error, lex.lineno);
+    exit(1);
+  }
+
+  printf("  \e[90m%-8s\e[0m %8.3fs \e[36m%8.1f\e[90m Mtok/s \e[36m%8.1f\e[90m MB/s\e[0m\n"
+    , name
+    , secs
+    , ntokens / secs / 1e6
+    , len / secs / (1 << 20));
+
+  free(source);
+}
+
+/*
+ * Run the lexer benchmarks.
+ */
+
+int
+main(int argc, const char **argv){
+  printf("\n  \e[36mlexer\e[0m\n\n");
+  bench("mixed", mixed_lines);
+  bench("keywords", keyword_lines);
+  bench("comments", comment_lines);
+  printf("\n");
+  return 0;
+}
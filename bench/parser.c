@@ -0,0 +1,136 @@
+
+//
+// parser.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parser.h"
+#include "state.h"
+
+/*
+ * Synthetic source size.
+ */
+
+#define SOURCE_SIZE (8 << 20)
+
+/*
+ * Statements the synthetic sources are built from.
+ */
+
+static const char *mixed_lines[] = {
+  "let count = 0\n",
+  "while count < 1000\n",
+  "  count += 1\n",
+  "  total = total + count * 2.5 - (count % 7) / 3\n",
+  "end\n",
+  "if total >= 100 && !done\n",
+  "  name = 'luna' + \"parser\"\n",
+  "end else\n",
+  "  mask = flags | 0x1f ^ bits << 2 and 255\n",
+  "end\n",
+  "print(count, total, name)\n",
+  NULL
+};
+
+static const char *primary_lines[] = {
+  "a\n",
+  "foo\n",
+  "1\n",
+  "'str'\n",
+  "[a, b, c]\n",
+  "x = y\n",
+  NULL
+};
+
+static const char *operator_lines[] = {
+  "a = b + c * d - e / f % g << h >> i < j <= k > l >= m == n != o\n",
+  "p = q and r ^ s | t && u || v\n",
+  "w = -x + ~y * !z ** 2 - a++ + --b\n",
+  NULL
+};
+
+/*
+ * Build a source of roughly SOURCE_SIZE bytes
+ * by repeating `lines`.
+ */
+
+static char *
+source_new(const char **lines) {
+  char *buf = malloc(SOURCE_SIZE + 256);
+  size_t len = 0;
+
+  while (len < SOURCE_SIZE) {
+    for (const char **line = lines; *line; ++line) {
+      size_t n = strlen(*line);
+      memcpy(buf + len, *line, n);
+      len += n;
+    }
+  }
+
+  buf[len] = 0;
+  return buf;
+}
+
+/*
+ * Parse `source` and report nodes and bytes per second,
+ * best of several runs.
+ */
+
+static void
+bench(const char *name, const char **lines) {
+  char *source = source_new(lines);
+  size_t len = strlen(source);
+  luna_state_t state;
+  luna_state_init(&state);
+
+  double secs = 0;
+  size_t nodes = 0;
+  for (int i = 0; i < 5; ++i) {
+    luna_lexer_t lex;
+    luna_parser_t parser;
+    luna_ast_t ast;
+    luna_ast_init(&ast);
+    luna_lexer_init(&lex, source, name, &state);
+    luna_parser_init(&parser, &lex, &ast);
+
+    clock_t start = clock();
+    luna_node_id_t root = luna_parse(&parser);
+    double t = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    if (!root) {
+      fprintf(stderr, "%s: %s\n", name, parser.err);
+      exit(1);
+    }
+
+    if (!i || t < secs) secs = t;
+    nodes = kv_size(ast.nodes);
+    luna_ast_free(&ast);
+  }
+
+  printf("  \e[90m%-9s\e[0m %8.3fs \e[36m%8.1f\e[90m Mnode/s \e[36m%8.1f\e[90m MB/s\e[0m\n"
+    , name
+    , secs
+    , nodes / secs / 1e6
+    , len / secs / (1 << 20));
+
+  free(source);
+}
+
+/*
+ * Run the parser benchmarks.
+ */
+
+int
+main(int argc, const char **argv){
+  printf("\n  \e[36mparser\e[0m\n\n");
+  bench("mixed", mixed_lines);
+  bench("primary", primary_lines);
+  bench("operators", operator_lines);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,118 @@
+
+//
+// sched.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "vm.h"
+#include "scheduler.h"
+#include "object.h"
+#include "opcodes.h"
+
+/*
+ * Constant n as an RK operand.
+ */
+
+#define KN(n) RKASK(n)
+
+/*
+ * Emit an instruction.
+ */
+
+#define emit(op, a, b, c) \
+  kv_push(luna_instruction_t, vm->main->code, ABC(op, a, b, c));
+
+/*
+ * Tasks forked, and loop iterations of each.
+ */
+
+#define TASKS 2000
+#define TASK_LOOP 50000
+
+/*
+ * Fork TASKS tasks counting down from TASK_LOOP,
+ * halting once they are all done.
+ */
+
+static luna_value_t fork_constants[] = {
+  luna_value_int(TASKS),
+  luna_value_int(TASK_LOOP),
+  luna_value_int(0),
+  luna_value_int(3),
+  luna_value_int(1)
+};
+
+static luna_vm_t *
+fork_program(int nthreads) {
+  luna_vm_t *vm = malloc(sizeof(luna_vm_t));
+  vm->trace = NULL;
+  kv_init(vm->registers);
+  vm->sched = luna_sched_new(nthreads);
+  vm->main = malloc(sizeof(luna_activation_t));
+  vm->main->nregisters = 2;
+  kv_init(vm->main->code);
+  kv_init(vm->main->lines);
+  luna_vec_init(&vm->main->constants);
+  for (int n = 0; n < 5; ++n) {
+    luna_vec_push(&vm->main->constants, fork_constants[n]);
+  }
+
+  emit(LOADK, 1, 0, 0);       // n = TASKS
+  emit(FORK, 0, 6, 0);        // loop: fork
+  emit(LOADK, 0, 1, 0);       //   i = TASK_LOOP
+  emit(LOADK, 1, 2, 0);       //   acc = 0
+  emit(ADD, 1, 1, KN(3));     //   acc += 3
+  emit(SUB, 0, 0, KN(4));     //   i -= 1
+  emit(JLT, -3, KN(2), 0);    //   0 < i ? loop
+  emit(HALT, 1, 0, 0);
+  emit(SUB, 1, 1, KN(4));     // n -= 1
+  emit(JLT, -9, KN(2), 1);    // 0 < n ? loop
+  emit(HALT, 1, 0, 0);        // wait for the tasks
+  vm->main->ip = vm->main->code.a;
+
+  return vm;
+}
+
+/*
+ * Wall clock seconds.
+ */
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run the fork benchmark on 1 to `max` threads
+ * and report throughput and speedup.
+ */
+
+int
+main(int argc, const char **argv){
+  int max = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  double base = 0;
+
+  printf("\n  \e[36msched: %d tasks of %d iterations\e[0m\n\n", TASKS, TASK_LOOP);
+  for (int n = 1; n <= max; n *= 2) {
+    luna_vm_t *vm = fork_program(n);
+    double start = now();
+    luna_eval(vm);
+    double secs = now() - start;
+    if (1 == n) base = secs;
+    printf("  \e[90m%3d threads\e[0m %8.3fs \e[36m%8.1f\e[90m Mops/s\e[0m %6.2fx\n"
+      , n
+      , secs
+      , (double) TASKS * TASK_LOOP * 3 / secs / 1e6
+      , base / secs);
+    if (n < max && n * 2 > max) n = max / 2;
+  }
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,568 @@
+
+//
+// aio.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+#include "state.h"
+#include "internal.h"
+
+/*
+ * Count `n` system calls.
+ */
+
+#define counted(self, n) __atomic_add_fetch(&(self)->syscalls, n, __ATOMIC_RELAXED)
+
+/*
+ * Mode of created files.
+ */
+
+#define LUNA_AIO_MODE 0644
+
+/*
+ * Grow the read buffer of `op`, doubling it once full,
+ * returning 0 when out of memory.
+ */
+
+static int
+grow(luna_aio_op_t *op) {
+  if (kv_max(op->buf) - kv_size(op->buf) > 1) return 1;
+  size_t max = kv_max(op->buf) ? 2 * kv_max(op->buf) : LUNA_READ_SIZE;
+  char *buf = realloc(op->buf.a, max);
+  if (unlikely(!buf)) return 0;
+  op->buf.a = buf;
+  kv_max(op->buf) = max;
+  return 1;
+}
+
+/*
+ * Room left in the read buffer of `op`, short of the nul.
+ */
+
+#define room(op) (kv_max((op)->buf) - kv_size((op)->buf) - 1)
+
+/*
+ * Store the result of `op` to its destination,
+ * returning its task to be woken.
+ */
+
+static luna_task_t *
+complete(luna_aio_op_t *op) {
+  luna_value_t val = LUNA_NULL;
+
+  switch (op->type) {
+    case LUNA_AIO_READ:
+    case LUNA_AIO_READ_CHUNK:
+      if (op->res >= 0) {
+        // grow() leaves room for the nul
+        op->buf.a[kv_size(op->buf)] = 0;
+        luna_string_t *str = luna_string_new(op->buf.a, kv_size(op->buf));
+        if (str) {
+          val = luna_value_object(str);
+          kv_init(op->buf);
+        }
+      }
+      break;
+    case LUNA_AIO_WRITE:
+    case LUNA_AIO_UNLINK:
+      val = luna_value_bool(op->res >= 0);
+      break;
+    case LUNA_AIO_STAT:
+      if (op->res >= 0) {
+        val = op->stx.stx_size > INT32_MAX
+          ? luna_value_float(op->stx.stx_size)
+          : luna_value_int(op->stx.stx_size);
+      }
+      break;
+    case LUNA_AIO_OPEN_READ:
+      if (op->res >= 0) val = luna_value_int(op->fd);
+      break;
+  }
+
+  // streams keep their fd
+  if (!luna_aio_owns_fd(op)) op->fd = -1;
+
+  kv_destroy(op->buf);
+  kv_init(op->buf);
+  *op->dest = val;
+  return op->task;
+}
+
+/*
+ * Run `op` with blocking system calls, on a pool thread.
+ */
+
+static void
+perform(luna_aio_t *self, luna_aio_op_t *op) {
+  ssize_t n = 0;
+  int calls = 1;
+
+  switch (op->type) {
+    case LUNA_AIO_READ:
+      if ((op->fd = open(op->path, O_RDONLY | O_CLOEXEC)) < 0) break;
+      do {
+        if (unlikely(!grow(op))) {
+          errno = ENOMEM;
+          n = -1;
+          break;
+        }
+        ++calls;
+        if ((n = read(op->fd, op->buf.a + kv_size(op->buf), room(op))) > 0) kv_size(op->buf) += n;
+      } while (n > 0 || (n < 0 && EINTR == errno));
+      break;
+    case LUNA_AIO_WRITE:
+      if ((op->fd = open(op->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, LUNA_AIO_MODE)) < 0) break;
+      while (op->off < kv_size(op->buf)) {
+        ++calls;
+        if ((n = write(op->fd, op->buf.a + op->off, kv_size(op->buf) - op->off)) > 0) op->off += n;
+        else if (n < 0 && EINTR != errno) break;
+      }
+      break;
+    case LUNA_AIO_UNLINK:
+      n = unlink(op->path);
+      break;
+    case LUNA_AIO_STAT:
+      n = statx(AT_FDCWD, op->path, 0, STATX_SIZE, &op->stx);
+      break;
+    case LUNA_AIO_OPEN_READ:
+      op->fd = open(op->path, O_RDONLY | O_CLOEXEC);
+      break;
+    case LUNA_AIO_READ_CHUNK:
+      while ((n = read(op->fd, op->buf.a, room(op))) < 0 && EINTR == errno) ++calls;
+      if (n > 0) kv_size(op->buf) = n;
+      break;
+  }
+
+  op->res = (op->fd < 0 && LUNA_AIO_OPEN == op->step) || n < 0 ? -errno : 0;
+  if (op->fd >= 0 && luna_aio_owns_fd(op)) {
+    close(op->fd);
+    op->fd = -1;
+    ++calls;
+  }
+  counted(self, calls);
+}
+
+/*
+ * Pool thread, running queued operations until stopped.
+ */
+
+static void *
+pool_work(void *arg) {
+  luna_aio_t *self = arg;
+  pthread_mutex_lock(&self->lock);
+
+  for (;;) {
+    while (!self->work && !self->stop) pthread_cond_wait(&self->cond, &self->lock);
+    luna_aio_op_t *op = self->work;
+    if (!op) break;
+    self->work = op->next;
+
+    pthread_mutex_unlock(&self->lock);
+    perform(self, op);
+    pthread_mutex_lock(&self->lock);
+
+    // signal once until reaped
+    op->next = self->done;
+    self->done = op;
+    if (!op->next) {
+      uint64_t one = 1;
+      write(self->fd, &one, sizeof(one));
+      counted(self, 1);
+    }
+  }
+
+  pthread_mutex_unlock(&self->lock);
+  return NULL;
+}
+
+/*
+ * Map the io_uring rings, returning -1 when
+ * io_uring is unavailable.
+ */
+
+static int
+ring_init(luna_aio_t *self) {
+  luna_aio_ring_t *r = &self->ring;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+
+  int fd = syscall(__NR_io_uring_setup, LUNA_AIO_ENTRIES, &p);
+  if (fd < 0) return -1;
+
+  // read at the current position, needed for pipes
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) goto error;
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+    r->cq_size = 0;
+  }
+
+  r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE
+    , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == r->sq_map) goto error;
+
+  r->cq_map = r->cq_size
+    ? mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE
+      , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)
+    : r->sq_map;
+  if (MAP_FAILED == r->cq_map) goto error;
+
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE
+    , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (MAP_FAILED == r->sqes) goto error;
+
+  char *sq = r->sq_map;
+  char *cq = r->cq_map;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  r->entries = p.sq_entries;
+  self->fd = fd;
+  return 0;
+
+error:
+  if (r->sqes && MAP_FAILED != r->sqes) munmap(r->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+  if (r->cq_size && r->cq_map && MAP_FAILED != r->cq_map) munmap(r->cq_map, r->cq_size);
+  if (r->sq_map && MAP_FAILED != r->sq_map) munmap(r->sq_map, r->sq_size);
+  close(fd);
+  return -1;
+}
+
+/*
+ * Fill `sqe` with the next step of `op`.
+ */
+
+static void
+prep(struct io_uring_sqe *sqe, luna_aio_op_t *op) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t) op;
+  sqe->fd = op->fd;
+
+  switch (op->step) {
+    case LUNA_AIO_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t) op->path;
+      sqe->len = LUNA_AIO_MODE;
+      sqe->open_flags = LUNA_AIO_WRITE == op->type
+        ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+        : O_RDONLY | O_CLOEXEC;
+      return;
+    case LUNA_AIO_CLOSE:
+      sqe->opcode = IORING_OP_CLOSE;
+      return;
+    case LUNA_AIO_IO:
+      break;
+  }
+
+  switch (op->type) {
+    case LUNA_AIO_OPEN_READ:
+      break;
+    case LUNA_AIO_READ:
+    case LUNA_AIO_READ_CHUNK:
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr = (uintptr_t) (op->buf.a + kv_size(op->buf));
+      sqe->len = room(op);
+      sqe->off = -1;
+      break;
+    case LUNA_AIO_WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->addr = (uintptr_t) (op->buf.a + op->off);
+      sqe->len = kv_size(op->buf) - op->off;
+      sqe->off = -1;
+      break;
+    case LUNA_AIO_UNLINK:
+      sqe->opcode = IORING_OP_UNLINKAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t) op->path;
+      break;
+    case LUNA_AIO_STAT:
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t) op->path;
+      sqe->len = STATX_SIZE;
+      sqe->off = (uintptr_t) &op->stx;
+      break;
+  }
+}
+
+/*
+ * Advance `op` past the step which completed with
+ * `res`, returning 1 when it has I/O left to do.
+ */
+
+static int
+step(luna_aio_op_t *op, int res) {
+  op->res = res;
+  if (res < 0) return 0;
+
+  if (LUNA_AIO_OPEN == op->step) {
+    op->fd = res;
+    op->step = LUNA_AIO_IO;
+    if (LUNA_AIO_OPEN_READ == op->type) return 0;
+  } else if (LUNA_AIO_READ_CHUNK == op->type) {
+    kv_size(op->buf) = res;
+    return 0;
+  } else if (LUNA_AIO_READ == op->type) {
+    if (!res) return 0;
+    kv_size(op->buf) += res;
+  } else if (LUNA_AIO_WRITE == op->type) {
+    if (!res || (op->off += res) == kv_size(op->buf)) return 0;
+  } else {
+    return 0;
+  }
+
+  if (LUNA_AIO_READ == op->type && unlikely(!grow(op))) {
+    op->res = -ENOMEM;
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Initialize the backend, io_uring unless unavailable or
+ * `backend` is LUNA_AIO_THREADS. Returns -1 on failure.
+ */
+
+int
+luna_aio_init(luna_aio_t *self, luna_aio_backend_t backend) {
+  self->backend = LUNA_AIO_NONE;
+  self->fd = -1;
+  self->inflight = 0;
+  self->syscalls = 0;
+  self->queued = NULL;
+  self->queued_tail = &self->queued;
+  self->done = NULL;
+  self->work = NULL;
+  self->nthreads = 0;
+  self->stop = 0;
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->cond, NULL);
+
+#ifndef LUNA_NO_IO_URING
+  if (LUNA_AIO_THREADS != backend && !ring_init(self)) {
+    self->backend = LUNA_AIO_URING;
+    return 0;
+  }
+#endif
+
+  if ((self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) return -1;
+  self->backend = LUNA_AIO_THREADS;
+  return 0;
+}
+
+/*
+ * Free the backend, which must have nothing in flight.
+ */
+
+void
+luna_aio_free(luna_aio_t *self) {
+  pthread_mutex_lock(&self->lock);
+  self->stop = 1;
+  pthread_cond_broadcast(&self->cond);
+  pthread_mutex_unlock(&self->lock);
+  for (int i = 0; i < self->nthreads; ++i) pthread_join(self->threads[i], NULL);
+
+  if (LUNA_AIO_URING == self->backend) {
+    luna_aio_ring_t *r = &self->ring;
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_size) munmap(r->cq_map, r->cq_size);
+    munmap(r->sq_map, r->sq_size);
+  }
+
+  if (self->fd >= 0) close(self->fd);
+  pthread_mutex_destroy(&self->lock);
+  pthread_cond_destroy(&self->cond);
+}
+
+/*
+ * Alloc an operation of `type` on `path` for `task`,
+ * or NULL when out of memory. `path` must outlive it.
+ */
+
+luna_aio_op_t *
+luna_aio_op_new(luna_aio_type_t type, const char *path, luna_task_t *task, luna_value_t *dest) {
+  luna_aio_op_t *op = malloc(sizeof(luna_aio_op_t));
+  if (unlikely(!op)) return NULL;
+  op->type = type;
+  op->step = LUNA_AIO_READ == type || LUNA_AIO_WRITE == type || LUNA_AIO_OPEN_READ == type
+    ? LUNA_AIO_OPEN
+    : LUNA_AIO_IO;
+  op->fd = -1;
+  op->res = 0;
+  op->path = path;
+  op->task = task;
+  op->dest = dest;
+  op->off = 0;
+  op->next = NULL;
+  kv_init(op->buf);
+  return op;
+}
+
+/*
+ * Queue `op` for the next submission.
+ */
+
+void
+luna_aio_queue(luna_aio_t *self, luna_aio_op_t *op) {
+  op->next = NULL;
+  pthread_mutex_lock(&self->lock);
+  *self->queued_tail = op;
+  self->queued_tail = &op->next;
+  pthread_mutex_unlock(&self->lock);
+}
+
+/*
+ * Submit the queued operations at once, as many as
+ * the ring takes, the rest waiting for completions.
+ */
+
+void
+luna_aio_submit(luna_aio_t *self) {
+  pthread_mutex_lock(&self->lock);
+
+  if (!self->queued) {
+    pthread_mutex_unlock(&self->lock);
+    return;
+  }
+
+  // hand them all to the pool
+  if (LUNA_AIO_THREADS == self->backend) {
+    *self->queued_tail = self->work;
+    self->work = self->queued;
+    self->queued = NULL;
+    self->queued_tail = &self->queued;
+    if (self->nthreads < LUNA_AIO_POOL
+      && !pthread_create(&self->threads[self->nthreads], NULL, pool_work, self)) {
+      ++self->nthreads;
+    }
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+    return;
+  }
+
+  // fill the ring, completions never outnumbering it
+  luna_aio_ring_t *r = &self->ring;
+  unsigned tail = *r->sq_tail;
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  while (self->queued && self->inflight < r->entries && tail - head < r->entries) {
+    luna_aio_op_t *op = self->queued;
+    if (!(self->queued = op->next)) self->queued_tail = &self->queued;
+    unsigned index = tail++ & *r->sq_mask;
+    prep(&r->sqes[index], op);
+    r->sq_array[index] = index;
+    ++self->inflight;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  // including entries an interrupted submission left
+  unsigned n = tail - head;
+  if (n) {
+    syscall(__NR_io_uring_enter, self->fd, n, 0, 0, NULL, 0);
+    counted(self, 1);
+  }
+
+  pthread_mutex_unlock(&self->lock);
+}
+
+/*
+ * Reap the completed operations, storing their results,
+ * and return their tasks linked by `next`, submitting the
+ * steps left, closes included. Called by the polling worker
+ * once `fd` is readable.
+ */
+
+luna_task_t *
+luna_aio_reap(luna_aio_t *self) {
+  luna_task_t *woken = NULL;
+
+  // pool
+  if (LUNA_AIO_THREADS == self->backend) {
+    uint64_t n;
+    read(self->fd, &n, sizeof(n));
+    counted(self, 1);
+    pthread_mutex_lock(&self->lock);
+    luna_aio_op_t *op = self->done;
+    self->done = NULL;
+    pthread_mutex_unlock(&self->lock);
+
+    while (op) {
+      luna_aio_op_t *next = op->next;
+      luna_task_t *task = complete(op);
+      task->next = woken;
+      woken = task;
+      free(op);
+      op = next;
+    }
+
+    return woken;
+  }
+
+  // io_uring, requeuing operations with steps left
+  luna_aio_ring_t *r = &self->ring;
+  luna_aio_op_t *requeue = NULL;
+  luna_aio_op_t **tail = &requeue;
+  unsigned head = *r->cq_head;
+  unsigned end = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  int n = end - head;
+
+  for (; head != end; ++head) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    luna_aio_op_t *op = (luna_aio_op_t *) (uintptr_t) cqe->user_data;
+
+    if (LUNA_AIO_CLOSE == op->step) {
+      free(op);
+      continue;
+    }
+
+    if (!step(op, cqe->res)) {
+      luna_task_t *task = complete(op);
+      task->next = woken;
+      woken = task;
+      // close after waking, without waiting for it
+      if (op->fd < 0) {
+        free(op);
+        continue;
+      }
+      op->step = LUNA_AIO_CLOSE;
+    }
+
+    *tail = op;
+    tail = &op->next;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&self->lock);
+  self->inflight -= n;
+  if (requeue) {
+    *tail = self->queued;
+    if (!self->queued) self->queued_tail = tail;
+    self->queued = requeue;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  // now, as nothing may poll again to close the last fd
+  if (requeue) luna_aio_submit(self);
+
+  return woken;
+}
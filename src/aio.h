@@ -0,0 +1,167 @@
+
+//
+// aio.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_AIO__
+#define __LUNA_AIO__
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include "scheduler.h"
+
+/*
+ * Submission queue entries, bounding
+ * the operations in flight.
+ */
+
+#ifndef LUNA_AIO_ENTRIES
+#define LUNA_AIO_ENTRIES 256
+#endif
+
+/*
+ * Threads of the fallback pool.
+ */
+
+#ifndef LUNA_AIO_POOL
+#define LUNA_AIO_POOL 4
+#endif
+
+/*
+ * Initial read buffer size, doubled as needed.
+ */
+
+#ifndef LUNA_READ_SIZE
+#define LUNA_READ_SIZE 4096
+#endif
+
+/*
+ * File operations. OPEN_READ and READ_CHUNK serve
+ * streams, which own the fd between chunks.
+ */
+
+typedef enum {
+  LUNA_AIO_READ,
+  LUNA_AIO_WRITE,
+  LUNA_AIO_UNLINK,
+  LUNA_AIO_STAT,
+  LUNA_AIO_OPEN_READ,
+  LUNA_AIO_READ_CHUNK
+} luna_aio_type_t;
+
+/*
+ * Backends.
+ */
+
+typedef enum {
+  LUNA_AIO_NONE,
+  LUNA_AIO_URING,
+  LUNA_AIO_THREADS
+} luna_aio_backend_t;
+
+/*
+ * File operation on behalf of `task`, its result stored
+ * to `dest` once done. Reads and writes go through the
+ * OPEN and IO steps before CLOSE, and fill or drain
+ * `buf`, the others take a single step.
+ */
+
+typedef struct luna_aio_op {
+  luna_aio_type_t type;
+  enum {
+    LUNA_AIO_OPEN,
+    LUNA_AIO_IO,
+    LUNA_AIO_CLOSE
+  } step;
+  int fd;
+  int res;
+  const char *path;
+  luna_task_t *task;
+  luna_value_t *dest;
+  kvec_t(char) buf;
+  size_t off;
+  struct statx stx;
+  struct luna_aio_op *next;
+} luna_aio_op_t;
+
+/*
+ * Check if `op` closes the fd it opens, streams
+ * keeping theirs open across operations.
+ */
+
+#define luna_aio_owns_fd(op) \
+  (LUNA_AIO_READ == (op)->type || LUNA_AIO_WRITE == (op)->type)
+
+/*
+ * io_uring rings, mapped from the kernel.
+ */
+
+typedef struct {
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  void *cq_map;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned entries;
+} luna_aio_ring_t;
+
+/*
+ * Luna file I/O backend.
+ *
+ * Operations are queued by any worker and submitted
+ * together once the workers run out of tasks, so the
+ * file I/O of every runnable task costs one system call.
+ * io_uring runs them in the kernel, otherwise a pool of
+ * threads runs them with plain system calls. Either
+ * way `fd` is readable once operations are done, and
+ * `syscalls` counts the system calls made.
+ */
+
+typedef struct {
+  luna_aio_backend_t backend;
+  int fd;
+  int inflight;
+  int64_t syscalls;
+  pthread_mutex_t lock;
+  luna_aio_op_t *queued;
+  luna_aio_op_t **queued_tail;
+  luna_aio_op_t *done;
+  luna_aio_ring_t ring;
+  pthread_cond_t cond;
+  luna_aio_op_t *work;
+  int nthreads;
+  int stop;
+  pthread_t threads[LUNA_AIO_POOL];
+} luna_aio_t;
+
+// protos
+
+int
+luna_aio_init(luna_aio_t *self, luna_aio_backend_t backend);
+
+void
+luna_aio_free(luna_aio_t *self);
+
+luna_aio_op_t *
+luna_aio_op_new(luna_aio_type_t type, const char *path, luna_task_t *task, luna_value_t *dest);
+
+void
+luna_aio_queue(luna_aio_t *self, luna_aio_op_t *op);
+
+void
+luna_aio_submit(luna_aio_t *self);
+
+luna_task_t *
+luna_aio_reap(luna_aio_t *self);
+
+#endif /* __LUNA_AIO__ */
@@ -0,0 +1,188 @@
+
+//
+// arena.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "internal.h"
+
+/*
+ * Round `n` up to the allocation alignment.
+ */
+
+#define align(n) (((n) + LUNA_ARENA_ALIGN - 1) & ~(size_t) (LUNA_ARENA_ALIGN - 1))
+
+/*
+ * Allocations larger than this get a chunk of their own.
+ */
+
+#define LUNA_ARENA_LARGE (LUNA_ARENA_CHUNK / 4)
+
+/*
+ * Alloc a chunk with `size` bytes of data.
+ */
+
+static luna_arena_chunk_t *
+chunk_new(luna_arena_t *self, size_t size) {
+  luna_arena_chunk_t *chunk = malloc(sizeof(luna_arena_chunk_t) + size);
+  if (unlikely(!chunk)) return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  self->nchunks++;
+  return chunk;
+}
+
+/*
+ * Initialize an empty arena, no memory is
+ * allocated until the first allocation.
+ */
+
+void
+luna_arena_init(luna_arena_t *self) {
+  self->chunk = NULL;
+  self->cleanups = NULL;
+  self->nchunks = 0;
+}
+
+/*
+ * Allocate `size` bytes, aligned to LUNA_ARENA_ALIGN.
+ *
+ * Small allocations are bumped out of the current chunk,
+ * large ones are linked in behind it so the space left
+ * in the current chunk is not wasted.
+ */
+
+void *
+luna_arena_alloc(luna_arena_t *self, size_t size) {
+  luna_arena_chunk_t *chunk = self->chunk;
+  size = align(size);
+
+  // fast path
+  if (likely(chunk && chunk->size - chunk->used >= size)) {
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+  }
+
+  // large
+  if (size > LUNA_ARENA_LARGE) {
+    luna_arena_chunk_t *large = chunk_new(self, size);
+    if (unlikely(!large)) return NULL;
+    large->used = size;
+    if (chunk) {
+      large->next = chunk->next;
+      chunk->next = large;
+    } else {
+      self->chunk = large;
+    }
+    return large->data;
+  }
+
+  // new chunk
+  if (unlikely(!(chunk = chunk_new(self, LUNA_ARENA_CHUNK)))) return NULL;
+  chunk->next = self->chunk;
+  chunk->used = size;
+  self->chunk = chunk;
+  return chunk->data;
+}
+
+/*
+ * Copy `len` bytes of `str` into the arena, nul-terminated.
+ */
+
+char *
+luna_arena_strndup(luna_arena_t *self, const char *str, size_t len) {
+  char *buf = luna_arena_alloc(self, len + 1);
+  if (unlikely(!buf)) return NULL;
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  return buf;
+}
+
+/*
+ * Run `fn` with `data` when the arena is freed.
+ */
+
+static int
+defer(luna_arena_t *self, void (*fn)(void *), void *data) {
+  luna_arena_cleanup_t *cleanup = luna_arena_alloc(self, sizeof(luna_arena_cleanup_t));
+  if (unlikely(!cleanup)) return -1;
+  cleanup->fn = fn;
+  cleanup->data = data;
+  cleanup->next = self->cleanups;
+  self->cleanups = cleanup;
+  return 0;
+}
+
+/*
+ * Release the storage of a vec.
+ */
+
+static void
+vec_release(void *data) {
+  luna_vec_t *vec = data;
+  kv_destroy(*vec);
+}
+
+/*
+ * Release a hash.
+ */
+
+static void
+hash_release(void *data) {
+  luna_hash_destroy((luna_hash_t *) data);
+}
+
+/*
+ * Alloc a vec whose storage is released with the arena.
+ */
+
+luna_vec_t *
+luna_arena_vec(luna_arena_t *self) {
+  luna_vec_t *vec = luna_arena_alloc(self, sizeof(luna_vec_t));
+  if (unlikely(!vec)) return NULL;
+  luna_vec_init(vec);
+  if (unlikely(defer(self, vec_release, vec))) return NULL;
+  return vec;
+}
+
+/*
+ * Alloc a hash which is destroyed with the arena.
+ */
+
+luna_hash_t *
+luna_arena_hash(luna_arena_t *self) {
+  luna_hash_t *hash = luna_hash_new();
+  if (unlikely(!hash)) return NULL;
+  if (unlikely(defer(self, hash_release, hash))) {
+    luna_hash_destroy(hash);
+    return NULL;
+  }
+  return hash;
+}
+
+/*
+ * Free everything allocated in the arena, leaving
+ * it empty and ready for reuse.
+ */
+
+void
+luna_arena_free(luna_arena_t *self) {
+  for (luna_arena_cleanup_t *c = self->cleanups; c; c = c->next) {
+    c->fn(c->data);
+  }
+
+  luna_arena_chunk_t *chunk = self->chunk;
+  while (chunk) {
+    luna_arena_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  luna_arena_init(self);
+}
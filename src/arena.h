@@ -0,0 +1,86 @@
+
+//
+// arena.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_ARENA__
+#define __LUNA_ARENA__
+
+#include <stddef.h>
+#include "vec.h"
+#include "hash.h"
+
+/*
+ * Default chunk size.
+ */
+
+#ifndef LUNA_ARENA_CHUNK
+#define LUNA_ARENA_CHUNK 65536
+#endif
+
+/*
+ * Allocation alignment.
+ */
+
+#define LUNA_ARENA_ALIGN 8
+
+/*
+ * Arena chunk, allocations are bumped out of `data`.
+ */
+
+typedef struct luna_arena_chunk {
+  struct luna_arena_chunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} luna_arena_chunk_t;
+
+/*
+ * Cleanup run when the arena is freed, releasing
+ * storage that grows outside of the arena.
+ */
+
+typedef struct luna_arena_cleanup {
+  struct luna_arena_cleanup *next;
+  void (*fn)(void *data);
+  void *data;
+} luna_arena_cleanup_t;
+
+/*
+ * Luna arena.
+ *
+ * Bump-pointer allocator owning an AST and its parser
+ * temporaries. Nothing is freed individually, the whole
+ * tree goes away with luna_arena_free() once codegen
+ * is done with it.
+ */
+
+typedef struct {
+  luna_arena_chunk_t *chunk;
+  luna_arena_cleanup_t *cleanups;
+  int nchunks;
+} luna_arena_t;
+
+// protos
+
+void
+luna_arena_init(luna_arena_t *self);
+
+void *
+luna_arena_alloc(luna_arena_t *self, size_t size);
+
+char *
+luna_arena_strndup(luna_arena_t *self, const char *str, size_t len);
+
+luna_vec_t *
+luna_arena_vec(luna_arena_t *self);
+
+luna_hash_t *
+luna_arena_hash(luna_arena_t *self);
+
+void
+luna_arena_free(luna_arena_t *self);
+
+#endif /* __LUNA_ARENA__ */
@@ -5,88 +5,212 @@
 // Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
 //
 
-#include "vec.h"
-#include "hash.h"
+#include <string.h>
 #include "ast.h"
+#include "arena.h"
 #include "internal.h"
 
 /*
- * Alloc a luna value and assign the given `node`.
+ * Initialize an empty ast, reserving index 0
+ * of each table for none.
  */
 
-luna_object_t *
-luna_node(luna_node_t *node) {
-  luna_object_t *self = malloc(sizeof(luna_object_t));
-  if (unlikely(!self)) return NULL;
-  self->type = LUNA_TYPE_NODE;
-  self->value.as_pointer = node;
-  return self;
+void
+luna_ast_init(luna_ast_t *self) {
+  luna_node_t none = { 0 };
+  kv_init(self->nodes);
+  kv_init(self->extra);
+  kv_init(self->names);
+  kv_init(self->literals);
+  kv_init(self->scratch);
+  memset(self->recent, 0, sizeof(self->recent));
+  luna_arena_init(&self->arena);
+  kv_push(luna_node_t, self->nodes, none);
+  kv_push(const char *, self->names, NULL);
+  kv_push(double, self->literals, 0);
 }
 
 /*
- * Alloc and initialize a new block node.
+ * Free the ast and everything it holds.
  */
 
-luna_block_node_t *
-luna_block_node_new() {
-  luna_block_node_t *self = malloc(sizeof(luna_block_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_BLOCK;
-  self->stmts = luna_vec_new();
-  return self;
+void
+luna_ast_free(luna_ast_t *self) {
+  kv_destroy(self->nodes);
+  kv_destroy(self->extra);
+  kv_destroy(self->names);
+  kv_destroy(self->literals);
+  kv_destroy(self->scratch);
+  luna_arena_free(&self->arena);
 }
 
 /*
- * Alloc and initialize a new args node.
+ * Append a node of `type` with fields `a` and `b`,
+ * returning its id.
  */
 
-luna_args_node_t *
-luna_args_node_new() {
-  luna_args_node_t *self = malloc(sizeof(luna_args_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_ARGS;
-  self->vec = luna_vec_new();
-  self->hash = luna_hash_new();
-  return self;
+luna_node_id_t
+luna_ast_push(luna_ast_t *self, luna_node_type type, uint32_t a, uint32_t b) {
+  luna_node_t node = { .type = type, .a = a, .b = b };
+  kv_push(luna_node_t, self->nodes, node);
+  return kv_size(self->nodes) - 1;
+}
+
+/*
+ * Return the index of `name`, appending it unless it was
+ * seen recently, 0 for NULL.
+ */
+
+uint32_t
+luna_ast_name_new(luna_ast_t *self, const char *name) {
+  if (!name) return 0;
+  uint32_t *slot = &self->recent[((uintptr_t) name >> 3) % LUNA_AST_RECENT];
+  if (name == kv_A(self->names, *slot)) return *slot;
+  kv_push(const char *, self->names, name);
+  return *slot = kv_size(self->names) - 1;
+}
+
+/*
+ * Append float literal `val`, returning its index.
+ */
+
+uint32_t
+luna_ast_literal_new(luna_ast_t *self, double val) {
+  kv_push(double, self->literals, val);
+  return kv_size(self->literals) - 1;
+}
+
+/*
+ * Move the scratch slots above `mark` to extra,
+ * returning them as a list.
+ */
+
+luna_list_t
+luna_ast_list_new(luna_ast_t *self, uint32_t mark) {
+  luna_list_t list = { kv_size(self->extra), kv_size(self->scratch) - mark };
+  for (uint32_t i = mark; i < kv_size(self->scratch); ++i) {
+    kv_push(uint32_t, self->extra, kv_A(self->scratch, i));
+  }
+  kv_size(self->scratch) = mark;
+  return list;
+}
+
+/*
+ * Return slot `i` of `list` or 0 past its end.
+ */
+
+static luna_node_id_t
+list_at(luna_ast_t *self, luna_list_t list, uint32_t i) {
+  return i < list.len ? luna_ast_extra(self, list.start + i) : 0;
+}
+
+/*
+ * Return child `i` of `node` in source order, 0 past the
+ * last child. Optional children are always last, so an
+ * absent one also ends the node.
+ */
+
+luna_node_id_t
+luna_ast_child(luna_ast_t *self, luna_node_t *node, uint32_t i) {
+  switch (node->type) {
+    case LUNA_NODE_BLOCK:
+    case LUNA_NODE_ARRAY:
+      return list_at(self, luna_ast_list(node), i);
+    case LUNA_NODE_HASH:
+      return i < node->b ? luna_ast_extra(self, node->a + 2 * i + 1) : 0;
+    case LUNA_NODE_SLOT:
+    case LUNA_NODE_BINARY_OP:
+    case LUNA_NODE_WHILE:
+      return i < 2 ? (i ? node->b : node->a) : 0;
+    case LUNA_NODE_UNARY_OP:
+    case LUNA_NODE_RETURN:
+      return i ? 0 : node->a;
+    case LUNA_NODE_DECL:
+      return i ? 0 : luna_ast_record(self, node->b, luna_decl_extra_t)->val;
+    case LUNA_NODE_CALL: {
+      luna_call_extra_t *call = luna_ast_record(self, node->b, luna_call_extra_t);
+      if (!i--) return node->a;
+      if (i < call->args.len) return luna_ast_extra(self, call->args.start + i);
+      i -= call->args.len;
+      return i < call->pairs.len ? luna_ast_extra(self, call->pairs.start + 2 * i + 1) : 0;
+    }
+    case LUNA_NODE_FUNCTION: {
+      luna_function_extra_t *fn = luna_ast_record(self, node->b, luna_function_extra_t);
+      if (i < fn->params.len) return luna_ast_extra(self, fn->params.start + i);
+      return i == fn->params.len ? fn->block : 0;
+    }
+    case LUNA_NODE_IF: {
+      luna_if_extra_t *stmt = luna_ast_record(self, node->b, luna_if_extra_t);
+      switch (i) {
+        case 0: return node->a;
+        case 1: return stmt->block;
+      }
+      i -= 2;
+      if (i < stmt->else_ifs.len) return luna_ast_extra(self, stmt->else_ifs.start + i);
+      return i == stmt->else_ifs.len ? stmt->else_block : 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Append the `size` byte extra record `rec`,
+ * returning its index.
+ */
+
+static uint32_t
+record(luna_ast_t *self, const void *rec, size_t size) {
+  uint32_t i = kv_size(self->extra);
+  const uint32_t *slots = rec;
+  for (size_t j = 0; j < size / sizeof(uint32_t); ++j) {
+    kv_push(uint32_t, self->extra, slots[j]);
+  }
+  return i;
+}
+
+/*
+ * Alloc and initialize a new block node of `stmts`.
+ */
+
+luna_node_id_t
+luna_block_node_new(luna_ast_t *ast, luna_list_t stmts) {
+  return luna_ast_push(ast, LUNA_NODE_BLOCK, stmts.start, stmts.len);
 }
 
 /*
  * Alloc and initialize a new int node with the given `val`.
  */
 
-luna_int_node_t *
-luna_int_node_new(int val) {
-  luna_int_node_t *self = malloc(sizeof(luna_int_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_INT;
-  self->val = val;
-  return self;
+luna_node_id_t
+luna_int_node_new(luna_ast_t *ast, int val) {
+  return luna_ast_push(ast, LUNA_NODE_INT, (uint32_t) val, 0);
 }
 
 /*
  * Alloc and initialize a new float node with the given `val`.
  */
 
-luna_float_node_t *
-luna_float_node_new(float val) {
-  luna_float_node_t *self = malloc(sizeof(luna_float_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_FLOAT;
-  self->val = val;
-  return self;
+luna_node_id_t
+luna_float_node_new(luna_ast_t *ast, double val) {
+  return luna_ast_push(ast, LUNA_NODE_FLOAT, luna_ast_literal_new(ast, val), 0);
+}
+
+/*
+ * Alloc and initialize a new bool node with the given `val`.
+ */
+
+luna_node_id_t
+luna_bool_node_new(luna_ast_t *ast, int val) {
+  return luna_ast_push(ast, LUNA_NODE_BOOL, !!val, 0);
 }
 
 /*
  * Alloc and initialize a new id node with the given `val`.
  */
 
-luna_id_node_t *
-luna_id_node_new(const char *val) {
-  luna_id_node_t *self = malloc(sizeof(luna_id_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_ID;
-  self->val = val;
-  return self;
+luna_node_id_t
+luna_id_node_new(luna_ast_t *ast, const char *val) {
+  return luna_ast_push(ast, LUNA_NODE_ID, luna_ast_name_new(ast, val), 0);
 }
 
 /*
@@ -94,114 +218,82 @@ luna_id_node_new(const char *val) {
  * given `name`, `type`, and `val`.
  */
 
-luna_decl_node_t *
-luna_decl_node_new(const char *name, const char *type, luna_node_t *val) {
-  luna_decl_node_t *self = malloc(sizeof(luna_decl_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_DECL;
-  self->type = type;
-  self->name = name;
-  self->val = val;
-  return self;
+luna_node_id_t
+luna_decl_node_new(luna_ast_t *ast, const char *name, const char *type, luna_node_id_t val) {
+  luna_decl_extra_t extra = { luna_ast_name_new(ast, type), val };
+  uint32_t i = record(ast, &extra, sizeof(extra));
+  return luna_ast_push(ast, LUNA_NODE_DECL, luna_ast_name_new(ast, name), i);
 }
 
 /*
  * Alloc and initialize a new string node with the given `val`.
  */
 
-luna_string_node_t *
-luna_string_node_new(const char *val) {
-  luna_string_node_t *self = malloc(sizeof(luna_string_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_STRING;
-  self->val = val;
-  return self;
+luna_node_id_t
+luna_string_node_new(luna_ast_t *ast, const char *val) {
+  return luna_ast_push(ast, LUNA_NODE_STRING, luna_ast_name_new(ast, val), 0);
 }
 
 /*
- * Alloc and initialize a new call node with the given `expr`.
+ * Alloc and initialize a new call node of `expr` with
+ * positional `args` and keyword arg `pairs`.
  */
 
-luna_call_node_t *
-luna_call_node_new(luna_node_t *expr) {
-  luna_call_node_t *self = malloc(sizeof(luna_call_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_CALL;
-  self->expr = expr;
-  self->args = luna_args_node_new();
-  if (unlikely(!self->args)) return NULL;
-  return self;
+luna_node_id_t
+luna_call_node_new(luna_ast_t *ast, luna_node_id_t expr, luna_list_t args, luna_list_t pairs) {
+  luna_call_extra_t extra = { args, pairs };
+  return luna_ast_push(ast, LUNA_NODE_CALL, expr, record(ast, &extra, sizeof(extra)));
 }
 
 /*
  * Alloc and initialize slot access node with `left` and `right`.
  */
 
-luna_slot_node_t *
-luna_slot_node_new(luna_node_t *left, luna_node_t *right) {
-  luna_slot_node_t *self = malloc(sizeof(luna_slot_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_SLOT;
-  self->left = left;
-  self->right = right;
-  return self;
+luna_node_id_t
+luna_slot_node_new(luna_ast_t *ast, luna_node_id_t left, luna_node_id_t right) {
+  return luna_ast_push(ast, LUNA_NODE_SLOT, left, right);
 }
 
 /*
  * Alloc and initialize a unary `op` node with `expr` node.
  */
 
-luna_unary_op_node_t *
-luna_unary_op_node_new(luna_token op, luna_node_t *expr, int postfix) {
-  luna_unary_op_node_t *self = malloc(sizeof(luna_unary_op_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_UNARY_OP;
-  self->op = op;
-  self->expr = expr;
-  self->postfix = postfix;
-  return self;
+luna_node_id_t
+luna_unary_op_node_new(luna_ast_t *ast, luna_token op, luna_node_id_t expr, int postfix) {
+  luna_node_id_t id = luna_ast_push(ast, LUNA_NODE_UNARY_OP, expr, 0);
+  luna_node_t *node = luna_ast_node(ast, id);
+  node->op = op;
+  if (postfix) node->flags |= LUNA_NODE_POSTFIX;
+  return id;
 }
 
 /*
  * Alloc and initialize a binary `op` node with `left` and `right` nodes.
  */
 
-luna_binary_op_node_t *
-luna_binary_op_node_new(luna_token op, luna_node_t *left, luna_node_t *right) {
-  luna_binary_op_node_t *self = malloc(sizeof(luna_binary_op_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_BINARY_OP;
-  self->op = op;
-  self->left = left;
-  self->right = right;
-  self->let = 0;
-  return self;
+luna_node_id_t
+luna_binary_op_node_new(luna_ast_t *ast, luna_token op, luna_node_id_t left, luna_node_id_t right) {
+  luna_node_id_t id = luna_ast_push(ast, LUNA_NODE_BINARY_OP, left, right);
+  luna_ast_node(ast, id)->op = op;
+  return id;
 }
 
 /*
- * Alloc and initialize a new array node.
+ * Alloc and initialize a new array node of `vals`.
  */
 
-luna_array_node_t *
-luna_array_node_new() {
-  luna_array_node_t *self = malloc(sizeof(luna_array_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_ARRAY;
-  self->vals = luna_vec_new();
-  return self;
+luna_node_id_t
+luna_array_node_new(luna_ast_t *ast, luna_list_t vals) {
+  return luna_ast_push(ast, LUNA_NODE_ARRAY, vals.start, vals.len);
 }
 
 /*
- * Alloc and initialize a new hash node.
+ * Alloc and initialize a new hash node of (name, val) `pairs`.
  */
 
-luna_hash_node_t *
-luna_hash_node_new() {
-  luna_hash_node_t *self = malloc(sizeof(luna_hash_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_HASH;
-  self->vals = luna_hash_new();
-  return self;
+luna_node_id_t
+luna_hash_node_new(luna_ast_t *ast, luna_list_t pairs) {
+  return luna_ast_push(ast, LUNA_NODE_HASH, pairs.start, pairs.len);
 }
 
 /*
@@ -209,16 +301,11 @@ luna_hash_node_new() {
  * `type`, `block` of statements and `params`.
  */
 
-luna_function_node_t *
-luna_function_node_new(const char *name, const char *type, luna_block_node_t *block, luna_vec_t *params) {
-  luna_function_node_t *self = malloc(sizeof(luna_function_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_FUNCTION;
-  self->params = params;
-  self->block = block;
-  self->type = type;
-  self->name = name;
-  return self;
+luna_node_id_t
+luna_function_node_new(luna_ast_t *ast, const char *name, const char *type, luna_node_id_t block, luna_list_t params) {
+  luna_function_extra_t extra = { luna_ast_name_new(ast, type), block, params };
+  uint32_t i = record(ast, &extra, sizeof(extra));
+  return luna_ast_push(ast, LUNA_NODE_FUNCTION, luna_ast_name_new(ast, name), i);
 }
 
 /*
@@ -226,53 +313,35 @@ luna_function_node_new(const char *name, const char *type, luna_block_node_t *bl
  * with an implicit return.
  */
 
-luna_function_node_t *
-luna_function_node_new_from_expr(luna_node_t *expr, luna_vec_t *params) {
-  luna_function_node_t *self = malloc(sizeof(luna_function_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_FUNCTION;
-  self->params = params;
-
-  // block
-  self->block = luna_block_node_new();
-  if (unlikely(!self->block)) return NULL;
-
-  // return
-  luna_return_node_t *ret = luna_return_node_new(expr);
-  luna_vec_push(self->block->stmts, luna_node((luna_node_t *) ret));
-
-  return self;
+luna_node_id_t
+luna_function_node_new_from_expr(luna_ast_t *ast, luna_node_id_t expr, luna_list_t params) {
+  uint32_t mark = luna_ast_mark(ast);
+  luna_ast_scratch(ast, luna_return_node_new(ast, expr));
+  luna_node_id_t block = luna_block_node_new(ast, luna_ast_list_new(ast, mark));
+  return luna_function_node_new(ast, NULL, NULL, block, params);
 }
 
 /*
  * Alloc and initialize a new type noe with the given `name`.
  */
 
-luna_type_node_t *
-luna_type_node_new(const char *name) {
-  luna_type_node_t *self = malloc(sizeof(luna_type_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_TYPE;
-  self->name = name;
-  return self;
+luna_node_id_t
+luna_type_node_new(luna_ast_t *ast, const char *name) {
+  return luna_ast_push(ast, LUNA_NODE_TYPE, luna_ast_name_new(ast, name), 0);
 }
 
 /*
  * Alloc and initialize a new if stmt node, negated for "unless",
- * with required `expr` and `block`.
+ * with required `expr` and `block`, `else_ifs` and an optional
+ * `else_block`.
  */
 
-luna_if_node_t *
-luna_if_node_new(int negate, luna_node_t *expr, luna_block_node_t *block) {
-  luna_if_node_t *self = malloc(sizeof(luna_if_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_IF;
-  self->negate = negate;
-  self->expr = expr;
-  self->block = block;
-  self->else_block = NULL;
-  self->else_ifs = luna_vec_new();
-  return self;
+luna_node_id_t
+luna_if_node_new(luna_ast_t *ast, int negate, luna_node_id_t expr, luna_node_id_t block, luna_list_t else_ifs, luna_node_id_t else_block) {
+  luna_if_extra_t extra = { block, else_block, else_ifs };
+  luna_node_id_t id = luna_ast_push(ast, LUNA_NODE_IF, expr, record(ast, &extra, sizeof(extra)));
+  if (negate) luna_ast_node(ast, id)->flags |= LUNA_NODE_NEGATE;
+  return id;
 }
 
 /*
@@ -280,26 +349,18 @@ luna_if_node_new(int negate, luna_node_t *expr, luna_block_node_t *block) {
  * otherwise "while", with required `expr` and `block`.
  */
 
-luna_while_node_t *
-luna_while_node_new(int negate, luna_node_t *expr, luna_block_node_t *block) {
-  luna_while_node_t *self = malloc(sizeof(luna_while_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_WHILE;
-  self->negate = negate;
-  self->expr = expr;
-  self->block = block;
-  return self;
+luna_node_id_t
+luna_while_node_new(luna_ast_t *ast, int negate, luna_node_id_t expr, luna_node_id_t block) {
+  luna_node_id_t id = luna_ast_push(ast, LUNA_NODE_WHILE, expr, block);
+  if (negate) luna_ast_node(ast, id)->flags |= LUNA_NODE_NEGATE;
+  return id;
 }
 
 /*
  * Alloc and initialize a new return node with the given `expr`.
  */
 
-luna_return_node_t *
-luna_return_node_new(luna_node_t *expr) {
-  luna_return_node_t *self = malloc(sizeof(luna_return_node_t));
-  if (unlikely(!self)) return NULL;
-  self->base.type = LUNA_NODE_RETURN;
-  self->expr = expr;
-  return self;
+luna_node_id_t
+luna_return_node_new(luna_ast_t *ast, luna_node_id_t expr) {
+  return luna_ast_push(ast, LUNA_NODE_RETURN, expr, 0);
 }
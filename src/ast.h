@@ -8,9 +8,10 @@
 #ifndef __LUNA_AST__
 #define __LUNA_AST__
 
+#include <stdint.h>
 #include "token.h"
-#include "vec.h"
-#include "object.h"
+#include "kvec.h"
+#include "arena.h"
 
 /*
  * Nodes.
@@ -53,256 +54,293 @@ LUNA_NODE_LIST
 } luna_node_type;
 
 /*
- * Luna node.
+ * Recent names remembered for reuse.
  */
 
-typedef struct {
-  luna_node_type type;
-  int lineno;
-} luna_node_t;
+#define LUNA_AST_RECENT 256
 
 /*
- * Luna block node.
+ * Node flags.
  */
 
-typedef struct {
-  luna_node_t base;
-  luna_vec_t *stmts;
-} luna_block_node_t;
+#define LUNA_NODE_NEGATE  1 // unless, until
+#define LUNA_NODE_POSTFIX 2 // a++
+#define LUNA_NODE_LET     4 // let a = b
 
 /*
- * Luna args node.
+ * Index of a node in its ast, 0 is no node.
  */
 
-typedef struct {
-  luna_node_t base;
-  luna_vec_t *vec;
-  luna_hash_t *hash;
-} luna_args_node_t;
+typedef uint32_t luna_node_id_t;
 
 /*
- * Luna slot access node.
+ * Run of `len` extra slots from `start`.
  */
 
 typedef struct {
-  luna_node_t base;
-  luna_node_t *left;
-  luna_node_t *right;
-} luna_slot_node_t;
+  uint32_t start;
+  uint32_t len;
+} luna_list_t;
 
 /*
- * Luna unary operation node.
+ * Luna node.
+ *
+ * Nodes are 16 bytes stored by value in the ast's node
+ * array, `a` and `b` hold child ids, names, inline
+ * values or lists depending on the type:
+ *
+ *   type       a            b
+ *
+ *   BLOCK      stmts start  stmts len
+ *   ARRAY      vals start   vals len
+ *   HASH       pairs start  pairs len   (name, val) pairs
+ *   CALL       expr         extra       luna_call_extra_t
+ *   SLOT       left         right
+ *   UNARY_OP   expr                     `op`, POSTFIX
+ *   BINARY_OP  left         right       `op`, LET
+ *   INT        value
+ *   FLOAT      literal
+ *   BOOL       value
+ *   ID         name
+ *   STRING     name
+ *   TYPE       name
+ *   DECL       name         extra       luna_decl_extra_t
+ *   FUNCTION   name         extra       luna_function_extra_t
+ *   IF         expr         extra       luna_if_extra_t, NEGATE
+ *   WHILE      expr         block       NEGATE
+ *   RETURN     expr
  */
 
 typedef struct {
-  luna_node_t base;
-  luna_token op;
-  luna_node_t *expr;
-  int postfix;
-} luna_unary_op_node_t;
+  uint8_t type;
+  uint8_t flags;
+  uint16_t op;
+  uint32_t lineno;
+  uint32_t a;
+  uint32_t b;
+} luna_node_t;
 
 /*
- * Luna binary operation node.
+ * Call extra, positional and keyword (name, val) args.
  */
 
 typedef struct {
-  luna_node_t base;
-  luna_token op;
-  luna_node_t *left;
-  luna_node_t *right;
-  int let;
-} luna_binary_op_node_t;
+  luna_list_t args;
+  luna_list_t pairs;
+} luna_call_extra_t;
 
 /*
- * Luna int node.
+ * Declaration extra.
  */
 
 typedef struct {
-  luna_node_t base;
-  int val;
-} luna_int_node_t;
+  uint32_t type;
+  luna_node_id_t val;
+} luna_decl_extra_t;
 
 /*
- * Luna float node.
+ * Function extra.
  */
 
 typedef struct {
-  luna_node_t base;
-  float val;
-} luna_float_node_t;
+  uint32_t type;
+  luna_node_id_t block;
+  luna_list_t params;
+} luna_function_extra_t;
 
 /*
- * Luna id node.
+ * If stmt extra, else ifs are IF nodes.
  */
 
 typedef struct {
-  luna_node_t base;
-  const char *val;
-} luna_id_node_t;
+  luna_node_id_t block;
+  luna_node_id_t else_block;
+  luna_list_t else_ifs;
+} luna_if_extra_t;
 
 /*
- * Luna declaration node.
+ * Luna ast.
+ *
+ * Nodes live in one contiguous array and refer to each
+ * other by index. Lists and the fields which do not fit
+ * a node live in `extra`, names and strings in `names`
+ * and float literals in `literals`, index 0 of each being
+ * none. Lists are gathered on `scratch` while parsing and
+ * copied to `extra` once complete, so nested lists never
+ * interleave. Strings built by folding go in `arena`.
+ *
+ * Names are interned, so `recent` maps recently seen name
+ * pointers to their index, and a variable referenced over
+ * and over shares one entry.
  */
 
 typedef struct {
-  luna_node_t base;
-  const char *name;
-  const char *type;
-  luna_node_t *val;
-} luna_decl_node_t;
+  kvec_t(luna_node_t) nodes;
+  kvec_t(uint32_t) extra;
+  kvec_t(const char *) names;
+  kvec_t(double) literals;
+  kvec_t(uint32_t) scratch;
+  uint32_t recent[LUNA_AST_RECENT];
+  luna_arena_t arena;
+} luna_ast_t;
 
 /*
- * Luna string node.
+ * Return node `id` of `ast`.
  */
 
-typedef struct {
-  luna_node_t base;
-  const char *val;
-} luna_string_node_t;
+#define luna_ast_node(ast, id) (&kv_A((ast)->nodes, (id)))
 
 /*
- * Luna array node.
+ * Return name `i` of `ast`, NULL for none.
  */
 
-typedef struct {
-  luna_node_t base;
-  luna_vec_t *vals;
-} luna_array_node_t;
+#define luna_ast_name(ast, i) kv_A((ast)->names, (i))
 
 /*
- * Luna hash node.
+ * Return float literal `i` of `ast`.
  */
 
-typedef struct {
-  luna_node_t base;
-  luna_hash_t *vals;
-} luna_hash_node_t;
+#define luna_ast_literal(ast, i) kv_A((ast)->literals, (i))
 
 /*
- * Luna call node.
+ * Return extra slot `i` of `ast`.
  */
 
-typedef struct {
-  luna_node_t base;
-  luna_node_t *expr;
-  luna_args_node_t *args;
-} luna_call_node_t;
+#define luna_ast_extra(ast, i) kv_A((ast)->extra, (i))
 
 /*
- * Luna function node.
+ * Return the extra record of `type` at `i`.
  */
 
-typedef struct {
-  luna_node_t base;
-  const char *type;
-  const char *name;
-  luna_block_node_t *block;
-  luna_vec_t *params;
-} luna_function_node_t;
+#define luna_ast_record(ast, i, type) ((type *) &luna_ast_extra(ast, i))
 
 /*
- * Luna type node.
+ * Return the list held by list node `node`.
  */
 
-typedef struct {
-  luna_node_t base;
-  const char *name;
-  luna_hash_t *types;
-} luna_type_node_t;
+#define luna_ast_list(node) ((luna_list_t) { (node)->a, (node)->b })
 
 /*
- * Luna if stmt node.
+ * Iterate `list` of `ast`, populating `i` and `id`.
  */
 
-typedef struct {
-  luna_node_t base;
-  int negate;
-  luna_node_t *expr;
-  luna_block_node_t *block;
-  luna_block_node_t *else_block;
-  luna_vec_t *else_ifs;
-} luna_if_node_t;
+#define luna_list_each(ast, list, block) { \
+    luna_node_id_t id; \
+    luna_list_t _list = (list); \
+    int len = _list.len; \
+    for (int i = 0; i < len; ++i) { \
+      id = luna_ast_extra(ast, _list.start + i); \
+      block; \
+    } \
+  }
 
 /*
- * Luna while loop stmt node.
+ * Iterate (name, val) `pairs` of `ast`, populating
+ * `i`, `slot` and `id`.
  */
 
-typedef struct {
-  luna_node_t base;
-  int negate;
-  luna_node_t *expr;
-  luna_block_node_t *block;
-} luna_while_node_t;
+#define luna_pairs_each(ast, pairs, block) { \
+    const char *slot; \
+    luna_node_id_t id; \
+    luna_list_t _list = (pairs); \
+    int len = _list.len; \
+    for (int i = 0; i < len; ++i) { \
+      slot = luna_ast_name(ast, luna_ast_extra(ast, _list.start + 2 * i)); \
+      id = luna_ast_extra(ast, _list.start + 2 * i + 1); \
+      block; \
+    } \
+  }
 
 /*
- * Luna return node.
+ * Return the current top of the scratch stack.
  */
 
-typedef struct {
-  luna_node_t base;
-  luna_node_t *expr;
-} luna_return_node_t;
+#define luna_ast_mark(ast) kv_size((ast)->scratch)
+
+/*
+ * Push `val` to the scratch stack.
+ */
+
+#define luna_ast_scratch(ast, val) kv_push(uint32_t, (ast)->scratch, (val))
 
 // protos
 
-luna_object_t *
-luna_node(luna_node_t *node);
+void
+luna_ast_init(luna_ast_t *self);
+
+void
+luna_ast_free(luna_ast_t *self);
+
+luna_node_id_t
+luna_ast_push(luna_ast_t *self, luna_node_type type, uint32_t a, uint32_t b);
+
+uint32_t
+luna_ast_name_new(luna_ast_t *self, const char *name);
+
+uint32_t
+luna_ast_literal_new(luna_ast_t *self, double val);
+
+luna_list_t
+luna_ast_list_new(luna_ast_t *self, uint32_t mark);
+
+luna_node_id_t
+luna_ast_child(luna_ast_t *self, luna_node_t *node, uint32_t i);
 
-luna_block_node_t *
-luna_block_node_new();
+luna_node_id_t
+luna_block_node_new(luna_ast_t *ast, luna_list_t stmts);
 
-luna_function_node_t *
-luna_function_node_new(const char *name, const char *type, luna_block_node_t *block, luna_vec_t *params);
+luna_node_id_t
+luna_function_node_new(luna_ast_t *ast, const char *name, const char *type, luna_node_id_t block, luna_list_t params);
 
-luna_function_node_t *
-luna_function_node_new_from_expr(luna_node_t *expr, luna_vec_t *params);
+luna_node_id_t
+luna_function_node_new_from_expr(luna_ast_t *ast, luna_node_id_t expr, luna_list_t params);
 
-luna_slot_node_t *
-luna_slot_node_new(luna_node_t *left, luna_node_t *right);
+luna_node_id_t
+luna_slot_node_new(luna_ast_t *ast, luna_node_id_t left, luna_node_id_t right);
 
-luna_call_node_t *
-luna_call_node_new(luna_node_t *expr);
+luna_node_id_t
+luna_call_node_new(luna_ast_t *ast, luna_node_id_t expr, luna_list_t args, luna_list_t pairs);
 
-luna_unary_op_node_t *
-luna_unary_op_node_new(luna_token op, luna_node_t *expr, int postfix);
+luna_node_id_t
+luna_unary_op_node_new(luna_ast_t *ast, luna_token op, luna_node_id_t expr, int postfix);
 
-luna_binary_op_node_t *
-luna_binary_op_node_new(luna_token op, luna_node_t *left, luna_node_t *right);
+luna_node_id_t
+luna_binary_op_node_new(luna_ast_t *ast, luna_token op, luna_node_id_t left, luna_node_id_t right);
 
-luna_id_node_t *
-luna_id_node_new(const char *val);
+luna_node_id_t
+luna_id_node_new(luna_ast_t *ast, const char *val);
 
-luna_decl_node_t *
-luna_decl_node_new(const char *name, const char *type, luna_node_t *val);
+luna_node_id_t
+luna_decl_node_new(luna_ast_t *ast, const char *name, const char *type, luna_node_id_t val);
 
-luna_int_node_t *
-luna_int_node_new(int val);
+luna_node_id_t
+luna_int_node_new(luna_ast_t *ast, int val);
 
-luna_float_node_t *
-luna_float_node_new(float val);
+luna_node_id_t
+luna_float_node_new(luna_ast_t *ast, double val);
 
-luna_array_node_t *
-luna_array_node_new();
+luna_node_id_t
+luna_bool_node_new(luna_ast_t *ast, int val);
 
-luna_hash_node_t *
-luna_hash_node_new();
+luna_node_id_t
+luna_array_node_new(luna_ast_t *ast, luna_list_t vals);
 
-luna_string_node_t *
-luna_string_node_new(const char *val);
+luna_node_id_t
+luna_hash_node_new(luna_ast_t *ast, luna_list_t pairs);
 
-luna_if_node_t *
-luna_if_node_new(int negate, luna_node_t *expr, luna_block_node_t *block);
+luna_node_id_t
+luna_string_node_new(luna_ast_t *ast, const char *val);
 
-luna_while_node_t *
-luna_while_node_new(int negate, luna_node_t *expr, luna_block_node_t *block);
+luna_node_id_t
+luna_if_node_new(luna_ast_t *ast, int negate, luna_node_id_t expr, luna_node_id_t block, luna_list_t else_ifs, luna_node_id_t else_block);
 
-luna_return_node_t *
-luna_return_node_new(luna_node_t *expr);
+luna_node_id_t
+luna_while_node_new(luna_ast_t *ast, int negate, luna_node_id_t expr, luna_node_id_t block);
 
-luna_args_node_t *
-luna_args_node_new();
+luna_node_id_t
+luna_return_node_new(luna_ast_t *ast, luna_node_id_t expr);
 
-luna_type_node_t *
-luna_type_node_new(const char *name);
+luna_node_id_t
+luna_type_node_new(luna_ast_t *ast, const char *name);
 
-#endif /* __LUNA_AST__ */
\ No newline at end of file
+#endif /* __LUNA_AST__ */
@@ -0,0 +1,339 @@
+
+//
+// bytecode.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bytecode.h"
+#include "object.h"
+#include "opcodes.h"
+#include "internal.h"
+
+/*
+ * .lunac layout, in host byte order:
+ *
+ *   header
+ *   code       ninstructions x uint64
+ *   lines      ninstructions x uint32, padded to 8
+ *   constants  nconstants records of a uint64 value, strings
+ *              followed by a uint64 length and the bytes
+ *              padded to 8
+ *
+ * Code and lines are used in place from the mapping,
+ * constants are decoded as strings must be interned.
+ */
+
+#define MAGIC 0x434e554c /* "LUNC" */
+
+/*
+ * File header.
+ */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;
+  uint32_t ninstructions;
+  uint32_t nconstants;
+  uint32_t nregisters;
+  uint32_t order;
+} header_t;
+
+/*
+ * Round `n` up to a multiple of 8.
+ */
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+/*
+ * Return the FNV-1a hash of `len` bytes of `source`.
+ */
+
+uint64_t
+luna_bytecode_hash(const char *source, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char) source[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+/*
+ * Write `len` bytes of `buf` followed by zero padding
+ * to a multiple of 8.
+ */
+
+static int
+write_padded(FILE *file, const void *buf, size_t len) {
+  static const char zero[8];
+  if (len && 1 != fwrite(buf, len, 1, file)) return -1;
+  size_t pad = ALIGN8(len) - len;
+  if (pad && 1 != fwrite(zero, pad, 1, file)) return -1;
+  return 0;
+}
+
+/*
+ * Write the main activation of `vm` compiled from source
+ * with `hash` to `path`, returning 0 on success. The file
+ * is written aside and renamed, so readers never see
+ * a partial one.
+ */
+
+int
+luna_bytecode_write(luna_vm_t *vm, uint64_t hash, const char *path) {
+  luna_activation_t *fn = vm->main;
+  char tmp[1024];
+  FILE *file;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= sizeof(tmp)) return -1;
+  if (!(file = fopen(tmp, "wb"))) return -1;
+
+  header_t header = {
+    .magic = MAGIC,
+    .version = LUNA_BYTECODE_VERSION,
+    .hash = hash,
+    .ninstructions = kv_size(fn->code),
+    .nconstants = luna_vec_length(&fn->constants),
+    .nregisters = fn->nregisters,
+    .order = 0x01020304
+  };
+
+  if (write_padded(file, &header, sizeof(header))) goto error;
+  if (write_padded(file, fn->code.a, kv_size(fn->code) * sizeof(luna_instruction_t))) goto error;
+  if (write_padded(file, fn->lines.a, kv_size(fn->lines) * sizeof(uint32_t))) goto error;
+
+  luna_vec_each(&fn->constants, {
+    if (1 != fwrite(&val, sizeof(val), 1, file)) goto error;
+    if (luna_is_string(val)) {
+      luna_string_t *str = luna_value_as_pointer(val);
+      uint64_t len = str->len;
+      if (1 != fwrite(&len, sizeof(len), 1, file)) goto error;
+      if (write_padded(file, str->val, len)) goto error;
+    }
+  });
+
+  if (fclose(file)) {
+    unlink(tmp);
+    return -1;
+  }
+
+  if (rename(tmp, path)) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+
+error:
+  fclose(file);
+  unlink(tmp);
+  return -1;
+}
+
+/*
+ * Check operands of the code in `fn` reference
+ * registers, constants and pcs which exist, so
+ * a corrupt file can't send the vm astray.
+ */
+
+#define REG(n) ((n) < fn->nregisters)
+#define KST(n) ((n) < luna_vec_length(&fn->constants))
+#define RK_(n) (ISK(n) ? KST(INDEXK(n)) : REG(n))
+#define PC(n) ((n) >= 0 && (n) < len)
+
+static int
+verify(luna_activation_t *fn) {
+  int len = kv_size(fn->code);
+  int nops = sizeof(luna_op_strings) / sizeof(luna_op_strings[0]);
+
+  for (int pc = 0; pc < len; ++pc) {
+    luna_instruction_t i = kv_A(fn->code, pc);
+    int ok;
+
+    if (OP(i) >= nops) return 0;
+
+    switch (OP(i)) {
+      case LUNA_OP_HALT:
+      case LUNA_OP_PRINT:
+        ok = REG(A(i));
+        break;
+      case LUNA_OP_TEST:
+        ok = REG(A(i)) && PC(pc + 2);
+        break;
+      case LUNA_OP_JMP:
+        ok = PC(pc + 1 + SB(i));
+        break;
+      case LUNA_OP_JTRUE:
+      case LUNA_OP_JFALSE:
+        ok = REG(A(i)) && PC(pc + 1 + SB(i));
+        break;
+      case LUNA_OP_LOADK:
+        ok = REG(A(i)) && KST(B(i));
+        break;
+      case LUNA_OP_LOADB:
+        ok = REG(A(i)) && KST(B(i)) && (!C(i) || PC(pc + 2));
+        break;
+      case LUNA_OP_MOVE:
+      case LUNA_OP_CAPTURE:
+      case LUNA_OP_DRAIN:
+        ok = REG(A(i)) && REG(B(i));
+        break;
+      case LUNA_OP_FORK:
+        ok = REG(A(i)) && C(i) <= SB(i) && PC(pc + 1 + SB(i));
+        for (int c = pc + 1 + SB(i) - C(i); ok && c < pc + 1 + SB(i); ++c) {
+          ok = LUNA_OP_CAPTURE == OP(kv_A(fn->code, c));
+        }
+        break;
+      case LUNA_OP_NEGATE:
+      case LUNA_OP_BIT_NOT:
+      case LUNA_OP_JOIN:
+      case LUNA_OP_SLEEP:
+      case LUNA_OP_CAT:
+      case LUNA_OP_DELETE:
+      case LUNA_OP_STAT:
+      case LUNA_OP_GREP:
+        ok = REG(A(i)) && RK_(B(i));
+        break;
+      case LUNA_OP_STREAM:
+        ok = REG(A(i)) && RK_(B(i)) && C(i) <= 1;
+        break;
+      case LUNA_OP_EQ:
+      case LUNA_OP_LT:
+      case LUNA_OP_LTE:
+        ok = RK_(B(i)) && RK_(C(i)) && PC(pc + 2);
+        break;
+      case LUNA_OP_JEQ:
+      case LUNA_OP_JLT:
+      case LUNA_OP_JLTE:
+      case LUNA_OP_JNEQ:
+      case LUNA_OP_JNLT:
+      case LUNA_OP_JNLTE:
+        ok = RK_(B(i)) && RK_(C(i)) && PC(pc + 1 + SA(i));
+        break;
+      default:
+        ok = REG(A(i)) && RK_(B(i)) && RK_(C(i));
+    }
+
+    if (!ok) return 0;
+  }
+
+  // must not run off the end
+  return LUNA_OP_HALT == OP(kv_A(fn->code, len - 1))
+    || LUNA_OP_JMP == OP(kv_A(fn->code, len - 1));
+}
+
+#undef REG
+#undef KST
+#undef RK_
+#undef PC
+
+/*
+ * Load bytecode from `path` when it was compiled from
+ * source with `hash` by this version of luna, interning
+ * strings in `state`. Returns NULL when the file is
+ * missing, stale or malformed.
+ */
+
+luna_vm_t *
+luna_bytecode_load(const char *path, uint64_t hash, luna_state_t *state) {
+  struct stat s;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  if (fstat(fd, &s) < 0 || s.st_size < sizeof(header_t)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = s.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) return NULL;
+
+  // header
+  header_t *header = (header_t *) map;
+  if (MAGIC != header->magic
+    || LUNA_BYTECODE_VERSION != header->version
+    || 0x01020304 != header->order
+    || hash != header->hash
+    || !header->ninstructions
+    || header->nregisters > LUNA_MAX_REGISTERS) goto error;
+
+  size_t n = header->ninstructions;
+  size_t code = ALIGN8(sizeof(header_t));
+  size_t lines = code + n * sizeof(luna_instruction_t);
+  size_t off = lines + ALIGN8(n * sizeof(uint32_t));
+  if (off > size) goto error;
+
+  luna_vm_t *vm = malloc(sizeof(luna_vm_t));
+  luna_activation_t *fn = malloc(sizeof(luna_activation_t));
+  if (unlikely(!vm || !fn)) {
+    free(vm);
+    free(fn);
+    goto error;
+  }
+
+  // code and lines in place, never grown
+  fn->code.a = (luna_instruction_t *) (map + code);
+  fn->code.n = fn->code.m = n;
+  fn->lines.a = (uint32_t *) (map + lines);
+  fn->lines.n = fn->lines.m = n;
+  fn->nregisters = header->nregisters;
+  fn->kindex = NULL;
+  fn->ip = fn->code.a;
+  luna_vec_init(&fn->constants);
+
+  // constants
+  for (uint32_t i = 0; i < header->nconstants; ++i) {
+    luna_value_t val;
+    if (off + sizeof(val) > size) goto corrupt;
+    memcpy(&val, map + off, sizeof(val));
+    off += sizeof(val);
+
+    if (luna_value_is_object(val)) {
+      uint64_t len;
+      if (off + sizeof(len) > size) goto corrupt;
+      memcpy(&len, map + off, sizeof(len));
+      off += sizeof(len);
+      if (len > size - off || len > INT32_MAX) goto corrupt;
+
+      luna_string_t *str = luna_string_slice(state, (char *) map + off, len);
+      if (unlikely(!str)) goto corrupt;
+
+      val = luna_value_object(str);
+      off += ALIGN8(len);
+    } else if (luna_value_is_pointer(val)) {
+      goto corrupt;
+    }
+
+    luna_vec_push(&fn->constants, val);
+  }
+
+  if (!verify(fn)) goto corrupt;
+
+  vm->main = fn;
+  vm->trace = NULL;
+  kv_init(vm->registers);
+  vm->sched = NULL;
+  vm->err = NULL;
+  vm->lineno = 0;
+  return vm;
+
+corrupt:
+  kv_destroy(fn->constants);
+  free(fn);
+  free(vm);
+
+error:
+  munmap(map, size);
+  return NULL;
+}
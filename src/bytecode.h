@@ -0,0 +1,50 @@
+
+//
+// bytecode.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_BYTECODE__
+#define __LUNA_BYTECODE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+#include "state.h"
+
+/*
+ * Bytecode format version, bump on any change to the
+ * layout or the instruction set, or to what a source
+ * compiles to, as caches are keyed by its hash alone.
+ *
+ *   2  FORK, JOIN and CAPTURE
+ *   3  SLEEP, CAT and DELETE
+ *   4  STAT and WRITE
+ *   5  STREAM, GREP, PRINT and DRAIN, method
+ *      receivers passed as first arguments
+ *   6  left operand locals copied before a right
+ *      operand writing locals
+ *   7  BIT_NOT
+ */
+
+#define LUNA_BYTECODE_VERSION 7
+
+/*
+ * Bytecode file extension.
+ */
+
+#define LUNA_BYTECODE_EXT ".lunac"
+
+// protos
+
+uint64_t
+luna_bytecode_hash(const char *source, size_t len);
+
+int
+luna_bytecode_write(luna_vm_t *vm, uint64_t hash, const char *path);
+
+luna_vm_t *
+luna_bytecode_load(const char *path, uint64_t hash, luna_state_t *state);
+
+#endif /* __LUNA_BYTECODE__ */
@@ -5,205 +5,748 @@
 // Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
 //
 
+#include <string.h>
 #include "ast.h"
+#include "fold.h"
+#include "peephole.h"
 #include "codegen.h"
 #include "internal.h"
 #include "visitor.h"
 #include "opcodes.h"
+#include "object.h"
 
-// TODO: MSB
-#define CONST(val) \
-  (vm->main->constants[vm->main->nconstants] = val, 32 + vm->main->nconstants++)
+/*
+ * Set error `str` when not previously set.
+ */
+
+#define error(str) \
+  (gen->err = gen->err \
+    ? gen->err \
+    : str)
+
+/*
+ * Constant RK operand for `val`.
+ */
+
+#define CONST(val) RKASK(constant(gen, val))
 
 /*
  * Emit an instruction.
  */
 
 #define emit(op, a, b, c) \
-  *vm->main->code++ = ABC(op, a, b, c);
+  emit_abc(gen, LUNA_OP_##op, a, b, c)
 
 /*
- * Emit binary operation.
+ * Return the index of constant `val`, appending it to the
+ * pool unless an identical constant exists.
+ */
+
+static int
+constant(luna_codegen_t *gen, luna_value_t val) {
+  int ret;
+  luna_activation_t *fn = gen->vm->main;
+  khiter_t k = kh_put(kindex, fn->kindex, val, &ret);
+  if (!ret) return kh_value(fn->kindex, k);
+
+  int n = luna_vec_length(&fn->constants);
+  if (n >= LUNA_MAX_CONSTANTS) {
+    kh_del(kindex, fn->kindex, k);
+    error("too many constants");
+    return 0;
+  }
+
+  kh_value(fn->kindex, k) = n;
+  luna_vec_push(&fn->constants, val);
+  return n;
+}
+
+/*
+ * Emit `op` with operands `a`, `b` and `c`, refusing
+ * operands which would not fit the instruction.
  */
 
 static void
-emit_op(luna_vm_t *vm, luna_binary_op_node_t *node, int l, int r) {
-  switch (node->op) {
-    case LUNA_TOKEN_OP_PLUS:
-      emit(ADD, 0, l, r);
-      break;
-    case LUNA_TOKEN_OP_MINUS:
-      emit(SUB, 0, l, r);
-      break;
-    case LUNA_TOKEN_OP_DIV:
-      emit(DIV, 0, l, r);
-      break;
-    case LUNA_TOKEN_OP_MUL:
-      emit(MUL, 0, l, r);
-      break;
-    case LUNA_TOKEN_OP_MOD:
-      emit(MOD, 0, l, r);
-      break;
-    case LUNA_TOKEN_OP_LT:
-      emit(LT, 0, l, r);
-      emit(JMP, 0, 1, 0);
-      emit(LOADB, 0, CONST(1), 1);
-      emit(LOADB, 0, CONST(0), 0);
-      break;
-    case LUNA_TOKEN_OP_LTE:
-      emit(LTE, 0, l, r);
-      emit(JMP, 0, 1, 0);
-      emit(LOADB, 0, CONST(1), 1);
-      emit(LOADB, 0, CONST(0), 0);
-      break;
+emit_abc(luna_codegen_t *gen, luna_op_t op, int a, int b, int c) {
+  luna_activation_t *fn = gen->vm->main;
+
+  if (a < 0 || a > LUNA_MAX_A) {
+    error("too many registers");
+    return;
+  }
+
+  if (b < 0 || b > LUNA_MAX_BC || c < 0 || c > LUNA_MAX_BC) {
+    error("operand out of range");
+    return;
   }
+
+  kv_push(luna_instruction_t, fn->code, ENCODE(op, a, b, c));
+  kv_push(uint32_t, fn->lines, gen->lineno);
 }
 
+/*
+ * Allocate the lowest free register as `state`,
+ * growing the frame only when every register is live.
+ */
+
+static int
+reg_alloc(luna_codegen_t *gen, luna_reg_t state) {
+  int n = 0;
+  int len = kv_size(gen->regs);
+  while (n < len && LUNA_REG_FREE != kv_A(gen->regs, n)) ++n;
+
+  if (n < len) {
+    kv_A(gen->regs, n) = state;
+    return n;
+  }
+
+  if (n >= LUNA_MAX_REGISTERS) {
+    error("too many registers");
+    return 0;
+  }
+
+  kv_push(unsigned char, gen->regs, state);
+  if (n >= gen->vm->main->nregisters) gen->vm->main->nregisters = n + 1;
+  return n;
+}
 
 /*
+ * Release operand `rk` when it is a temporary.
+ */
+
+static void
+release(luna_codegen_t *gen, int rk) {
+  if (rk < 0 || ISK(rk) || rk >= kv_size(gen->regs)) return;
+  if (LUNA_REG_TEMP == kv_A(gen->regs, rk)) {
+    kv_A(gen->regs, rk) = LUNA_REG_FREE;
+  }
+}
 
-0: lt 5 2;
- : false1:
- : ...
- : ...
- : true1:
- : ...
- : ...
- : endif1:
- : ...
- : ...
- : ...
-*/
+/*
+ * Return the id of `node`.
+ */
 
+#define node_id(gen, node) \
+  ((luna_node_id_t) ((node) - luna_ast_node((gen)->ast, 0)))
 
 /*
- * Visit block `node`.
+ * Count the nodes of the ast up to each id assigning or
+ * incrementing a local. The parser builds bottom up, so
+ * the nodes of an operand lie between the ids of the
+ * operand before it and of the operand itself.
  */
 
 static void
-visit_block(luna_visitor_t *self, luna_block_node_t *node) {
-  luna_vec_each(node->stmts, {
-    visit((luna_node_t *) val->value.as_pointer);
-  });
+count_writes(luna_codegen_t *gen) {
+  int n = 0;
+  kv_size(gen->writes) = 0;
+  for (size_t id = 0; id < kv_size(gen->ast->nodes); ++id) {
+    luna_node_t *node = luna_ast_node(gen->ast, id);
+    switch (node->type) {
+      case LUNA_NODE_BINARY_OP:
+        switch (node->op) {
+          case LUNA_TOKEN_OP_ASSIGN:
+          case LUNA_TOKEN_OP_PLUS_ASSIGN:
+          case LUNA_TOKEN_OP_MINUS_ASSIGN:
+          case LUNA_TOKEN_OP_MUL_ASSIGN:
+          case LUNA_TOKEN_OP_DIV_ASSIGN:
+          case LUNA_TOKEN_OP_AND_ASSIGN:
+          case LUNA_TOKEN_OP_OR_ASSIGN:
+            ++n;
+        }
+        break;
+      case LUNA_NODE_UNARY_OP:
+        if (LUNA_TOKEN_OP_INCR == node->op || LUNA_TOKEN_OP_DECR == node->op) ++n;
+        break;
+    }
+    kv_push(int, gen->writes, n);
+  }
 }
 
 /*
- * Visit int `node`.
+ * Return left operand `rk`, copied to a temporary when it
+ * is a local read in place and the nodes between `from`
+ * and `to` of the right operand write a local, which
+ * could change it before the operation is emitted.
+ */
+
+static int
+stable(luna_codegen_t *gen, int rk, luna_node_id_t from, luna_node_id_t to) {
+  if (rk < 0 || ISK(rk) || rk >= kv_size(gen->regs)) return rk;
+  if (LUNA_REG_LOCAL != kv_A(gen->regs, rk)) return rk;
+  if (kv_A(gen->writes, to - 1) == kv_A(gen->writes, from)) return rk;
+  int reg = reg_alloc(gen, LUNA_REG_TEMP);
+  emit(MOVE, reg, rk, 0);
+  return reg;
+}
+
+/*
+ * Return the frame of the node being generated.
+ */
+
+#define frame(gen) (&kv_A((gen)->frames, kv_size((gen)->frames) - 1))
+
+/*
+ * Return the destination register of the current
+ * expression, allocating a temporary when none was given.
+ */
+
+static int
+target(luna_codegen_t *gen) {
+  int dest = frame(gen)->dest;
+  return dest < 0
+    ? reg_alloc(gen, LUNA_REG_TEMP)
+    : dest;
+}
+
+/*
+ * Request node `id` be generated into register `dest`,
+ * or any register when -1, returning it to be visited.
+ * Its RK operand is in `result` once the caller resumes.
+ */
+
+static luna_node_id_t
+expr(luna_codegen_t *gen, luna_node_id_t id, int dest) {
+  gen->dest = dest;
+  return id;
+}
+
+/*
+ * Enter `node`, taking the destination requested for it.
  */
 
 static void
-visit_int(luna_visitor_t *self, luna_int_node_t *node) {
-  // printf("(int %d)", node->val);
+enter(luna_visitor_t *self, luna_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_codegen_frame_t frame = { .dest = gen->dest };
+  kv_push(luna_codegen_frame_t, gen->frames, frame);
+  gen->dest = -1;
+  gen->result = -1;
 }
 
 /*
- * Visit float `node`.
+ * Leave `node`, moving its result to the
+ * requested destination.
  */
 
 static void
-visit_float(luna_visitor_t *self, luna_float_node_t *node) {
-  luna_vm_t *vm = (luna_vm_t *) self->data;
+leave(luna_visitor_t *self, luna_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int dest = kv_pop(gen->frames).dest;
+  int rk = gen->result;
+
+  if (rk < 0) {
+    error("unsupported expression");
+    gen->result = 0;
+    return;
+  }
+
+  if (dest < 0 || rk == dest) return;
+
+  if (ISK(rk)) {
+    emit(LOADK, dest, INDEXK(rk), 0);
+  } else {
+    emit(MOVE, dest, rk, 0);
+    release(gen, rk);
+  }
+
+  gen->result = dest;
 }
 
 /*
- * Visit id `node`.
+ * Swap the current registers, captures and locals with `scope`.
  */
 
 static void
-visit_id(luna_visitor_t *self, luna_id_node_t *node) {
-  // printf("(id %s)", node->val);
+swap_scope(luna_codegen_t *gen, luna_codegen_scope_t *scope) {
+  luna_codegen_scope_t tmp = { gen->regs, gen->captures, gen->locals };
+  gen->regs = scope->regs;
+  gen->captures = scope->captures;
+  gen->locals = scope->locals;
+  *scope = tmp;
 }
 
 /*
- * Visit decl `node`.
+ * Return the register of local `name` or -1. Inside a task
+ * body the locals of the enclosing code are captured into
+ * a register of the task on first use.
+ */
+
+static int
+local(luna_codegen_t *gen, const char *name) {
+  int ret;
+  khiter_t k = kh_get(locals, gen->locals, name);
+  if (k != kh_end(gen->locals)) return kh_value(gen->locals, k);
+  if (!kv_size(gen->scopes)) return -1;
+
+  luna_codegen_scope_t outer = kv_pop(gen->scopes);
+  swap_scope(gen, &outer);
+  int from = local(gen, name);
+  swap_scope(gen, &outer);
+  kv_push(luna_codegen_scope_t, gen->scopes, outer);
+  if (from < 0) return -1;
+
+  int reg = reg_alloc(gen, LUNA_REG_LOCAL);
+  k = kh_put(locals, gen->locals, name, &ret);
+  kh_value(gen->locals, k) = reg;
+  kv_push(int, gen->captures, reg);
+  kv_push(int, gen->captures, from);
+  return reg;
+}
+
+/*
+ * Declare local `name` in register `reg`, remembering
+ * it unless it belongs to a task body.
+ */
+
+static void
+declare(luna_codegen_t *gen, const char *name, int reg) {
+  int ret;
+  khiter_t k = kh_put(locals, gen->locals, name, &ret);
+  if (!kv_size(gen->scopes)) {
+    luna_codegen_decl_t decl = { name, ret ? -1 : kh_value(gen->locals, k) };
+    kv_push(luna_codegen_decl_t, gen->declared, decl);
+  }
+  kh_value(gen->locals, k) = reg;
+}
+
+/*
+ * Emit comparison `op` of `l` and `r` loading
+ * a bool into `a`, inverted when `negate` is set.
+ */
+
+static void
+emit_compare(luna_codegen_t *gen, luna_op_t op, int a, int l, int r, int negate) {
+  emit_abc(gen, op, 0, l, r);
+  emit(JMP, 0, 1, 0);
+  emit(LOADB, a, constant(gen, negate ? LUNA_FALSE : LUNA_TRUE), 1);
+  emit(LOADB, a, constant(gen, negate ? LUNA_TRUE : LUNA_FALSE), 0);
+}
+
+/*
+ * Emit binary operation `op` of `l` and `r` into `a`.
+ */
+
+static void
+emit_op(luna_codegen_t *gen, luna_token op, int a, int l, int r) {
+  switch (op) {
+    case LUNA_TOKEN_OP_PLUS: emit(ADD, a, l, r); break;
+    case LUNA_TOKEN_OP_MINUS: emit(SUB, a, l, r); break;
+    case LUNA_TOKEN_OP_DIV: emit(DIV, a, l, r); break;
+    case LUNA_TOKEN_OP_MUL: emit(MUL, a, l, r); break;
+    case LUNA_TOKEN_OP_MOD: emit(MOD, a, l, r); break;
+    case LUNA_TOKEN_OP_POW: emit(POW, a, l, r); break;
+    case LUNA_TOKEN_OP_BIT_SHL: emit(BIT_SHL, a, l, r); break;
+    case LUNA_TOKEN_OP_BIT_SHR: emit(BIT_SHR, a, l, r); break;
+    case LUNA_TOKEN_OP_BIT_AND: emit(BIT_AND, a, l, r); break;
+    case LUNA_TOKEN_OP_BIT_OR: emit(BIT_OR, a, l, r); break;
+    case LUNA_TOKEN_OP_BIT_XOR: emit(BIT_XOR, a, l, r); break;
+    case LUNA_TOKEN_OP_LT: emit_compare(gen, LUNA_OP_LT, a, l, r, 0); break;
+    case LUNA_TOKEN_OP_LTE: emit_compare(gen, LUNA_OP_LTE, a, l, r, 0); break;
+    case LUNA_TOKEN_OP_GT: emit_compare(gen, LUNA_OP_LT, a, r, l, 0); break;
+    case LUNA_TOKEN_OP_GTE: emit_compare(gen, LUNA_OP_LTE, a, r, l, 0); break;
+    case LUNA_TOKEN_OP_EQ: emit_compare(gen, LUNA_OP_EQ, a, l, r, 0); break;
+    case LUNA_TOKEN_OP_NEQ: emit_compare(gen, LUNA_OP_EQ, a, l, r, 1); break;
+    default: error("unsupported operator");
+  }
+}
+
+/*
+ * Return the operator applied by compound assignment `op`.
+ */
+
+static luna_token
+compound_op(luna_token op) {
+  switch (op) {
+    case LUNA_TOKEN_OP_PLUS_ASSIGN: return LUNA_TOKEN_OP_PLUS;
+    case LUNA_TOKEN_OP_MINUS_ASSIGN: return LUNA_TOKEN_OP_MINUS;
+    case LUNA_TOKEN_OP_MUL_ASSIGN: return LUNA_TOKEN_OP_MUL;
+    case LUNA_TOKEN_OP_DIV_ASSIGN: return LUNA_TOKEN_OP_DIV;
+  }
+  return LUNA_TOKEN_ILLEGAL;
+}
+
+/*
+ * Emit a JMP to be patched, returning its pc.
+ */
+
+static int
+jump(luna_codegen_t *gen) {
+  emit(JMP, 0, 0, 0);
+  return kv_size(gen->vm->main->code) - 1;
+}
+
+/*
+ * Point the JMP at `pc` to `target`, a `pc` of -1
+ * is a jump which was never emitted.
  */
 
 static void
-visit_decl(luna_visitor_t *self, luna_decl_node_t *node) {
+patch(luna_codegen_t *gen, int pc, int target) {
+  int off = target - pc - 1;
+  if (pc < 0 || gen->err) return;
+  if (off < -LUNA_MAX_JUMP || off > LUNA_MAX_JUMP) {
+    error("jump too far");
+    return;
+  }
+  kv_A(gen->vm->main->code, pc) = ENCODE(LUNA_OP_JMP, 0, off, 0);
+}
+
+/*
+ * Generate condition `id` followed by a JMP taken when
+ * its truthiness equals `jump_if`, returning the next node
+ * to visit, or 0 once the JMP's pc is in the frame's `pc`.
+ * Comparisons branch on their operands directly rather
+ * than materializing a bool.
+ */
+
+static luna_node_id_t
+cond(luna_codegen_t *gen, luna_node_id_t id, int jump_if) {
+  luna_codegen_frame_t *f = frame(gen);
+  luna_node_t *bin = luna_ast_node(gen->ast, id);
+
+  if (LUNA_NODE_BINARY_OP == bin->type) {
+    luna_op_t op = LUNA_OP_HALT;
+    int swap = 0, negate = 0;
+
+    switch (bin->op) {
+      case LUNA_TOKEN_OP_LT: op = LUNA_OP_LT; break;
+      case LUNA_TOKEN_OP_LTE: op = LUNA_OP_LTE; break;
+      case LUNA_TOKEN_OP_GT: op = LUNA_OP_LT; swap = 1; break;
+      case LUNA_TOKEN_OP_GTE: op = LUNA_OP_LTE; swap = 1; break;
+      case LUNA_TOKEN_OP_EQ: op = LUNA_OP_EQ; break;
+      case LUNA_TOKEN_OP_NEQ: op = LUNA_OP_EQ; negate = 1; break;
+    }
+
+    if (LUNA_OP_HALT != op) {
+      switch (f->cond++) {
+        case 0:
+          return expr(gen, bin->a, -1);
+        case 1:
+          f->rk = stable(gen, gen->result, bin->a, id);
+          return expr(gen, bin->b, -1);
+      }
+
+      int l = f->rk, r = gen->result;
+      f->cond = 0;
+      release(gen, r);
+      release(gen, l);
+      emit_abc(gen, op, negate ? !jump_if : jump_if, swap ? r : l, swap ? l : r);
+      f->pc = jump(gen);
+      return 0;
+    }
+  }
+
+  if (0 == f->cond++) return expr(gen, id, -1);
+  f->cond = 0;
+
+  int rk = gen->result;
+  release(gen, rk);
+
+  // constant, jump always or never
+  if (ISK(rk)) {
+    luna_value_t val = luna_vec_at(&gen->vm->main->constants, INDEXK(rk));
+    f->pc = luna_value_is_truthy(val) == jump_if ? jump(gen) : -1;
+    return 0;
+  }
+
+  emit(TEST, rk, 0, jump_if);
+  f->pc = jump(gen);
+  return 0;
+}
+
+/*
+ * Visit block `node`, its result is that of the last statement.
+ */
+
+static luna_node_id_t
+visit_block(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_list_t stmts = luna_ast_list(node);
+  int rk = step ? gen->result : -1;
+
+  if (step < stmts.len) {
+    luna_node_id_t id = luna_ast_extra(gen->ast, stmts.start + step);
+    release(gen, rk);
+    gen->lineno = luna_ast_node(gen->ast, id)->lineno;
+    return expr(gen, id, -1);
+  }
+
+  gen->result = rk < 0 ? CONST(LUNA_NULL) : rk;
+  return 0;
+}
+
+/*
+ * Visit int `node`.
+ */
+
+static luna_node_id_t
+visit_int(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  gen->result = CONST(luna_value_int((int32_t) node->a));
+  return 0;
+}
+
+/*
+ * Visit float `node`.
+ */
+
+static luna_node_id_t
+visit_float(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  gen->result = CONST(luna_value_float(luna_ast_literal(gen->ast, node->a)));
+  return 0;
+}
+
+/*
+ * Visit bool `node`.
+ */
+
+static luna_node_id_t
+visit_bool(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  gen->result = CONST(luna_value_bool(node->a));
+  return 0;
+}
+
+/*
+ * Visit id `node`, locals are read in place.
+ */
+
+static luna_node_id_t
+visit_id(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int reg = local(gen, luna_ast_name(gen->ast, node->a));
+  if (reg < 0) {
+    error("undefined variable");
+    return 0;
+  }
+  gen->result = reg;
+  return 0;
+}
+
+/*
+ * Visit decl `node`.
+ */
+
+static luna_node_id_t
+visit_decl(luna_visitor_t *self, luna_node_t *node, int step) {
   // printf("(decl %s:%s", node->name, node->type ? node->type : "");
   // if (node->val) visit(node->val);
   // printf(")");
+  return 0;
 }
 
 /*
  * Visit string `node`.
  */
 
-static void
-visit_string(luna_visitor_t *self, luna_string_node_t *node) {
-  // printf("(string '%s')", inspect(node->val));
+static luna_node_id_t
+visit_string(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_string_t *str = luna_string(gen->state, luna_ast_name(gen->ast, node->a));
+  if (unlikely(!str)) {
+    error("out of memory");
+    return 0;
+  }
+  gen->result = CONST(luna_value_object(str));
+  return 0;
 }
 
 /*
  * Visit unary op `node`.
  */
 
-static void
-visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
-  luna_vm_t *vm = (luna_vm_t *) self->data;
-  visit(node->expr);
-  emit(NEGATE, 0, 0, 0);
+static luna_node_id_t
+visit_unary_op(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int reg, a, old;
+
+  switch (node->op) {
+    case LUNA_TOKEN_OP_PLUS:
+      return step ? 0 : expr(gen, node->a, frame(gen)->dest);
+    case LUNA_TOKEN_OP_MINUS:
+    case LUNA_TOKEN_OP_BIT_NOT: {
+      if (0 == step) return expr(gen, node->a, -1);
+      int rk = gen->result;
+      release(gen, rk);
+      a = target(gen);
+      emit_abc(gen, LUNA_TOKEN_OP_MINUS == node->op ? LUNA_OP_NEGATE : LUNA_OP_BIT_NOT, a, rk, 0);
+      gen->result = a;
+      return 0;
+    }
+    case LUNA_TOKEN_OP_INCR:
+    case LUNA_TOKEN_OP_DECR:
+      if (0 == step) {
+        if (LUNA_NODE_ID != luna_ast_node(gen->ast, node->a)->type) {
+          error("invalid increment operand");
+          return 0;
+        }
+        return expr(gen, node->a, -1);
+      }
+      a = old = reg = gen->result;
+      if (node->flags & LUNA_NODE_POSTFIX) {
+        a = old = target(gen);
+        // `a = a++` targets the local itself, save its old value aside
+        if (a == reg) old = reg_alloc(gen, LUNA_REG_TEMP);
+        emit(MOVE, old, reg, 0);
+      }
+      if (LUNA_TOKEN_OP_INCR == node->op) {
+        emit(ADD, reg, reg, CONST(luna_value_int(1)));
+      } else {
+        emit(SUB, reg, reg, CONST(luna_value_int(1)));
+      }
+      if (old != a) {
+        emit(MOVE, a, old, 0);
+        release(gen, old);
+      }
+      gen->result = a;
+      return 0;
+  }
+
+  error("unsupported operator");
+  return 0;
 }
 
 /*
- * Visit binary op `node`.
+ * Visit assignment `node` of a local, declaring it
+ * unless it exists, the value is generated directly
+ * into the local's register.
  */
 
-static void
-visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
-  luna_vm_t *vm = (luna_vm_t *) self->data;
-  if (LUNA_NODE_BINARY_OP == node->left->type) {
-    visit(node->left);
-    int r = CONST(((luna_float_node_t *) node->right)->val);
-    emit_op(vm, node, 0, r);
-  } else {
-    int l = CONST(((luna_float_node_t *) node->left)->val);
-    int r = CONST(((luna_float_node_t *) node->right)->val);
-    emit_op(vm, node, l, r);
+static luna_node_id_t
+visit_assign(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_codegen_frame_t *f = frame(gen);
+  luna_node_t *left = luna_ast_node(gen->ast, node->a);
+  int compound = LUNA_TOKEN_OP_ASSIGN != node->op;
+
+  if (step) {
+    if (compound) {
+      int r = gen->result;
+      release(gen, r);
+      release(gen, f->left);
+      emit_op(gen, compound_op(node->op), f->rk, f->left, r);
+    // declared after the value, so `a = a` is undefined
+    } else if (f->declare) {
+      declare(gen, luna_ast_name(gen->ast, left->a), f->rk);
+    }
+    gen->result = f->rk;
+    return 0;
+  }
+
+  if (LUNA_NODE_ID != left->type) {
+    error("invalid assignment target");
+    return 0;
   }
+
+  const char *name = luna_ast_name(gen->ast, left->a);
+  int reg = node->flags & LUNA_NODE_LET ? -1 : local(gen, name);
+
+  if (compound) {
+    if (reg < 0) {
+      error("undefined variable");
+      return 0;
+    }
+    if (LUNA_TOKEN_ILLEGAL == compound_op(node->op)) {
+      error("unsupported operator");
+      return 0;
+    }
+    f->rk = reg;
+    f->left = stable(gen, reg, node->a, node_id(gen, node));
+    return expr(gen, node->b, -1);
+  }
+
+  if (reg < 0) {
+    reg = reg_alloc(gen, LUNA_REG_LOCAL);
+    f->declare = 1;
+  }
+
+  f->rk = reg;
+  return expr(gen, node->b, reg);
+}
+
+/*
+ * Visit binary op `node`. Operands die once the operation
+ * is emitted, so the result may reuse one of their registers.
+ */
+
+static luna_node_id_t
+visit_binary_op(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+
+  switch (node->op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      return visit_assign(self, node, step);
+  }
+
+  switch (step) {
+    case 0:
+      return expr(gen, node->a, -1);
+    case 1:
+      frame(gen)->rk = stable(gen, gen->result, node->a, node_id(gen, node));
+      return expr(gen, node->b, -1);
+  }
+
+  int l = frame(gen)->rk;
+  int r = gen->result;
+  release(gen, r);
+  release(gen, l);
+  int a = target(gen);
+  emit_op(gen, node->op, a, l, r);
+  gen->result = a;
+  return 0;
 }
 
 /*
  * Visit array `node`.
  */
 
-static void
-visit_array(luna_visitor_t *self, luna_array_node_t *node) {
+static luna_node_id_t
+visit_array(luna_visitor_t *self, luna_node_t *node, int step) {
   // printf("(array\n");
   // ++indents;
   // luna_vec_each(node->vals, {
   //   INDENT;
-  //   visit((luna_node_t *) val->value.as_pointer);
+  //   visit((luna_node_t *) luna_value_as_pointer(val));
   //   if (i != len - 1) printf("\n");
   // });
   // --indents;
   // printf(")");
+  return 0;
 }
 
 /*
  * Visit hash `node`.
  */
 
-static void
-visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+static luna_node_id_t
+visit_hash(luna_visitor_t *self, luna_node_t *node, int step) {
   // printf("(hash\n");
   // ++indents;
   // luna_hash_each(node->vals, {
   //   INDENT;
   //   printf("%s: ", slot);
-  //   visit((luna_node_t *) val->value.as_pointer);
+  //   visit((luna_node_t *) luna_value_as_pointer(val));
   //   printf("\n");
   // });
   // --indents;
   // printf(")");
+  return 0;
 }
 
 /*
  * Visit slot `node`.
  */
 
-static void
-visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+static luna_node_id_t
+visit_slot(luna_visitor_t *self, luna_node_t *node, int step) {
   // printf("(slot\n");
   // ++indents;
   // INDENT;
@@ -213,47 +756,289 @@ visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
   // visit(node->right);
   // --indents;
   // printf(")");
+  return 0;
 }
 
 /*
- * Visit call `node`.
+ * Generate task `body` forked by `expr &`. The body runs
+ * on registers of its own and halts with its result,
+ * followed by the captures FORK copies into the task.
  */
 
-static void
-visit_call(luna_visitor_t *self, luna_call_node_t * node) {
-  // printf("(call\n");
-  // ++indents;
-  // INDENT;
-  // visit((luna_node_t *) node->expr);
-  // if (luna_vec_length(node->args->vec)) {
-  //   printf("\n");
-  //   INDENT;
-  //   luna_vec_each(node->args->vec, {
-  //     visit((luna_node_t *) val->value.as_pointer);
-  //     if (i != len - 1) printf(" ");
-  //   });
-
-  //   luna_hash_each(node->args->hash, {
-  //     printf(" %s: ", slot);
-  //     visit((luna_node_t *) val->value.as_pointer);
-  //   });
-  // }
-  // --indents;
-  // printf(")");
+static luna_node_id_t
+fork_call(luna_codegen_t *gen, luna_node_id_t body, int step) {
+  luna_codegen_frame_t *f = frame(gen);
+  luna_activation_t *fn = gen->vm->main;
+
+  if (!step) {
+    emit(FORK, 0, 0, 0);
+    f->pc = kv_size(fn->code) - 1;
+    luna_codegen_scope_t outer = { .locals = kh_init(locals) };
+    kv_init(outer.regs);
+    kv_init(outer.captures);
+    swap_scope(gen, &outer);
+    kv_push(luna_codegen_scope_t, gen->scopes, outer);
+    return expr(gen, body, -1);
+  }
+
+  int rk = gen->result;
+  if (ISK(rk)) {
+    int reg = reg_alloc(gen, LUNA_REG_TEMP);
+    emit(LOADK, reg, INDEXK(rk), 0);
+    rk = reg;
+  }
+  emit(HALT, rk, 0, 0);
+
+  int n = kv_size(gen->captures);
+  for (int c = 0; c < n; c += 2) {
+    emit(CAPTURE, kv_A(gen->captures, c), kv_A(gen->captures, c + 1), 0);
+  }
+
+  luna_codegen_scope_t outer = kv_pop(gen->scopes);
+  swap_scope(gen, &outer);
+  kv_destroy(outer.regs);
+  kv_destroy(outer.captures);
+  kh_destroy(locals, outer.locals);
+
+  int a = target(gen);
+  int off = kv_size(fn->code) - f->pc - 1;
+  gen->result = a;
+  if (gen->err) return 0;
+  if (off > LUNA_MAX_JUMP) {
+    error("jump too far");
+    return 0;
+  }
+  kv_A(fn->code, f->pc) = ENCODE(LUNA_OP_FORK, a, off, n / 2);
+  return 0;
+}
+
+/*
+ * Generate join(...) of `args`, waiting for each task in
+ * turn, the result is that of the last. Non-tasks are
+ * joined as themselves.
+ */
+
+static luna_node_id_t
+join_call(luna_codegen_t *gen, luna_list_t args, int step) {
+  luna_codegen_frame_t *f = frame(gen);
+
+  if (step) {
+    int r = gen->result;
+    release(gen, r);
+    // a later arg may be the local joined into
+    if (1 == step) f->rk = args.len > 1
+      ? reg_alloc(gen, LUNA_REG_TEMP)
+      : target(gen);
+    emit(JOIN, f->rk, r, 0);
+  }
+
+  if (step < args.len) {
+    return expr(gen, luna_ast_extra(gen->ast, args.start + step), -1);
+  }
+
+  gen->result = args.len ? f->rk : CONST(LUNA_NULL);
+  return 0;
+}
+
+/*
+ * Builtins compiled to their own opcode.
+ */
+
+static struct {
+  const char *name;
+  int op;
+  int argc;
+} builtins[] = {
+  { "sleep", LUNA_OP_SLEEP, 1 },
+  { "cat", LUNA_OP_CAT, 1 },
+  { "delete", LUNA_OP_DELETE, 1 },
+  { "rm", LUNA_OP_DELETE, 1 },
+  { "stat", LUNA_OP_STAT, 1 },
+  { "write", LUNA_OP_WRITE, 2 }
+};
+
+/*
+ * Return the opcode of builtin `name` called
+ * with `argc` arguments, or -1.
+ */
+
+static int
+builtin(const char *name, int argc) {
+  int n = sizeof(builtins) / sizeof(builtins[0]);
+  for (int i = 0; i < n; ++i) {
+    if (argc == builtins[i].argc && !strcmp(builtins[i].name, name)) return builtins[i].op;
+  }
+  return -1;
+}
+
+/*
+ * Generate builtin `op` of `args`, one or two.
+ */
+
+static luna_node_id_t
+builtin_call(luna_codegen_t *gen, int op, luna_list_t args, int step) {
+  if (step < args.len) {
+    luna_node_id_t id = luna_ast_extra(gen->ast, args.start + step);
+    if (step) frame(gen)->rk = stable(gen, gen->result
+      , luna_ast_extra(gen->ast, args.start), id + 1);
+    return expr(gen, id, -1);
+  }
+
+  int b = 2 == args.len ? frame(gen)->rk : gen->result;
+  int c = 2 == args.len ? gen->result : 0;
+  if (2 == args.len) release(gen, c);
+  release(gen, b);
+  int a = target(gen);
+  emit_abc(gen, op, a, b, c);
+  gen->result = a;
+  return 0;
+}
+
+/*
+ * Check if `call` of `name` is a stream stage,
+ * grep(src, pattern) or print(src).
+ */
+
+static int
+is_stage(const char *name, luna_call_extra_t *call) {
+  if (call->pairs.len) return 0;
+  if (!strcmp("grep", name)) return 2 == call->args.len;
+  if (!strcmp("print", name)) return 1 == call->args.len;
+  return 0;
+}
+
+/*
+ * Return the record of call `id` when it is
+ * a stream stage, otherwise NULL.
+ */
+
+static luna_call_extra_t *
+stage(luna_codegen_t *gen, luna_node_id_t id) {
+  luna_node_t *node = luna_ast_node(gen->ast, id);
+  if (LUNA_NODE_CALL != node->type) return NULL;
+  luna_node_t *callee = luna_ast_node(gen->ast, node->a);
+  if (LUNA_NODE_ID != callee->type) return NULL;
+  luna_call_extra_t *call = luna_ast_record(gen->ast, node->b, luna_call_extra_t);
+  return is_stage(luna_ast_name(gen->ast, callee->a), call) ? call : NULL;
+}
+
+/*
+ * Return the call of stage `n` of the chain ending
+ * in `call`, which has `len` stages, 0 the innermost.
+ */
+
+static luna_call_extra_t *
+nth_stage(luna_codegen_t *gen, luna_call_extra_t *call, int len, int n) {
+  while (--len > n) call = stage(gen, luna_ast_extra(gen->ast, call->args.start));
+  return call;
+}
+
+/*
+ * Generate the chain of stages ending in `call`, such
+ * as cat(path).grep(str).print(), fused into a stream
+ * making a single pass over its source. Its source is
+ * the first arg of the innermost stage, the file at
+ * the path when it is cat(path), STREAM then takes
+ * each stage in turn and DRAIN runs the stream.
+ */
+
+static luna_node_id_t
+stream_call(luna_codegen_t *gen, luna_call_extra_t *call, int step) {
+  luna_codegen_frame_t *f = frame(gen);
+  luna_call_extra_t *inner = call;
+  luna_node_id_t source;
+  int len = 1;
+
+  while (source = luna_ast_extra(gen->ast, inner->args.start), stage(gen, source)) {
+    inner = stage(gen, source);
+    ++len;
+  }
+
+  // cat(path)
+  luna_node_t *node = luna_ast_node(gen->ast, source);
+  luna_call_extra_t *cat = LUNA_NODE_CALL == node->type
+    ? luna_ast_record(gen->ast, node->b, luna_call_extra_t)
+    : NULL;
+  int file = cat
+    && LUNA_NODE_ID == luna_ast_node(gen->ast, node->a)->type
+    && !strcmp("cat", luna_ast_name(gen->ast, luna_ast_node(gen->ast, node->a)->a))
+    && 1 == cat->args.len
+    && !cat->pairs.len;
+
+  if (!step) return expr(gen, file ? luna_ast_extra(gen->ast, cat->args.start) : source, -1);
+
+  if (1 == step) {
+    int rk = gen->result;
+    release(gen, rk);
+    f->rk = reg_alloc(gen, LUNA_REG_TEMP);
+    emit(STREAM, f->rk, rk, file);
+    f->stage = 0;
+  } else {
+    // the pattern of the grep() at f->stage
+    int rk = gen->result;
+    release(gen, rk);
+    emit(GREP, f->rk, rk, 0);
+    ++f->stage;
+  }
+
+  for (; f->stage < len; ++f->stage) {
+    luna_call_extra_t *s = nth_stage(gen, call, len, f->stage);
+    if (2 == s->args.len) return expr(gen, luna_ast_extra(gen->ast, s->args.start + 1), -1);
+    emit(PRINT, f->rk, 0, 0);
+  }
+
+  release(gen, f->rk);
+  int a = target(gen);
+  emit(DRAIN, a, f->rk, 0);
+  gen->result = a;
+  return 0;
+}
+
+/*
+ * Visit call `node`, only `expr &`, which the parser
+ * turns into fork(expr), join(...), the builtins
+ * sleep(ms), cat(path), write(path, str), stat(path)
+ * and delete(path) or rm(path), and chains of grep()
+ * and print() are supported.
+ */
+
+static luna_node_id_t
+visit_call(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_node_t *callee = luna_ast_node(gen->ast, node->a);
+  luna_call_extra_t *call = luna_ast_record(gen->ast, node->b, luna_call_extra_t);
+  const char *name = LUNA_NODE_ID == callee->type
+    ? luna_ast_name(gen->ast, callee->a)
+    : NULL;
+
+  if (!name || call->pairs.len) return 0;
+
+  if (!strcmp("fork", name) && 1 == call->args.len) {
+    return fork_call(gen, luna_ast_extra(gen->ast, call->args.start), step);
+  }
+
+  if (!strcmp("join", name)) return join_call(gen, call->args, step);
+
+  if (is_stage(name, call)) return stream_call(gen, call, step);
+
+  int op = builtin(name, call->args.len);
+  if (op >= 0) return builtin_call(gen, op, call->args, step);
+
+  return 0;
 }
 
 /*
  * Visit function `node`.
  */
 
-static void
-visit_function(luna_visitor_t *self, luna_function_node_t * node) {
+static luna_node_id_t
+visit_function(luna_visitor_t *self, luna_node_t *node, int step) {
   // printf("(function %s -> %s", node->name, node->type ? node->type : "");
   // ++indents;
   // luna_vec_each(node->params, {
   //   printf("\n");
   //   INDENT;
-  //   visit((luna_node_t *) val->value.as_pointer);
+  //   visit((luna_node_t *) luna_value_as_pointer(val));
   // });
   // --indents;
   // printf("\n");
@@ -261,30 +1046,45 @@ visit_function(luna_visitor_t *self, luna_function_node_t * node) {
   // visit((luna_node_t *) node->block);
   // --indents;
   // printf(")");
+  return 0;
 }
 
 /*
  * Visit `while` node.
  */
 
-static void
-visit_while(luna_visitor_t *self, luna_while_node_t *node) {
-  // // while | until
-  // printf("(%s ", node->negate ? "until" : "while");
-  // visit((luna_node_t *) node->expr);
-  // ++indents;
-  // printf("\n");
-  // visit((luna_node_t *) node->block);
-  // --indents;
-  // printf(")\n");
+static luna_node_id_t
+visit_while(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_codegen_frame_t *f = frame(gen);
+  luna_node_id_t next;
+
+  switch (step) {
+    // test at the bottom, one branch per iteration
+    case 0:
+      f->lineno = gen->lineno;
+      f->pc = jump(gen);
+      f->body = kv_size(gen->vm->main->code);
+      return expr(gen, node->b, -1);
+    case 1:
+      release(gen, gen->result);
+      patch(gen, f->pc, kv_size(gen->vm->main->code));
+      gen->lineno = f->lineno;
+  }
+
+  if ((next = cond(gen, node->a, !(node->flags & LUNA_NODE_NEGATE)))) return next;
+  patch(gen, f->pc, f->body);
+
+  gen->result = CONST(LUNA_NULL);
+  return 0;
 }
 
 /*
  * Visit `return` node.
  */
 
-static void
-visit_return(luna_visitor_t *self, luna_return_node_t *node) {
+static luna_node_id_t
+visit_return(luna_visitor_t *self, luna_node_t *node, int step) {
   // printf("(return");
   // if (node->expr) {
   //   ++indents;
@@ -294,64 +1094,202 @@ visit_return(luna_visitor_t *self, luna_return_node_t *node) {
   //   --indents;
   // }
   // printf(")");
+  return 0;
 }
 
 /*
- * Visit if `node`.
+ * Visit if `node`. Each branch generates its condition
+ * and block, then jumps past those remaining.
+ */
+
+static luna_node_id_t
+visit_if(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_codegen_frame_t *f = frame(gen);
+  luna_if_extra_t *stmt = luna_ast_record(gen->ast, node->b, luna_if_extra_t);
+  int nelse_ifs = stmt->else_ifs.len;
+  luna_node_id_t next;
+
+  if (0 == step) f->exits = kv_size(gen->exits);
+
+  // if | unless, else ifs
+  while (f->branch <= nelse_ifs) {
+    luna_node_t *branch = f->branch
+      ? luna_ast_node(gen->ast, luna_ast_extra(gen->ast, stmt->else_ifs.start + f->branch - 1))
+      : node;
+
+    if (0 == f->phase) {
+      if ((next = cond(gen, branch->a, branch->flags & LUNA_NODE_NEGATE))) return next;
+      f->next = f->pc;
+      f->phase = 1;
+      return expr(gen, luna_ast_record(gen->ast, branch->b, luna_if_extra_t)->block, -1);
+    }
+
+    release(gen, gen->result);
+    if (f->branch < nelse_ifs || stmt->else_block) {
+      kv_push(int, gen->exits, jump(gen));
+    }
+    patch(gen, f->next, kv_size(gen->vm->main->code));
+    f->phase = 0;
+    ++f->branch;
+  }
+
+  // else
+  if (stmt->else_block) {
+    if (0 == f->phase++) return expr(gen, stmt->else_block, -1);
+    release(gen, gen->result);
+  }
+
+  for (int i = f->exits; i < kv_size(gen->exits); ++i) {
+    patch(gen, kv_A(gen->exits, i), kv_size(gen->vm->main->code));
+  }
+
+  kv_size(gen->exits) = f->exits;
+  gen->result = CONST(LUNA_NULL);
+  return 0;
+}
+
+/*
+ * Alloc a vm with an empty main activation.
+ */
+
+static luna_vm_t *
+vm_new() {
+  luna_vm_t *vm = malloc(sizeof(luna_vm_t));
+  luna_activation_t *fn = malloc(sizeof(luna_activation_t));
+  if (unlikely(!vm || !fn)) {
+    free(vm);
+    free(fn);
+    return NULL;
+  }
+
+  kv_init(fn->code);
+  kv_init(fn->lines);
+  fn->ip = NULL;
+  fn->nregisters = 0;
+  luna_vec_init(&fn->constants);
+  fn->kindex = kh_init(kindex);
+
+  vm->main = fn;
+  vm->trace = NULL;
+  kv_init(vm->registers);
+  vm->sched = NULL;
+  vm->err = NULL;
+  vm->lineno = 0;
+  return vm;
+}
+
+/*
+ * Discard the code appended from `start`, forgetting
+ * the locals it declared, latest first.
  */
 
 static void
-visit_if(luna_visitor_t *self, luna_if_node_t *node) {
-  // // if
-  // printf("(%s ", node->negate ? "unless" : "if");
-  // visit((luna_node_t *) node->expr);
-  // ++indents;
-  // printf("\n");
-  // visit((luna_node_t *) node->block);
-  // --indents;
-  // printf(")");
+rollback(luna_codegen_t *gen, int start) {
+  luna_activation_t *fn = gen->vm->main;
+  fn->code.n = start;
+  fn->lines.n = start;
 
-  // // else ifs
-  // luna_vec_each(node->else_ifs, {
-  //   luna_if_node_t *else_if = (luna_if_node_t *) val->value.as_pointer;
-  //   printf("\n");
-  //   INDENT;
-  //   printf("(else if ");
-  //   visit((luna_node_t *) else_if->expr);
-  //   ++indents;
-  //   printf("\n");
-  //   visit((luna_node_t *) else_if->block);
-  //   --indents;
-  //   printf(")");
-  // });
+  while (kv_size(gen->declared)) {
+    luna_codegen_decl_t decl = kv_pop(gen->declared);
+    khiter_t k = kh_get(locals, gen->locals, decl.name);
+    kv_A(gen->regs, kh_value(gen->locals, k)) = LUNA_REG_FREE;
+    if (decl.prev < 0) {
+      kh_del(locals, gen->locals, k);
+    } else {
+      kh_value(gen->locals, k) = decl.prev;
+    }
+  }
 
-  // // else
-  // if (node->else_block) {
-  //   printf("\n");
-  //   INDENT;
-  //   printf("(else\n");
-  //   ++indents;
-  //   visit((luna_node_t *) node->else_block);
-  //   --indents;
-  //   printf(")");
-  // }
+  for (int n = 0; n < kv_size(gen->regs); ++n) {
+    if (LUNA_REG_TEMP == kv_A(gen->regs, n)) kv_A(gen->regs, n) = LUNA_REG_FREE;
+  }
+
+  kv_size(gen->frames) = 0;
+  kv_size(gen->exits) = 0;
+}
+
+/*
+ * Initialize the code generator for `ast`, which
+ * is folded in place, string constants are interned
+ * in `state`.
+ */
+
+void
+luna_codegen_init(luna_codegen_t *self, luna_ast_t *ast, luna_state_t *state) {
+  self->err = NULL;
+  self->vm = NULL;
+  self->dest = -1;
+  self->result = -1;
+  kv_init(self->regs);
+  kv_init(self->captures);
+  kv_init(self->scopes);
+  kv_init(self->frames);
+  kv_init(self->exits);
+  kv_init(self->declared);
+  kv_init(self->writes);
+  self->locals = NULL;
+  self->state = state;
+  self->ast = ast;
+  self->eliminated = 0;
+  self->lineno = 0;
+}
+
+/*
+ * Free the generator's state, the vm is left to its user.
+ */
+
+void
+luna_codegen_free(luna_codegen_t *self) {
+  kv_destroy(self->regs);
+  kv_destroy(self->captures);
+  kv_destroy(self->scopes);
+  kv_destroy(self->frames);
+  kv_destroy(self->exits);
+  kv_destroy(self->declared);
+  kv_destroy(self->writes);
+  if (self->locals) kh_destroy(locals, self->locals);
+  self->locals = NULL;
+}
+
+/*
+ * Generate code for node `id` after folding constants,
+ * returning NULL and setting `self->err` on failure.
+ */
+
+luna_vm_t *
+luna_gen(luna_codegen_t *self, luna_node_id_t id) {
+  luna_vm_t *vm = luna_gen_append(self, self->ast, id);
+  luna_codegen_free(self);
+  return vm;
 }
 
 /*
- * Generate code for the given `node`.
+ * Append code for node `id` of `ast` to the vm, which is
+ * allocated on first use, and point it at the new code.
+ * Only the new code is folded and optimized, so the cost
+ * does not grow with what was generated before. Returns
+ * NULL and sets `self->err` on failure, leaving the vm
+ * as it was.
  */
 
 luna_vm_t *
-luna_gen(luna_node_t *node) {
-  luna_vm_t *vm = malloc(sizeof(luna_vm_t *));
-  if (!vm) return NULL;
-  vm->main = malloc(sizeof(luna_activation_t *));
-  vm->main->nconstants = 0;
-  vm->main->constants = malloc(1024 * sizeof(int *)); // TODO: vec / objects
-  vm->main->ip = vm->main->code = malloc(64 * 1024);
+luna_gen_append(luna_codegen_t *self, luna_ast_t *ast, luna_node_id_t id) {
+  luna_codegen_t *gen = self;
+  self->err = NULL;
+
+  if (!self->vm && !(self->vm = vm_new())) {
+    error("out of memory");
+    return NULL;
+  }
+
+  if (!self->locals) self->locals = kh_init(locals);
 
   luna_visitor_t visitor = {
-    .data = (void *) vm,
+    .data = (void *) self,
+    .ast = ast,
+    .enter = enter,
+    .leave = leave,
     .visit_if = visit_if,
     .visit_id = visit_id,
     .visit_int = visit_int,
@@ -363,6 +1301,7 @@ luna_gen(luna_node_t *node) {
     .visit_block = visit_block,
     .visit_decl = visit_decl,
     .visit_float = visit_float,
+    .visit_bool = visit_bool,
     .visit_string = visit_string,
     .visit_return = visit_return,
     .visit_function = visit_function,
@@ -370,8 +1309,32 @@ luna_gen(luna_node_t *node) {
     .visit_binary_op = visit_binary_op
   };
 
-  luna_visit(&visitor, node);
-  emit(HALT, 0, 0, 0);
+  luna_activation_t *fn = self->vm->main;
+  int start = kv_size(fn->code);
+  self->ast = ast;
+  kv_size(self->declared) = 0;
 
-  return vm;
+  luna_fold(ast, id);
+  count_writes(self);
+
+  // halt with the result in a register
+  self->dest = -1;
+  luna_visit(&visitor, id);
+  int rk = self->result;
+  if (ISK(rk)) {
+    int reg = reg_alloc(gen, LUNA_REG_TEMP);
+    emit(LOADK, reg, INDEXK(rk), 0);
+    rk = reg;
+  }
+  emit(HALT, rk, 0, 0);
+  release(gen, rk);
+
+  if (self->err) {
+    rollback(self, start);
+    return NULL;
+  }
+
+  self->eliminated = luna_peephole(fn, start);
+  fn->ip = fn->code.a + start;
+  return self->vm;
 }
@@ -10,10 +10,131 @@
 
 #include "ast.h"
 #include "vm.h"
+#include "state.h"
+#include "khash.h"
+
+/*
+ * Local name -> register map.
+ */
+
+KHASH_MAP_INIT_STR(locals, int);
+
+/*
+ * Register states.
+ */
+
+typedef enum {
+  LUNA_REG_FREE,
+  LUNA_REG_TEMP,
+  LUNA_REG_LOCAL
+} luna_reg_t;
+
+/*
+ * Register states of a frame, and the (task, enclosing)
+ * register pairs copied into a task when it is forked.
+ */
+
+typedef kvec_t(unsigned char) luna_codegen_regs_t;
+typedef kvec_t(int) luna_codegen_captures_t;
+
+/*
+ * Registers, captures and locals of the code
+ * enclosing the task body being generated.
+ */
+
+typedef struct {
+  luna_codegen_regs_t regs;
+  luna_codegen_captures_t captures;
+  khash_t(locals) *locals;
+} luna_codegen_scope_t;
+
+/*
+ * State of a node being generated, kept across the
+ * steps between its children.
+ */
+
+typedef struct {
+  int dest;    // requested register, -1 for any
+  int rk;      // left operand or assigned local
+  int left;    // left operand of a compound assignment
+  int pc;      // jump emitted by the condition
+  int cond;    // condition step
+  int body;    // loop body
+  int lineno;  // loop line
+  int declare; // assignment declares its local
+  int exits;   // first exit of the if
+  int branch;  // if branch, 0 for the if itself
+  int next;    // jump to the next branch
+  int phase;   // branch phase
+  int stage;   // stream stage
+} luna_codegen_frame_t;
+
+/*
+ * Local declared by the code being appended, and the
+ * register of the local it shadows or -1.
+ */
+
+typedef struct {
+  const char *name;
+  int prev;
+} luna_codegen_decl_t;
+
+/*
+ * Code generator.
+ *
+ * Expressions are generated into the register requested
+ * by `dest` when they are entered, or any register when -1,
+ * and leave their RK operand in `result`. Temporaries die
+ * as soon as their consumer is emitted, so `regs` always
+ * hands out the lowest dead register. `frames` parallels
+ * the visitor's stack, and `exits` holds the jumps out of
+ * the if statements being generated.
+ *
+ * Code may be appended to the same vm over and over, the
+ * locals, registers and constants of earlier code staying
+ * put. `declared` remembers the locals of the code being
+ * appended so they are forgotten should it fail.
+ *
+ * Task bodies forked with `&` run on registers of their
+ * own, so `scopes` saves those of the enclosing code while
+ * one is generated, and locals it reads are `captures`.
+ *
+ * `writes` counts the nodes up to each id assigning or
+ * incrementing a local, so an operand may be checked for
+ * writes to the locals read in place by the one before it.
+ */
+
+typedef struct {
+  char *err;
+  luna_vm_t *vm;
+  int dest;
+  int result;
+  luna_codegen_regs_t regs;
+  luna_codegen_captures_t captures;
+  kvec_t(luna_codegen_scope_t) scopes;
+  kvec_t(luna_codegen_frame_t) frames;
+  kvec_t(int) exits;
+  kvec_t(luna_codegen_decl_t) declared;
+  kvec_t(int) writes;
+  khash_t(locals) *locals;
+  luna_state_t *state;
+  luna_ast_t *ast;
+  int eliminated;
+  int lineno;
+} luna_codegen_t;
 
 // protos
 
+void
+luna_codegen_init(luna_codegen_t *self, luna_ast_t *ast, luna_state_t *state);
+
+void
+luna_codegen_free(luna_codegen_t *self);
+
+luna_vm_t *
+luna_gen(luna_codegen_t *self, luna_node_id_t id);
+
 luna_vm_t *
-luna_gen(luna_node_t *node);
+luna_gen_append(luna_codegen_t *self, luna_ast_t *ast, luna_node_id_t id);
 
 #endif /* __LUNA_CODE__ */
@@ -10,10 +10,39 @@
 
 #include <stdio.h>
 #include "opcodes.h"
+#include "object.h"
 #include "vm.h"
 
 /*
- * Dump disassembled program to stdout.
+ * Dump RK operand `n` as a register or constant index.
+ */
+
+static void
+luna_dump_operand(int n) {
+  if (ISK(n)) {
+    fprintf(stderr, " k%d", INDEXK(n));
+  } else {
+    fprintf(stderr, " %d", n);
+  }
+}
+
+/*
+ * Dump the register or constant value of operand `n` to stderr.
+ */
+
+static void
+luna_dump_rk(luna_vm_t *vm, int n) {
+  luna_value_t *constants = vm->main->constants.a;
+  if (ISK(n)) {
+    fprintf(stderr, " ");
+    luna_value_dump(K(INDEXK(n)), stderr);
+  } else {
+    fprintf(stderr, " r%d", n);
+  }
+}
+
+/*
+ * Dump disassembled program to stderr.
  *
  * TODO: return a string
  */
@@ -21,27 +50,96 @@
 void
 luna_dump(luna_vm_t *vm) {
   luna_instruction_t *ip = vm->main->ip;
+  luna_instruction_t *end = vm->main->code.a + vm->main->code.n;
   luna_instruction_t i;
-  int registers[32] = {0};
 
-  for (;;) {
+  while (ip < end) {
+    int pc = ip - vm->main->ip;
+    unsigned line = pc < kv_size(vm->main->lines) ? kv_A(vm->main->lines, pc) : 0;
     i = *ip++;
-    printf("%10s ", luna_op_strings[OP(i)]);
+    fprintf(stderr, "%4d :%-3u %10s ", pc, line, luna_op_strings[OP(i)]);
     switch (OP(i)) {
-      // -
+      // op : R(A)
       case LUNA_OP_HALT:
-        printf("\n");
-        return;
+      case LUNA_OP_PRINT:
+        fprintf(stderr, "%d\n", A(i));
+        break;
 
       // op : sBx
       case LUNA_OP_JMP:
-        printf("%d\n", B(i));
+        fprintf(stderr, "%d; -> %d\n", SB(i), pc + 1 + SB(i));
+        break;
+
+      // op : R(A) sBx
+      case LUNA_OP_JTRUE:
+      case LUNA_OP_JFALSE:
+        fprintf(stderr, "%d %d; -> %d\n", A(i), SB(i), pc + 1 + SB(i));
+        break;
+
+      // op : R(A) C
+      case LUNA_OP_TEST:
+        fprintf(stderr, "%d %d\n", A(i), C(i));
+        break;
+
+      // op : R(A) R(B)
+      case LUNA_OP_MOVE:
+      case LUNA_OP_CAPTURE:
+      case LUNA_OP_DRAIN:
+        fprintf(stderr, "%d %d\n", A(i), B(i));
+        break;
+
+      // op : R(A) sBx C
+      case LUNA_OP_FORK:
+        fprintf(stderr, "%d %d %d; -> %d\n", A(i), SB(i), C(i), pc + 1 + SB(i));
         break;
 
       // op : R(A) RK(B)
+      case LUNA_OP_NEGATE:
+      case LUNA_OP_BIT_NOT:
+      case LUNA_OP_JOIN:
+      case LUNA_OP_SLEEP:
+      case LUNA_OP_CAT:
+      case LUNA_OP_DELETE:
+      case LUNA_OP_STAT:
+      case LUNA_OP_GREP:
+        fprintf(stderr, "%d", A(i));
+        luna_dump_operand(B(i));
+        fprintf(stderr, ";");
+        luna_dump_rk(vm, B(i));
+        fprintf(stderr, "\n");
+        break;
+
+      // op : R(A) RK(B) C
+      case LUNA_OP_STREAM:
+        fprintf(stderr, "%d", A(i));
+        luna_dump_operand(B(i));
+        fprintf(stderr, " %d;", C(i));
+        luna_dump_rk(vm, B(i));
+        fprintf(stderr, "\n");
+        break;
+
+      // op : R(A) K(B)
       case LUNA_OP_LOADK:
       case LUNA_OP_LOADB:
-        printf("%d %d; %d\n", A(i), B(i), K(B(i)));
+        fprintf(stderr, "%d k%d;", A(i), B(i));
+        luna_dump_rk(vm, RKASK(B(i)));
+        fprintf(stderr, "\n");
+        break;
+
+      // op : sA RK(B) RK(C)
+      case LUNA_OP_JEQ:
+      case LUNA_OP_JLT:
+      case LUNA_OP_JLTE:
+      case LUNA_OP_JNEQ:
+      case LUNA_OP_JNLT:
+      case LUNA_OP_JNLTE:
+        fprintf(stderr, "%d", SA(i));
+        luna_dump_operand(B(i));
+        luna_dump_operand(C(i));
+        fprintf(stderr, ";");
+        luna_dump_rk(vm, B(i));
+        luna_dump_rk(vm, C(i));
+        fprintf(stderr, " -> %d\n", pc + 1 + SA(i));
         break;
 
       // op : R(A) RK(B) RK(C)
@@ -51,9 +149,22 @@ luna_dump(luna_vm_t *vm) {
       case LUNA_OP_MUL:
       case LUNA_OP_MOD:
       case LUNA_OP_POW:
+      case LUNA_OP_BIT_SHL:
+      case LUNA_OP_BIT_SHR:
+      case LUNA_OP_BIT_AND:
+      case LUNA_OP_BIT_OR:
+      case LUNA_OP_BIT_XOR:
+      case LUNA_OP_EQ:
       case LUNA_OP_LT:
       case LUNA_OP_LTE:
-        printf("%d %d %d; %d %d\n", A(i), B(i), C(i), RK(B(i)), RK(C(i)));
+      case LUNA_OP_WRITE:
+        fprintf(stderr, "%d", A(i));
+        luna_dump_operand(B(i));
+        luna_dump_operand(C(i));
+        fprintf(stderr, ";");
+        luna_dump_rk(vm, B(i));
+        luna_dump_rk(vm, C(i));
+        fprintf(stderr, "\n");
         break;
     }
   }
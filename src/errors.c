@@ -38,3 +38,28 @@ luna_report_error(luna_parser_t *parser) {
     parser->ctx,
     err);
 }
+
+/*
+ * Report code generation error.
+ */
+
+void
+luna_report_gen_error(luna_codegen_t *gen, const char *filename) {
+  fprintf(stderr,
+    "luna(%s). codegen error, %s.\n",
+    filename,
+    gen->err);
+}
+
+/*
+ * Report runtime error.
+ */
+
+void
+luna_report_runtime_error(luna_vm_t *vm, const char *filename) {
+  fprintf(stderr,
+    "luna(%s:%d). runtime error, %s.\n",
+    filename,
+    vm->lineno,
+    vm->err);
+}
@@ -9,10 +9,18 @@
 #define __LUNA_ERRORS__
 
 #include "parser.h"
+#include "codegen.h"
+#include "vm.h"
 
 // protos
 
 void
 luna_report_error(luna_parser_t *parser);
 
+void
+luna_report_gen_error(luna_codegen_t *gen, const char *filename);
+
+void
+luna_report_runtime_error(luna_vm_t *vm, const char *filename);
+
 #endif /* __LUNA_ERRORS__ */
\ No newline at end of file
@@ -0,0 +1,273 @@
+
+//
+// fold.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fold.h"
+#include "visitor.h"
+#include "internal.h"
+
+/*
+ * Check if `node` is a number or bool literal.
+ */
+
+static int
+is_literal(luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_INT:
+    case LUNA_NODE_FLOAT:
+    case LUNA_NODE_BOOL:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Return the value of literal `node`.
+ */
+
+static luna_value_t
+literal(luna_ast_t *ast, luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_INT:
+      return luna_value_int((int32_t) node->a);
+    case LUNA_NODE_FLOAT:
+      return luna_value_float(luna_ast_literal(ast, node->a));
+    case LUNA_NODE_BOOL:
+      return luna_value_bool(node->a);
+  }
+  return LUNA_NULL;
+}
+
+/*
+ * Turn `node` into a literal of `val`, keeping its line.
+ */
+
+static void
+set_literal(luna_ast_t *ast, luna_node_t *node, luna_value_t val) {
+  node->flags = node->op = node->b = 0;
+
+  if (luna_value_is_int(val)) {
+    node->type = LUNA_NODE_INT;
+    node->a = (uint32_t) luna_value_as_int(val);
+  } else if (luna_value_is_bool(val)) {
+    node->type = LUNA_NODE_BOOL;
+    node->a = luna_value_as_bool(val);
+  } else {
+    node->type = LUNA_NODE_FLOAT;
+    node->a = luna_ast_literal_new(ast, luna_value_as_float(val));
+  }
+}
+
+/*
+ * Evaluate binary `op` of `b` and `c` exactly as the vm
+ * would, returning 0 when `op` is not foldable.
+ *
+ * Keep in sync with the handlers in vm.c.
+ */
+
+static int
+eval_op(luna_token op, luna_value_t b, luna_value_t c, luna_value_t *ret) {
+  int ints = luna_value_is_int(b) && luna_value_is_int(c);
+  int32_t x = luna_value_to_int(b), y = luna_value_to_int(c);
+  double fx = luna_value_to_float(b), fy = luna_value_to_float(c);
+
+  switch (op) {
+    case LUNA_TOKEN_OP_PLUS:
+      *ret = ints
+        ? luna_value_int((uint32_t) x + (uint32_t) y)
+        : luna_value_float(fx + fy);
+      return 1;
+    case LUNA_TOKEN_OP_MINUS:
+      *ret = ints
+        ? luna_value_int((uint32_t) x - (uint32_t) y)
+        : luna_value_float(fx - fy);
+      return 1;
+    case LUNA_TOKEN_OP_MUL:
+      *ret = ints
+        ? luna_value_int((uint32_t) x * (uint32_t) y)
+        : luna_value_float(fx * fy);
+      return 1;
+    case LUNA_TOKEN_OP_DIV:
+      *ret = ints && y && !(INT32_MIN == x && -1 == y)
+        ? luna_value_int(x / y)
+        : luna_value_float(fx / fy);
+      return 1;
+    case LUNA_TOKEN_OP_MOD:
+      *ret = ints && y && !(INT32_MIN == x && -1 == y)
+        ? luna_value_int(x % y)
+        : luna_value_float(fmod(fx, fy));
+      return 1;
+    case LUNA_TOKEN_OP_POW: {
+      double d = pow(fx, fy);
+      *ret = ints && y >= 0 && d >= INT32_MIN && d <= INT32_MAX
+        ? luna_value_int((int32_t) d)
+        : luna_value_float(d);
+      return 1;
+    }
+    case LUNA_TOKEN_OP_BIT_SHL: *ret = luna_value_int((uint32_t) x << (y & 31)); return 1;
+    case LUNA_TOKEN_OP_BIT_SHR: *ret = luna_value_int(x >> (y & 31)); return 1;
+    case LUNA_TOKEN_OP_BIT_AND: *ret = luna_value_int(x & y); return 1;
+    case LUNA_TOKEN_OP_BIT_OR: *ret = luna_value_int(x | y); return 1;
+    case LUNA_TOKEN_OP_BIT_XOR: *ret = luna_value_int(x ^ y); return 1;
+    case LUNA_TOKEN_OP_LT: *ret = luna_value_bool(ints ? x < y : fx < fy); return 1;
+    case LUNA_TOKEN_OP_LTE: *ret = luna_value_bool(ints ? x <= y : fx <= fy); return 1;
+    case LUNA_TOKEN_OP_GT: *ret = luna_value_bool(ints ? y < x : fy < fx); return 1;
+    case LUNA_TOKEN_OP_GTE: *ret = luna_value_bool(ints ? y <= x : fy <= fx); return 1;
+    case LUNA_TOKEN_OP_EQ:
+    case LUNA_TOKEN_OP_NEQ: {
+      int eq = luna_value_is_number(b) && luna_value_is_number(c)
+        ? fx == fy
+        : b == c;
+      *ret = luna_value_bool(LUNA_TOKEN_OP_EQ == op ? eq : !eq);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Fold binary op `node` of string literals `l` and `r`,
+ * concatenated by ADD and compared by value in the vm,
+ * returning 0 when `op` is not foldable.
+ */
+
+static int
+fold_strings(luna_ast_t *ast, luna_node_t *node, const char *l, const char *r) {
+  switch (node->op) {
+    case LUNA_TOKEN_OP_PLUS: {
+      size_t a = strlen(l), b = strlen(r);
+      char *buf = luna_arena_alloc(&ast->arena, a + b + 1);
+      if (unlikely(!buf)) return 0;
+      memcpy(buf, l, a);
+      memcpy(buf + a, r, b + 1);
+      node->type = LUNA_NODE_STRING;
+      node->flags = node->op = node->b = 0;
+      node->a = luna_ast_name_new(ast, buf);
+      return 1;
+    }
+    case LUNA_TOKEN_OP_EQ:
+      set_literal(ast, node, luna_value_bool(0 == strcmp(l, r)));
+      return 1;
+    case LUNA_TOKEN_OP_NEQ:
+      set_literal(ast, node, luna_value_bool(0 != strcmp(l, r)));
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Fold unary op `node` of its folded operand, as
+ * NEGATE and BIT_NOT would compute it.
+ */
+
+static void
+fold_unary_op(luna_ast_t *ast, luna_node_t *node) {
+  luna_node_t *expr = luna_ast_node(ast, node->a);
+  if (!is_literal(expr) || LUNA_NODE_BOOL == expr->type) return;
+
+  luna_value_t b = literal(ast, expr);
+  switch (node->op) {
+    case LUNA_TOKEN_OP_PLUS:
+      set_literal(ast, node, b);
+      break;
+    case LUNA_TOKEN_OP_MINUS:
+      set_literal(ast, node, luna_value_is_int(b)
+        ? luna_value_int(-(uint32_t) luna_value_as_int(b))
+        : luna_value_float(-luna_value_as_float(b)));
+      break;
+    case LUNA_TOKEN_OP_BIT_NOT:
+      set_literal(ast, node, luna_value_int(~luna_value_to_int(b)));
+      break;
+  }
+}
+
+/*
+ * Fold binary op `node` of its folded operands.
+ */
+
+static void
+fold_binary_op(luna_ast_t *ast, luna_node_t *node) {
+  luna_value_t val;
+  luna_node_t *l = luna_ast_node(ast, node->a);
+  luna_node_t *r = luna_ast_node(ast, node->b);
+
+  // strings
+  if (LUNA_NODE_STRING == l->type && LUNA_NODE_STRING == r->type) {
+    fold_strings(ast, node
+      , luna_ast_name(ast, l->a)
+      , luna_ast_name(ast, r->a));
+    return;
+  }
+
+  // numbers and bools
+  if (is_literal(l) && is_literal(r)
+    && eval_op(node->op, literal(ast, l), literal(ast, r), &val)) {
+    set_literal(ast, node, val);
+  }
+}
+
+/*
+ * Visit unary op `node`, folding it after its operand.
+ */
+
+static luna_node_id_t
+visit_unary_op(luna_visitor_t *self, luna_node_t *node, int step) {
+  if (0 == step) return node->a;
+  fold_unary_op(self->ast, node);
+  return 0;
+}
+
+/*
+ * Visit binary op `node`, folding it after its operands,
+ * leaving assignment targets alone.
+ */
+
+static luna_node_id_t
+visit_binary_op(luna_visitor_t *self, luna_node_t *node, int step) {
+  switch (node->op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      return step ? 0 : node->b;
+  }
+
+  switch (step) {
+    case 0: return node->a;
+    case 1: return node->b;
+  }
+
+  fold_binary_op(self->ast, node);
+  return 0;
+}
+
+/*
+ * Fold constant sub-expressions of node `id` in place,
+ * folded nodes become literals while their operands are
+ * left unreferenced. Folded values are exactly those the
+ * vm would compute at runtime.
+ *
+ * Folding never appends nodes, so node pointers held
+ * by the caller stay valid.
+ */
+
+void
+luna_fold(luna_ast_t *ast, luna_node_id_t id) {
+  luna_visitor_t visitor = {
+    .ast = ast,
+    .visit_unary_op = visit_unary_op,
+    .visit_binary_op = visit_binary_op
+  };
+
+  luna_visit(&visitor, id);
+}
@@ -0,0 +1,15 @@
+//
+// fold.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_FOLD__
+#define __LUNA_FOLD__
+
+#include "ast.h"
+
+void
+luna_fold(luna_ast_t *ast, luna_node_id_t id);
+
+#endif /* __LUNA_FOLD__ */
@@ -12,20 +12,20 @@
  */
 
 inline void
-luna_hash_set(khash_t(value) *self, char *key, luna_object_t *val) {
+luna_hash_set(khash_t(value) *self, char *key, luna_value_t val) {
   int ret;
   khiter_t k = kh_put(value, self, key, &ret);
   kh_value(self, k) = val;
 }
 
 /*
- * Get hash `key`, or NULL.
+ * Get hash `key`, or null.
  */
 
-inline luna_object_t *
+inline luna_value_t
 luna_hash_get(khash_t(value) *self, char *key) {
   khiter_t k = kh_get(value, self, key);
-  return k == kh_end(self) ? NULL : kh_value(self, k);
+  return k == kh_end(self) ? LUNA_NULL : kh_value(self, k);
 }
 
 /*
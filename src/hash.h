@@ -9,6 +9,7 @@
 #define __LUNA_HASH__
 
 #include "khash.h"
+#include "value.h"
 
 // luna object
 
@@ -16,7 +17,7 @@ typedef struct luna_object_struct luna_object_t;
 
 // value hash
 
-KHASH_MAP_INIT_STR(value, luna_object_t *);
+KHASH_MAP_INIT_STR(value, luna_value_t);
 
 /*
  * Luna hash.
@@ -49,7 +50,7 @@ typedef khash_t(value) luna_hash_t;
 
 #define luna_hash_each(self, block) { \
    const char *slot; \
-   luna_object_t *val; \
+   luna_value_t val; \
     for (khiter_t k = kh_begin(self); k < kh_end(self); ++k) { \
       if (!kh_exist(self, k)) continue; \
       slot = kh_key(self, k); \
@@ -76,7 +77,7 @@ typedef khash_t(value) luna_hash_t;
  */
 
 #define luna_hash_each_val(self, block) { \
-    luna_object_t *val; \
+    luna_value_t val; \
     for (khiter_t k = kh_begin(self); k < kh_end(self); ++k) { \
       if (!kh_exist(self, k)) continue; \
       val = kh_value(self, k); \
@@ -87,9 +88,9 @@ typedef khash_t(value) luna_hash_t;
 // protos
 
 void
-luna_hash_set(khash_t(value) *self, char *key, luna_object_t *val);
+luna_hash_set(khash_t(value) *self, char *key, luna_value_t val);
 
-luna_object_t *
+luna_value_t
 luna_hash_get(khash_t(value) *self, char *key);
 
 int
@@ -6,13 +6,15 @@
 
 #include <math.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "lexer.h"
+#include "span.h"
 
 /*
- * Next char in the array.
+ * Next char in the source.
  */
 
 #ifdef EBUG_LEXER
@@ -25,10 +27,17 @@
 #endif
 
 /*
- * Undo the previous char.
+ * Step back over the previous char. The source
+ * is never written, so it may be mapped read-only.
  */
 
-#define undo (self->source[--self->offset] = self->stash)
+#define undo (--self->offset)
+
+/*
+ * Lookahead char.
+ */
+
+#define peek (self->source[self->offset])
 
 /*
  * Assign token `t`.
@@ -37,10 +46,10 @@
 #define token(t) (self->tok.type = LUNA_TOKEN_##t)
 
 /*
- * Accept char `c` or undo and return 0.
+ * Accept lookahead char `c` or return 0.
  */
 
-#define accept(c) (c == next ? c : (undo, 0))
+#define accept(c) (c == peek ? (++self->offset, c) : 0)
 
 /*
  * Set error `msg` and assign ILLEGAL token.
@@ -49,14 +58,16 @@
 #define error(msg) (self->error = msg, token(ILLEGAL))
 
 /*
- * Initialize lexer with the given `source` and `filename`.
+ * Initialize lexer with the given `source` and `filename`,
+ * interning identifiers and strings in `state`.
  */
 
 void
-luna_lexer_init(luna_lexer_t *self, char *source, const char *filename) {
+luna_lexer_init(luna_lexer_t *self, const char *source, const char *filename, luna_state_t *state) {
   self->error = NULL;
   self->source = source;
   self->filename = filename;
+  self->state = state;
   self->lineno = 1;
   self->offset = 0;
 }
@@ -74,49 +85,83 @@ hex(const char c) {
   return -1;
 }
 
+/*
+ * Intern `len` bytes at `str` as the token's string value.
+ */
+
+static int
+intern(luna_lexer_t *self, const char *str, int len) {
+  luna_string_t *val = luna_string_slice(self->state, str, len);
+  if (!val) return error("out of memory"), 0;
+  self->tok.value.as_string = val->val;
+  return 1;
+}
+
+/*
+ * Keyword slot of the `len` byte identifier at `str`.
+ *
+ * A perfect hash over the keyword set, every keyword
+ * lands in its own slot, so one probe and a memcmp()
+ * classify any identifier.
+ */
+
+#define KEYWORD_SLOT(str, len) \
+  (((unsigned char) (str)[0] \
+    + (unsigned char) (str)[(len) - 1] * 15 \
+    + (len)) & 31)
+
+/*
+ * Keywords by slot.
+ */
+
+static const struct {
+  const char *name;
+  int len;
+  luna_token type;
+} keywords[32] = {
+  [0] = { "and", 3, LUNA_TOKEN_OP_BIT_AND },
+  [1] = { "def", 3, LUNA_TOKEN_DEF },
+  [3] = { "type", 4, LUNA_TOKEN_TYPE },
+  [4] = { "end", 3, LUNA_TOKEN_END },
+  [5] = { "if", 2, LUNA_TOKEN_IF },
+  [7] = { "while", 5, LUNA_TOKEN_WHILE },
+  [10] = { "return", 6, LUNA_TOKEN_RETURN },
+  [14] = { "until", 5, LUNA_TOKEN_UNTIL },
+  [20] = { "else", 4, LUNA_TOKEN_ELSE },
+  [23] = { "for", 3, LUNA_TOKEN_FOR },
+  [24] = { "unless", 6, LUNA_TOKEN_UNLESS },
+  [27] = { "let", 3, LUNA_TOKEN_LET },
+  [29] = { "not", 3, LUNA_TOKEN_OP_LNOT }
+};
+
+/*
+ * Return the keyword token for the `len` byte
+ * identifier at `str`, or LUNA_TOKEN_ID.
+ */
+
+static luna_token
+keyword(const char *str, int len) {
+  if (len < 2 || len > 6) return LUNA_TOKEN_ID;
+  int slot = KEYWORD_SLOT(str, len);
+  return len == keywords[slot].len && 0 == memcmp(keywords[slot].name, str, len)
+    ? keywords[slot].type
+    : LUNA_TOKEN_ID;
+}
+
 /*
  * Scan identifier.
  */
 
 static int
 scan_ident(luna_lexer_t *self, int c) {
-  int len = 0;
-  char buf[128]; // TODO: ditch these buffers
-  token(ID);
+  const char *str = self->source + self->offset - 1;
 
-  do {
-    buf[len++] = c;
-  } while (isalpha(c = next) || isdigit(c) || '_' == c);
-  undo;
+  self->offset += luna_span_ident(self->source + self->offset);
 
-  buf[len++] = 0;
-  switch (len-1) {
-    case 2:
-      if (0 == strcmp("if", buf)) return token(IF);
-      break;
-    case 3:
-      if (0 == strcmp("for", buf)) return token(FOR);
-      if (0 == strcmp("def", buf)) return token(DEF);
-      if (0 == strcmp("end", buf)) return token(END);
-      if (0 == strcmp("let", buf)) return token(LET);
-      if (0 == strcmp("and", buf)) return token(OP_BIT_AND);
-      if (0 == strcmp("not", buf)) return token(OP_LNOT);
-      break;
-    case 4:
-      if (0 == strcmp("else", buf)) return token(ELSE);
-      if (0 == strcmp("type", buf)) return token(TYPE);
-      break;
-    case 5:
-      if (0 == strcmp("while", buf)) return token(WHILE);
-      if (0 == strcmp("until", buf)) return token(UNTIL);
-      break;
-    default:
-      if (0 == strcmp("return", buf)) return token(RETURN);
-      if (0 == strcmp("unless", buf)) return token(UNLESS);
-  }
+  int len = self->source + self->offset - str;
+  if (LUNA_TOKEN_ID != (self->tok.type = keyword(str, len))) return 1;
 
-  self->tok.value.as_string = strdup(buf);
-  return 1;
+  return intern(self, str, len);
 }
 
 /*
@@ -126,47 +171,90 @@ scan_ident(luna_lexer_t *self, int c) {
 static int
 hex_literal(luna_lexer_t *self) {
   int a = hex(next);
-  int b = hex(next);
+  int b = a > -1 ? hex(next) : -1;
   if (a > -1 && b > -1) return a << 4 | b;
   error("string hex literal \\x contains invalid digits");
   return -1;
 }
 
+/*
+ * Unescape the `len` byte string literal body at `str`,
+ * which has already been validated by scan_string().
+ */
+
+static int
+unescape(luna_lexer_t *self, const char *str, int len) {
+  char *buf = len < LUNA_BUF_SIZE ? self->buf : malloc(len);
+  if (!buf) return error("out of memory"), 0;
+  int c, n = 0;
+
+  for (int i = 0; i < len; ++i) {
+    if ('\\' == (c = str[i])) {
+      switch (c = str[++i]) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'e': c = '\e'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case 'x':
+          c = hex(str[i + 1]) << 4 | hex(str[i + 2]);
+          i += 2;
+          break;
+      }
+    }
+    buf[n++] = c;
+  }
+
+  int ret = intern(self, buf, n);
+  if (buf != self->buf) free(buf);
+  return ret;
+}
+
 /*
  * Scan string.
+ *
+ * The value is interned straight out of the source,
+ * only literals containing escapes are copied.
  */
 
 static int
 scan_string(luna_lexer_t *self, int quote) {
-  int c, len = 0;
-  char buf[128];
+  const char *str = self->source + self->offset;
+  int c, escaped = 0;
   token(STRING);
 
   while (quote != (c = next)) {
     switch (c) {
+      case 0:
+        undo;
+        error("unterminated string literal");
+        return 0;
       case '\n': ++self->lineno; break;
       case '\\':
+        escaped = 1;
         switch (c = next) {
-          case 'a': c = '\a'; break;
-          case 'b': c = '\b'; break;
-          case 'e': c = '\e'; break;
-          case 'f': c = '\f'; break;
-          case 'n': c = '\n'; break;
-          case 'r': c = '\r'; break;
-          case 't': c = '\t'; break;
-          case 'v': c = '\v'; break;
+          case 0:
+            undo;
+            error("unterminated string literal");
+            return 0;
+          case '\n':
+            ++self->lineno;
+            break;
           case 'x':
-            if (-1 == (c = hex_literal(self)))
-              return 0;
+            if (-1 == hex_literal(self)) return 0;
+            break;
         }
         break;
     }
-    buf[len++] = c;
   }
 
-  buf[len++] = 0;
-  self->tok.value.as_string = strdup(buf); // TODO: remove
-  return 1;
+  int len = self->source + self->offset - 1 - str;
+  return escaped
+    ? unescape(self, str, len)
+    : intern(self, str, len);
 }
 
 /*
@@ -175,7 +263,9 @@ scan_string(luna_lexer_t *self, int quote) {
 
 static int
 scan_number(luna_lexer_t *self, int c) {
-  int n = 0, type = 0, expo = 0, e;
+  uint64_t n = 0;
+  int type = 0, expo = 0;
+  double e = 1;
   int expo_type = 1;
   /* expo_type:
    * 1 -> '+'(default)
@@ -215,6 +305,9 @@ scan_number(luna_lexer_t *self, int c) {
     else if ('.' == c) goto scan_float;
     else if ('e' == c || 'E' == c) goto scan_expo;
     n = n * 10 + c - '0';
+    for (size_t len = luna_span_digits(self->source + self->offset); len; --len) {
+      n = n * 10 + self->source[self->offset++] - '0';
+    }
   } while (isdigit(c = next) || '_' == c || '.' == c || 'e' == c || 'E' == c);
   undo;
   self->tok.value.as_int = n;
@@ -223,7 +316,6 @@ scan_number(luna_lexer_t *self, int c) {
   // [0-9_]+
 
   scan_float: {
-    e = 1;
     type = 1;
     token(FLOAT);
     while (isdigit(c = next) || '_' == c || 'e' == c || 'E' == c) {
@@ -233,7 +325,7 @@ scan_number(luna_lexer_t *self, int c) {
       e *= 10;
     }
     undo;
-    self->tok.value.as_float = (float) n / e;
+    self->tok.value.as_float = (double) n / e;
     return 1;
   }
 
@@ -253,27 +345,30 @@ scan_number(luna_lexer_t *self, int c) {
     if (type == 0)
       self->tok.value.as_int = n * pow(10, expo);
     else
-      self->tok.value.as_float = ((float) n / e) * pow(10, expo);
+      self->tok.value.as_float = ((double) n / e) * pow(10, expo);
   }
 
   return 1;
 }
 
 /*
- * Scan the next token in the stream, returns 0
- * on EOS, ILLEGAL token, or a syntax error.
+ * Scan the next token.
  */
 
-int
-luna_scan(luna_lexer_t *self) {
+static int
+scan(luna_lexer_t *self) {
   int c;
   token(ILLEGAL);
+  self->tok.newline = 0;
 
   // scan
   scan:
+  self->tok.offset = self->offset;
   switch (c = next) {
     case ' ':
-    case '\t': goto scan;
+    case '\t':
+      self->offset += luna_span_blanks(self->source + self->offset);
+      goto scan;
     case '(': return token(LPAREN);
     case ')': return token(RPAREN);
     case '{': return token(LBRACE);
@@ -288,76 +383,60 @@ luna_scan(luna_lexer_t *self) {
     case '?': return token(QMARK);
     case ':': return token(COLON);
     case '+':
-      switch (next) {
-        case '+': return token(OP_INCR);
-        case '=': return token(OP_PLUS_ASSIGN);
-        default: return undo, token(OP_PLUS);
-      }
+      if (accept('+')) return token(OP_INCR);
+      if (accept('=')) return token(OP_PLUS_ASSIGN);
+      return token(OP_PLUS);
     case '-':
-      switch (next) {
-        case '-': return token(OP_DECR);
-        case '=': return token(OP_MINUS_ASSIGN);
-        default: return undo, token(OP_MINUS);
-      }
+      if (accept('-')) return token(OP_DECR);
+      if (accept('=')) return token(OP_MINUS_ASSIGN);
+      return token(OP_MINUS);
     case '*':
-      switch (next) {
-        case '=': return token(OP_MUL_ASSIGN);
-        case '*': return token(OP_POW);
-        default: return undo, token(OP_MUL);
-      }
+      if (accept('=')) return token(OP_MUL_ASSIGN);
+      if (accept('*')) return token(OP_POW);
+      return token(OP_MUL);
     case '/':
-      return '=' == next
+      return accept('=')
         ? token(OP_DIV_ASSIGN)
-        : (undo, token(OP_DIV));
+        : token(OP_DIV);
     case '!':
-      return '=' == next
+      return accept('=')
         ? token(OP_NEQ)
-        : (undo, token(OP_NOT));
+        : token(OP_NOT);
     case '=':
-      return '=' == next
+      return accept('=')
         ? token(OP_EQ)
-        : (undo, token(OP_ASSIGN));
+        : token(OP_ASSIGN);
     case '&':
-      switch (next) {
-        case '&':
-          return '=' == next
-            ? token(OP_AND_ASSIGN)
-            : (undo, token(OP_AND));
-        default:
-          return undo, token(OP_FORK);
-      }
+      if (!accept('&')) return token(OP_FORK);
+      return accept('=')
+        ? token(OP_AND_ASSIGN)
+        : token(OP_AND);
     case '|':
-      switch (next) {
-        case '|':
-          return '=' == next
-            ? token(OP_OR_ASSIGN)
-            : (undo, token(OP_OR));
-        default:
-          return undo, token(OP_BIT_OR);
-      }
+      if (!accept('|')) return token(OP_BIT_OR);
+      return accept('=')
+        ? token(OP_OR_ASSIGN)
+        : token(OP_OR);
     case '<':
-      switch (next) {
-        case '=': return token(OP_LTE);
-        case '<': return token(OP_BIT_SHL);
-        default: return undo, token(OP_LT);
-      }
+      if (accept('=')) return token(OP_LTE);
+      if (accept('<')) return token(OP_BIT_SHL);
+      return token(OP_LT);
     case '>':
-      switch (next) {
-        case '=': return token(OP_GTE);
-        case '>': return token(OP_BIT_SHR);
-        default: return undo, token(OP_GT);
-      }
+      if (accept('=')) return token(OP_GTE);
+      if (accept('>')) return token(OP_BIT_SHR);
+      return token(OP_GT);
     case '#':
-      while ((c = next) != '\n' && c) ; undo;
+      self->offset += luna_span_line(self->source + self->offset);
       goto scan;
     case '\n':
     case '\r':
       ++self->lineno;
+      self->tok.newline = 1;
       goto scan;
     case '"':
     case '\'':
       return scan_string(self, c);
     case 0:
+      undo;
       token(EOS);
       return 0;
     default:
@@ -367,3 +446,18 @@ luna_scan(luna_lexer_t *self) {
       return 0;
   }
 }
+
+/*
+ * Scan the next token in the stream, returns 0
+ * on EOS, ILLEGAL token, or a syntax error.
+ *
+ * The token's `offset` and `len` span its lexeme
+ * in the source.
+ */
+
+int
+luna_scan(luna_lexer_t *self) {
+  int ret = scan(self);
+  self->tok.len = self->offset - self->tok.offset;
+  return ret;
+}
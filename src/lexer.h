@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "token.h"
+#include "state.h"
 
 #ifndef LUNA_BUF_SIZE
 #define LUNA_BUF_SIZE 1024
@@ -26,8 +27,9 @@ typedef struct {
   int stash;
   int lineno;
   off_t offset;
-  char *source;
+  const char *source;
   const char *filename;
+  luna_state_t *state;
   luna_token_t tok;
   char buf[LUNA_BUF_SIZE];
 } luna_lexer_t;
@@ -38,6 +40,6 @@ int
 luna_scan(luna_lexer_t *self);
 
 void
-luna_lexer_init(luna_lexer_t *self, char *source, const char *filename);
+luna_lexer_init(luna_lexer_t *self, const char *source, const char *filename, luna_state_t *state);
 
 #endif /* __LUNA_LEXER__ */
\ No newline at end of file
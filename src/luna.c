@@ -16,9 +16,13 @@
 #include "lexer.h"
 #include "parser.h"
 #include "errors.h"
-#include "utils.h"
+#include "source.h"
 #include "prettyprint.h"
+#include "bytecode.h"
 #include "codegen.h"
+#include "disasm.h"
+#include "trace.h"
+#include "scheduler.h"
 #include "vm.h"
 
 // --ast
@@ -29,6 +33,18 @@ static int ast = 0;
 
 static int tokens = 0;
 
+// --trace
+
+static int trace = 0;
+
+// --no-cache
+
+static int cache = 1;
+
+// --threads, 0 for one per core
+
+static int threads = 0;
+
 /*
  * Output usage information.
  */
@@ -40,10 +56,13 @@ usage() {
     "\n"
     "\n  Options:"
     "\n"
-    "\n    -A, --ast       output ast to stdout"
-    "\n    -T, --tokens    output tokens to stdout"
-    "\n    -h, --help      output help information"
-    "\n    -V, --version   output luna version"
+    "\n    -A, --ast          output ast to stdout"
+    "\n    -T, --tokens       output tokens to stdout"
+    "\n    -t, --trace        output bytecode and execution trace to stderr"
+    "\n    -C, --no-cache     do not read or write .lunac bytecode"
+    "\n    -j, --threads <n>  run forked tasks on <n> threads [cores]"
+    "\n    -h, --help         output help information"
+    "\n    -V, --version      output luna version"
     "\n"
     "\n  Examples:"
     "\n"
@@ -67,37 +86,6 @@ version() {
   exit(0);
 }
 
-/*
- * Line-noise REPL.
- */
-
-void
-repl() {
-  char *line;
-  while(line = linenoise("luna> ")) {
-    if ('\0' != line[0]) {
-      // parse the input
-      luna_lexer_t lex;
-      luna_lexer_init(&lex, line, "stdin");
-      luna_parser_t parser;
-      luna_parser_init(&parser, &lex);
-      luna_block_node_t *root;
-
-      // oh noes!
-      if (!(root = luna_parse(&parser))) {
-        luna_report_error(&parser);
-        exit(1);
-      }
-
-      // print
-      luna_prettyprint((luna_node_t *) root);
-      linenoiseHistoryAdd(line);
-    }
-    free(line);
-  }
-  exit(0);
-}
-
 /*
  * Parse arguments.
  */
@@ -118,6 +106,18 @@ parse_args(int *argc, const char **argv) {
     } else if (!strcmp("-T", arg) || !strcmp("--tokens", arg)) {
       tokens = 1;
       --*argc; ++argv;
+    } else if (!strcmp("-t", arg) || !strcmp("--trace", arg)) {
+      trace = 1;
+      --*argc; ++argv;
+    } else if (!strcmp("-C", arg) || !strcmp("--no-cache", arg)) {
+      cache = 0;
+      --*argc; ++argv;
+    } else if (!strcmp("-j", arg) || !strcmp("--threads", arg)) {
+      if (i + 1 == len || (threads = atoi(args[++i])) < 1) {
+        fprintf(stderr, "%s requires a thread count\n", arg);
+        exit(1);
+      }
+      *argc -= 2; argv += 2;
     } else if ('-' == arg[0]) {
       fprintf(stderr, "unknown flag %s\n", arg);
       exit(1);
@@ -127,19 +127,94 @@ parse_args(int *argc, const char **argv) {
   return argv;
 }
 
+/*
+ * Write the bytecode path for `path` with source `hash` to
+ * `buf`, in $LUNA_CACHE_DIR when set, otherwise alongside.
+ */
+
+static int
+cache_path(char *buf, size_t len, const char *path, uint64_t hash) {
+  const char *dir = getenv("LUNA_CACHE_DIR");
+  size_t n = strlen(path);
+  int ret = dir
+    ? snprintf(buf, len, "%s/%016llx" LUNA_BYTECODE_EXT, dir, (unsigned long long) hash)
+    : n > 5 && !strcmp(path + n - 5, ".luna")
+      ? snprintf(buf, len, "%sc", path)
+      : snprintf(buf, len, "%s" LUNA_BYTECODE_EXT, path);
+  return ret > 0 && ret < len;
+}
+
+/*
+ * Evaluate `vm`, reporting errors as of `path`,
+ * and return status.
+ */
+
+static int
+run(luna_vm_t *vm, const char *path) {
+  // --trace, reused by each line of the REPL
+  if (trace && !vm->trace) vm->trace = luna_trace_new(LUNA_TRACE_SIZE);
+  if (trace) vm->trace->n = 0;
+
+  // --threads, tracing interleaves nothing
+  if (!vm->sched) {
+    int n = trace ? 1 : threads ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+    vm->sched = luna_sched_new(n);
+  }
+
+  // evaluate
+  luna_value_t val = luna_eval(vm);
+  int failed = NULL != vm->err;
+  if (failed) {
+    luna_report_runtime_error(vm, path);
+    vm->err = NULL;
+  } else {
+    luna_value_inspect(val);
+  }
+
+  if (trace) {
+    fprintf(stderr, "\n");
+    luna_trace_dump(vm->trace, stderr);
+  }
+
+  return failed;
+}
+
 /*
  * Evaluate `source` with the given
  * `path` name and return status.
  */
 
 int
-eval(char *source, const char *path) {
+eval(luna_source_t *source, const char *path) {
+  char lunac[1024];
+  uint64_t hash = 0;
+  luna_state_t state;
+  luna_vm_t *vm;
+
+  luna_state_init(&state);
+
+  // fresh bytecode
+  int cached = cache && !tokens && !ast && strcmp("stdin", path);
+  if (cached) {
+    hash = luna_bytecode_hash(source->data, source->len);
+    cached = cache_path(lunac, sizeof(lunac), path, hash);
+  }
+
+  if (cached) {
+    if (vm = luna_bytecode_load(lunac, hash, &state)) {
+      if (trace) luna_dump(vm);
+      return run(vm, path);
+    }
+  }
+
   // parse the input
   luna_lexer_t lex;
-  luna_lexer_init(&lex, source, path);
+  luna_lexer_init(&lex, source->data, path, &state);
+  luna_ast_t tree;
+  luna_ast_init(&tree);
   luna_parser_t parser;
-  luna_parser_init(&parser, &lex);
-  luna_block_node_t *root;
+  luna_parser_init(&parser, &lex, &tree);
+  luna_node_id_t root;
 
   // --tokens
   if (tokens) {
@@ -158,16 +233,75 @@ eval(char *source, const char *path) {
 
   // --ast
   if (ast) {
-    luna_prettyprint((luna_node_t *) root);
+    luna_prettyprint(&tree, root);
     return 1;
   }
 
-  // evaluate
-  luna_vm_t *vm = luna_gen((luna_node_t *) root);
-  luna_object_t *obj = luna_eval(vm);
-  luna_object_inspect(obj);
+  // generate
+  luna_codegen_t gen;
+  luna_codegen_init(&gen, &tree, &state);
+  vm = luna_gen(&gen, root);
+  luna_ast_free(&tree);
+  if (!vm) {
+    luna_report_gen_error(&gen, path);
+    return 1;
+  }
+
+  // --trace
+  if (trace) {
+    luna_dump(vm);
+    fprintf(stderr, "\n  %d instructions eliminated\n\n", gen.eliminated);
+  }
 
-  return 0;
+  // cache, failure only costs the next run
+  if (cached) luna_bytecode_write(vm, hash, lunac);
+
+  return run(vm, path);
+}
+
+/*
+ * Line-noise REPL. Each line is appended to one vm,
+ * so locals and constants persist across lines.
+ */
+
+void
+repl() {
+  char *line;
+  luna_state_t state;
+  luna_state_init(&state);
+  luna_codegen_t gen;
+  luna_codegen_init(&gen, NULL, &state);
+  while(line = linenoise("luna> ")) {
+    if ('\0' != line[0]) {
+      // parse the input
+      luna_lexer_t lex;
+      luna_lexer_init(&lex, line, "stdin", &state);
+      luna_ast_t tree;
+      luna_ast_init(&tree);
+      luna_parser_t parser;
+      luna_parser_init(&parser, &lex, &tree);
+      luna_node_id_t root;
+      luna_vm_t *vm;
+
+      // oh noes!
+      if (!(root = luna_parse(&parser))) {
+        luna_report_error(&parser);
+      // --ast
+      } else if (ast) {
+        luna_prettyprint(&tree, root);
+      // generate and evaluate
+      } else if (!(vm = luna_gen_append(&gen, &tree, root))) {
+        luna_report_gen_error(&gen, "stdin");
+      } else {
+        run(vm, "stdin");
+      }
+
+      luna_ast_free(&tree);
+      linenoiseHistoryAdd(line);
+    }
+    free(line);
+  }
+  exit(0);
 }
 
 /*
@@ -178,15 +312,22 @@ int
 main(int argc, const char **argv){
   int tried_ext = 0;
   const char *path, *orig;
-  char *source;
+  char buf[256];
+  luna_source_t source;
+  int status;
 
   // parse arguments
   argv = parse_args(&argc, argv);
 
   // eval stdin
   if (1 == argc && !isatty(0)) {
-    source = read_until_eof(stdin);
-    return eval(source, "stdin");
+    if (luna_source_fd(&source, 0) < 0) {
+      fprintf(stderr, "error reading stdin:\n\n  %s\n\n", strerror(errno));
+      exit(1);
+    }
+    status = eval(&source, "stdin");
+    luna_source_free(&source);
+    return status;
   }
 
   // REPL
@@ -195,12 +336,11 @@ main(int argc, const char **argv){
   // eval file
   orig = path = argv[1];
   read:
-  if (!(source = file_read(path))) {
+  if (luna_source_open(&source, path) < 0) {
     // try with .luna extension
     if (!tried_ext) {
       tried_ext = 1;
-      char buf[256];
-      snprintf(buf, 256, "%s.luna", path);
+      snprintf(buf, sizeof(buf), "%s.luna", path);
       path = buf;
       goto read;
     }
@@ -208,5 +348,7 @@ main(int argc, const char **argv){
     exit(1);
   }
 
-  return eval(source, path);
+  status = eval(&source, path);
+  luna_source_free(&source);
+  return status;
 }
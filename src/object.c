@@ -8,20 +8,33 @@
 #include <assert.h>
 #include <stdio.h>
 #include "object.h"
+#include "state.h"
 #include "internal.h"
 
 /*
- * Print `self` to stdout.
+ * Write `val` to `stream`.
  */
 
 void
-luna_object_inspect(luna_object_t *self) {
-  switch (self->type) {
-    case LUNA_TYPE_FLOAT:
-      printf("%2f\n", self->value.as_float);
+luna_value_dump(luna_value_t val, FILE *stream) {
+  switch (luna_value_type(val)) {
+    case LUNA_TYPE_NULL:
+      fprintf(stream, "null");
+      break;
+    case LUNA_TYPE_BOOL:
+      fprintf(stream, "%s", luna_value_as_bool(val) ? "true" : "false");
       break;
     case LUNA_TYPE_INT:
-      printf("%d\n", self->value.as_int);
+      fprintf(stream, "%d", luna_value_as_int(val));
+      break;
+    case LUNA_TYPE_FLOAT:
+      fprintf(stream, "%2f", luna_value_as_float(val));
+      break;
+    case LUNA_TYPE_STRING:
+      fprintf(stream, "'%s'", ((luna_string_t *) luna_value_as_pointer(val))->val);
+      break;
+    case LUNA_TYPE_TASK:
+      fprintf(stream, "[task]");
       break;
     default:
       assert(0 && "unhandled");
@@ -29,37 +42,11 @@ luna_object_inspect(luna_object_t *self) {
 }
 
 /*
- * Allocate an initialize a new object of the given `type`.
+ * Print `val` to stdout.
  */
 
-static luna_object_t *
-alloc_object(luna_object type) {
-  luna_object_t *self = malloc(sizeof(luna_object_t));
-  if (unlikely(!self)) return NULL;
-  self->type = type;
-  return self;
-}
-
-/*
- * Allocate a new int object with the given `val`.
- */
-
-luna_object_t *
-luna_int_new(int val) {
-  luna_object_t *self = alloc_object(LUNA_TYPE_INT);
-  if (unlikely(!self)) return NULL;
-  self->value.as_int = val;
-  return self;
-}
-
-/*
- * Allocate a new float object with the given `val`.
- */
-
-luna_object_t *
-luna_float_new(float val) {
-  luna_object_t *self = alloc_object(LUNA_TYPE_FLOAT);
-  if (unlikely(!self)) return NULL;
-  self->value.as_float = val;
-  return self;
+void
+luna_value_inspect(luna_value_t val) {
+  luna_value_dump(val, stdout);
+  printf("\n");
 }
@@ -8,13 +8,15 @@
 #ifndef __LUNA_OBJECT__
 #define __LUNA_OBJECT__
 
+#include <stdio.h>
+#include "value.h"
 #include "hash.h"
 
 /*
  * Check if `val` is the given type.
  */
 
-#define luna_object_is(val, t) ((val)->type == LUNA_TYPE_##t)
+#define luna_object_is(val, t) (luna_value_type(val) == LUNA_TYPE_##t)
 
 /*
  * Specific type macros.
@@ -24,10 +26,10 @@
 #define luna_is_array(val) luna_object_is(val, ARRAY)
 #define luna_is_object(val) luna_object_is(val, OBJECT)
 #define luna_is_string(val) luna_object_is(val, STRING)
-#define luna_is_float(val) luna_object_is(val, FLOAT)
-#define luna_is_int(val) luna_object_is(val, INT)
-#define luna_is_bool(val) luna_object_is(val, BOOL)
-#define luna_is_null(val) luna_object_is(val, NULL)
+#define luna_is_float(val) luna_value_is_float(val)
+#define luna_is_int(val) luna_value_is_int(val)
+#define luna_is_bool(val) luna_value_is_bool(val)
+#define luna_is_null(val) luna_value_is_null(val)
 
 /*
  * Luna value types.
@@ -42,34 +44,50 @@ typedef enum {
   LUNA_TYPE_STRING,
   LUNA_TYPE_OBJECT,
   LUNA_TYPE_ARRAY,
-  LUNA_TYPE_LIST
+  LUNA_TYPE_LIST,
+  LUNA_TYPE_TASK
 } luna_object;
 
 /*
  * Luna object.
  *
- * A simple tagged union forming
- * the basis of a Luna values.
+ * Header of heap-allocated values, which
+ * are boxed with luna_value_object().
  */
 
 struct luna_object_struct {
   luna_object type;
   union {
     void *as_pointer;
-    int as_int;
-    float as_float;
   } value;
 };
 
+/*
+ * Return the type of `val`.
+ */
+
+static inline luna_object
+luna_value_type(luna_value_t val) {
+  switch (luna_value_tag(val)) {
+    case LUNA_TAG_INT:
+      return LUNA_TYPE_INT;
+    case LUNA_TAG_SPECIAL:
+      return LUNA_NULL == val ? LUNA_TYPE_NULL : LUNA_TYPE_BOOL;
+    case LUNA_TAG_OBJECT:
+      return ((luna_object_t *) luna_value_as_pointer(val))->type;
+    case LUNA_TAG_POINTER:
+      return LUNA_TYPE_NODE;
+    default:
+      return LUNA_TYPE_FLOAT;
+  }
+}
+
 // protos
 
 void
-luna_object_inspect(luna_object_t *self);
-
-luna_object_t *
-luna_int_new(int val);
+luna_value_dump(luna_value_t val, FILE *stream);
 
-luna_object_t *
-luna_float_new(float val);
+void
+luna_value_inspect(luna_value_t val);
 
 #endif /* __LUNA_OBJECT__ */
@@ -21,6 +21,15 @@
   o(EQ, "eq") \
   o(LT, "lt") \
   o(LTE, "lte") \
+  o(TEST, "test") \
+  o(JEQ, "jeq") \
+  o(JLT, "jlt") \
+  o(JLTE, "jlte") \
+  o(JNEQ, "jneq") \
+  o(JNLT, "jnlt") \
+  o(JNLTE, "jnlte") \
+  o(JTRUE, "jtrue") \
+  o(JFALSE, "jfalse") \
   o(ADD, "add") \
   o(SUB, "sub") \
   o(DIV, "div") \
@@ -32,7 +41,20 @@
   o(BIT_SHR, "bshr") \
   o(BIT_AND, "band") \
   o(BIT_OR, "bor") \
-  o(BIT_XOR, "bxor")
+  o(BIT_XOR, "bxor") \
+  o(FORK, "fork") \
+  o(JOIN, "join") \
+  o(CAPTURE, "capture") \
+  o(SLEEP, "sleep") \
+  o(CAT, "cat") \
+  o(DELETE, "delete") \
+  o(STAT, "stat") \
+  o(WRITE, "write") \
+  o(STREAM, "stream") \
+  o(GREP, "grep") \
+  o(PRINT, "print") \
+  o(DRAIN, "drain") \
+  o(BIT_NOT, "bnot")
 
 /*
  * Opcodes enum.
@@ -8,7 +8,6 @@
 #include <stdio.h>
 #include "prettyprint.h"
 #include "parser.h"
-#include "vec.h"
 #include "token.h"
 
 // TODO: test contextual errors
@@ -86,22 +85,24 @@
 #define error(str) \
   ((self->err = self->err \
     ? self->err \
-    : str), NULL)
+    : str), 0)
 
 // forward declarations
 
-static luna_block_node_t *block(luna_parser_t *self);
-static luna_node_t *expr(luna_parser_t *self);
-static luna_node_t *call_expr(luna_parser_t *self);
-static luna_node_t *not_expr(luna_parser_t *self);
+static luna_node_id_t block(luna_parser_t *self);
+static luna_node_id_t expr(luna_parser_t *self);
+static luna_node_id_t call_expr(luna_parser_t *self);
+static luna_node_id_t not_expr(luna_parser_t *self);
 
 /*
- * Initialize with the given lexer.
+ * Initialize with the given lexer, appending
+ * nodes to `ast`.
  */
 
 void
-luna_parser_init(luna_parser_t *self, luna_lexer_t *lex) {
+luna_parser_init(luna_parser_t *self, luna_lexer_t *lex, luna_ast_t *ast) {
   self->lex = lex;
+  self->ast = ast;
   self->la = NULL;
   self->ctx = NULL;
   self->err = NULL;
@@ -112,12 +113,12 @@ luna_parser_init(luna_parser_t *self, luna_lexer_t *lex) {
  * '(' expr ')'
  */
 
-static luna_node_t *
+static luna_node_id_t
 paren_expr(luna_parser_t *self) {
-  luna_node_t *node;
+  luna_node_id_t node;
   debug("paren_expr");
-  if (!accept(LPAREN)) return NULL;
-  if (!(node = expr(self))) return NULL;
+  if (!accept(LPAREN)) return 0;
+  if (!(node = expr(self))) return 0;
   if (!accept(RPAREN)) return error("expression missing closing ')'");
   return node;
 }
@@ -128,19 +129,19 @@ paren_expr(luna_parser_t *self) {
  */
 
 int
-arg_list(luna_parser_t *self, luna_array_node_t *arr, luna_token delim) {
+arg_list(luna_parser_t *self, luna_token delim) {
   // trailing ','
   if (delim == peek->type) return 1;
 
   // expr
-  luna_node_t *val;
+  luna_node_id_t val;
   if (!(val = expr(self))) return 0;
 
-  luna_vec_push(arr->vals, luna_node(val));
+  luna_ast_scratch(self->ast, val);
 
   // ',' arg_list
   if (accept(COMMA)) {
-    if (!arg_list(self, arr, delim)) return 0;
+    if (!arg_list(self, delim)) return 0;
   }
 
   return 1;
@@ -150,16 +151,16 @@ arg_list(luna_parser_t *self, luna_array_node_t *arr, luna_token delim) {
  * '[' arg_list? ']'
  */
 
-static luna_node_t *
+static luna_node_id_t
 array_expr(luna_parser_t *self) {
-  luna_array_node_t *node = luna_array_node_new();
+  uint32_t mark = luna_ast_mark(self->ast);
   debug("array_expr");
 
-  if (!accept(LBRACK)) return NULL;
+  if (!accept(LBRACK)) return 0;
   context("array");
-  if (!arg_list(self, node, LUNA_TOKEN_RBRACK)) return NULL;
+  if (!arg_list(self, LUNA_TOKEN_RBRACK)) return 0;
   if (!accept(RBRACK)) return error("array missing closing ']'");
-  return (luna_node_t *) node;
+  return luna_array_node_new(self->ast, luna_ast_list_new(self->ast, mark));
 }
 
 /*
@@ -168,25 +169,26 @@ array_expr(luna_parser_t *self) {
  */
 
 int
-hash_pairs(luna_parser_t *self, luna_hash_node_t *hash, luna_token delim) {
+hash_pairs(luna_parser_t *self, luna_token delim) {
   // trailing ','
   if (delim == peek->type) return 1;
 
   // id
-  if (!is(ID)) return error("hash pair key expected"), 0;
+  if (!is(ID)) return error("hash pair key expected");
   char *id = next->value.as_string;
 
   // :
-  if (!accept(COLON)) return error("hash pair ':' missing"), 0;
+  if (!accept(COLON)) return error("hash pair ':' missing");
 
   // expr
-  luna_node_t *val;
+  luna_node_id_t val;
   if (!(val = expr(self))) return 0;
-  luna_hash_set(hash->vals, id, luna_node(val));
+  luna_ast_scratch(self->ast, luna_ast_name_new(self->ast, id));
+  luna_ast_scratch(self->ast, val);
 
   // ',' hash_pairs
   if (accept(COMMA)) {
-    if (!hash_pairs(self, hash, delim)) return 0;
+    if (!hash_pairs(self, delim)) return 0;
   }
 
   return 1;
@@ -196,16 +198,20 @@ hash_pairs(luna_parser_t *self, luna_hash_node_t *hash, luna_token delim) {
  * '{' hash_pairs? '}'
  */
 
-static luna_node_t *
+static luna_node_id_t
 hash_expr(luna_parser_t *self) {
-  luna_hash_node_t *node = luna_hash_node_new();
+  uint32_t mark = luna_ast_mark(self->ast);
   debug("hash_expr");
 
-  if (!accept(LBRACE)) return NULL;
+  if (!accept(LBRACE)) return 0;
   context("hash");
-  if (!hash_pairs(self, node, LUNA_TOKEN_RBRACE)) return NULL;
+  if (!hash_pairs(self, LUNA_TOKEN_RBRACE)) return 0;
   if (!accept(RBRACE)) return error("hash missing closing '}'");
-  return (luna_node_t *) node;
+
+  // pairs are gathered as (name, val) slots
+  luna_list_t pairs = luna_ast_list_new(self->ast, mark);
+  pairs.len /= 2;
+  return luna_hash_node_new(self->ast, pairs);
 }
 
 /*
@@ -218,18 +224,18 @@ hash_expr(luna_parser_t *self) {
  * | paren_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 primary_expr(luna_parser_t *self) {
   debug("primary_expr");
   switch (peek->type) {
     case LUNA_TOKEN_ID:
-      return (luna_node_t *) luna_id_node_new(next->value.as_string);
+      return luna_id_node_new(self->ast, next->value.as_string);
     case LUNA_TOKEN_INT:
-      return (luna_node_t *) luna_int_node_new(next->value.as_int);
+      return luna_int_node_new(self->ast, next->value.as_int);
     case LUNA_TOKEN_FLOAT:
-      return (luna_node_t *) luna_float_node_new(next->value.as_float);
+      return luna_float_node_new(self->ast, next->value.as_float);
     case LUNA_TOKEN_STRING:
-      return (luna_node_t *) luna_string_node_new(next->value.as_string);
+      return luna_string_node_new(self->ast, next->value.as_string);
     case LUNA_TOKEN_LBRACK:
       return array_expr(self);
     case LUNA_TOKEN_LBRACE:
@@ -243,15 +249,15 @@ primary_expr(luna_parser_t *self) {
  * | call_expr '**' call_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 pow_expr(luna_parser_t *self) {
-  luna_node_t *node, *right;
+  luna_node_id_t node, right;
   debug("pow_expr");
-  if (!(node = call_expr(self))) return NULL;
+  if (!(node = call_expr(self))) return 0;
   if (accept(OP_POW)) {
     context("** operation");
     if (right = call_expr(self)) {
-      return (luna_node_t *) luna_binary_op_node_new(LUNA_TOKEN_OP_POW, node, right);
+      return luna_binary_op_node_new(self->ast, LUNA_TOKEN_OP_POW, node, right);
     } else {
       return error("missing right-hand expression");
     }
@@ -265,13 +271,13 @@ pow_expr(luna_parser_t *self) {
  * | pow_expr '--'
  */
 
-static luna_node_t *
+static luna_node_id_t
 postfix_expr(luna_parser_t *self) {
-  luna_node_t *node;
+  luna_node_id_t node;
   debug("postfix_expr");
-  if (!(node = pow_expr(self))) return NULL;
+  if (!(node = pow_expr(self))) return 0;
   if (accept(OP_INCR) || accept(OP_DECR)) {
-    return (luna_node_t *) luna_unary_op_node_new(prev->type, node, 1);
+    return luna_unary_op_node_new(self->ast, prev->type, node, 1);
   }
   return node;
 }
@@ -286,7 +292,7 @@ postfix_expr(luna_parser_t *self) {
  * | primary_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 unary_expr(luna_parser_t *self) {
   debug("unary_expr");
   if (accept(OP_INCR)
@@ -295,227 +301,98 @@ unary_expr(luna_parser_t *self) {
     || accept(OP_PLUS)
     || accept(OP_MINUS)
     || accept(OP_NOT)) {
-    return (luna_node_t *) luna_unary_op_node_new(prev->type, unary_expr(self), 0);
+    luna_token op = prev->type;
+    luna_node_id_t node;
+    if (!(node = unary_expr(self))) return 0;
+    return luna_unary_op_node_new(self->ast, op, node, 0);
   }
   return postfix_expr(self);
 }
 
 /*
- * unary_expr (('* | '/' | '%') unary_expr)*
+ * Binary operators, from the precedence table in the
+ * Readme, higher binds tighter. All are left associative.
  */
 
-static luna_node_t *
-multiplicative_expr(luna_parser_t *self) {
-  luna_token op;
-  luna_node_t *node, *right;
-  debug("multiplicative_expr");
-  if (!(node = unary_expr(self))) return NULL;
-  while (accept(OP_MUL) || accept(OP_DIV) || accept(OP_MOD)) {
-    op = prev->type;
-    context("multiplicative operation");
-    if (right = unary_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(op, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
+static struct {
+  int prec;
+  char *context;
+} binary_ops[] = {
+  [LUNA_TOKEN_OP_MUL] = { 10, "multiplicative operation" },
+  [LUNA_TOKEN_OP_DIV] = { 10, "multiplicative operation" },
+  [LUNA_TOKEN_OP_MOD] = { 10, "multiplicative operation" },
+  [LUNA_TOKEN_OP_PLUS] = { 9, "additive operation" },
+  [LUNA_TOKEN_OP_MINUS] = { 9, "additive operation" },
+  [LUNA_TOKEN_OP_BIT_SHL] = { 8, "shift operation" },
+  [LUNA_TOKEN_OP_BIT_SHR] = { 8, "shift operation" },
+  [LUNA_TOKEN_OP_LT] = { 7, "relational operation" },
+  [LUNA_TOKEN_OP_LTE] = { 7, "relational operation" },
+  [LUNA_TOKEN_OP_GT] = { 7, "relational operation" },
+  [LUNA_TOKEN_OP_GTE] = { 7, "relational operation" },
+  [LUNA_TOKEN_OP_EQ] = { 6, "equality operation" },
+  [LUNA_TOKEN_OP_NEQ] = { 6, "equality operation" },
+  [LUNA_TOKEN_OP_BIT_AND] = { 5, "& operation" },
+  [LUNA_TOKEN_OP_BIT_XOR] = { 4, "^ operation" },
+  [LUNA_TOKEN_OP_BIT_OR] = { 3, "| operation" },
+  [LUNA_TOKEN_OP_AND] = { 2, "&& operation" },
+  [LUNA_TOKEN_OP_OR] = { 1, "|| operation" }
+};
 
 /*
- * multiplicative_expr (('+ | '-') multiplicative_expr)*
+ * Return the precedence of binary operator `t`, 0 for none.
  */
 
-static luna_node_t *
-additive_expr(luna_parser_t *self) {
-  luna_token op;
-  luna_node_t *node, *right;
-  debug("additive_expr");
-  if (!(node = multiplicative_expr(self))) return NULL;
-  while (accept(OP_PLUS) || accept(OP_MINUS)) {
-    op = prev->type;
-    context("additive operation");
-    if (right = multiplicative_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(op, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
-
-/*
- * additive_expr (('<<' | '>>') additive_expr)*
- */
-
-static luna_node_t *
-shift_expr(luna_parser_t *self) {
-  luna_token op;
-  luna_node_t *node, *right;
-  debug("shift_expr");
-  if (!(node = additive_expr(self))) return NULL;
-  while (accept(OP_BIT_SHL) || accept(OP_BIT_SHR)) {
-    op = prev->type;
-    context("shift operation");
-    if (right = additive_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(op, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
-
-/*
- * shift_expr (('<' | '<=' | '>' | '>=') shift_expr)*
- */
-
-static luna_node_t *
-relational_expr(luna_parser_t *self) {
-  luna_token op;
-  luna_node_t *node, *right;
-  debug("relational_expr");
-  if (!(node = shift_expr(self))) return NULL;
-  while (accept(OP_LT) || accept(OP_LTE) || accept(OP_GT) || accept(OP_GTE)) {
-    op = prev->type;
-    context("relational operation");
-    if (right = shift_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(op, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
+#define precedence(t) \
+  ((t) < sizeof(binary_ops) / sizeof(binary_ops[0]) \
+    ? binary_ops[t].prec \
+    : 0)
 
 /*
- * relational_expr (('==' | '!=') relational_expr)*
+ * unary_expr (op binary_expr)*
+ *
+ * Precedence climbing, operators binding at least as
+ * tightly as `min` are folded in to the left, while the
+ * right-hand side only takes those binding tighter.
  */
 
-static luna_node_t *
-equality_expr(luna_parser_t *self) {
-  luna_token op;
-  luna_node_t *node, *right;
-  debug("equality_expr");
-  if (!(node = relational_expr(self))) return NULL;
-  while (accept(OP_EQ) || accept(OP_NEQ)) {
-    op = prev->type;
-    context("equality operation");
-    if (right = relational_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(op, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
-
-/*
- * equality_expr ('and' equality_expr)*
- */
+static luna_node_id_t
+binary_expr(luna_parser_t *self, int min) {
+  luna_node_id_t node, right;
+  debug("binary_expr");
+  if (!(node = unary_expr(self))) return 0;
 
-static luna_node_t *
-bitwise_and_expr(luna_parser_t *self) {
-  luna_node_t *node, *right;
-  debug("bitwise_and_expr");
-  if (!(node = equality_expr(self))) return NULL;
-  while (accept(OP_BIT_AND)) {
-    context("& operation");
-    if (right = equality_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(LUNA_TOKEN_OP_BIT_AND, node, right);
-    } else {
+  for (;;) {
+    luna_token op = peek->type;
+    int prec = precedence(op);
+    if (!prec || prec < min) break;
+    next;
+    context(binary_ops[op].context);
+    if (!(right = binary_expr(self, prec + 1))) {
       return error("missing right-hand expression");
     }
+    node = luna_binary_op_node_new(self->ast, op, node, right);
   }
-  return node;
-}
 
-/*
- * bitwise_and_expr ('^' bitwise_and_expr)*
- */
-
-static luna_node_t *
-bitwise_xor_expr(luna_parser_t *self) {
-  luna_node_t *node, *right;
-  debug("bitwise_xor_expr");
-  if (!(node = bitwise_and_expr(self))) return NULL;
-  while (accept(OP_BIT_XOR)) {
-    context("^ operation");
-    if (right = bitwise_and_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(LUNA_TOKEN_OP_BIT_XOR, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
   return node;
 }
 
 /*
- * bitwise_xor_expr ('|' bitwise_xor_expr)*
+ * binary_expr '&'?
  */
 
-static luna_node_t *
-bitswise_or_expr(luna_parser_t *self) {
-  luna_node_t *node, *right;
-  debug("bitswise_or_expr");
-  if (!(node = bitwise_xor_expr(self))) return NULL;
-  while (accept(OP_BIT_OR)) {
-    context("| operation");
-    if (right = bitwise_xor_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(LUNA_TOKEN_OP_BIT_OR, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
-
-/*
- * bitswise_or_expr ('&&' bitswise_or_expr)*
- */
-
-static luna_node_t *
-logical_and_expr(luna_parser_t *self) {
-  luna_node_t *node, *right;
-  debug("logical_and_expr");
-  if (!(node = bitswise_or_expr(self))) return NULL;
-  while (accept(OP_AND)) {
-    context("&& operation");
-    if (right = bitswise_or_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(LUNA_TOKEN_OP_AND, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
-  return node;
-}
-
-/*
- * logical_and_expr ('||' logical_and_expr)* '&'?
- */
-
-static luna_node_t *
-logical_or_expr(luna_parser_t *self) {
-  luna_node_t *node, *right;
-  debug("logical_or_expr");
-  if (!(node = logical_and_expr(self))) return NULL;
-
-  // '||'
-  while (accept(OP_OR)) {
-    context("|| operation");
-    if (right = logical_and_expr(self)) {
-      node = (luna_node_t *) luna_binary_op_node_new(LUNA_TOKEN_OP_OR, node, right);
-    } else {
-      return error("missing right-hand expression");
-    }
-  }
+static luna_node_id_t
+fork_expr(luna_parser_t *self) {
+  luna_node_id_t node;
+  debug("fork_expr");
+  if (!(node = binary_expr(self, 1))) return 0;
 
   // '&'
   if (accept(OP_FORK)) {
-    luna_id_node_t *id = luna_id_node_new("fork");
-    luna_call_node_t *call = luna_call_node_new((luna_node_t *) id);
-    luna_vec_push(call->args->vec, luna_node(node));
-    node = (luna_node_t *) call;
+    uint32_t mark = luna_ast_mark(self->ast);
+    luna_ast_scratch(self->ast, node);
+    luna_list_t args = luna_ast_list_new(self->ast, mark);
+    luna_node_id_t id = luna_id_node_new(self->ast, "fork");
+    node = luna_call_node_new(self->ast, id, args, (luna_list_t) { 0, 0 });
   }
 
   return node;
@@ -525,15 +402,13 @@ logical_or_expr(luna_parser_t *self) {
  * (id ':' type ('=' expr)? (',' id ':' type ('=' expr)?)*)
  */
 
-static luna_vec_t *
-function_params(luna_parser_t *self) {
-  luna_vec_t *params = luna_vec_new();
+static int
+function_params(luna_parser_t *self, luna_list_t *params) {
+  uint32_t mark = luna_ast_mark(self->ast);
   debug("params");
   context("function params");
 
-  if (!is(ID)) return params;
-
-  do {
+  if (is(ID)) do {
     // id
     if (!is(ID)) return error("missing identifier");
     const char *id = next->value.as_string;
@@ -544,44 +419,16 @@ function_params(luna_parser_t *self) {
     const char *type = next->value.as_string;
 
     // ('=' expr)?
-    luna_object_t *param;
+    luna_node_id_t val = 0;
     if (accept(OP_ASSIGN)) {
-      luna_node_t *val = expr(self);
-      if (!val) return NULL;
-      param = luna_node((luna_node_t *) luna_decl_node_new(id, type, val));
-    } else {
-      param = luna_node((luna_node_t *) luna_decl_node_new(id, type, NULL));
+      if (!(val = expr(self))) return 0;
     }
 
-    luna_vec_push(params, param);
+    luna_ast_scratch(self->ast, luna_decl_node_new(self->ast, id, type, val));
   } while (accept(COMMA));
 
-  return params;
-}
-
-/*
- * ':' params? block
- */
-
-static luna_node_t *
-function_expr(luna_parser_t *self) {
-  luna_block_node_t *body;
-  luna_vec_t *params;
-  debug("function_expr");
-
-  // ':'
-  if (accept(COLON)) {
-    // params?
-    if (!(params = function_params(self))) return NULL;
-    context("function");
-
-    // block
-    if (body = block(self)) {
-      //return (luna_node_t *) luna_function_node_new(body, params);
-    }
-  }
-
-  return NULL;
+  *params = luna_ast_list_new(self->ast, mark);
+  return 1;
 }
 
 /*
@@ -589,21 +436,21 @@ function_expr(luna_parser_t *self) {
  * | primary_expr call_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 slot_access_expr(luna_parser_t * self) {
-  luna_node_t *node;
+  luna_node_id_t node;
   debug("slot_access_expr");
 
   // primary_expr
   node = primary_expr(self);
-  if (!node) return NULL;
+  if (!node) return 0;
 
   // id*
   // TODO: replace
   // while (is(ID)) {
-  //   luna_node_t *right = call_expr(self);
-  //   if (!right) return NULL;
-  //   node = (luna_node_t *) luna_slot_node_new(node, right);
+  //   luna_node_id_t right = call_expr(self);
+  //   if (!right) return 0;
+  //   node = luna_slot_node_new(node, right);
   // }
 
   return node;
@@ -613,10 +460,12 @@ slot_access_expr(luna_parser_t * self) {
  * (expr (',' expr)*)
  */
 
-luna_args_node_t *
-call_args(luna_parser_t *self) {
-  luna_node_t *node;
-  luna_args_node_t *args = luna_args_node_new();
+int
+call_args(luna_parser_t *self, luna_list_t *args, luna_list_t *pairs) {
+  luna_node_id_t node;
+  uint32_t mark = luna_ast_mark(self->ast);
+  kvec_t(uint32_t) kw;
+  kv_init(kw);
 
   self->in_args++;
 
@@ -625,61 +474,100 @@ call_args(luna_parser_t *self) {
     if (node = expr(self)) {
       // TODO: assert string or id
       if (accept(COLON)) {
-        luna_node_t *val = expr(self);
-        const char *str = ((luna_id_node_t *) node)->val;
-        luna_hash_set(args->hash, (char *) str, luna_node(val));
+        luna_node_id_t val = expr(self);
+        kv_push(uint32_t, kw, luna_ast_node(self->ast, node)->a);
+        kv_push(uint32_t, kw, val);
       }
-      luna_vec_push(args->vec, luna_node(node));
+      luna_ast_scratch(self->ast, node);
     } else {
-      return NULL;
+      kv_destroy(kw);
+      return 0;
     }
   } while (accept(COMMA));
 
   self->in_args--;
 
-  return args;
+  // positional, then (name, val) pairs
+  *args = luna_ast_list_new(self->ast, mark);
+  for (size_t i = 0; i < kv_size(kw); ++i) luna_ast_scratch(self->ast, kv_A(kw, i));
+  *pairs = luna_ast_list_new(self->ast, mark);
+  pairs->len /= 2;
+
+  kv_destroy(kw);
+  return 1;
+}
+
+/*
+ * Prepend `arg` to the args of `call`, the
+ * list is copied to the end of extra.
+ */
+
+static void
+prepend_arg(luna_ast_t *ast, luna_node_id_t call, luna_node_id_t arg) {
+  uint32_t mark = luna_ast_mark(ast);
+  uint32_t rec = luna_ast_node(ast, call)->b;
+  luna_ast_scratch(ast, arg);
+  luna_list_each(ast, luna_ast_record(ast, rec, luna_call_extra_t)->args, {
+    luna_ast_scratch(ast, id);
+  });
+  luna_list_t args = luna_ast_list_new(ast, mark);
+  luna_ast_record(ast, rec, luna_call_extra_t)->args = args;
+}
+
+/*
+ * '(' args? ')' of a call to `node`.
+ */
+
+static luna_node_id_t
+call(luna_parser_t *self, luna_node_id_t node) {
+  luna_list_t args = { 0, 0 };
+  luna_list_t pairs = { 0, 0 };
+  context("function call");
+
+  // args? ')'
+  if (!accept(RPAREN)) {
+    if (!call_args(self, &args, &pairs)) return 0;
+    if (!accept(RPAREN)) return error("missing closing ')'");
+  }
+
+  return luna_call_node_new(self->ast, node, args, pairs);
 }
 
 /*
  *   slot_access_expr '(' args? ')'
- * | slot_access_expr '.' call_expr
+ * | call_expr '.' slot_access_expr '(' args? ')'
+ * | call_expr '.' slot_access_expr
  * | slot_access_expr
+ *
+ * Method calls chain left to right, passing the
+ * receiver first, so a.b(c).d() is d(b(a, c)).
  */
 
-static luna_node_t *
+static luna_node_id_t
 call_expr(luna_parser_t *self) {
-  luna_node_t *node;
-  luna_call_node_t *call = NULL;
+  luna_node_id_t node;
   debug("call_expr");
 
   // slot_access_expr
-  if (!(node = slot_access_expr(self))) return NULL;
+  if (!(node = slot_access_expr(self))) return 0;
 
-  // '('
-  if (accept(LPAREN)) {
-    context("function call");
-    call = luna_call_node_new(node);
-
-    // args? ')'
-    if (!accept(RPAREN)) {
-      call->args = call_args(self);
-      if (!accept(RPAREN)) return error("missing closing ')'");
-    }
-
-    node = (luna_node_t *) call;
+  // '(' on the same line
+  if (!peek->newline && accept(LPAREN)) {
+    if (!(node = call(self, node))) return 0;
   }
 
-  // '.' call_expr
-  if (accept(OP_DOT)) {
+  // ('.' slot_access_expr ('(' args? ')')?)*
+  while (accept(OP_DOT)) {
     // TODO: verify slot access or call
-    luna_node_t *expr = call_expr(self);
+    luna_node_id_t expr = slot_access_expr(self);
+    if (!expr) return 0;
 
-    if (LUNA_NODE_CALL == expr->type) {
-      luna_call_node_t *call = (luna_call_node_t *) expr;
-      luna_vec_push(call->args->vec, luna_node(node));
-      node = (luna_node_t *) call;
+    if (!peek->newline && accept(LPAREN)) {
+      if (!(expr = call(self, expr))) return 0;
+      prepend_arg(self->ast, expr, node);
+      node = expr;
     } else {
-      node = (luna_node_t *) luna_slot_node_new(node, expr);
+      node = luna_slot_node_new(self->ast, node, expr);
     }
   }
 
@@ -687,7 +575,7 @@ call_expr(luna_parser_t *self) {
 }
 
 /*
- *   logical_or_expr
+ *   fork_expr
  * | 'let' call_expr '=' not_expr
  * | call_expr '=' not_expr
  * | call_expr '+=' not_expr
@@ -697,26 +585,26 @@ call_expr(luna_parser_t *self) {
  * | call_expr '||=' not_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 assignment_expr(luna_parser_t *self) {
   luna_token op;
-  luna_node_t *node, *right;
+  luna_node_id_t node, right;
   int let = 0;
 
   // let?
   if (accept(LET)) let = 1;
 
   debug("assignment_expr");
-  if (!(node = logical_or_expr(self))) return NULL;
+  if (!(node = fork_expr(self))) return 0;
 
   // =
   if (accept(OP_ASSIGN)) {
     op = prev->type;
     context("assignment");
-    if (!(right = not_expr(self))) return NULL;
-    luna_binary_op_node_t *ret = luna_binary_op_node_new(op, node, right);
-    ret->let = let;
-    return (luna_node_t *) ret;
+    if (!(right = not_expr(self))) return 0;
+    luna_node_id_t ret = luna_binary_op_node_new(self->ast, op, node, right);
+    if (let) luna_ast_node(self->ast, ret)->flags |= LUNA_NODE_LET;
+    return ret;
   }
 
   // compound
@@ -728,8 +616,8 @@ assignment_expr(luna_parser_t *self) {
     || accept(OP_AND_ASSIGN)) {
     op = prev->type;
     context("compoound assignment");
-    if (!(right = not_expr(self))) return NULL;
-    return (luna_node_t *) luna_binary_op_node_new(op, node, right);
+    if (!(right = not_expr(self))) return 0;
+    return luna_binary_op_node_new(self->ast, op, node, right);
   }
 
   return node;
@@ -740,13 +628,13 @@ assignment_expr(luna_parser_t *self) {
  * | assignment_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 not_expr(luna_parser_t *self) {
   debug("not_expr");
   if (accept(OP_LNOT)) {
-    luna_node_t *expr;
-    if (!(expr = not_expr(self))) return NULL;
-    return (luna_node_t *) luna_unary_op_node_new(LUNA_TOKEN_OP_LNOT, expr, 0);
+    luna_node_id_t expr;
+    if (!(expr = not_expr(self))) return 0;
+    return luna_unary_op_node_new(self->ast, LUNA_TOKEN_OP_LNOT, expr, 0);
   }
   return assignment_expr(self);
 }
@@ -755,11 +643,11 @@ not_expr(luna_parser_t *self) {
  *  not_expr
  */
 
-static luna_node_t *
+static luna_node_id_t
 expr(luna_parser_t *self) {
-  luna_node_t *node;
+  luna_node_id_t node;
   debug("expr");
-  if (!(node = not_expr(self))) return NULL;
+  if (!(node = not_expr(self))) return 0;
   return node;
 }
 
@@ -767,14 +655,14 @@ expr(luna_parser_t *self) {
  * expr (newline)
  */
 
-static luna_node_t *
+static luna_node_id_t
 expr_stmt(luna_parser_t *self) {
-  luna_node_t *node;
+  luna_node_id_t node;
   debug("expr_stmt");
 
-  if (!(node = expr(self))) return NULL;
+  if (!(node = expr(self))) return 0;
 
-  if (!(is(RPAREN) || is(EOS))) {
+  if (!(is(RPAREN) || is(EOS) || peek->newline)) {
     return error("missing newline");
   }
 
@@ -785,51 +673,49 @@ expr_stmt(luna_parser_t *self) {
  * 'type' id (id ':' id)*
  */
 
-static luna_node_t *
+static luna_node_id_t
 type_stmt(luna_parser_t *self) {
   debug("type_stmt");
   context("type statement");
-  luna_type_node_t *type;
+  luna_node_id_t type;
 
   // 'type'
-  if (!accept(TYPE)) return NULL;
+  if (!accept(TYPE)) return 0;
 
   // id
   if (!is(ID)) return error("missing type name");
   const char *name = next->value.as_string;
-  type = luna_type_node_new(name);
+  type = luna_type_node_new(self->ast, name);
 
   // type fields
   do {
     // id
-    if (!(is(ID))) return error("expecting field");
-    const char *name = next->value.as_string;
+    if (!accept(ID)) return error("expecting field");
 
     // ':'
     if (!accept(COLON)) return error("expecting ':'");
 
     // id
-    if (!(is(ID))) return error("expecting field type");
-    const char *type = next->value.as_string;
+    if (!accept(ID)) return error("expecting field type");
   } while (!accept(END));
 
-  return (luna_node_t *) type;
+  return type;
 }
 
 /*
  * 'def' id '(' args? ')' (':' id)? block
  */
 
-static luna_node_t *
+static luna_node_id_t
 function_stmt(luna_parser_t *self) {
-  luna_block_node_t *body;
-  luna_vec_t *params;
+  luna_node_id_t body;
+  luna_list_t params = { 0, 0 };
   const char *type = NULL;
   debug("function_stmt");
   context("function statement");
 
   // 'def'
-  if (!accept(DEF)) return NULL;
+  if (!accept(DEF)) return 0;
 
   // id
   if (!is(ID)) return error("missing function name");
@@ -838,13 +724,11 @@ function_stmt(luna_parser_t *self) {
   // '('
   if (accept(LPAREN)) {
     // params?
-    if (!(params = function_params(self))) return NULL;
+    if (!function_params(self, &params)) return 0;
 
     // ')'
     context("function");
     if (!accept(RPAREN)) return error("missing closing ')'");
-  } else {
-    params = luna_vec_new();
   }
 
   context("function");
@@ -857,10 +741,10 @@ function_stmt(luna_parser_t *self) {
 
   // block
   if (body = block(self)) {
-    return (luna_node_t *) luna_function_node_new(name, type, body, params);
+    return luna_function_node_new(self->ast, name, type, body, params);
   }
 
-  return NULL;
+  return 0;
 }
 
 /*
@@ -869,74 +753,73 @@ function_stmt(luna_parser_t *self) {
  *  ('else' block)?
  */
 
-static luna_node_t *
+static luna_node_id_t
 if_stmt(luna_parser_t *self) {
-  luna_node_t *cond;
-  luna_block_node_t *body;
+  luna_node_id_t cond, body, else_block = 0;
   debug("if_stmt");
 
   // ('if' | 'unless')
-  if (!(accept(IF) || accept(UNLESS))) return NULL;
+  if (!(accept(IF) || accept(UNLESS))) return 0;
   int negate = LUNA_TOKEN_UNLESS == prev->type;
 
   // expr
   context("if statement condition");
-  if (!(cond = expr(self))) return NULL;
+  if (!(cond = expr(self))) return 0;
 
   // block
   context("if statement");
-  if (!(body = block(self))) return NULL;
+  if (!(body = block(self))) return 0;
 
-  luna_if_node_t *node = luna_if_node_new(negate, cond, body);
+  uint32_t mark = luna_ast_mark(self->ast);
 
   // 'else'
   loop:
   if (accept(ELSE)) {
-    luna_block_node_t *body;
+    luna_node_id_t cond, body;
 
     // ('else' 'if' block)*
     if (accept(IF)) {
       context("else if statement condition");
-      if (!(cond = expr(self))) return NULL;
+      if (!(cond = expr(self))) return 0;
       context("else if statement");
-      if (!(body = block(self))) return NULL;
-      luna_vec_push(node->else_ifs, luna_node((luna_node_t *) luna_if_node_new(0, cond, body)));
+      if (!(body = block(self))) return 0;
+      luna_ast_scratch(self->ast, luna_if_node_new(self->ast, 0, cond, body, (luna_list_t) { 0, 0 }, 0));
       goto loop;
     // 'else'
     } else {
       context("else statement");
-      if (!(body = block(self))) return NULL;
-      node->else_block = body;
+      if (!(body = block(self))) return 0;
+      else_block = body;
     }
 
   }
 
-  return (luna_node_t *) node;
+  luna_list_t else_ifs = luna_ast_list_new(self->ast, mark);
+  return luna_if_node_new(self->ast, negate, cond, body, else_ifs, else_block);
 }
 
 /*
  * ('while' | 'until') expr block
  */
 
-static luna_node_t *
+static luna_node_id_t
 while_stmt(luna_parser_t *self) {
-  luna_node_t *cond;
-  luna_block_node_t *body;
+  luna_node_id_t cond, body;
   debug("while_stmt");
 
   // ('until' | 'while')
-  if (!(accept(UNTIL) || accept(WHILE))) return NULL;
+  if (!(accept(UNTIL) || accept(WHILE))) return 0;
   int negate = LUNA_TOKEN_UNTIL == prev->type;
   context("while statement condition");
 
   // expr
-  if (!(cond = expr(self))) return NULL;
+  if (!(cond = expr(self))) return 0;
   context("while statement");
 
   // block
-  if (!(body = block(self))) return NULL;
+  if (!(body = block(self))) return 0;
 
-  return (luna_node_t *) luna_while_node_new(negate, cond, body);
+  return luna_while_node_new(self->ast, negate, cond, body);
 }
 
 /*
@@ -944,18 +827,18 @@ while_stmt(luna_parser_t *self) {
  * | 'return'
  */
 
-static luna_node_t *
+static luna_node_id_t
 return_stmt(luna_parser_t *self) {
   debug("return");
   context("return statement");
 
   // 'return'
-  if (!accept(RETURN)) return NULL;
+  if (!accept(RETURN)) return 0;
 
   // 'return' expr
-  luna_node_t *node;
-  if (!(node = expr(self))) return NULL;
-  return (luna_node_t *) luna_return_node_new(node);
+  luna_node_id_t node;
+  if (!(node = expr(self))) return 0;
+  return luna_return_node_new(self->ast, node);
 }
 
 /*
@@ -967,65 +850,72 @@ return_stmt(luna_parser_t *self) {
  * | expr_stmt
  */
 
-static luna_node_t *
+static luna_node_id_t
 stmt(luna_parser_t *self) {
+  luna_node_id_t node;
   debug("stmt");
   context("statement");
-  if (is(IF) || is(UNLESS)) return if_stmt(self);
-  if (is(WHILE) || is(UNTIL)) return while_stmt(self);
-  if (is(RETURN)) return return_stmt(self);
-  if (is(DEF)) return function_stmt(self);
-  if (is(TYPE)) return type_stmt(self);
-  return expr_stmt(self);
+
+  // line of the first token
+  int lineno = (peek, self->lex->lineno);
+
+  if (is(IF) || is(UNLESS)) node = if_stmt(self);
+  else if (is(WHILE) || is(UNTIL)) node = while_stmt(self);
+  else if (is(RETURN)) node = return_stmt(self);
+  else if (is(DEF)) node = function_stmt(self);
+  else if (is(TYPE)) node = type_stmt(self);
+  else node = expr_stmt(self);
+
+  if (node) luna_ast_node(self->ast, node)->lineno = lineno;
+  return node;
 }
 
 /*
  * ws (stmt ws)+ 'end'
  */
 
-static luna_block_node_t *
+static luna_node_id_t
 block(luna_parser_t *self) {
   debug("block");
-  luna_node_t *node;
-  luna_block_node_t *block = luna_block_node_new();
-
-  if (accept(END)) return block;
-
-  do {
-    if (!(node = stmt(self))) return NULL;
-    luna_vec_push(block->stmts, luna_node(node));
-  } while (!accept(END));
+  luna_node_id_t node;
+  uint32_t mark = luna_ast_mark(self->ast);
+
+  if (!accept(END)) {
+    do {
+      if (!(node = stmt(self))) return 0;
+      luna_ast_scratch(self->ast, node);
+    } while (!accept(END));
+  }
 
-  return block;
+  return luna_block_node_new(self->ast, luna_ast_list_new(self->ast, mark));
 }
 
 /*
  * ws (stmt ws)*
  */
 
-static luna_block_node_t *
+static luna_node_id_t
 program(luna_parser_t *self) {
   debug("program");
-  luna_node_t *node;
-  luna_block_node_t *block = luna_block_node_new();
+  luna_node_id_t node;
+  uint32_t mark = luna_ast_mark(self->ast);
 
   while (!accept(EOS)) {
     if (node = stmt(self)) {
-      luna_vec_push(block->stmts, luna_node(node));
+      luna_ast_scratch(self->ast, node);
     } else {
-      return NULL;
+      return 0;
     }
   }
 
-  return block;
+  return luna_block_node_new(self->ast, luna_ast_list_new(self->ast, mark));
 }
 
 /*
- * Parse input.
+ * Parse input, returning the root block or 0.
  */
 
-luna_block_node_t *
+luna_node_id_t
 luna_parse(luna_parser_t *self) {
   return program(self);
 }
-
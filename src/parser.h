@@ -23,14 +23,15 @@ typedef struct {
   luna_token_t *la;
   luna_token_t lb;
   luna_lexer_t *lex;
+  luna_ast_t *ast;
 } luna_parser_t;
 
 // protos
 
 void
-luna_parser_init(luna_parser_t *self, luna_lexer_t *lex);
+luna_parser_init(luna_parser_t *self, luna_lexer_t *lex, luna_ast_t *ast);
 
-luna_block_node_t *
+luna_node_id_t
 luna_parse(luna_parser_t *self);
 
 #endif /* __LUNA_PARSER__ */
\ No newline at end of file
@@ -0,0 +1,371 @@
+
+//
+// peephole.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include "peephole.h"
+#include "opcodes.h"
+#include "internal.h"
+
+/*
+ * Instruction with its jump resolved to an absolute
+ * target, or -1 when it does not jump.
+ */
+
+typedef struct {
+  luna_instruction_t i;
+  int target;
+  int dead;
+} insn_t;
+
+/*
+ * Check if `i` is a compare-and-branch.
+ */
+
+static int
+is_branch(luna_instruction_t i) {
+  switch (OP(i)) {
+    case LUNA_OP_JEQ:
+    case LUNA_OP_JLT:
+    case LUNA_OP_JLTE:
+    case LUNA_OP_JNEQ:
+    case LUNA_OP_JNLT:
+    case LUNA_OP_JNLTE:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Return the jump offset of `i`, or 0 when it does not jump.
+ */
+
+static int
+offset(luna_instruction_t i) {
+  switch (OP(i)) {
+    case LUNA_OP_JMP:
+    case LUNA_OP_JTRUE:
+    case LUNA_OP_JFALSE:
+    case LUNA_OP_FORK:
+      return SB(i);
+  }
+  return is_branch(i) ? SA(i) : 0;
+}
+
+/*
+ * Check if `i` jumps.
+ */
+
+static int
+is_jump(luna_instruction_t i) {
+  switch (OP(i)) {
+    case LUNA_OP_JMP:
+    case LUNA_OP_JTRUE:
+    case LUNA_OP_JFALSE:
+    case LUNA_OP_FORK:
+      return 1;
+  }
+  return is_branch(i);
+}
+
+/*
+ * Check if `i` may skip the instruction following it,
+ * which must then stay where it is.
+ */
+
+static int
+skips(luna_instruction_t i) {
+  switch (OP(i)) {
+    case LUNA_OP_EQ:
+    case LUNA_OP_LT:
+    case LUNA_OP_LTE:
+    case LUNA_OP_TEST:
+      return 1;
+    case LUNA_OP_LOADB:
+      return C(i);
+  }
+  return 0;
+}
+
+/*
+ * Return the register written by `i`, or -1.
+ */
+
+static int
+writes(luna_instruction_t i) {
+  switch (OP(i)) {
+    case LUNA_OP_LOADK:
+    case LUNA_OP_LOADB:
+    case LUNA_OP_MOVE:
+    case LUNA_OP_ADD:
+    case LUNA_OP_SUB:
+    case LUNA_OP_DIV:
+    case LUNA_OP_MUL:
+    case LUNA_OP_MOD:
+    case LUNA_OP_POW:
+    case LUNA_OP_NEGATE:
+    case LUNA_OP_BIT_NOT:
+    case LUNA_OP_BIT_SHL:
+    case LUNA_OP_BIT_SHR:
+    case LUNA_OP_BIT_AND:
+    case LUNA_OP_BIT_OR:
+    case LUNA_OP_BIT_XOR:
+    case LUNA_OP_JOIN:
+    case LUNA_OP_SLEEP:
+    case LUNA_OP_CAT:
+    case LUNA_OP_DELETE:
+    case LUNA_OP_STAT:
+    case LUNA_OP_WRITE:
+    case LUNA_OP_STREAM:
+    case LUNA_OP_DRAIN:
+      return A(i);
+  }
+  return -1;
+}
+
+/*
+ * Check if `i` reads register `r`, FORK reading
+ * whichever registers its task captures.
+ */
+
+static int
+reads(luna_instruction_t i, int r) {
+  switch (OP(i)) {
+    case LUNA_OP_FORK:
+      return 1;
+    case LUNA_OP_LOADK:
+    case LUNA_OP_LOADB:
+    case LUNA_OP_JMP:
+      return 0;
+    case LUNA_OP_HALT:
+    case LUNA_OP_TEST:
+    case LUNA_OP_JTRUE:
+    case LUNA_OP_JFALSE:
+    case LUNA_OP_PRINT:
+      return A(i) == r;
+    case LUNA_OP_GREP:
+      return A(i) == r || B(i) == r;
+    case LUNA_OP_MOVE:
+    case LUNA_OP_NEGATE:
+    case LUNA_OP_BIT_NOT:
+    case LUNA_OP_SLEEP:
+    case LUNA_OP_CAT:
+    case LUNA_OP_DELETE:
+    case LUNA_OP_STAT:
+    case LUNA_OP_STREAM:
+    case LUNA_OP_DRAIN:
+      return B(i) == r;
+  }
+  return B(i) == r || C(i) == r;
+}
+
+/*
+ * Return the live instruction after `pc`, or `n`.
+ */
+
+static int
+next_live(insn_t *code, int n, int pc) {
+  while (++pc < n && code[pc].dead) ;
+  return pc;
+}
+
+/*
+ * Return the live instruction before `pc`, or -1.
+ */
+
+static int
+prev_live(insn_t *code, int pc) {
+  while (--pc >= 0 && code[pc].dead) ;
+  return pc;
+}
+
+/*
+ * Check if the instruction at `pc` may be removed
+ * without changing what a preceding skip skips.
+ */
+
+static int
+removable(insn_t *code, int pc) {
+  int prev = prev_live(code, pc);
+  return prev < 0 || !skips(code[prev].i);
+}
+
+/*
+ * Retarget jumps landing on an unconditional
+ * jump to that jump's target. FORK stays put,
+ * its captures sit right before its target.
+ */
+
+static void
+thread_jumps(insn_t *code, int n) {
+  for (int pc = 0; pc < n; ++pc) {
+    int hops = 0;
+    int target = code[pc].target;
+    if (target < 0 || LUNA_OP_FORK == OP(code[pc].i)) continue;
+    while (target < n
+      && LUNA_OP_JMP == OP(code[target].i)
+      && target != code[target].target
+      && hops++ < n) target = code[target].target;
+    code[pc].target = target;
+  }
+}
+
+/*
+ * Remove unconditional jumps to the next instruction.
+ */
+
+static void
+drop_jumps(insn_t *code, int n) {
+  for (int pc = 0; pc < n; ++pc) {
+    if (LUNA_OP_JMP != OP(code[pc].i) || code[pc].dead) continue;
+    if (next_live(code, n, pc) != code[pc].target) continue;
+    if (removable(code, pc)) code[pc].dead = 1;
+  }
+}
+
+/*
+ * Fuse a compare or TEST followed by a JMP into one
+ * conditional branch. The pair jumps when the compare
+ * equals A, or the truthiness of R(A) equals C.
+ */
+
+static void
+fuse_branches(insn_t *code, int n, int *targeted) {
+  static const luna_op_t taken[] = {
+    [LUNA_OP_EQ] = LUNA_OP_JEQ,
+    [LUNA_OP_LT] = LUNA_OP_JLT,
+    [LUNA_OP_LTE] = LUNA_OP_JLTE
+  };
+
+  static const luna_op_t not_taken[] = {
+    [LUNA_OP_EQ] = LUNA_OP_JNEQ,
+    [LUNA_OP_LT] = LUNA_OP_JNLT,
+    [LUNA_OP_LTE] = LUNA_OP_JNLTE
+  };
+
+  for (int pc = 0; pc < n; ++pc) {
+    luna_instruction_t i = code[pc].i;
+    if (code[pc].dead || !skips(i) || LUNA_OP_LOADB == OP(i)) continue;
+
+    int jmp = next_live(code, n, pc);
+    if (jmp == n || LUNA_OP_JMP != OP(code[jmp].i)) continue;
+    if (targeted[jmp] || !removable(code, pc)) continue;
+
+    int target = code[jmp].target;
+    int off = target - pc - 1;
+
+    if (LUNA_OP_TEST == OP(i)) {
+      code[pc].i = ENCODE(C(i) ? LUNA_OP_JTRUE : LUNA_OP_JFALSE, A(i), off, 0);
+    } else {
+      if (off < -LUNA_MAX_SHORT_JUMP || off > LUNA_MAX_SHORT_JUMP) continue;
+      luna_op_t op = A(i) ? taken[OP(i)] : not_taken[OP(i)];
+      code[pc].i = ENCODE(op, off, B(i), C(i));
+    }
+
+    code[pc].target = target;
+    code[jmp].dead = 1;
+  }
+}
+
+/*
+ * Remove self-moves, and loads overwritten by the
+ * next instruction before being read.
+ */
+
+static void
+drop_stores(insn_t *code, int n) {
+  for (int pc = 0; pc < n; ++pc) {
+    luna_instruction_t i = code[pc].i;
+    if (code[pc].dead) continue;
+
+    switch (OP(i)) {
+      case LUNA_OP_MOVE:
+        if (A(i) == B(i)) {
+          if (removable(code, pc)) code[pc].dead = 1;
+          continue;
+        }
+        break;
+      case LUNA_OP_LOADB:
+        if (C(i)) continue;
+        break;
+      case LUNA_OP_LOADK:
+        break;
+      default:
+        continue;
+    }
+
+    int next = next_live(code, n, pc);
+    if (next == n) continue;
+    luna_instruction_t j = code[next].i;
+    if (writes(j) == A(i) && !reads(j, A(i)) && removable(code, pc)) {
+      code[pc].dead = 1;
+    }
+  }
+}
+
+/*
+ * Optimize the code of `fn` from `start` in place, returning
+ * the number of instructions eliminated. Code before `start`
+ * is left alone, so appending to `fn` only costs the new code.
+ */
+
+int
+luna_peephole(luna_activation_t *fn, int start) {
+  int n = kv_size(fn->code) - start;
+  int len = 0;
+  luna_instruction_t *base = fn->code.a + start;
+  uint32_t *lines = fn->lines.a + start;
+  insn_t *code = malloc(n * sizeof(insn_t));
+  int *targeted = calloc(n + 1, sizeof(int));
+  int *map = malloc((n + 1) * sizeof(int));
+  if (unlikely(!code || !targeted || !map)) goto done;
+
+  // decode
+  for (int pc = 0; pc < n; ++pc) {
+    luna_instruction_t i = base[pc];
+    code[pc].i = i;
+    code[pc].dead = 0;
+    code[pc].target = is_jump(i) ? pc + 1 + offset(i) : -1;
+  }
+
+  thread_jumps(code, n);
+  drop_jumps(code, n);
+
+  for (int pc = 0; pc < n; ++pc) {
+    if (!code[pc].dead && code[pc].target >= 0) ++targeted[code[pc].target];
+  }
+
+  fuse_branches(code, n, targeted);
+  drop_stores(code, n);
+
+  // removed instructions map to their next live one
+  for (int pc = 0; pc < n; ++pc) map[pc] = code[pc].dead ? -1 : len++;
+  map[n] = len;
+  for (int pc = n - 1; pc >= 0; --pc) if (map[pc] < 0) map[pc] = map[pc + 1];
+
+  // compact, re-encoding jumps
+  for (int pc = 0; pc < n; ++pc) {
+    if (code[pc].dead) continue;
+    luna_instruction_t i = code[pc].i;
+    if (code[pc].target >= 0) {
+      int off = map[code[pc].target] - map[pc] - 1;
+      i = is_branch(i)
+        ? ENCODE(OP(i), off, B(i), C(i))
+        : ENCODE(OP(i), A(i), off, C(i));
+    }
+    base[map[pc]] = i;
+    lines[map[pc]] = lines[pc];
+  }
+
+  fn->code.n = start + len;
+  fn->lines.n = start + len;
+
+done:
+  free(code);
+  free(targeted);
+  free(map);
+  return len ? n - len : 0;
+}
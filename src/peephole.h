@@ -0,0 +1,16 @@
+
+//
+// peephole.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_PEEPHOLE__
+#define __LUNA_PEEPHOLE__
+
+#include "vm.h"
+
+int
+luna_peephole(luna_activation_t *fn, int start);
+
+#endif /* __LUNA_PEEPHOLE__ */
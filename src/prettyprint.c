@@ -97,273 +97,361 @@ inspect(const char *str) {
  * Visit block `node`.
  */
 
-static void
-visit_block(luna_visitor_t *self, luna_block_node_t *node) {
-  luna_vec_each(node->stmts, {
-    if (i) printf("\n");
-    INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
-    if (!indents) printf("\n");
-  });
+static luna_node_id_t
+visit_block(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_list_t stmts = luna_ast_list(node);
+  if (step && !indents) printf("\n");
+  if (step == stmts.len) return 0;
+  if (step) printf("\n");
+  INDENT;
+  return luna_ast_extra(self->ast, stmts.start + step);
 }
 
 /*
  * Visit int `node`.
  */
 
-static void
-visit_int(luna_visitor_t *self, luna_int_node_t *node) {
-  printf("(int %d)", node->val);
+static luna_node_id_t
+visit_int(luna_visitor_t *self, luna_node_t *node, int step) {
+  printf("(int %d)", (int32_t) node->a);
+  return 0;
 }
 
 /*
  * Visit float `node`.
  */
 
-static void
-visit_float(luna_visitor_t *self, luna_float_node_t *node) {
-  printf("(float %f)", node->val);
+static luna_node_id_t
+visit_float(luna_visitor_t *self, luna_node_t *node, int step) {
+  printf("(float %f)", luna_ast_literal(self->ast, node->a));
+  return 0;
+}
+
+/*
+ * Visit bool `node`.
+ */
+
+static luna_node_id_t
+visit_bool(luna_visitor_t *self, luna_node_t *node, int step) {
+  printf("(bool %s)", node->a ? "true" : "false");
+  return 0;
 }
 
 /*
  * Visit id `node`.
  */
 
-static void
-visit_id(luna_visitor_t *self, luna_id_node_t *node) {
-  printf("(id %s)", node->val);
+static luna_node_id_t
+visit_id(luna_visitor_t *self, luna_node_t *node, int step) {
+  printf("(id %s)", luna_ast_name(self->ast, node->a));
+  return 0;
 }
 
 /*
  * Visit decl `node`.
  */
 
-static void
-visit_decl(luna_visitor_t *self, luna_decl_node_t *node) {
-  printf("(decl %s:%s", node->name, node->type ? node->type : "");
-  if (node->val) visit(node->val);
+static luna_node_id_t
+visit_decl(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_decl_extra_t *decl = luna_ast_record(self->ast, node->b, luna_decl_extra_t);
+  if (0 == step) {
+    const char *type = luna_ast_name(self->ast, decl->type);
+    printf("(decl %s:%s", luna_ast_name(self->ast, node->a), type ? type : "");
+    if (decl->val) return decl->val;
+  }
   printf(")");
+  return 0;
 }
 
 /*
  * Visit string `node`.
  */
 
-static void
-visit_string(luna_visitor_t *self, luna_string_node_t *node) {
-  printf("(string '%s')", inspect(node->val));
+static luna_node_id_t
+visit_string(luna_visitor_t *self, luna_node_t *node, int step) {
+  printf("(string '%s')", inspect(luna_ast_name(self->ast, node->a)));
+  return 0;
 }
 
 /*
  * Visit unary op `node`.
  */
 
-static void
-visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
-  int c = node->postfix ? '@' : 0;
-  printf("(%c%s ", c, luna_token_type_string(node->op));
-  visit(node->expr);
+static luna_node_id_t
+visit_unary_op(luna_visitor_t *self, luna_node_t *node, int step) {
+  if (0 == step) {
+    int c = node->flags & LUNA_NODE_POSTFIX ? '@' : 0;
+    printf("(%c%s ", c, luna_token_type_string(node->op));
+    return node->a;
+  }
   printf(")");
+  return 0;
 }
 
 /*
  * Visit binary op `node`.
  */
 
-static void
-visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
-  if (node->let) {
-    printf("(let %s ", luna_token_type_string(node->op));
-  } else {
-    printf("(%s ", luna_token_type_string(node->op));
+static luna_node_id_t
+visit_binary_op(luna_visitor_t *self, luna_node_t *node, int step) {
+  switch (step) {
+    case 0:
+      if (node->flags & LUNA_NODE_LET) {
+        printf("(let %s ", luna_token_type_string(node->op));
+      } else {
+        printf("(%s ", luna_token_type_string(node->op));
+      }
+      return node->a;
+    case 1:
+      printf(" ");
+      return node->b;
   }
-  visit(node->left);
-  printf(" ");
-  visit(node->right);
   printf(")");
+  return 0;
 }
 
 /*
  * Visit array `node`.
  */
 
-static void
-visit_array(luna_visitor_t *self, luna_array_node_t *node) {
-  printf("(array\n");
-  ++indents;
-  luna_vec_each(node->vals, {
-    INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
-    if (i != len - 1) printf("\n");
-  });
-  --indents;
-  printf(")");
+static luna_node_id_t
+visit_array(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_list_t vals = luna_ast_list(node);
+  if (0 == step) {
+    printf("(array\n");
+    ++indents;
+  }
+  if (step == vals.len) {
+    --indents;
+    printf(")");
+    return 0;
+  }
+  if (step) printf("\n");
+  INDENT;
+  return luna_ast_extra(self->ast, vals.start + step);
 }
 
 /*
  * Visit hash `node`.
  */
 
-static void
-visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
-  printf("(hash\n");
-  ++indents;
-  luna_hash_each(node->vals, {
-    INDENT;
-    printf("%s: ", slot);
-    visit((luna_node_t *) val->value.as_pointer);
+static luna_node_id_t
+visit_hash(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_list_t pairs = luna_ast_list(node);
+  if (0 == step) {
+    printf("(hash\n");
+    ++indents;
+  } else {
     printf("\n");
-  });
-  --indents;
-  printf(")");
+  }
+  if (step == pairs.len) {
+    --indents;
+    printf(")");
+    return 0;
+  }
+  INDENT;
+  printf("%s: ", luna_ast_name(self->ast, luna_ast_extra(self->ast, pairs.start + 2 * step)));
+  return luna_ast_extra(self->ast, pairs.start + 2 * step + 1);
 }
 
 /*
  * Visit slot `node`.
  */
 
-static void
-visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
-  printf("(slot\n");
-  ++indents;
-  INDENT;
-  visit(node->left);
-  printf("\n");
-  INDENT;
-  visit(node->right);
+static luna_node_id_t
+visit_slot(luna_visitor_t *self, luna_node_t *node, int step) {
+  switch (step) {
+    case 0:
+      printf("(slot\n");
+      ++indents;
+      INDENT;
+      return node->a;
+    case 1:
+      printf("\n");
+      INDENT;
+      return node->b;
+  }
   --indents;
   printf(")");
+  return 0;
 }
 
 /*
- * Visit call `node`.
+ * Visit call `node`, keyword args are only
+ * printed along with positional ones.
  */
 
-static void
-visit_call(luna_visitor_t *self, luna_call_node_t * node) {
-  printf("(call\n");
-  ++indents;
-  INDENT;
-  visit((luna_node_t *) node->expr);
-  if (luna_vec_length(node->args->vec)) {
-    printf("\n");
+static luna_node_id_t
+visit_call(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_call_extra_t *call = luna_ast_record(self->ast, node->b, luna_call_extra_t);
+  int nargs = call->args.len;
+  int pair = step - nargs - 1;
+
+  // expr
+  if (0 == step) {
+    printf("(call\n");
+    ++indents;
     INDENT;
-    luna_vec_each(node->args->vec, {
-      visit((luna_node_t *) val->value.as_pointer);
-      if (i != len - 1) printf(" ");
-    });
-
-    luna_hash_each(node->args->hash, {
-      printf(" %s: ", slot);
-      visit((luna_node_t *) val->value.as_pointer);
-    });
+    return node->a;
+  }
+
+  // args
+  if (step <= nargs) {
+    if (1 == step) {
+      printf("\n");
+      INDENT;
+    } else {
+      printf(" ");
+    }
+    return luna_ast_extra(self->ast, call->args.start + step - 1);
   }
+
+  // keyword args
+  if (nargs && pair < call->pairs.len) {
+    const char *slot = luna_ast_name(self->ast, luna_ast_extra(self->ast, call->pairs.start + 2 * pair));
+    printf(" %s: ", slot);
+    return luna_ast_extra(self->ast, call->pairs.start + 2 * pair + 1);
+  }
+
   --indents;
   printf(")");
+  return 0;
 }
 
 /*
  * Visit function `node`.
  */
 
-static void
-visit_function(luna_visitor_t *self, luna_function_node_t * node) {
-  printf("(function %s -> %s", node->name, node->type ? node->type : "");
-  ++indents;
-  luna_vec_each(node->params, {
+static luna_node_id_t
+visit_function(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_function_extra_t *fn = luna_ast_record(self->ast, node->b, luna_function_extra_t);
+
+  if (0 == step) {
+    const char *type = luna_ast_name(self->ast, fn->type);
+    printf("(function %s -> %s", luna_ast_name(self->ast, node->a), type ? type : "");
+    ++indents;
+  }
+
+  // params
+  if (step < fn->params.len) {
     printf("\n");
     INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
-  });
-  --indents;
-  printf("\n");
-  ++indents;
-  visit((luna_node_t *) node->block);
+    return luna_ast_extra(self->ast, fn->params.start + step);
+  }
+
+  // block
+  if (step == fn->params.len) {
+    --indents;
+    printf("\n");
+    ++indents;
+    return fn->block;
+  }
+
   --indents;
   printf(")");
+  return 0;
 }
 
 /*
  * Visit `while` node.
  */
 
-static void
-visit_while(luna_visitor_t *self, luna_while_node_t *node) {
-  // while | until
-  printf("(%s ", node->negate ? "until" : "while");
-  visit((luna_node_t *) node->expr);
-  ++indents;
-  printf("\n");
-  visit((luna_node_t *) node->block);
+static luna_node_id_t
+visit_while(luna_visitor_t *self, luna_node_t *node, int step) {
+  switch (step) {
+    case 0:
+      // while | until
+      printf("(%s ", node->flags & LUNA_NODE_NEGATE ? "until" : "while");
+      return node->a;
+    case 1:
+      ++indents;
+      printf("\n");
+      return node->b;
+  }
   --indents;
   printf(")\n");
+  return 0;
 }
 
 /*
  * Visit `return` node.
  */
 
-static void
-visit_return(luna_visitor_t *self, luna_return_node_t *node) {
-  printf("(return");
-  if (node->expr) {
-    ++indents;
-    printf("\n");
-    INDENT;
-    visit((luna_node_t *) node->expr);
+static luna_node_id_t
+visit_return(luna_visitor_t *self, luna_node_t *node, int step) {
+  if (0 == step) {
+    printf("(return");
+    if (node->a) {
+      ++indents;
+      printf("\n");
+      INDENT;
+      return node->a;
+    }
+  } else {
     --indents;
   }
   printf(")");
+  return 0;
 }
 
 /*
- * Visit if `node`.
+ * Visit if `node`. Each branch takes two steps, its
+ * condition then its block.
  */
 
-static void
-visit_if(luna_visitor_t *self, luna_if_node_t *node) {
+static luna_node_id_t
+visit_if(luna_visitor_t *self, luna_node_t *node, int step) {
+  luna_if_extra_t *stmt = luna_ast_record(self->ast, node->b, luna_if_extra_t);
+  int nelse_ifs = stmt->else_ifs.len;
+
   // if
-  printf("(%s ", node->negate ? "unless" : "if");
-  visit((luna_node_t *) node->expr);
-  ++indents;
-  printf("\n");
-  visit((luna_node_t *) node->block);
+  if (0 == step) {
+    printf("(%s ", node->flags & LUNA_NODE_NEGATE ? "unless" : "if");
+    return node->a;
+  }
+
+  // block of the if or an else if
+  if (step & 1 && step <= 2 * nelse_ifs + 1) {
+    luna_node_t *branch = 1 == step
+      ? node
+      : luna_ast_node(self->ast, luna_ast_extra(self->ast, stmt->else_ifs.start + step / 2 - 1));
+    ++indents;
+    printf("\n");
+    return luna_ast_record(self->ast, branch->b, luna_if_extra_t)->block;
+  }
+
   --indents;
   printf(")");
 
   // else ifs
-  luna_vec_each(node->else_ifs, {
-    luna_if_node_t *else_if = (luna_if_node_t *) val->value.as_pointer;
+  if (step <= 2 * nelse_ifs) {
+    luna_node_t *else_if = luna_ast_node(self->ast, luna_ast_extra(self->ast, stmt->else_ifs.start + step / 2 - 1));
     printf("\n");
     INDENT;
     printf("(else if ");
-    visit((luna_node_t *) else_if->expr);
-    ++indents;
-    printf("\n");
-    visit((luna_node_t *) else_if->block);
-    --indents;
-    printf(")");
-  });
+    return else_if->a;
+  }
 
   // else
-  if (node->else_block) {
+  if (step == 2 * nelse_ifs + 2 && stmt->else_block) {
     printf("\n");
     INDENT;
     printf("(else\n");
     ++indents;
-    visit((luna_node_t *) node->else_block);
-    --indents;
-    printf(")");
+    return stmt->else_block;
   }
+
+  return 0;
 }
 
 /*
- * Pretty-print the given `node` to stdout.
+ * Pretty-print node `id` of `ast` to stdout.
  */
 
 void
-luna_prettyprint(luna_node_t *node) {
+luna_prettyprint(luna_ast_t *ast, luna_node_id_t id) {
   luna_visitor_t visitor = {
+    .ast = ast,
     .visit_if = visit_if,
     .visit_id = visit_id,
     .visit_int = visit_int,
@@ -375,6 +463,7 @@ luna_prettyprint(luna_node_t *node) {
     .visit_block = visit_block,
     .visit_decl = visit_decl,
     .visit_float = visit_float,
+    .visit_bool = visit_bool,
     .visit_string = visit_string,
     .visit_return = visit_return,
     .visit_function = visit_function,
@@ -382,7 +471,7 @@ luna_prettyprint(luna_node_t *node) {
     .visit_binary_op = visit_binary_op
   };
 
-  luna_visit(&visitor, node);
+  luna_visit(&visitor, id);
 
   printf("\n");
 }
@@ -11,6 +11,6 @@
 #include "ast.h"
 
 void
-luna_prettyprint(luna_node_t *node);
+luna_prettyprint(luna_ast_t *ast, luna_node_id_t id);
 
 #endif /* __LUNA_PP__ */
\ No newline at end of file
@@ -0,0 +1,313 @@
+
+//
+// reactor.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "reactor.h"
+#include "internal.h"
+
+/*
+ * Nanoseconds of the monotonic clock.
+ */
+
+static uint64_t
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Requeue `task` on worker `w`, no longer parked.
+ */
+
+static void
+wake(luna_reactor_t *self, luna_worker_t *w, luna_task_t *task) {
+  __atomic_sub_fetch(&self->parked, 1, __ATOMIC_RELEASE);
+  luna_sched_wake(w, task);
+}
+
+/*
+ * Arm `timerfd` for the earliest timer,
+ * disarming it when there is none.
+ */
+
+static void
+arm(luna_reactor_t *self) {
+  uint64_t deadline = kv_size(self->timers) ? kv_A(self->timers, 0).deadline : 0;
+  if (deadline == self->armed) return;
+  struct itimerspec its = { .it_value = {
+    .tv_sec = deadline / 1000000000,
+    .tv_nsec = deadline % 1000000000
+  }};
+  timerfd_settime(self->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+  self->armed = deadline;
+}
+
+/*
+ * Push `timer` onto the heap.
+ */
+
+static void
+heap_push(luna_reactor_t *self, luna_timer_t timer) {
+  kv_push(luna_timer_t, self->timers, timer);
+  luna_timer_t *heap = self->timers.a;
+  int i = kv_size(self->timers) - 1;
+  while (i) {
+    int parent = (i - 1) / 2;
+    if (heap[parent].deadline <= timer.deadline) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = timer;
+}
+
+/*
+ * Pop the earliest timer off the heap.
+ */
+
+static luna_timer_t
+heap_pop(luna_reactor_t *self) {
+  luna_timer_t *heap = self->timers.a;
+  luna_timer_t top = heap[0];
+  luna_timer_t last = kv_pop(self->timers);
+  int n = kv_size(self->timers);
+
+  for (int i = 0; n; ) {
+    int child = 2 * i + 1;
+    if (child >= n) {
+      heap[i] = last;
+      break;
+    }
+    if (child + 1 < n && heap[child + 1].deadline < heap[child].deadline) ++child;
+    if (last.deadline <= heap[child].deadline) {
+      heap[i] = last;
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+
+  return top;
+}
+
+/*
+ * Wake the tasks whose timers expired onto `w`,
+ * returning how many.
+ */
+
+static int
+expire(luna_reactor_t *self, luna_worker_t *w) {
+  uint64_t expirations;
+  int woken = 0;
+  read(self->timerfd, &expirations, sizeof(expirations));
+
+  pthread_mutex_lock(&self->lock);
+  self->armed = 0;
+  uint64_t t = now();
+  while (kv_size(self->timers) && kv_A(self->timers, 0).deadline <= t) {
+    wake(self, w, heap_pop(self).task);
+    ++woken;
+  }
+  arm(self);
+  pthread_mutex_unlock(&self->lock);
+
+  return woken;
+}
+
+/*
+ * Alloc a reactor, or NULL on failure.
+ */
+
+luna_reactor_t *
+luna_reactor_new() {
+  luna_reactor_t *self = malloc(sizeof(luna_reactor_t));
+  if (unlikely(!self)) return NULL;
+
+  self->fd = epoll_create1(EPOLL_CLOEXEC);
+  self->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  self->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  self->parked = 0;
+  self->polling = 0;
+  self->armed = 0;
+  pthread_mutex_init(&self->lock, NULL);
+  kv_init(self->timers);
+
+  // $LUNA_IO=threads skips io_uring
+  const char *io = getenv("LUNA_IO");
+  int aio = luna_aio_init(&self->aio, io && !strcmp("threads", io)
+    ? LUNA_AIO_THREADS
+    : LUNA_AIO_URING);
+
+  // the timer is told apart by its NULL data
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  struct epoll_event done = { .events = EPOLLIN, .data.ptr = &self->aio };
+  struct epoll_event wake = { .events = EPOLLIN, .data.ptr = &self->wakefd };
+  if (self->fd < 0 || self->timerfd < 0 || self->wakefd < 0 || aio
+    || epoll_ctl(self->fd, EPOLL_CTL_ADD, self->timerfd, &ev)
+    || epoll_ctl(self->fd, EPOLL_CTL_ADD, self->aio.fd, &done)
+    || epoll_ctl(self->fd, EPOLL_CTL_ADD, self->wakefd, &wake)) {
+    luna_reactor_free(self);
+    return NULL;
+  }
+
+  return self;
+}
+
+/*
+ * Free the reactor, which must have no tasks parked.
+ */
+
+void
+luna_reactor_free(luna_reactor_t *self) {
+  if (self->fd >= 0) close(self->fd);
+  if (self->timerfd >= 0) close(self->timerfd);
+  if (self->wakefd >= 0) close(self->wakefd);
+  luna_aio_free(&self->aio);
+  pthread_mutex_destroy(&self->lock);
+  kv_destroy(self->timers);
+  free(self);
+}
+
+/*
+ * Park `task` for `ms` milliseconds, returning 1. NaN and
+ * negative durations are 0, and long ones end at the
+ * latest deadline a timespec holds.
+ */
+
+int
+luna_reactor_sleep(luna_reactor_t *self, luna_task_t *task, double ms) {
+  uint64_t t = now();
+  uint64_t max = INT64_MAX - t;
+  double ns = ms > 0 ? ms * 1e6 : 0;
+  luna_timer_t timer = { t + (ns < max ? (uint64_t) ns : max), task };
+  pthread_mutex_lock(&self->lock);
+  __atomic_add_fetch(&self->parked, 1, __ATOMIC_RELEASE);
+  heap_push(self, timer);
+  arm(self);
+  pthread_mutex_unlock(&self->lock);
+  return 1;
+}
+
+/*
+ * Queue file operation `type` on `path` for `task`, with
+ * `len` bytes of `data` to write, parking it until its
+ * result is stored to `dest`. Returns 0 when out of memory,
+ * otherwise 1, after which the task may be resumed by
+ * another worker at any time.
+ */
+
+int
+luna_reactor_file(luna_reactor_t *self, luna_task_t *task, luna_aio_type_t type
+  , const char *path, const char *data, int len, luna_value_t *dest) {
+  luna_aio_op_t *op = luna_aio_op_new(type, path, task, dest);
+  if (unlikely(!op)) return 0;
+
+  if (len) {
+    kv_resize(char, op->buf, len);
+    if (unlikely(!op->buf.a)) {
+      free(op);
+      return 0;
+    }
+    memcpy(op->buf.a, data, len);
+    kv_size(op->buf) = len;
+  }
+
+  __atomic_add_fetch(&self->parked, 1, __ATOMIC_RELEASE);
+  luna_aio_queue(&self->aio, op);
+  return 1;
+}
+
+/*
+ * Queue a read of up to `size` bytes from stream `fd` for
+ * `task`, parking it until the chunk, an empty string at
+ * the end, is stored to `dest`. Returns 0 when out of
+ * memory, otherwise 1.
+ */
+
+int
+luna_reactor_chunk(luna_reactor_t *self, luna_task_t *task, int fd, int size, luna_value_t *dest) {
+  luna_aio_op_t *op = luna_aio_op_new(LUNA_AIO_READ_CHUNK, NULL, task, dest);
+  if (unlikely(!op)) return 0;
+
+  // room for the nul
+  kv_resize(char, op->buf, size + 1);
+  if (unlikely(!op->buf.a)) {
+    free(op);
+    return 0;
+  }
+
+  op->fd = fd;
+  __atomic_add_fetch(&self->parked, 1, __ATOMIC_RELEASE);
+  luna_aio_queue(&self->aio, op);
+  return 1;
+}
+
+/*
+ * Submit the file operations queued since the last poll,
+ * then wait up to `timeout` milliseconds, -1 for ever, for
+ * parked tasks to be ready, queuing them on `w`. Returns
+ * the number of tasks woken, 0 when another worker is
+ * already polling or the poll is interrupted.
+ */
+
+int
+luna_reactor_poll(luna_reactor_t *self, luna_worker_t *w, int timeout) {
+  struct epoll_event events[LUNA_REACTOR_EVENTS];
+  int polling = 0;
+  int woken = 0;
+
+  if (!__atomic_compare_exchange_n(&self->polling, &polling, 1
+    , 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+
+  luna_aio_submit(&self->aio);
+
+  int n = epoll_wait(self->fd, events, LUNA_REACTOR_EVENTS, timeout);
+  for (int e = 0; e < n; ++e) {
+    // timers
+    if (!events[e].data.ptr) {
+      woken += expire(self, w);
+      continue;
+    }
+
+    // interrupted
+    if (&self->wakefd == events[e].data.ptr) {
+      uint64_t count;
+      read(self->wakefd, &count, sizeof(count));
+      continue;
+    }
+
+    // file operations
+    luna_task_t *task = luna_aio_reap(&self->aio);
+    while (task) {
+      luna_task_t *next = task->next;
+      wake(self, w, task);
+      task = next;
+      ++woken;
+    }
+  }
+
+  __atomic_store_n(&self->polling, 0, __ATOMIC_SEQ_CST);
+  return woken;
+}
+
+/*
+ * Interrupt the worker blocked polling, or the next
+ * one to poll.
+ */
+
+void
+luna_reactor_interrupt(luna_reactor_t *self) {
+  uint64_t one = 1;
+  write(self->wakefd, &one, sizeof(one));
+}
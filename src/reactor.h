@@ -0,0 +1,90 @@
+
+//
+// reactor.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_REACTOR__
+#define __LUNA_REACTOR__
+
+#include <pthread.h>
+#include "scheduler.h"
+#include "aio.h"
+
+/*
+ * Events handled per poll.
+ */
+
+#ifndef LUNA_REACTOR_EVENTS
+#define LUNA_REACTOR_EVENTS 64
+#endif
+
+/*
+ * Task sleeping until `deadline`, in
+ * nanoseconds of the monotonic clock.
+ */
+
+typedef struct {
+  uint64_t deadline;
+  luna_task_t *task;
+} luna_timer_t;
+
+/*
+ * Luna reactor.
+ *
+ * Parks tasks on blocking operations so their worker
+ * moves on to other tasks, resuming them once the epoll
+ * instance `fd` reports their file operations done by
+ * `aio`, or the earliest of the `timers` heap fires
+ * `timerfd`. Workers with nothing to run poll it, one at
+ * a time, and requeue the tasks woken on their own deque,
+ * so a single thread drives any number of tasks waiting
+ * on I/O. Writing `wakefd` interrupts the poll when other
+ * work comes up.
+ */
+
+typedef struct luna_reactor {
+  int fd;
+  int timerfd;
+  int wakefd;
+  int64_t parked;
+  int polling;
+  uint64_t armed;
+  pthread_mutex_t lock;
+  kvec_t(luna_timer_t) timers;
+  luna_aio_t aio;
+} luna_reactor_t;
+
+/*
+ * Check if tasks are parked on `self`.
+ */
+
+#define luna_reactor_parked(self) \
+  (0 != __atomic_load_n(&(self)->parked, __ATOMIC_ACQUIRE))
+
+// protos
+
+luna_reactor_t *
+luna_reactor_new();
+
+void
+luna_reactor_free(luna_reactor_t *self);
+
+int
+luna_reactor_sleep(luna_reactor_t *self, luna_task_t *task, double ms);
+
+int
+luna_reactor_file(luna_reactor_t *self, luna_task_t *task, luna_aio_type_t type
+  , const char *path, const char *data, int len, luna_value_t *dest);
+
+int
+luna_reactor_chunk(luna_reactor_t *self, luna_task_t *task, int fd, int size, luna_value_t *dest);
+
+int
+luna_reactor_poll(luna_reactor_t *self, luna_worker_t *worker, int timeout);
+
+void
+luna_reactor_interrupt(luna_reactor_t *self);
+
+#endif /* __LUNA_REACTOR__ */
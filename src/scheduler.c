@@ -0,0 +1,537 @@
+
+//
+// scheduler.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "scheduler.h"
+#include "reactor.h"
+#include "internal.h"
+
+/*
+ * Atomic shorthands.
+ */
+
+#define load(ptr, order) __atomic_load_n(ptr, __ATOMIC_##order)
+#define store(ptr, val, order) __atomic_store_n(ptr, val, __ATOMIC_##order)
+#define fence(order) __atomic_thread_fence(__ATOMIC_##order)
+#define cas(ptr, expected, val) \
+  __atomic_compare_exchange_n(ptr, expected, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+/*
+ * Alloc a deque array of `size` slots.
+ */
+
+static luna_deque_array_t *
+array_new(int64_t size) {
+  luna_deque_array_t *array = malloc(sizeof(luna_deque_array_t) + size * sizeof(luna_task_t *));
+  if (unlikely(!array)) return NULL;
+  array->mask = size - 1;
+  return array;
+}
+
+/*
+ * Initialize an empty deque.
+ */
+
+int
+luna_deque_init(luna_deque_t *self) {
+  self->top = self->bottom = 0;
+  kv_init(self->old);
+  return (self->array = array_new(LUNA_DEQUE_SIZE)) ? 0 : -1;
+}
+
+/*
+ * Push `task` to the bottom, growing when full. Only
+ * called by the owner, returns -1 when out of memory.
+ */
+
+int
+luna_deque_push(luna_deque_t *self, luna_task_t *task) {
+  int64_t b = load(&self->bottom, RELAXED);
+  int64_t t = load(&self->top, ACQUIRE);
+  luna_deque_array_t *array = load(&self->array, RELAXED);
+
+  // grow, copying the live range
+  if (b - t > array->mask) {
+    luna_deque_array_t *grown = array_new(2 * (array->mask + 1));
+    if (unlikely(!grown)) return -1;
+    for (int64_t i = t; i < b; ++i) {
+      grown->tasks[i & grown->mask] = array->tasks[i & array->mask];
+    }
+    kv_push(luna_deque_array_t *, self->old, array);
+    store(&self->array, grown, RELEASE);
+    array = grown;
+  }
+
+  store(&array->tasks[b & array->mask], task, RELAXED);
+  store(&self->bottom, b + 1, RELEASE);
+  return 0;
+}
+
+/*
+ * Take the bottom task, or NULL. Only called by the owner.
+ */
+
+luna_task_t *
+luna_deque_take(luna_deque_t *self) {
+  int64_t b = load(&self->bottom, RELAXED) - 1;
+  luna_deque_array_t *array = load(&self->array, RELAXED);
+  store(&self->bottom, b, RELAXED);
+  fence(SEQ_CST);
+  int64_t t = load(&self->top, RELAXED);
+
+  // empty
+  if (t > b) {
+    store(&self->bottom, b + 1, RELAXED);
+    return NULL;
+  }
+
+  luna_task_t *task = load(&array->tasks[b & array->mask], RELAXED);
+
+  // last one, race the thieves for it
+  if (t == b) {
+    if (!cas(&self->top, &t, t + 1)) task = NULL;
+    store(&self->bottom, b + 1, RELAXED);
+  }
+
+  return task;
+}
+
+/*
+ * Steal the top task, or NULL when empty or
+ * another worker got there first.
+ */
+
+luna_task_t *
+luna_deque_steal(luna_deque_t *self) {
+  int64_t t = load(&self->top, ACQUIRE);
+  fence(SEQ_CST);
+  int64_t b = load(&self->bottom, ACQUIRE);
+  if (t >= b) return NULL;
+
+  luna_deque_array_t *array = load(&self->array, ACQUIRE);
+  luna_task_t *task = load(&array->tasks[t & array->mask], RELAXED);
+  return cas(&self->top, &t, t + 1) ? task : NULL;
+}
+
+/*
+ * Alloc a scheduler of `nworkers` workers, clamped
+ * to LUNA_MAX_THREADS.
+ */
+
+luna_sched_t *
+luna_sched_new(int nworkers) {
+  if (nworkers < 1) nworkers = 1;
+  if (nworkers > LUNA_MAX_THREADS) nworkers = LUNA_MAX_THREADS;
+
+  luna_sched_t *self = malloc(sizeof(luna_sched_t));
+  luna_worker_t *workers = calloc(nworkers, sizeof(luna_worker_t));
+  if (unlikely(!self || !workers)) goto error;
+
+  for (int i = 0; i < nworkers; ++i) {
+    luna_worker_t *w = &workers[i];
+    if (unlikely(luna_deque_init(&w->deque))) goto error;
+    w->overflow = NULL;
+    kv_init(w->stacks);
+    kv_init(w->blocks);
+    w->nfree = 0;
+    w->seed = i + 1;
+    w->sched = self;
+  }
+
+  self->main.base.type = LUNA_TYPE_TASK;
+  self->main.ip = NULL;
+  self->main.registers = NULL;
+  self->main.result = LUNA_NULL;
+  self->main.next = NULL;
+  self->main.waiters = NULL;
+  self->main_ready = 0;
+  self->main_waiting = 0;
+  self->pending = 0;
+  self->idle = 0;
+  self->sleeping = 0;
+  self->epoch = 0;
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->cond, NULL);
+  self->stack_size = 0;
+  self->nworkers = nworkers;
+  self->running = 0;
+  self->stop = 0;
+  self->data = NULL;
+  self->reactor = NULL;
+  self->workers = workers;
+  return self;
+
+error:
+  if (workers) {
+    for (int i = 0; i < nworkers; ++i) free(workers[i].deque.array);
+  }
+  free(workers);
+  free(self);
+  return NULL;
+}
+
+/*
+ * Size stacks for `nregisters`, dropping pooled stacks
+ * which are too small. Only called between evaluations,
+ * when no task holds a stack.
+ */
+
+void
+luna_sched_reserve(luna_sched_t *self, int nregisters) {
+  if (nregisters <= self->stack_size) return;
+  for (int i = 0; i < self->nworkers; ++i) {
+    luna_worker_t *w = &self->workers[i];
+    for (int j = 0; j < kv_size(w->stacks); ++j) free(kv_A(w->stacks, j));
+    kv_size(w->stacks) = 0;
+  }
+  self->stack_size = nregisters;
+}
+
+/*
+ * Start the threads of the workers other than the
+ * first, running `fn` with their worker. Workers whose
+ * thread fails to start are left idle, as only the
+ * owner ever pushes to a deque.
+ */
+
+void
+luna_sched_start(luna_sched_t *self, void *(*fn)(void *), void *data) {
+  if (self->running || 1 == self->nworkers) return;
+  self->data = data;
+  store(&self->stop, 0, RELEASE);
+  self->running = 1;
+  for (int i = 1; i < self->nworkers; ++i) {
+    luna_worker_t *w = &self->workers[i];
+    if (pthread_create(&w->thread, NULL, fn, w)) break;
+    self->running = i + 1;
+  }
+}
+
+/*
+ * Check if tasks are parked on `reactor` with no
+ * worker polling it.
+ */
+
+#define unpolled(reactor) \
+  ((reactor) \
+    && luna_reactor_parked(reactor) \
+    && !load(&(reactor)->polling, SEQ_CST))
+
+/*
+ * Wake an idle worker to pick up new work, or every one
+ * with `all`, the worker blocked polling the reactor being
+ * interrupted when no other is sleeping. Pushes seeing no
+ * idle worker skip it, see go_idle().
+ */
+
+static void
+notify(luna_sched_t *self, int all) {
+  fence(SEQ_CST);
+  if (!load(&self->idle, RELAXED)) return;
+
+  pthread_mutex_lock(&self->lock);
+  store(&self->epoch, self->epoch + 1, RELAXED);
+  int sleeping = self->sleeping;
+  if (all) {
+    pthread_cond_broadcast(&self->cond);
+  } else if (sleeping) {
+    pthread_cond_signal(&self->cond);
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  luna_reactor_t *reactor = load(&self->reactor, ACQUIRE);
+  if (reactor && (all || !sleeping)) luna_reactor_interrupt(reactor);
+}
+
+/*
+ * Count `w` idle as of `epoch`, returning 1 when work
+ * showed up meanwhile, as it was pushed before `w` was
+ * counted, or `w` is being stopped. The caller must
+ * decrement `idle` once done waiting.
+ */
+
+static int
+go_idle(luna_sched_t *self, luna_worker_t *w, uint64_t *epoch) {
+  *epoch = load(&self->epoch, SEQ_CST);
+  __atomic_add_fetch(&self->idle, 1, __ATOMIC_SEQ_CST);
+
+  if (load(&self->stop, SEQ_CST)) return 1;
+  if (w == self->workers && load(&self->main_ready, SEQ_CST)) return 1;
+  for (int i = 0; i < self->nworkers; ++i) {
+    luna_deque_t *deque = &self->workers[i].deque;
+    if (load(&deque->bottom, SEQ_CST) > load(&deque->top, SEQ_CST)) return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Sleep until notified, unless work showed up or parked
+ * tasks are left with no worker polling the reactor.
+ */
+
+static void
+park(luna_sched_t *self, luna_worker_t *w) {
+  uint64_t epoch;
+  int ready = go_idle(self, w, &epoch);
+  luna_reactor_t *reactor = load(&self->reactor, ACQUIRE);
+
+  if (!ready && !unpolled(reactor)) {
+    pthread_mutex_lock(&self->lock);
+    ++self->sleeping;
+    while (epoch == load(&self->epoch, RELAXED)) {
+      pthread_cond_wait(&self->cond, &self->lock);
+    }
+    --self->sleeping;
+    pthread_mutex_unlock(&self->lock);
+  }
+
+  __atomic_sub_fetch(&self->idle, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Stop the worker threads, once no tasks are pending.
+ */
+
+void
+luna_sched_stop(luna_sched_t *self) {
+  if (!self->running) return;
+  store(&self->stop, 1, SEQ_CST);
+  notify(self, 1);
+  for (int i = 1; i < self->running; ++i) {
+    pthread_join(self->workers[i].thread, NULL);
+  }
+  self->running = 0;
+}
+
+/*
+ * Queue `task` on worker `self`.
+ */
+
+void
+luna_sched_push(luna_worker_t *self, luna_task_t *task) {
+  if (unlikely(luna_deque_push(&self->deque, task))) {
+    task->next = self->overflow;
+    self->overflow = task;
+  // overflow is the owner's alone
+  } else if (self->sched->running) {
+    notify(self->sched, 0);
+  }
+}
+
+/*
+ * Make blocked `task` runnable on worker `w`, main
+ * being flagged for the first worker instead.
+ */
+
+void
+luna_sched_wake(luna_worker_t *w, luna_task_t *task) {
+  luna_sched_t *sched = w->sched;
+  if (&sched->main == task) {
+    store(&sched->main_ready, 1, SEQ_CST);
+    if (sched->running) notify(sched, 1);
+  } else {
+    luna_sched_push(w, task);
+  }
+}
+
+/*
+ * Return the reactor, created by the first task to park.
+ */
+
+luna_reactor_t *
+luna_sched_reactor(luna_sched_t *self) {
+  luna_reactor_t *reactor = load(&self->reactor, ACQUIRE);
+  if (reactor) return reactor;
+  if (unlikely(!(reactor = luna_reactor_new()))) return NULL;
+
+  // another worker may have beaten us to it
+  luna_reactor_t *prev = NULL;
+  if (cas(&self->reactor, &prev, reactor)) return reactor;
+  luna_reactor_free(reactor);
+  return prev;
+}
+
+/*
+ * Steal a task from the workers other than `w`,
+ * starting from a random one.
+ */
+
+static luna_task_t *
+steal(luna_sched_t *self, luna_worker_t *w) {
+  int n = self->nworkers;
+  w->seed ^= w->seed << 13;
+  w->seed ^= w->seed >> 17;
+  w->seed ^= w->seed << 5;
+  int start = w->seed % n;
+
+  for (int i = 0; i < n; ++i) {
+    luna_worker_t *victim = &self->workers[(start + i) % n];
+    if (victim == w) continue;
+    luna_task_t *task = luna_deque_steal(&victim->deque);
+    if (task) return task;
+  }
+
+  return NULL;
+}
+
+/*
+ * Return the next task for `w` to run: its own newest
+ * task, main for the first worker once ready, one woken
+ * by the reactor, or one stolen from another worker. Spins
+ * a while when there is none, then parks until other workers
+ * may have produced one, or blocks polling the reactor,
+ * returning NULL when nothing can ever come, or the worker
+ * is being stopped.
+ */
+
+luna_task_t *
+luna_sched_next(luna_sched_t *self, luna_worker_t *w) {
+  int first = w == self->workers;
+  luna_task_t *task;
+
+  for (int spins = 0; ; ++spins) {
+    int idle = spins >= LUNA_SCHED_SPINS;
+
+    if (task = luna_deque_take(&w->deque)) break;
+
+    if (task = w->overflow) {
+      w->overflow = task->next;
+      break;
+    }
+
+    if (first && __atomic_exchange_n(&self->main_ready, 0, __ATOMIC_ACQUIRE)) {
+      task = &self->main;
+      break;
+    }
+
+    // wait for parked tasks, blocking when alone or idle,
+    // a file operation may take several polls to wake its task
+    luna_reactor_t *reactor = load(&self->reactor, ACQUIRE);
+    if (reactor && luna_reactor_parked(reactor)) {
+      int woken;
+      if (!self->running) {
+        woken = luna_reactor_poll(reactor, w, -1);
+      } else if (idle) {
+        uint64_t epoch;
+        woken = luna_reactor_poll(reactor, w, go_idle(self, w, &epoch) ? 0 : -1);
+        __atomic_sub_fetch(&self->idle, 1, __ATOMIC_SEQ_CST);
+      } else {
+        woken = luna_reactor_poll(reactor, w, 0);
+      }
+      if (woken || !self->running) continue;
+    }
+
+    if (first && !self->running) return NULL;
+    if (task = steal(self, w)) break;
+    if (!first && load(&self->stop, ACQUIRE)) return NULL;
+    if (idle) park(self, w);
+  }
+
+  // hand the reactor over, busy from now on
+  if (self->running && unpolled(load(&self->reactor, ACQUIRE))) notify(self, 0);
+  return task;
+}
+
+/*
+ * Have main, which halted with tasks pending, resumed
+ * once the last is done, by luna_task_done() unless
+ * already done.
+ */
+
+void
+luna_sched_wait(luna_sched_t *self, luna_worker_t *w) {
+  store(&self->main_waiting, 1, SEQ_CST);
+  if (load(&self->pending, SEQ_CST)) return;
+  if (__atomic_exchange_n(&self->main_waiting, 0, __ATOMIC_SEQ_CST)) {
+    store(&self->main_ready, 1, RELEASE);
+  }
+}
+
+/*
+ * Fork a task resuming at `ip` on worker `w`, returning
+ * NULL when out of memory. Its registers are not cleared,
+ * the code never reads one it did not write.
+ */
+
+luna_task_t *
+luna_task_new(luna_worker_t *w, luna_instruction_t *ip) {
+  luna_value_t *stack;
+
+  if (kv_size(w->stacks)) {
+    stack = kv_pop(w->stacks);
+  } else {
+    int size = w->sched->stack_size ? w->sched->stack_size : 1;
+    if (unlikely(!(stack = malloc(size * sizeof(luna_value_t))))) return NULL;
+  }
+
+  if (!w->nfree) {
+    luna_task_t *block = malloc(LUNA_TASK_BLOCK * sizeof(luna_task_t));
+    if (unlikely(!block)) goto error;
+    kv_push(luna_task_t *, w->blocks, block);
+    w->nfree = LUNA_TASK_BLOCK;
+  }
+
+  luna_task_t *task = &kv_A(w->blocks, kv_size(w->blocks) - 1)[--w->nfree];
+  task->base.type = LUNA_TYPE_TASK;
+  task->ip = ip;
+  task->registers = stack;
+  task->result = LUNA_NULL;
+  task->next = NULL;
+  task->waiters = NULL;
+  __atomic_add_fetch(&w->sched->pending, 1, __ATOMIC_RELAXED);
+  return task;
+
+error:
+  kv_push(luna_value_t *, w->stacks, stack);
+  return NULL;
+}
+
+/*
+ * Block `waiter` until `self` is done, returning 0
+ * when it already is. The waiter may be resumed by
+ * another worker as soon as this returns 1, so it
+ * must be saved beforehand.
+ */
+
+int
+luna_task_wait(luna_task_t *self, luna_task_t *waiter) {
+  luna_task_t *head = load(&self->waiters, ACQUIRE);
+  do {
+    if (LUNA_TASK_DONE == head) return 0;
+    waiter->next = head;
+  } while (!__atomic_compare_exchange_n(&self->waiters, &head, waiter
+    , 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  return 1;
+}
+
+/*
+ * Finish `self` with `result` on worker `w`, returning
+ * its stack to the pool and waking the tasks joining it.
+ */
+
+void
+luna_task_done(luna_worker_t *w, luna_task_t *self, luna_value_t result) {
+  luna_sched_t *sched = w->sched;
+  self->result = result;
+  kv_push(luna_value_t *, w->stacks, self->registers);
+  self->registers = NULL;
+
+  luna_task_t *waiter = __atomic_exchange_n(&self->waiters, LUNA_TASK_DONE, __ATOMIC_ACQ_REL);
+  while (waiter) {
+    luna_task_t *next = waiter->next;
+    luna_sched_wake(w, waiter);
+    waiter = next;
+  }
+
+  // main waits for the last
+  if (!__atomic_sub_fetch(&sched->pending, 1, __ATOMIC_SEQ_CST)
+    && __atomic_exchange_n(&sched->main_waiting, 0, __ATOMIC_SEQ_CST)) {
+    luna_sched_wake(w, &sched->main);
+  }
+}
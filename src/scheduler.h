@@ -0,0 +1,228 @@
+
+//
+// scheduler.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_SCHEDULER__
+#define __LUNA_SCHEDULER__
+
+#include <pthread.h>
+#include "vm.h"
+#include "object.h"
+
+/*
+ * Tasks allocated at a time.
+ */
+
+#ifndef LUNA_TASK_BLOCK
+#define LUNA_TASK_BLOCK 256
+#endif
+
+/*
+ * Initial deque capacity, must be a power of two.
+ */
+
+#ifndef LUNA_DEQUE_SIZE
+#define LUNA_DEQUE_SIZE 256
+#endif
+
+/*
+ * Failed attempts at finding work before an
+ * idle worker parks.
+ */
+
+#ifndef LUNA_SCHED_SPINS
+#define LUNA_SCHED_SPINS 64
+#endif
+
+/*
+ * Upper bound on workers.
+ */
+
+#define LUNA_MAX_THREADS 256
+
+/*
+ * Check if `val` is a task.
+ */
+
+#define luna_is_task(val) luna_object_is(val, TASK)
+
+/*
+ * Waiters of a task which is done.
+ */
+
+#define LUNA_TASK_DONE ((luna_task_t *) 1)
+
+/*
+ * Check if `task` is done, its result then being readable.
+ */
+
+#define luna_task_is_done(task) \
+  (LUNA_TASK_DONE == __atomic_load_n(&(task)->waiters, __ATOMIC_ACQUIRE))
+
+/*
+ * Luna task.
+ *
+ * A coroutine forked by `&`, which is no more than a position
+ * in the code and a register stack of its own, so switching
+ * tasks swaps `ip` and the registers without touching the C
+ * stack, and any worker may resume it. Tasks blocked joining
+ * it are pushed onto `waiters`, linked by `next`, until it is
+ * done and `waiters` becomes LUNA_TASK_DONE.
+ */
+
+typedef struct luna_task {
+  luna_object_t base;
+  luna_instruction_t *ip;
+  luna_value_t *registers;
+  luna_value_t result;
+  struct luna_task *next;
+  struct luna_task *waiters;
+} luna_task_t;
+
+/*
+ * Deque storage, `mask + 1` slots.
+ */
+
+typedef struct {
+  int64_t mask;
+  luna_task_t *tasks[];
+} luna_deque_array_t;
+
+/*
+ * Chase-Lev work-stealing deque.
+ *
+ * The owner pushes and takes tasks at the bottom without
+ * locking, other workers steal from the top with a CAS, only
+ * racing the owner for the last task. Outgrown arrays are
+ * kept in `old` until the deque is freed, as a thief may
+ * still be reading one.
+ */
+
+typedef struct {
+  int64_t top;
+  int64_t bottom;
+  luna_deque_array_t *array;
+  kvec_t(luna_deque_array_t *) old;
+} luna_deque_t;
+
+/*
+ * Luna worker, one per thread.
+ *
+ * Tasks forked or woken by a worker go to its own deque,
+ * or `overflow` should the deque fail to grow. Register
+ * stacks of finished tasks are pooled in `stacks` for the
+ * next fork, and tasks, which outlive their run as their
+ * handle may be joined any time later, are carved out of
+ * `blocks`, so forking takes no lock and never calls
+ * malloc once warm.
+ */
+
+typedef struct luna_worker {
+  luna_deque_t deque;
+  luna_task_t *overflow;
+  kvec_t(luna_value_t *) stacks;
+  kvec_t(luna_task_t *) blocks;
+  int nfree;
+  unsigned seed;
+  pthread_t thread;
+  struct luna_sched *sched;
+} luna_worker_t;
+
+/*
+ * Luna scheduler.
+ *
+ * Runs tasks on `nworkers` threads, M tasks to N workers,
+ * the running task keeping its worker until it joins an
+ * unfinished task, parks on the `reactor` or halts. Idle
+ * workers steal from the others. The thread evaluating the vm is the first worker
+ * and alone runs `main`, which it resumes once `main_ready`
+ * is set, halting main with tasks `pending` sets `main_waiting`
+ * until the last one is done. The other threads are started
+ * by the first fork and stopped once main halts with none.
+ *
+ * Workers out of work count themselves `idle` and sleep on
+ * `cond` until a push, a wake or the reactor bumps `epoch`,
+ * all but the one polling the reactor, which blocks in epoll
+ * and is interrupted when no other is `sleeping`.
+ */
+
+typedef struct luna_sched {
+  luna_task_t main;
+  int main_ready;
+  int main_waiting;
+  int64_t pending;
+  int idle;
+  int sleeping;
+  uint64_t epoch;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stack_size;
+  int nworkers;
+  int running;
+  int stop;
+  void *data;
+  struct luna_reactor *reactor;
+  luna_worker_t *workers;
+} luna_sched_t;
+
+/*
+ * Check if tasks are pending.
+ */
+
+#define luna_sched_pending(sched) \
+  (0 != __atomic_load_n(&(sched)->pending, __ATOMIC_ACQUIRE))
+
+// protos
+
+luna_sched_t *
+luna_sched_new(int nworkers);
+
+void
+luna_sched_reserve(luna_sched_t *self, int nregisters);
+
+void
+luna_sched_start(luna_sched_t *self, void *(*fn)(void *), void *data);
+
+void
+luna_sched_stop(luna_sched_t *self);
+
+void
+luna_sched_push(luna_worker_t *self, luna_task_t *task);
+
+void
+luna_sched_wake(luna_worker_t *worker, luna_task_t *task);
+
+struct luna_reactor *
+luna_sched_reactor(luna_sched_t *self);
+
+luna_task_t *
+luna_sched_next(luna_sched_t *self, luna_worker_t *worker);
+
+void
+luna_sched_wait(luna_sched_t *self, luna_worker_t *worker);
+
+luna_task_t *
+luna_task_new(luna_worker_t *worker, luna_instruction_t *ip);
+
+int
+luna_task_wait(luna_task_t *self, luna_task_t *waiter);
+
+void
+luna_task_done(luna_worker_t *worker, luna_task_t *self, luna_value_t result);
+
+int
+luna_deque_init(luna_deque_t *self);
+
+int
+luna_deque_push(luna_deque_t *self, luna_task_t *task);
+
+luna_task_t *
+luna_deque_take(luna_deque_t *self);
+
+luna_task_t *
+luna_deque_steal(luna_deque_t *self);
+
+#endif /* __LUNA_SCHEDULER__ */
@@ -0,0 +1,197 @@
+
+//
+// search.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdint.h>
+#include <string.h>
+#include "search.h"
+#include "internal.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Return the start of the right half of the critical
+ * factorization of `needle`, the later of its maximal
+ * suffixes under both byte orders, with its `period`.
+ */
+
+static size_t
+factorize(const unsigned char *needle, size_t len, size_t *period) {
+  size_t suffix[2];
+  size_t p[2];
+
+  for (int rev = 0; rev < 2; ++rev) {
+    size_t max = SIZE_MAX;
+    size_t j = 0, k = 1;
+    p[rev] = 1;
+    while (j + k < len) {
+      unsigned char a = needle[j + k];
+      unsigned char b = needle[max + k];
+      if (rev ? b < a : a < b) {
+        j += k;
+        k = 1;
+        p[rev] = j - max;
+      } else if (a == b) {
+        if (k != p[rev]) {
+          ++k;
+        } else {
+          j += p[rev];
+          k = 1;
+        }
+      } else {
+        max = j++;
+        k = p[rev] = 1;
+      }
+    }
+    suffix[rev] = max + 1;
+  }
+
+  int rev = suffix[1] > suffix[0];
+  *period = p[rev];
+  return suffix[rev];
+}
+
+/*
+ * Two-Way search for a needle of at least two bytes.
+ */
+
+static const char *
+two_way(const luna_search_t *self, const char *buf, size_t len) {
+  const unsigned char *needle = (const unsigned char *) self->needle;
+  const unsigned char *hay = (const unsigned char *) buf;
+  size_t n = self->len;
+  size_t suffix = self->suffix;
+  size_t j = 0;
+
+  // periodic, remembering the prefix already matched
+  if (self->periodic) {
+    size_t memory = 0;
+    while (j <= len - n) {
+      size_t i = suffix > memory ? suffix : memory;
+      while (i < n && needle[i] == hay[i + j]) ++i;
+      if (i < n) {
+        j += i - suffix + 1;
+        memory = 0;
+        continue;
+      }
+      i = suffix - 1;
+      while (memory < i + 1 && needle[i] == hay[i + j]) --i;
+      if (i + 1 < memory + 1) return buf + j;
+      j += self->period;
+      memory = n - self->period;
+    }
+    return NULL;
+  }
+
+  while (j <= len - n) {
+    size_t i = suffix;
+    while (i < n && needle[i] == hay[i + j]) ++i;
+    if (i < n) {
+      j += i - suffix + 1;
+      continue;
+    }
+    i = suffix - 1;
+    while (SIZE_MAX != i && needle[i] == hay[i + j]) --i;
+    if (SIZE_MAX == i) return buf + j;
+    j += self->period;
+  }
+
+  return NULL;
+}
+
+/*
+ * Charge the bytes compared for a false candidate at
+ * `at`, checking if they outweigh those filtered,
+ * long needles then switching to Two-Way.
+ */
+
+#define overspent(self, spent, at) \
+  ((self)->len > LUNA_SEARCH_SHORT \
+    && ((spent) += (self)->len) > 4 * (at) + 4096)
+
+/*
+ * First / last byte filter for a needle of at
+ * least two bytes.
+ */
+
+static const char *
+filter(const luna_search_t *self, const char *buf, size_t len) {
+  const char *needle = self->needle;
+  size_t n = self->len;
+  size_t last = n - 1;
+  size_t spent = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128i first_bytes = _mm_set1_epi8(needle[0]);
+  __m128i last_bytes = _mm_set1_epi8(needle[last]);
+  for (; i + last + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (buf + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (buf + i + last));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+      _mm_cmpeq_epi8(a, first_bytes),
+      _mm_cmpeq_epi8(b, last_bytes)));
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+      if (!memcmp(buf + at + 1, needle + 1, n - 2)) return buf + at;
+      if (overspent(self, spent, at)) return two_way(self, buf + at, len - at);
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  // memchr() pair for the rest
+  while (i + last < len) {
+    const char *p = memchr(buf + i, needle[0], len - last - i);
+    if (!p) return NULL;
+    i = p - buf;
+    if (p[last] == needle[last]) {
+      if (!memcmp(p + 1, needle + 1, n - 2)) return p;
+      if (overspent(self, spent, i)) return two_way(self, p, len - i);
+    }
+    ++i;
+  }
+
+  return NULL;
+}
+
+/*
+ * Compile the `len` bytes of `needle`, which must
+ * outlive `self`.
+ */
+
+void
+luna_search_init(luna_search_t *self, const char *needle, size_t len) {
+  self->needle = needle;
+  self->len = len;
+  self->suffix = 0;
+  self->period = 1;
+  self->periodic = 0;
+  if (len <= LUNA_SEARCH_SHORT) return;
+
+  self->suffix = factorize((const unsigned char *) needle, len, &self->period);
+  self->periodic = !memcmp(needle, needle + self->period, self->suffix);
+  if (!self->periodic) {
+    size_t right = len - self->suffix;
+    self->period = (self->suffix > right ? self->suffix : right) + 1;
+  }
+}
+
+/*
+ * Return the first occurrence of the needle in the
+ * `len` bytes of `buf`, or NULL.
+ */
+
+const char *
+luna_search_find(const luna_search_t *self, const char *buf, size_t len) {
+  size_t n = self->len;
+  if (n > len) return NULL;
+  if (!n) return buf;
+  if (1 == n) return memchr(buf, self->needle[0], len);
+  return filter(self, buf, len);
+}
@@ -0,0 +1,51 @@
+
+//
+// search.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_SEARCH__
+#define __LUNA_SEARCH__
+
+#include <stddef.h>
+
+/*
+ * Longest needle searched with the first / last byte
+ * filter alone, longer ones switching to Two-Way once
+ * it lets through too many false candidates.
+ */
+
+#ifndef LUNA_SEARCH_SHORT
+#define LUNA_SEARCH_SHORT 32
+#endif
+
+/*
+ * Compiled literal needle.
+ *
+ * Short needles are found by comparing the first and
+ * last bytes of 16 candidate positions at once, with
+ * SSE2 when available, or memchr() on the first byte
+ * otherwise, and only the candidates matching both are
+ * compared in full. Long ones fall back to the Two-Way
+ * algorithm, linear whatever the input, from the `suffix`
+ * and `period` of their critical factorization.
+ */
+
+typedef struct {
+  const char *needle;
+  size_t len;
+  size_t suffix;
+  size_t period;
+  int periodic;
+} luna_search_t;
+
+// protos
+
+void
+luna_search_init(luna_search_t *self, const char *needle, size_t len);
+
+const char *
+luna_search_find(const luna_search_t *self, const char *buf, size_t len);
+
+#endif /* __LUNA_SEARCH__ */
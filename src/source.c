@@ -0,0 +1,133 @@
+
+//
+// source.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "source.h"
+#include "internal.h"
+
+/*
+ * Map the `len` byte regular file `fd`.
+ *
+ * The file is mapped over an anonymous reservation of at
+ * least `len + 1` bytes, so the zero pages past EOF always
+ * terminate it, even when it ends on a page boundary.
+ */
+
+static int
+map(luna_source_t *self, int fd, size_t len) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (len + page) & ~(page - 1);
+
+  char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == base) return -1;
+
+  if (MAP_FAILED == mmap(base, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+    munmap(base, size);
+    return -1;
+  }
+
+  self->data = base;
+  self->len = len;
+  self->mapped = size;
+  return 0;
+}
+
+/*
+ * Read `fd` until EOF, doubling the buffer as it fills
+ * so the whole read is linear in the input size.
+ */
+
+static int
+stream(luna_source_t *self, int fd) {
+  size_t len = 0, cap = LUNA_SOURCE_CHUNK;
+  char *buf = malloc(cap);
+  if (unlikely(!buf)) return -1;
+
+  for (;;) {
+    // grow, leaving room for the nul
+    if (cap - len < 2) {
+      char *tmp = realloc(buf, cap *= 2);
+      if (unlikely(!tmp)) goto error;
+      buf = tmp;
+    }
+
+    ssize_t n = read(fd, buf + len, cap - len - 1);
+    if (n < 0 && EINTR == errno) continue;
+    if (n < 0) goto error;
+    if (0 == n) break;
+    len += n;
+  }
+
+  buf[len] = 0;
+  self->data = buf;
+  self->len = len;
+  self->mapped = 0;
+  return 0;
+
+error:
+  free(buf);
+  return -1;
+}
+
+/*
+ * Load the script readable from `fd`, mapping regular
+ * files read at their start and streaming anything else,
+ * such as pipes and terminals.
+ *
+ * Returns -1 with errno set on failure.
+ */
+
+int
+luna_source_fd(luna_source_t *self, int fd) {
+  struct stat s;
+  if (fstat(fd, &s) < 0) return -1;
+
+  if (S_ISREG(s.st_mode) && s.st_size > 0 && 0 == lseek(fd, 0, SEEK_CUR)) {
+    if (0 == map(self, fd, s.st_size)) return 0;
+  }
+
+  return stream(self, fd);
+}
+
+/*
+ * Load the script at `path`.
+ *
+ * Returns -1 with errno set on failure.
+ */
+
+int
+luna_source_open(luna_source_t *self, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+
+  int ret = luna_source_fd(self, fd);
+  int err = errno;
+  close(fd);
+  errno = err;
+
+  return ret;
+}
+
+/*
+ * Release the source buffer.
+ */
+
+void
+luna_source_free(luna_source_t *self) {
+  if (self->mapped) {
+    munmap((void *) self->data, self->mapped);
+  } else {
+    free((void *) self->data);
+  }
+  self->data = NULL;
+  self->len = self->mapped = 0;
+}
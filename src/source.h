@@ -0,0 +1,47 @@
+
+//
+// source.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_SOURCE__
+#define __LUNA_SOURCE__
+
+#include <stddef.h>
+
+/*
+ * Initial capacity of streamed sources.
+ */
+
+#ifndef LUNA_SOURCE_CHUNK
+#define LUNA_SOURCE_CHUNK 4096
+#endif
+
+/*
+ * Luna source.
+ *
+ * An owned, nul-terminated and read-only buffer of `len`
+ * bytes of script, handed to the lexer as-is. Regular files
+ * are mapped, `mapped` bytes of them, anything else is
+ * streamed into a heap buffer.
+ */
+
+typedef struct {
+  const char *data;
+  size_t len;
+  size_t mapped;
+} luna_source_t;
+
+// protos
+
+int
+luna_source_open(luna_source_t *self, const char *path);
+
+int
+luna_source_fd(luna_source_t *self, int fd);
+
+void
+luna_source_free(luna_source_t *self);
+
+#endif /* __LUNA_SOURCE__ */
@@ -0,0 +1,163 @@
+
+//
+// span.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_SPAN__
+#define __LUNA_SPAN__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Character class spans used by the lexer.
+ *
+ * Each luna_span_*() returns the length of the run of
+ * bytes at `str` belonging to a class. With SSE2, or AVX2
+ * when built with -mavx2, a block of 16 or 32 bytes is
+ * classified at a time, otherwise one byte at a time.
+ *
+ * `str` must be nul-terminated, nul never belongs to a
+ * class so every run ends at or before it. Vector loads are
+ * aligned, they may read past the nul but never past the
+ * page holding it.
+ */
+
+#if defined(__GNUC__) && defined(__AVX2__) && !defined(LUNA_NO_SIMD)
+
+#include <immintrin.h>
+
+#define LUNA_SPAN_SIMD
+#define LUNA_SPAN_BLOCK 32
+#define LUNA_SPAN_MASK 0xffffffffu
+
+typedef __m256i luna_span_block_t;
+
+#define load(p) _mm256_load_si256((const __m256i *) (p))
+#define set(c) _mm256_set1_epi8(c)
+#define eq(b, c) _mm256_cmpeq_epi8(b, set(c))
+#define gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define either(a, b) _mm256_or_si256(a, b)
+#define both(a, b) _mm256_and_si256(a, b)
+#define mask(b) ((uint32_t) _mm256_movemask_epi8(b))
+
+#elif defined(__GNUC__) && defined(__SSE2__) && !defined(LUNA_NO_SIMD)
+
+#include <emmintrin.h>
+
+#define LUNA_SPAN_SIMD
+#define LUNA_SPAN_BLOCK 16
+#define LUNA_SPAN_MASK 0xffffu
+
+typedef __m128i luna_span_block_t;
+
+#define load(p) _mm_load_si128((const __m128i *) (p))
+#define set(c) _mm_set1_epi8(c)
+#define eq(b, c) _mm_cmpeq_epi8(b, set(c))
+#define gt(a, b) _mm_cmpgt_epi8(a, b)
+#define either(a, b) _mm_or_si128(a, b)
+#define both(a, b) _mm_and_si128(a, b)
+#define mask(b) ((uint32_t) _mm_movemask_epi8(b))
+
+#endif
+
+#ifdef LUNA_SPAN_SIMD
+
+/*
+ * Bytes of `b` within `lo`..`hi`, signed compares
+ * leave bytes above 0x7f out of every range.
+ */
+
+#define range(b, lo, hi) both(gt(b, set((lo) - 1)), gt(set((hi) + 1), b))
+
+/*
+ * Define span `name` ending at the bytes flagged by
+ * `stop`, a mask expression of block `b`.
+ *
+ * Empty runs, like the single space between most
+ * tokens, are rejected by the `scalar` test of the
+ * first byte `c` before touching a vector. The first
+ * load is aligned down to the block, with the bytes
+ * before `str` masked out.
+ */
+
+#define LUNA_SPAN(name, stop, scalar) \
+  __attribute__((no_sanitize_address)) \
+  static inline size_t \
+  name(const char *str) { \
+    int c = *str; \
+    if (!(scalar)) return 0; \
+    size_t off = (uintptr_t) str & (LUNA_SPAN_BLOCK - 1); \
+    const char *p = str - off; \
+    luna_span_block_t b = load(p); \
+    uint32_t m = (stop) & LUNA_SPAN_MASK & (LUNA_SPAN_MASK << off); \
+    while (!m) { \
+      p += LUNA_SPAN_BLOCK; \
+      b = load(p); \
+      m = (stop) & LUNA_SPAN_MASK; \
+    } \
+    return p + __builtin_ctz(m) - str; \
+  }
+
+#else
+
+/*
+ * Define span `name` of bytes `c` matching `scalar`.
+ */
+
+#define LUNA_SPAN(name, stop, scalar) \
+  static inline size_t \
+  name(const char *str) { \
+    const char *p = str; \
+    for (int c; c = *p, (scalar); ++p) ; \
+    return p - str; \
+  }
+
+#endif
+
+/*
+ * Spaces and tabs.
+ */
+
+LUNA_SPAN(luna_span_blanks
+  , ~mask(either(eq(b, ' '), eq(b, '\t')))
+  , ' ' == c || '\t' == c)
+
+/*
+ * Anything up to a newline, for comments.
+ */
+
+LUNA_SPAN(luna_span_line
+  , mask(either(eq(b, '\n'), eq(b, 0)))
+  , '\n' != c && c)
+
+/*
+ * Identifier characters [a-zA-Z0-9_].
+ */
+
+LUNA_SPAN(luna_span_ident
+  , ~mask(either(either(range(either(b, set(0x20)), 'a', 'z'), range(b, '0', '9')), eq(b, '_')))
+  , ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9') || '_' == c)
+
+/*
+ * Decimal digits.
+ */
+
+LUNA_SPAN(luna_span_digits
+  , ~mask(range(b, '0', '9'))
+  , c >= '0' && c <= '9')
+
+#ifdef LUNA_SPAN_SIMD
+#undef load
+#undef set
+#undef eq
+#undef gt
+#undef either
+#undef both
+#undef mask
+#undef range
+#endif
+
+#endif /* __LUNA_SPAN__ */
@@ -8,16 +8,51 @@
 #ifndef __LUNA_STATE__
 #define __LUNA_STATE__
 
+#include <string.h>
 #include "khash.h"
+#include "object.h"
 
 // TODO: move
 
+/*
+ * Interned string, boxed with luna_value_object().
+ */
+
 typedef struct {
+  luna_object_t base;
   int len;
   char *val;
 } luna_string_t;
 
-KHASH_MAP_INIT_STR(str, luna_string_t *);
+/*
+ * Unterminated string slice, so strings can be
+ * looked up straight out of the source.
+ */
+
+typedef struct {
+  const char *ptr;
+  int len;
+} luna_slice_t;
+
+/*
+ * X31 hash of slice `s`.
+ */
+
+static inline khint_t
+luna_slice_hash(luna_slice_t s) {
+  khint_t h = 0;
+  for (int i = 0; i < s.len; ++i) h = (h << 5) - h + (unsigned char) s.ptr[i];
+  return h;
+}
+
+/*
+ * Check if slices `a` and `b` are equal.
+ */
+
+#define luna_slice_equal(a, b) \
+  ((a).len == (b).len && 0 == memcmp((a).ptr, (b).ptr, (a).len))
+
+KHASH_INIT(str, luna_slice_t, luna_string_t *, 1, luna_slice_hash, luna_slice_equal);
 
 /*
  * Luna state.
@@ -35,6 +70,12 @@ luna_state_init(luna_state_t *self);
 // TODO: move
 
 luna_string_t *
-luna_string(luna_state_t *state, char *val);
+luna_string(luna_state_t *state, const char *val);
+
+luna_string_t *
+luna_string_slice(luna_state_t *state, const char *val, int len);
+
+luna_string_t *
+luna_string_new(char *val, int len);
 
 #endif /* __LUNA_STATE__ */
\ No newline at end of file
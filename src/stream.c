@@ -0,0 +1,308 @@
+
+//
+// stream.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stream.h"
+#include "object.h"
+#include "state.h"
+#include "internal.h"
+
+/*
+ * Check if the chain ends in print(), leaving
+ * nothing to collect.
+ */
+
+#define sinks(self) \
+  (kv_size((self)->stages) \
+    && LUNA_STAGE_PRINT == kv_A((self)->stages, kv_size((self)->stages) - 1).type)
+
+/*
+ * Append the `len` bytes of `s` to `buf`.
+ */
+
+static void
+append(luna_stream_buf_t *buf, const char *s, size_t len) {
+  if (!len) return;
+  if (kv_size(*buf) + len > kv_max(*buf)) {
+    size_t max = kv_max(*buf) ? kv_max(*buf) : 64;
+    while (max < kv_size(*buf) + len) max *= 2;
+    char *a = realloc(buf->a, max);
+    if (unlikely(!a)) return;
+    buf->a = a;
+    kv_max(*buf) = max;
+  }
+  memcpy(buf->a + kv_size(*buf), s, len);
+  kv_size(*buf) += len;
+}
+
+/*
+ * Run the `len` bytes of line `s` through the stages
+ * from `from` on, `nl` when followed by a newline,
+ * which is part of `s` then.
+ */
+
+static void
+line(luna_stream_t *self, const char *s, size_t len, int nl, int from) {
+  int n = kv_size(self->stages);
+
+  for (int i = from; i < n; ++i) {
+    luna_stage_t *stage = &kv_A(self->stages, i);
+    switch (stage->type) {
+      case LUNA_STAGE_GREP:
+        if (!stage->search.needle) return;
+        if (!luna_search_find(&stage->search, s, len - nl)) return;
+        break;
+      case LUNA_STAGE_PRINT:
+        fwrite(s, 1, len, stdout);
+        if (!nl) putchar('\n');
+        break;
+    }
+  }
+
+  if (!sinks(self)) append(&self->out, s, len);
+}
+
+/*
+ * Run the whole lines from `buf` to `end` through the
+ * stages. A leading grep() searches them at once, only
+ * the lines around its matches being delimited, and
+ * through the rest of the stages.
+ */
+
+static void
+lines(luna_stream_t *self, const char *buf, const char *end) {
+  luna_stage_t *grep = kv_size(self->stages) ? &kv_A(self->stages, 0) : NULL;
+
+  if (!grep || LUNA_STAGE_GREP != grep->type) {
+    const char *nl;
+    while (buf < end && (nl = memchr(buf, '\n', end - buf))) {
+      line(self, buf, nl + 1 - buf, 1, 0);
+      buf = nl + 1;
+    }
+    return;
+  }
+
+  if (!grep->search.needle) return;
+
+  // needles hold no newline, so matches lie within a line
+  const char *hit;
+  while (buf < end && (hit = luna_search_find(&grep->search, buf, end - buf))) {
+    const char *start = memrchr(buf, '\n', hit - buf);
+    const char *nl = memchr(hit, '\n', end - hit);
+    start = start ? start + 1 : buf;
+    line(self, start, nl + 1 - start, 1, 1);
+    buf = nl + 1;
+  }
+}
+
+/*
+ * Alloc a stream over `source`, the file at that
+ * path when `file` is set, or NULL on failure.
+ */
+
+luna_stream_t *
+luna_stream_new(luna_value_t source, int file) {
+  luna_stream_t *self = malloc(sizeof(luna_stream_t));
+  if (unlikely(!self)) return NULL;
+  self->state = !file
+    ? LUNA_STREAM_VALUE
+    : luna_is_string(source)
+      ? LUNA_STREAM_OPEN
+      : LUNA_STREAM_FAILED;
+  self->source = source;
+  self->chunk = LUNA_NULL;
+  self->fd = -1;
+  kv_init(self->stages);
+  kv_init(self->carry);
+  kv_init(self->out);
+  return self;
+}
+
+/*
+ * Free the stream, closing its file.
+ */
+
+void
+luna_stream_free(luna_stream_t *self) {
+  if (self->fd >= 0) close(self->fd);
+  kv_destroy(self->stages);
+  kv_destroy(self->carry);
+  kv_destroy(self->out);
+  free(self);
+}
+
+/*
+ * Append grep(), keeping the lines containing string
+ * `pattern`, any other value, or one spanning lines,
+ * matching none. Returns 0 when out of memory.
+ */
+
+int
+luna_stream_grep(luna_stream_t *self, luna_value_t pattern) {
+  luna_stage_t stage = { .type = LUNA_STAGE_GREP };
+  if (luna_is_string(pattern)) {
+    luna_string_t *str = luna_value_as_pointer(pattern);
+    if (!memchr(str->val, '\n', str->len)) {
+      luna_search_init(&stage.search, str->val, str->len);
+    }
+  }
+  kv_push(luna_stage_t, self->stages, stage);
+  return NULL != self->stages.a;
+}
+
+/*
+ * Append print(), writing each line to stdout.
+ * Returns 0 when out of memory.
+ */
+
+int
+luna_stream_print(luna_stream_t *self) {
+  luna_stage_t stage = { .type = LUNA_STAGE_PRINT };
+  kv_push(luna_stage_t, self->stages, stage);
+  return NULL != self->stages.a;
+}
+
+/*
+ * Run the lines of the `len` bytes of `buf` through
+ * the stages, in place but for the line completing
+ * the carry of the previous chunk, and the last one
+ * when incomplete, which is carried to the next.
+ */
+
+void
+luna_stream_push(luna_stream_t *self, const char *buf, size_t len) {
+  const char *end = buf + len;
+
+  // complete the carried line
+  if (kv_size(self->carry)) {
+    const char *nl = memchr(buf, '\n', len);
+    const char *stop = nl ? nl + 1 : end;
+    append(&self->carry, buf, stop - buf);
+    if (!nl) return;
+    line(self, self->carry.a, kv_size(self->carry), 1, 0);
+    kv_size(self->carry) = 0;
+    buf = stop;
+  }
+
+  // whole lines
+  const char *last = buf < end ? memrchr(buf, '\n', end - buf) : NULL;
+  if (last) {
+    lines(self, buf, last + 1);
+    buf = last + 1;
+  }
+
+  // carry the rest
+  append(&self->carry, buf, end - buf);
+}
+
+/*
+ * Run the carried line, which has no newline,
+ * through the stages.
+ */
+
+void
+luna_stream_end(luna_stream_t *self) {
+  if (!kv_size(self->carry)) return;
+  line(self, self->carry.a, kv_size(self->carry), 0, 0);
+  kv_size(self->carry) = 0;
+}
+
+/*
+ * Push the value source, other values than
+ * strings as they are inspected.
+ */
+
+static void
+push_value(luna_stream_t *self) {
+  if (luna_is_string(self->source)) {
+    luna_string_t *str = luna_value_as_pointer(self->source);
+    luna_stream_push(self, str->val, str->len);
+    return;
+  }
+
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+  if (unlikely(!out)) return;
+  luna_value_dump(self->source, out);
+  fclose(out);
+  luna_stream_push(self, buf, len);
+  free(buf);
+}
+
+/*
+ * Advance the stream, running the chunk the reactor
+ * stored, if any, then queuing the next operation on
+ * behalf of `task`. Returns 1 when `task` is parked
+ * on it, 0 once the stream is done.
+ */
+
+int
+luna_stream_next(luna_stream_t *self, luna_reactor_t *reactor, luna_task_t *task) {
+  luna_value_t chunk = self->chunk;
+  self->chunk = LUNA_NULL;
+
+  switch (self->state) {
+    case LUNA_STREAM_VALUE:
+      push_value(self);
+      luna_stream_end(self);
+      self->state = LUNA_STREAM_DONE;
+      return 0;
+    case LUNA_STREAM_OPEN:
+      if (unlikely(!reactor)) break;
+      self->state = LUNA_STREAM_OPENING;
+      if (luna_reactor_file(reactor, task, LUNA_AIO_OPEN_READ
+        , ((luna_string_t *) luna_value_as_pointer(self->source))->val
+        , NULL, 0, &self->chunk)) return 1;
+      break;
+    case LUNA_STREAM_OPENING:
+      if (!luna_is_int(chunk)) break;
+      self->fd = luna_value_as_int(chunk);
+      self->state = LUNA_STREAM_READING;
+      if (luna_reactor_chunk(reactor, task, self->fd, LUNA_STREAM_CHUNK, &self->chunk)) return 1;
+      break;
+    case LUNA_STREAM_READING:
+      // a read error ends the stream early
+      if (luna_is_string(chunk)) {
+        luna_string_t *str = luna_value_as_pointer(chunk);
+        int len = str->len;
+        luna_stream_push(self, str->val, len);
+        free(str->val);
+        free(str);
+        if (len && luna_reactor_chunk(reactor, task, self->fd, LUNA_STREAM_CHUNK, &self->chunk)) return 1;
+      }
+      luna_stream_end(self);
+      self->state = LUNA_STREAM_DONE;
+      return 0;
+    case LUNA_STREAM_DONE:
+    case LUNA_STREAM_FAILED:
+      return 0;
+  }
+
+  self->state = LUNA_STREAM_FAILED;
+  return 0;
+}
+
+/*
+ * Return the lines collected, null when the chain
+ * ends in print() or the file could not be read.
+ */
+
+luna_value_t
+luna_stream_result(luna_stream_t *self) {
+  if (LUNA_STREAM_FAILED == self->state || sinks(self)) return LUNA_NULL;
+
+  append(&self->out, "", 1);
+  if (unlikely(!kv_size(self->out))) return LUNA_NULL;
+  luna_string_t *str = luna_string_new(self->out.a, kv_size(self->out) - 1);
+  if (unlikely(!str)) return LUNA_NULL;
+  kv_init(self->out);
+  return luna_value_object(str);
+}
@@ -0,0 +1,113 @@
+
+//
+// stream.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_STREAM__
+#define __LUNA_STREAM__
+
+#include "kvec.h"
+#include "value.h"
+#include "reactor.h"
+#include "search.h"
+
+/*
+ * Bytes read per chunk of a file.
+ */
+
+#ifndef LUNA_STREAM_CHUNK
+#define LUNA_STREAM_CHUNK 65536
+#endif
+
+/*
+ * Stages lines pass through.
+ */
+
+typedef enum {
+  LUNA_STAGE_GREP,
+  LUNA_STAGE_PRINT
+} luna_stage_type_t;
+
+/*
+ * Stage, grep() keeping the lines containing
+ * its `search` needle, none when NULL.
+ */
+
+typedef struct {
+  luna_stage_type_t type;
+  luna_search_t search;
+} luna_stage_t;
+
+/*
+ * Line buffer.
+ */
+
+typedef kvec_t(char) luna_stream_buf_t;
+
+/*
+ * Stream states.
+ */
+
+typedef enum {
+  LUNA_STREAM_VALUE,
+  LUNA_STREAM_OPEN,
+  LUNA_STREAM_OPENING,
+  LUNA_STREAM_READING,
+  LUNA_STREAM_DONE,
+  LUNA_STREAM_FAILED
+} luna_stream_state_t;
+
+/*
+ * Luna stream.
+ *
+ * Fused builtin chain such as cat(path).grep(str).print(),
+ * running the lines of its `source`, a string or the file
+ * at that path, through each of its `stages` in one pass.
+ * Files are read a chunk at a time through the reactor,
+ * the task parked meanwhile, so memory stays constant
+ * whatever their size: only a line straddling two chunks
+ * is copied, to `carry`. A leading grep() searches whole
+ * chunks rather than each line, lines without a match
+ * never being scanned for their bounds. Lines left once the stages ran
+ * are collected to `out`, unless the chain ends in print().
+ */
+
+typedef struct {
+  luna_stream_state_t state;
+  luna_value_t source;
+  luna_value_t chunk;
+  int fd;
+  kvec_t(luna_stage_t) stages;
+  luna_stream_buf_t carry;
+  luna_stream_buf_t out;
+} luna_stream_t;
+
+// protos
+
+luna_stream_t *
+luna_stream_new(luna_value_t source, int file);
+
+void
+luna_stream_free(luna_stream_t *self);
+
+int
+luna_stream_grep(luna_stream_t *self, luna_value_t pattern);
+
+int
+luna_stream_print(luna_stream_t *self);
+
+void
+luna_stream_push(luna_stream_t *self, const char *buf, size_t len);
+
+void
+luna_stream_end(luna_stream_t *self);
+
+int
+luna_stream_next(luna_stream_t *self, luna_reactor_t *reactor, luna_task_t *task);
+
+luna_value_t
+luna_stream_result(luna_stream_t *self);
+
+#endif /* __LUNA_STREAM__ */
@@ -6,32 +6,63 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "state.h"
 
 /*
- * Return a new luna_string_t for the given `val`,
- * allocating space in the strings hash unless present,
- * or NULL on failure.
+ * Return the interned luna_string_t for `len` bytes
+ * of `val`, which need not be nul-terminated, allocating
+ * space in the strings hash unless present, or NULL on failure.
  */
 
 luna_string_t *
-luna_string(luna_state_t *state, char *val) {
-  khiter_t k = kh_get(str, state->strs, val);
+luna_string_slice(luna_state_t *state, const char *val, int len) {
+  luna_slice_t key = { val, len };
+  khiter_t k = kh_get(str, state->strs, key);
 
   // exists
-  int exists = kh_size(state->strs) && kh_exist(state->strs, k);
-  if (exists) return kh_value(state->strs, k);
+  if (k != kh_end(state->strs)) return kh_value(state->strs, k);
 
   // alloc
   int ret;
   luna_string_t *self = calloc(1, sizeof(luna_string_t));
-  self->len = strlen(val);
-  self->val = malloc(self->len + 1);
+  if (!self) return NULL;
+  self->base.type = LUNA_TYPE_STRING;
+  self->len = len;
+  self->val = malloc(len + 1);
   if (!self->val) return NULL;
-  memcpy(self->val, val, self->len);
-  self->val[self->len] = 0;
-  k = kh_put(str, state->strs, val, &ret);
+  memcpy(self->val, val, len);
+  self->val[len] = 0;
+  key.ptr = self->val;
+  k = kh_put(str, state->strs, key, &ret);
 
   return kh_value(state->strs, k) = self;
-}
\ No newline at end of file
+}
+
+/*
+ * Return a new luna_string_t for the given `val`,
+ * allocating space in the strings hash unless present,
+ * or NULL on failure.
+ */
+
+luna_string_t *
+luna_string(luna_state_t *state, const char *val) {
+  return luna_string_slice(state, val, strlen(val));
+}
+
+/*
+ * Return a string taking ownership of the `len` bytes
+ * of nul-terminated `val`, without interning it, so it
+ * may be created by any thread, or NULL on failure.
+ */
+
+luna_string_t *
+luna_string_new(char *val, int len) {
+  luna_string_t *self = calloc(1, sizeof(luna_string_t));
+  if (!self) return NULL;
+  self->base.type = LUNA_TYPE_STRING;
+  self->len = len;
+  self->val = val;
+  return self;
+}
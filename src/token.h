@@ -9,6 +9,7 @@
 #define __LUNA_TOKEN__
 
 #include <assert.h>
+#include <sys/types.h>
 
 /*
  * Tokens.
@@ -98,14 +99,19 @@ LUNA_TOKEN_LIST
 
 /*
  * Token struct.
+ *
+ * `offset` and `len` span the lexeme in the source,
+ * ids and strings carry their interned value.
  */
 
 typedef struct {
+  off_t offset;
   int len;
+  int newline;
   luna_token type;
   struct {
     char *as_string;
-    float as_float;
+    double as_float;
     int as_int;
   } value;
 } luna_token_t;
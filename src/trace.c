@@ -0,0 +1,67 @@
+
+//
+// trace.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include "trace.h"
+#include "vm.h"
+#include "opcodes.h"
+#include "internal.h"
+
+/*
+ * Alloc a new trace buffer holding `size` records,
+ * rounded up to a power of two.
+ */
+
+luna_trace_t *
+luna_trace_new(uint32_t size) {
+  luna_trace_t *self = malloc(sizeof(luna_trace_t));
+  if (unlikely(!self)) return NULL;
+  uint32_t n = 1;
+  while (n < size) n <<= 1;
+  self->records = malloc(n * sizeof(luna_trace_record_t));
+  if (unlikely(!self->records)) return free(self), NULL;
+  self->mask = n - 1;
+  self->n = 0;
+  return self;
+}
+
+/*
+ * Free the trace buffer.
+ */
+
+void
+luna_trace_destroy(luna_trace_t *self) {
+  free(self->records);
+  free(self);
+}
+
+/*
+ * Decode the buffered records to `stream`, oldest first.
+ */
+
+void
+luna_trace_dump(luna_trace_t *self, FILE *stream) {
+  uint64_t size = (uint64_t) self->mask + 1;
+  uint64_t start = self->n > size ? self->n - size : 0;
+
+  if (start) {
+    fprintf(stream, "  ... %llu records dropped\n", (unsigned long long) start);
+  }
+
+  for (uint64_t n = start; n < self->n; ++n) {
+    luna_trace_record_t *rec = &self->records[n & self->mask];
+    luna_instruction_t i = rec->i;
+    fprintf(stream, "  %6u %10s %d %s%d %s%d\n"
+      , rec->pc
+      , luna_op_strings[OP(i)]
+      , A(i)
+      , ISK(B(i)) ? "k" : "", INDEXK(B(i))
+      , ISK(C(i)) ? "k" : "", INDEXK(C(i)));
+  }
+
+  fprintf(stream, "  %llu instructions\n", (unsigned long long) self->n);
+}
@@ -0,0 +1,69 @@
+
+//
+// trace.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_TRACE__
+#define __LUNA_TRACE__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Default number of trace records, must be a power of two.
+ */
+
+#ifndef LUNA_TRACE_SIZE
+#define LUNA_TRACE_SIZE 4096
+#endif
+
+/*
+ * Trace record.
+ *
+ * The offset of the instruction from the start
+ * of the code and the instruction word itself.
+ */
+
+typedef struct {
+  uint64_t i;
+  uint32_t pc;
+} luna_trace_record_t;
+
+/*
+ * Trace ring buffer.
+ *
+ * Records wrap around once `mask + 1` instructions
+ * have been traced, leaving the most recent ones.
+ */
+
+typedef struct {
+  uint64_t n;
+  uint32_t mask;
+  luna_trace_record_t *records;
+} luna_trace_t;
+
+/*
+ * Append a record for instruction `i` at `pc`.
+ */
+
+static inline void
+luna_trace_record(luna_trace_t *self, uint32_t pc, uint64_t i) {
+  luna_trace_record_t *rec = &self->records[self->n++ & self->mask];
+  rec->pc = pc;
+  rec->i = i;
+}
+
+// protos
+
+luna_trace_t *
+luna_trace_new(uint32_t size);
+
+void
+luna_trace_destroy(luna_trace_t *self);
+
+void
+luna_trace_dump(luna_trace_t *self, FILE *stream);
+
+#endif /* __LUNA_TRACE__ */
@@ -13,10 +13,4 @@
 off_t
 file_size(const char *filename);
 
-char *
-file_read(const char *filename);
-
-char *
-read_until_eof(FILE *stream);
-
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+
+//
+// value.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef __LUNA_VALUE__
+#define __LUNA_VALUE__
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Luna value.
+ *
+ * A NaN-boxed 64-bit word. Doubles are stored as-is, everything
+ * else lives in the payload of a quiet NaN that arithmetic never
+ * produces, keyed by the upper 16 bits:
+ *
+ *   0x7ffc  int      low 32 bits
+ *   0x7ffd  special  null, false, true
+ *   0xfffc  object   low 48 bits, luna_object_t *
+ *   0xfffd  pointer  low 48 bits, opaque (ast nodes)
+ *
+ * Ints, floats, bools and null never touch the allocator.
+ */
+
+typedef uint64_t luna_value_t;
+
+/*
+ * Tags.
+ */
+
+#define LUNA_TAG_MASK     0xffff000000000000ull
+#define LUNA_TAG_BOXED    0x7ffc000000000000ull
+#define LUNA_TAG_INT      0x7ffc000000000000ull
+#define LUNA_TAG_SPECIAL  0x7ffd000000000000ull
+#define LUNA_TAG_OBJECT   0xfffc000000000000ull
+#define LUNA_TAG_POINTER  0xfffd000000000000ull
+#define LUNA_PAYLOAD_MASK 0x0000ffffffffffffull
+
+/*
+ * Canonical NaN, so computed NaNs never alias a tag.
+ */
+
+#define LUNA_NAN 0x7ff8000000000000ull
+
+/*
+ * Specials.
+ */
+
+#define LUNA_NULL (LUNA_TAG_SPECIAL | 1)
+#define LUNA_FALSE (LUNA_TAG_SPECIAL | 2)
+#define LUNA_TRUE (LUNA_TAG_SPECIAL | 3)
+
+/*
+ * Return the tag of `v`.
+ */
+
+#define luna_value_tag(v) ((v) & LUNA_TAG_MASK)
+
+/*
+ * Type checks.
+ */
+
+#define luna_value_is_int(v) (luna_value_tag(v) == LUNA_TAG_INT)
+#define luna_value_is_float(v) (((v) & LUNA_TAG_BOXED) != LUNA_TAG_BOXED)
+#define luna_value_is_number(v) (luna_value_is_int(v) || luna_value_is_float(v))
+#define luna_value_is_bool(v) ((v) == LUNA_TRUE || (v) == LUNA_FALSE)
+#define luna_value_is_null(v) ((v) == LUNA_NULL)
+#define luna_value_is_object(v) (luna_value_tag(v) == LUNA_TAG_OBJECT)
+#define luna_value_is_pointer(v) (luna_value_tag(v) == LUNA_TAG_POINTER)
+
+/*
+ * Check if `v` is truthy, only null and false are not.
+ */
+
+#define luna_value_is_truthy(v) ((v) != LUNA_NULL && (v) != LUNA_FALSE)
+
+/*
+ * Box an int, usable in constant expressions.
+ */
+
+#define luna_value_int(n) ((luna_value_t) (LUNA_TAG_INT | (uint32_t) (n)))
+
+/*
+ * Box a bool.
+ */
+
+#define luna_value_bool(b) ((b) ? LUNA_TRUE : LUNA_FALSE)
+
+/*
+ * Box an object.
+ */
+
+#define luna_value_object(p) \
+  ((luna_value_t) (LUNA_TAG_OBJECT | ((uintptr_t) (p) & LUNA_PAYLOAD_MASK)))
+
+/*
+ * Box an opaque pointer.
+ */
+
+#define luna_value_pointer(p) \
+  ((luna_value_t) (LUNA_TAG_POINTER | ((uintptr_t) (p) & LUNA_PAYLOAD_MASK)))
+
+/*
+ * Unbox an int.
+ */
+
+#define luna_value_as_int(v) ((int32_t) (uint32_t) (v))
+
+/*
+ * Unbox a bool.
+ */
+
+#define luna_value_as_bool(v) ((v) == LUNA_TRUE)
+
+/*
+ * Unbox an object or pointer.
+ */
+
+#define luna_value_as_pointer(v) ((void *) (uintptr_t) ((v) & LUNA_PAYLOAD_MASK))
+
+/*
+ * Box a float.
+ */
+
+static inline luna_value_t
+luna_value_float(double d) {
+  luna_value_t v;
+  if (d != d) return LUNA_NAN;
+  memcpy(&v, &d, sizeof(d));
+  return v;
+}
+
+/*
+ * Unbox a float.
+ */
+
+static inline double
+luna_value_as_float(luna_value_t v) {
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+/*
+ * Coerce `v` to a double, non-numbers are 0.
+ */
+
+static inline double
+luna_value_to_float(luna_value_t v) {
+  if (luna_value_is_int(v)) return luna_value_as_int(v);
+  if (luna_value_is_float(v)) return luna_value_as_float(v);
+  return 0;
+}
+
+/*
+ * Coerce `v` to an int, non-numbers are 0. Floats are
+ * truncated then wrap modulo 2^32, NaN and infinities
+ * being 0.
+ */
+
+static inline int32_t
+luna_value_to_int(luna_value_t v) {
+  if (luna_value_is_int(v)) return luna_value_as_int(v);
+  if (!luna_value_is_float(v)) return 0;
+  double d = luna_value_as_float(v);
+  if (d >= INT32_MIN && d <= INT32_MAX) return (int32_t) d;
+  if (d != d || d - d != 0) return 0;
+  d = fmod(trunc(d), 4294967296.0);
+  if (d < 0) d += 4294967296.0;
+  return (int32_t) (uint32_t) d;
+}
+
+#endif /* __LUNA_VALUE__ */
@@ -15,7 +15,7 @@
  * Luna array.
  */
 
-typedef kvec_t(luna_object_t *) luna_vec_t;
+typedef kvec_t(luna_value_t) luna_vec_t;
 
 /*
  * Initialize an array.
@@ -30,36 +30,36 @@ typedef kvec_t(luna_object_t *) luna_vec_t;
 #define luna_vec_length(self) kv_size(*self)
 
 /*
- * Push `obj` into the array.
+ * Push `val` into the array.
  */
 
-#define luna_vec_push(self, obj) \
-  kv_push(luna_object_t *, *self, obj)
+#define luna_vec_push(self, val) \
+  kv_push(luna_value_t, *self, val)
 
 /*
- * Pop an object out of the array.
+ * Pop a value out of the array, or null.
  */
 
 #define luna_vec_pop(self) \
   (luna_vec_length(self) \
     ? kv_pop(*self) \
-    : NULL)
+    : LUNA_NULL)
 
 /*
- * Return the object at `i`.
+ * Return the value at `i`, or null.
  */
 
 #define luna_vec_at(self, i) \
   (((i) >= 0 && (i) < luna_vec_length(self)) \
     ? kv_A(*self, (i)) \
-    : NULL)
+    : LUNA_NULL)
 
 /*
  * Iterate the array, populating `i` and `val`.
  */
 
 #define luna_vec_each(self, block) { \
-    luna_object_t *val; \
+    luna_value_t val; \
     int len = luna_vec_length(self); \
     for (int i = 0; i < len; ++i) { \
       val = luna_vec_at(self, i); \
@@ -8,36 +8,83 @@
 #include "visitor.h"
 
 /*
- * Visit the node when a `type` callback is present.
+ * Node being visited and the step it resumes at.
  */
 
-#define VISIT(type) \
-  if (!self->visit_##type) return; \
-  self->visit_##type(self, (luna_##type##_node_t *) node); \
-  break;
+typedef struct {
+  luna_node_id_t id;
+  int step;
+} frame_t;
 
 /*
- * Visit `node`, invoking the associated callback.
+ * Step the `type` callback when present, otherwise
+ * walk the node's children.
  */
 
-void
-luna_visit(luna_visitor_t *self, luna_node_t *node) {
+#define STEP(type) \
+  return self->visit_##type \
+    ? self->visit_##type(self, node, step) \
+    : luna_ast_child(self->ast, node, step);
+
+/*
+ * Run `step` of `node`, returning the next node to visit
+ * or 0 once it is done.
+ */
+
+static luna_node_id_t
+step(luna_visitor_t *self, luna_node_t *node, int step) {
   switch (node->type) {
-    case LUNA_NODE_BLOCK: VISIT(block);
-    case LUNA_NODE_ID: VISIT(id);
-    case LUNA_NODE_DECL: VISIT(decl);
-    case LUNA_NODE_INT: VISIT(int);
-    case LUNA_NODE_FLOAT: VISIT(float);
-    case LUNA_NODE_STRING: VISIT(string);
-    case LUNA_NODE_SLOT: VISIT(slot);
-    case LUNA_NODE_CALL: VISIT(call);
-    case LUNA_NODE_IF: VISIT(if);
-    case LUNA_NODE_WHILE: VISIT(while);
-    case LUNA_NODE_UNARY_OP: VISIT(unary_op);
-    case LUNA_NODE_BINARY_OP: VISIT(binary_op);
-    case LUNA_NODE_FUNCTION: VISIT(function);
-    case LUNA_NODE_ARRAY: VISIT(array);
-    case LUNA_NODE_HASH: VISIT(hash);
-    case LUNA_NODE_RETURN: VISIT(return);
+    case LUNA_NODE_BLOCK: STEP(block);
+    case LUNA_NODE_ID: STEP(id);
+    case LUNA_NODE_DECL: STEP(decl);
+    case LUNA_NODE_INT: STEP(int);
+    case LUNA_NODE_FLOAT: STEP(float);
+    case LUNA_NODE_BOOL: STEP(bool);
+    case LUNA_NODE_STRING: STEP(string);
+    case LUNA_NODE_SLOT: STEP(slot);
+    case LUNA_NODE_CALL: STEP(call);
+    case LUNA_NODE_IF: STEP(if);
+    case LUNA_NODE_WHILE: STEP(while);
+    case LUNA_NODE_UNARY_OP: STEP(unary_op);
+    case LUNA_NODE_BINARY_OP: STEP(binary_op);
+    case LUNA_NODE_FUNCTION: STEP(function);
+    case LUNA_NODE_ARRAY: STEP(array);
+    case LUNA_NODE_HASH: STEP(hash);
+    case LUNA_NODE_RETURN: STEP(return);
+  }
+  return 0;
+}
+
+/*
+ * Visit node `id` and everything it returns, invoking
+ * the associated callbacks.
+ */
+
+void
+luna_visit(luna_visitor_t *self, luna_node_id_t id) {
+  kvec_t(frame_t) stack;
+  if (!id) return;
+
+  kv_init(stack);
+  kv_push(frame_t, stack, ((frame_t) { id, 0 }));
+  if (self->enter) self->enter(self, luna_ast_node(self->ast, id));
+
+  while (kv_size(stack)) {
+    frame_t *frame = &kv_A(stack, kv_size(stack) - 1);
+    luna_node_t *node = luna_ast_node(self->ast, frame->id);
+    luna_node_id_t next = step(self, node, frame->step++);
+
+    // descend
+    if (next) {
+      kv_push(frame_t, stack, ((frame_t) { next, 0 }));
+      if (self->enter) self->enter(self, luna_ast_node(self->ast, next));
+      continue;
+    }
+
+    // done, resume the parent
+    if (self->leave) self->leave(self, node);
+    --kv_size(stack);
   }
-}
\ No newline at end of file
+
+  kv_destroy(stack);
+}
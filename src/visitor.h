@@ -10,39 +10,45 @@
 
 #include "ast.h"
 
-/*
- * Visit the given `node`.
- */
-
-#define visit(node) luna_visit(self, node)
-
 /*
  * Visitor struct.
+ *
+ * Nodes are visited from an explicit stack rather than by
+ * recursion, so arbitrarily deep trees are safe. `enter` and
+ * `leave` run before and after every node. In between, the
+ * node's callback is invoked with `step` 0 and again after
+ * each node it returns is visited, until it returns 0.
+ * Nodes without a callback have their children visited
+ * in source order.
  */
 
 typedef struct luna_visitor {
   void *data;
-  void (* visit_block)(struct luna_visitor *self, luna_block_node_t *node);
-  void (* visit_id)(struct luna_visitor *self, luna_id_node_t *node);
-  void (* visit_int)(struct luna_visitor *self, luna_int_node_t *node);
-  void (* visit_float)(struct luna_visitor *self, luna_float_node_t *node);
-  void (* visit_string)(struct luna_visitor *self, luna_string_node_t *node);
-  void (* visit_slot)(struct luna_visitor *self, luna_slot_node_t *node);
-  void (* visit_call)(struct luna_visitor *self, luna_call_node_t *node);
-  void (* visit_while)(struct luna_visitor *self, luna_while_node_t *node);
-  void (* visit_unary_op)(struct luna_visitor *self, luna_unary_op_node_t *node);
-  void (* visit_binary_op)(struct luna_visitor *self, luna_binary_op_node_t *node);
-  void (* visit_function)(struct luna_visitor *self, luna_function_node_t *node);
-  void (* visit_array)(struct luna_visitor *self, luna_array_node_t *node);
-  void (* visit_hash)(struct luna_visitor *self, luna_hash_node_t *node);
-  void (* visit_return)(struct luna_visitor *self, luna_return_node_t *node);
-  void (* visit_decl)(struct luna_visitor *self, luna_decl_node_t *node);
-  void (* visit_if)(struct luna_visitor *self, luna_if_node_t *node);
+  luna_ast_t *ast;
+  void (* enter)(struct luna_visitor *self, luna_node_t *node);
+  void (* leave)(struct luna_visitor *self, luna_node_t *node);
+  luna_node_id_t (* visit_block)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_id)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_int)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_float)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_bool)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_string)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_slot)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_call)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_while)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_unary_op)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_binary_op)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_function)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_array)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_hash)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_return)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_decl)(struct luna_visitor *self, luna_node_t *node, int step);
+  luna_node_id_t (* visit_if)(struct luna_visitor *self, luna_node_t *node, int step);
 } luna_visitor_t;
 
 // protos
 
 void
-luna_visit(luna_visitor_t *self, luna_node_t *node);
+luna_visit(luna_visitor_t *self, luna_node_id_t id);
 
 #endif /* __LUNA_VISITOR__ */
@@ -5,89 +5,665 @@
 // Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
 //
 
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "vm.h"
-#include "disasm.h"
+#include "scheduler.h"
+#include "reactor.h"
+#include "stream.h"
+#include "state.h"
 #include "object.h"
 #include "opcodes.h"
 #include "internal.h"
 
-luna_object_t *
-luna_eval(luna_vm_t *vm) {
-  luna_dump(vm);
-  printf("\n");
-  luna_instruction_t *ip = vm->main->ip;
+/*
+ * Use "labels as values" for threaded dispatch when
+ * available, unless -DLUNA_NO_COMPUTED_GOTO is given.
+ */
+
+#if defined(__GNUC__) && !defined(LUNA_NO_COMPUTED_GOTO)
+#define LUNA_COMPUTED_GOTO
+#endif
+
+/*
+ * Dispatch macros.
+ *
+ * With computed gotos each handler jumps directly to the
+ * next handler through the label table, giving every opcode
+ * its own indirect branch. Otherwise we fall back to a switch.
+ *
+ * Tracing swaps in a table whose entries all lead to `traced`,
+ * which records the instruction before jumping to its handler,
+ * so untraced runs pay nothing for it. The switch fallback
+ * tests the trace buffer once per instruction instead.
+ */
+
+#ifdef LUNA_COMPUTED_GOTO
+#define DISPATCH goto *table[OP(i = *ip++)]
+#define LOOP DISPATCH;
+#define CASE(op) op_##op
+#define NEXT DISPATCH
+#else
+#define LOOP for (;;) switch (i = *ip++, TRACE, OP(i))
+#define CASE(op) case LUNA_OP_##op
+#define NEXT break
+#endif
+
+/*
+ * Record the current instruction.
+ */
+
+#define TRACE \
+  (unlikely(trace) \
+    ? luna_trace_record(trace, ip - 1 - vm->main->ip, i) \
+    : (void) 0)
+
+/*
+ * Fail the task when `b` or `c` is a task, which has
+ * no value to compute with until joined.
+ */
+
+#define NUMERIC(b, c) \
+  if (unlikely(luna_is_task(b) || luna_is_task(c))) { \
+    fail(vm, ip, "task used as a number, join() it first"); \
+    ret = LUNA_NULL; \
+    goto halt; \
+  }
+
+/*
+ * Int arithmetic when both operands are ints, wrapping
+ * on overflow, otherwise float arithmetic.
+ */
+
+#define ARITH(op) { \
+  luna_value_t b = RK(B(i)), c = RK(C(i)); \
+  if (luna_is_int(b) && luna_is_int(c)) { \
+    R(A(i)) = luna_value_int((uint32_t) luna_value_as_int(b) op (uint32_t) luna_value_as_int(c)); \
+  } else { \
+    NUMERIC(b, c); \
+    R(A(i)) = luna_value_float(luna_value_to_float(b) op luna_value_to_float(c)); \
+  } \
+}
+
+/*
+ * Bitwise arithmetic, coercing operands to ints.
+ */
+
+#define BITWISE(op) { \
+  luna_value_t b = RK(B(i)), c = RK(C(i)); \
+  if (!(luna_is_int(b) && luna_is_int(c))) NUMERIC(b, c); \
+  R(A(i)) = luna_value_int(luna_value_to_int(b) op luna_value_to_int(c)); \
+}
+
+/*
+ * Bitwise shift of `type`, unsigned for left shifts so
+ * they wrap, by the low 5 bits of the count.
+ */
+
+#define SHIFT(type, op) { \
+  luna_value_t b = RK(B(i)), c = RK(C(i)); \
+  if (!(luna_is_int(b) && luna_is_int(c))) NUMERIC(b, c); \
+  R(A(i)) = luna_value_int((type) luna_value_to_int(b) op (luna_value_to_int(c) & 31)); \
+}
+
+/*
+ * Numeric comparison of `b` and `c`.
+ */
+
+#define NUMCMP(b, op, c) \
+  (luna_is_int(b) && luna_is_int(c) \
+    ? luna_value_as_int(b) op luna_value_as_int(c) \
+    : luna_value_to_float(b) op luna_value_to_float(c))
+
+/*
+ * Check RK(B) and RK(C) can be ordered, as ints
+ * always can.
+ */
+
+#define ORDERED { \
+  luna_value_t b = RK(B(i)), c = RK(C(i)); \
+  if (!(luna_is_int(b) && luna_is_int(c))) NUMERIC(b, c); \
+}
+
+/*
+ * Equality of `b` and `c`, numbers and strings compare
+ * by value, tasks by identity.
+ */
+
+#define EQUALS(b, c) \
+  (luna_value_is_number(b) && luna_value_is_number(c) \
+    ? luna_value_to_float(b) == luna_value_to_float(c) \
+    : b == c || same_string(b, c))
+
+/*
+ * Skip the next instruction unless `cond` of RK(B)
+ * and RK(C) matches A, so the following JMP is taken
+ * when it does.
+ */
+
+#define COMPARE(cond) { \
+  luna_value_t b = RK(B(i)), c = RK(C(i)); \
+  if ((cond) != A(i)) ip++; \
+}
+
+/*
+ * Jump by signed A when `cond` of RK(B) and RK(C) holds.
+ */
+
+#define BRANCH(cond) { \
+  luna_value_t b = RK(B(i)), c = RK(C(i)); \
+  if (cond) ip += SA(i); \
+}
+
+/*
+ * Switch to the next task `w` has to run, ending when there
+ * is none. On the first worker handles only reach tasks
+ * forked earlier, so there is always one while a task is
+ * blocked, unless the code is broken.
+ */
+
+#define RESUME { \
+  if (unlikely(!(task = luna_sched_next(sched, w)))) { \
+    ret = LUNA_NULL; \
+    goto end; \
+  } \
+  ip = task->ip; \
+  registers = task->registers; \
+}
+
+/*
+ * Park the task on file operation `type` of the path
+ * in RK(B), with `len` bytes of `data` to write, until
+ * the reactor stores its result to R(A), `none` until
+ * then. The path is read first, as R(A) may hold it.
+ */
+
+#define FILE_OP(type, none, data, len) { \
+  luna_value_t b = RK(B(i)); \
+  luna_reactor_t *reactor = luna_sched_reactor(sched); \
+  R(A(i)) = none; \
+  if (luna_is_string(b) && likely(NULL != reactor)) { \
+    const char *path = ((luna_string_t *) luna_value_as_pointer(b))->val; \
+    task->ip = ip; \
+    if (luna_reactor_file(reactor, task, type, path, data, len, &R(A(i)))) RESUME; \
+  } \
+}
+
+/*
+ * Check if `b` and `c` are strings of the same bytes.
+ */
+
+static int
+same_string(luna_value_t b, luna_value_t c) {
+  if (!luna_is_string(b) || !luna_is_string(c)) return 0;
+  luna_string_t *l = luna_value_as_pointer(b);
+  luna_string_t *r = luna_value_as_pointer(c);
+  return l->len == r->len && 0 == memcmp(l->val, r->val, l->len);
+}
+
+/*
+ * Return strings `b` and `c` concatenated,
+ * or null when out of memory.
+ */
+
+static luna_value_t
+concat(luna_value_t b, luna_value_t c) {
+  luna_string_t *l = luna_value_as_pointer(b);
+  luna_string_t *r = luna_value_as_pointer(c);
+  int len = l->len + r->len;
+  char *buf = malloc(len + 1);
+  if (unlikely(!buf)) return LUNA_NULL;
+  memcpy(buf, l->val, l->len);
+  memcpy(buf + l->len, r->val, r->len);
+  buf[len] = 0;
+
+  luna_string_t *str = luna_string_new(buf, len);
+  if (unlikely(!str)) {
+    free(buf);
+    return LUNA_NULL;
+  }
+  return luna_value_object(str);
+}
+
+/*
+ * Record runtime error `msg` of the instruction
+ * before `ip`, unless another task failed first.
+ */
+
+static void
+fail(luna_vm_t *vm, luna_instruction_t *ip, const char *msg) {
+  const char *none = NULL;
+  if (__atomic_compare_exchange_n(&vm->err, &none, msg, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    vm->lineno = kv_A(vm->main->lines, ip - 1 - vm->main->code.a);
+  }
+}
+
+/*
+ * Run `task` on worker `w`, then whatever else the
+ * scheduler hands it, until main halts or, on the other
+ * workers, the scheduler is stopped. Worker threads
+ * start without a task.
+ */
+
+static void *
+work(void *arg);
+
+static luna_value_t
+execute(luna_vm_t *vm, luna_worker_t *w, luna_task_t *task) {
+  luna_instruction_t *ip = NULL;
   luna_instruction_t i;
-  int registers[32] = {0};
-
-  for (;;) {
-    switch (OP(i = *ip++)) {
-      // LOADK
-      case LUNA_OP_LOADK:
-        printf("loadk %d\n", K(B(i)));
-        R((A(i))) = K(B(i));
-        break;
-
-      // LOADB
-      case LUNA_OP_LOADB:
-        printf("loadb %d %d %d\n", A(i), K(B(i)), C(i));
-        R(A(i)) = K(B(i));
-        if (C(i)) ip++;
-        break;
-
-      // ADD
-      case LUNA_OP_ADD:
-        R(A(i)) = RK(B(i)) + RK(C(i));
-        break;
-
-      // SUB
-      case LUNA_OP_SUB:
-        R(A(i)) = RK(B(i)) - RK(C(i));
-        break;
-
-      // DIV
-      case LUNA_OP_DIV:
-        R(A(i)) = RK(B(i)) / RK(C(i));
-        break;
-
-      // MUL
-      case LUNA_OP_MUL:
-        R(A(i)) = RK(B(i)) * RK(C(i));
-        break;
-
-      // MOD
-      case LUNA_OP_MOD:
-        R(A(i)) = RK(B(i)) % RK(C(i));
-        break;
-
-      // NEGATE
-      case LUNA_OP_NEGATE:
-        R(A(i)) = -R(B(i));
-        break;
-
-      // LT
-      case LUNA_OP_LT:
-        printf("lt %d %d\n", RK(B(i)), RK(C(i)));
-        if (RK(B(i)) < RK(C(i))) ip++;
-        break;
-
-      // LTE
-      case LUNA_OP_LTE:
-        printf("lte %d %d\n", RK(B(i)), RK(C(i)));
-        if (RK(B(i)) <= RK(C(i))) ip++;
-        break;
-
-      // JMP
-      case LUNA_OP_JMP:
-        printf("jmp %d\n", B(i));
-        ip += B(i);
-        break;
-
-      // HALT
-      case LUNA_OP_HALT:
+  luna_trace_t *trace = vm->trace;
+  luna_value_t *constants = vm->main->constants.a;
+  luna_value_t *registers = NULL;
+  luna_sched_t *sched = vm->sched;
+  luna_value_t ret;
+
+#ifdef LUNA_COMPUTED_GOTO
+  static void *labels[] = {
+#define o(op, str) &&op_##op,
+LUNA_OP_LIST
+#undef o
+  };
+
+  static void *traced_labels[] = {
+#define o(op, str) &&traced,
+LUNA_OP_LIST
+#undef o
+  };
+
+  void **table = trace ? traced_labels : labels;
+#endif
+
+  if (task) {
+    ip = task->ip;
+    registers = task->registers;
+  } else {
+    RESUME;
+  }
+
+  LOOP {
+#ifdef LUNA_COMPUTED_GOTO
+    // record and resume
+    traced:
+      TRACE;
+      goto *labels[OP(i)];
+#endif
+
+    // HALT
+    CASE(HALT):
+      ret = R(A(i));
+    halt:
+      if (task != &sched->main) {
+        luna_task_done(w, task, ret);
+        RESUME;
+      // main waits for the tasks still pending
+      } else if (luna_sched_pending(sched)) {
+        task->ip = ip - 1;
+        luna_sched_wait(sched, w);
+        RESUME;
+      } else {
         goto end;
+      }
+      NEXT;
+
+    // JMP
+    CASE(JMP):
+      ip += SB(i);
+      NEXT;
+
+    // LOADK
+    CASE(LOADK):
+      R(A(i)) = K(B(i));
+      NEXT;
+
+    // LOADB
+    CASE(LOADB):
+      R(A(i)) = K(B(i));
+      if (C(i)) ip++;
+      NEXT;
+
+    // MOVE
+    CASE(MOVE):
+      R(A(i)) = R(B(i));
+      NEXT;
+
+    // EQ
+    CASE(EQ):
+      COMPARE(EQUALS(b, c));
+      NEXT;
+
+    // LT
+    CASE(LT):
+      ORDERED;
+      COMPARE(NUMCMP(b, <, c));
+      NEXT;
+
+    // LTE
+    CASE(LTE):
+      ORDERED;
+      COMPARE(NUMCMP(b, <=, c));
+      NEXT;
+
+    // TEST
+    CASE(TEST):
+      if (luna_value_is_truthy(R(A(i))) != C(i)) ip++;
+      NEXT;
+
+    // JEQ
+    CASE(JEQ):
+      BRANCH(EQUALS(b, c));
+      NEXT;
+
+    // JLT
+    CASE(JLT):
+      ORDERED;
+      BRANCH(NUMCMP(b, <, c));
+      NEXT;
+
+    // JLTE
+    CASE(JLTE):
+      ORDERED;
+      BRANCH(NUMCMP(b, <=, c));
+      NEXT;
+
+    // JNEQ
+    CASE(JNEQ):
+      BRANCH(!EQUALS(b, c));
+      NEXT;
+
+    // JNLT
+    CASE(JNLT):
+      ORDERED;
+      BRANCH(!NUMCMP(b, <, c));
+      NEXT;
+
+    // JNLTE
+    CASE(JNLTE):
+      ORDERED;
+      BRANCH(!NUMCMP(b, <=, c));
+      NEXT;
+
+    // JTRUE
+    CASE(JTRUE):
+      if (luna_value_is_truthy(R(A(i)))) ip += SB(i);
+      NEXT;
+
+    // JFALSE
+    CASE(JFALSE):
+      if (!luna_value_is_truthy(R(A(i)))) ip += SB(i);
+      NEXT;
+
+    // ADD, concatenating strings
+    CASE(ADD): {
+      luna_value_t b = RK(B(i)), c = RK(C(i));
+      if (unlikely(luna_is_string(b) && luna_is_string(c))) {
+        R(A(i)) = concat(b, c);
+        NEXT;
+      }
+      ARITH(+);
+      NEXT;
+    }
+
+    // SUB
+    CASE(SUB):
+      ARITH(-);
+      NEXT;
+
+    // DIV
+    CASE(DIV): {
+      luna_value_t b = RK(B(i)), c = RK(C(i));
+      if (!(luna_is_int(b) && luna_is_int(c))) NUMERIC(b, c);
+      R(A(i)) = luna_is_int(b) && luna_is_int(c) && luna_value_as_int(c)
+        && !(INT32_MIN == luna_value_as_int(b) && -1 == luna_value_as_int(c))
+        ? luna_value_int(luna_value_as_int(b) / luna_value_as_int(c))
+        : luna_value_float(luna_value_to_float(b) / luna_value_to_float(c));
+      NEXT;
+    }
+
+    // MUL
+    CASE(MUL):
+      ARITH(*);
+      NEXT;
+
+    // MOD
+    CASE(MOD): {
+      luna_value_t b = RK(B(i)), c = RK(C(i));
+      if (!(luna_is_int(b) && luna_is_int(c))) NUMERIC(b, c);
+      R(A(i)) = luna_is_int(b) && luna_is_int(c) && luna_value_as_int(c)
+        && !(INT32_MIN == luna_value_as_int(b) && -1 == luna_value_as_int(c))
+        ? luna_value_int(luna_value_as_int(b) % luna_value_as_int(c))
+        : luna_value_float(fmod(luna_value_to_float(b), luna_value_to_float(c)));
+      NEXT;
+    }
+
+    // POW
+    CASE(POW): {
+      luna_value_t b = RK(B(i)), c = RK(C(i));
+      if (!(luna_is_int(b) && luna_is_int(c))) NUMERIC(b, c);
+      double d = pow(luna_value_to_float(b), luna_value_to_float(c));
+      R(A(i)) = luna_is_int(b) && luna_is_int(c)
+        && luna_value_as_int(c) >= 0 && d >= INT32_MIN && d <= INT32_MAX
+        ? luna_value_int((int32_t) d)
+        : luna_value_float(d);
+      NEXT;
+    }
+
+    // NEGATE
+    CASE(NEGATE): {
+      luna_value_t b = RK(B(i));
+      if (!luna_is_int(b)) NUMERIC(b, b);
+      R(A(i)) = luna_is_int(b)
+        ? luna_value_int(-(uint32_t) luna_value_as_int(b))
+        : luna_value_float(-luna_value_to_float(b));
+      NEXT;
+    }
+
+    // BIT_NOT
+    CASE(BIT_NOT): {
+      luna_value_t b = RK(B(i));
+      if (!luna_is_int(b)) NUMERIC(b, b);
+      R(A(i)) = luna_value_int(~luna_value_to_int(b));
+      NEXT;
+    }
+
+    // BIT_SHL
+    CASE(BIT_SHL):
+      SHIFT(uint32_t, <<);
+      NEXT;
+
+    // BIT_SHR
+    CASE(BIT_SHR):
+      SHIFT(int32_t, >>);
+      NEXT;
+
+    // BIT_AND
+    CASE(BIT_AND):
+      BITWISE(&);
+      NEXT;
+
+    // BIT_OR
+    CASE(BIT_OR):
+      BITWISE(|);
+      NEXT;
+
+    // BIT_XOR
+    CASE(BIT_XOR):
+      BITWISE(^);
+      NEXT;
+
+    // FORK
+    CASE(FORK): {
+      // start the other workers once there is work
+      if (unlikely(!sched->running) && sched->nworkers > 1 && !trace) {
+        luna_sched_start(sched, work, vm);
+      }
+      luna_task_t *t = luna_task_new(w, ip);
+      luna_instruction_t *c = ip += SB(i);
+      if (likely(NULL != t)) {
+        // captures precede the code after the task's
+        for (c -= C(i); c < ip; ++c) t->registers[A(*c)] = R(B(*c));
+        luna_sched_push(w, t);
+        R(A(i)) = luna_value_object(t);
+      } else {
+        R(A(i)) = LUNA_NULL;
+      }
+      NEXT;
+    }
+
+    // JOIN
+    CASE(JOIN): {
+      luna_value_t b = RK(B(i));
+      if (luna_is_task(b)) {
+        luna_task_t *t = luna_value_as_pointer(b);
+        // block, retrying the join once woken
+        if (!luna_task_is_done(t)) {
+          task->ip = ip - 1;
+          if (luna_task_wait(t, task)) {
+            RESUME;
+            NEXT;
+          }
+        }
+        b = t->result;
+      }
+      R(A(i)) = b;
+      NEXT;
+    }
+
+    // CAPTURE, read by FORK
+    CASE(CAPTURE):
+      NEXT;
+
+    // SLEEP, parking the task
+    CASE(SLEEP): {
+      double ms = luna_value_to_float(RK(B(i)));
+      R(A(i)) = LUNA_NULL;
+      if (ms > 0) {
+        luna_reactor_t *reactor = luna_sched_reactor(sched);
+        task->ip = ip;
+        if (likely(NULL != reactor) && luna_reactor_sleep(reactor, task, ms)) RESUME;
+      }
+      NEXT;
+    }
+
+    // CAT, parking the task until read
+    CASE(CAT): {
+      FILE_OP(LUNA_AIO_READ, LUNA_NULL, NULL, 0);
+      NEXT;
+    }
+
+    // WRITE, parking the task until written
+    CASE(WRITE): {
+      luna_value_t c = RK(C(i));
+      if (luna_is_string(c)) {
+        luna_string_t *str = luna_value_as_pointer(c);
+        FILE_OP(LUNA_AIO_WRITE, LUNA_FALSE, str->val, str->len);
+      } else {
+        R(A(i)) = LUNA_FALSE;
+      }
+      NEXT;
+    }
+
+    // DELETE, parking the task until unlinked
+    CASE(DELETE): {
+      FILE_OP(LUNA_AIO_UNLINK, LUNA_FALSE, NULL, 0);
+      NEXT;
+    }
+
+    // STAT, parking the task until its size is known
+    CASE(STAT): {
+      FILE_OP(LUNA_AIO_STAT, LUNA_NULL, NULL, 0);
+      NEXT;
+    }
+
+    // STREAM, over the file at path RK(B) when C
+    CASE(STREAM): {
+      luna_stream_t *stream = luna_stream_new(RK(B(i)), C(i));
+      R(A(i)) = likely(NULL != stream) ? luna_value_pointer(stream) : LUNA_NULL;
+      NEXT;
+    }
+
+    // GREP stage
+    CASE(GREP): {
+      if (likely(luna_value_is_pointer(R(A(i))))) {
+        luna_stream_grep(luna_value_as_pointer(R(A(i))), RK(B(i)));
+      }
+      NEXT;
+    }
+
+    // PRINT stage
+    CASE(PRINT): {
+      if (likely(luna_value_is_pointer(R(A(i))))) {
+        luna_stream_print(luna_value_as_pointer(R(A(i))));
+      }
+      NEXT;
+    }
+
+    // DRAIN, parking the task on each chunk and
+    // running DRAIN again once it is read
+    CASE(DRAIN): {
+      luna_value_t b = R(B(i));
+      if (unlikely(!luna_value_is_pointer(b))) {
+        R(A(i)) = LUNA_NULL;
+        NEXT;
+      }
+      luna_stream_t *stream = luna_value_as_pointer(b);
+      task->ip = ip - 1;
+      if (luna_stream_next(stream, luna_sched_reactor(sched), task)) {
+        RESUME;
+      } else {
+        R(A(i)) = luna_stream_result(stream);
+        luna_stream_free(stream);
+      }
+      NEXT;
     }
   }
 
 end:
-  return luna_int_new(R(0));
+  return ret;
+}
+
+/*
+ * Worker thread, running tasks of the vm
+ * until the scheduler is stopped.
+ */
+
+static void *
+work(void *arg) {
+  luna_worker_t *w = arg;
+  execute(w->sched->data, w, NULL);
+  return NULL;
+}
+
+/*
+ * Evaluate the main activation of `vm`, along with
+ * the tasks it forks, on a single worker unless the
+ * vm is given a scheduler of its own.
+ */
+
+luna_value_t
+luna_eval(luna_vm_t *vm) {
+  int nregisters = vm->main->nregisters;
+
+  // grow, keeping the registers of earlier evaluations
+  if (kv_size(vm->registers) < nregisters) {
+    kv_resize(luna_value_t, vm->registers, nregisters);
+    for (int n = kv_size(vm->registers); n < nregisters; ++n) {
+      kv_A(vm->registers, n) = LUNA_NULL;
+    }
+    kv_size(vm->registers) = nregisters;
+  }
+
+  // main runs as a task of its own
+  if (unlikely(!vm->sched) && !(vm->sched = luna_sched_new(1))) return LUNA_NULL;
+  luna_sched_t *sched = vm->sched;
+  luna_task_t *main = &sched->main;
+  main->ip = vm->main->ip;
+  main->registers = vm->registers.a;
+  luna_sched_reserve(sched, nregisters);
+
+  luna_value_t ret = execute(vm, sched->workers, main);
+  luna_sched_stop(sched);
+  return ret;
 }
@@ -10,12 +10,23 @@
 
 #include <stdint.h>
 #include "ast.h"
+#include "vec.h"
+#include "value.h"
+#include "trace.h"
+#include "khash.h"
 
 /*
  * Instruction.
  */
 
-typedef uint32_t luna_instruction_t;
+typedef uint64_t luna_instruction_t;
+
+/*
+ * Constant pool index, mapping a value's bits
+ * to its slot so identical constants are shared.
+ */
+
+KHASH_MAP_INIT_INT64(kindex, int);
 
 /*
  * Luna activation record.
@@ -23,68 +34,141 @@ typedef uint32_t luna_instruction_t;
 
 typedef struct {
   luna_instruction_t *ip;
-  luna_instruction_t *code; // TODO: pointer to single malloc()?
-  int nconstants;
-  int *constants;
+  kvec_t(luna_instruction_t) code;
+  kvec_t(uint32_t) lines;
+  int nregisters;
+  luna_vec_t constants;
+  khash_t(kindex) *kindex;
 } luna_activation_t;
 
 /*
  * Luna VM.
+ *
+ * Registers outlive an evaluation, so code appended to
+ * `main` later sees the locals left by what ran before.
+ * `sched` runs forked tasks, allocated on first use.
+ * `err` is the first runtime error of an evaluation,
+ * raised on line `lineno`, the task failing ending
+ * as though it halted with null.
  */
 
 typedef struct {
   luna_activation_t *main;
   luna_instruction_t *jump;
+  kvec_t(luna_value_t) registers;
+  struct luna_sched *sched;
+  luna_trace_t *trace;
+  const char *err;
+  int lineno;
 } luna_vm_t;
 
 /*
- *   8    8   8   8
- * +----------------+
- * | op | a | b | c |
- * +----------------+
+ * Operand limits.
+ */
+
+#define LUNA_MAX_A 0xffff
+#define LUNA_MAX_BC 0xfffff
+
+/*
+ * Registers are addressed by A, so at most 65536 per
+ * activation, and constants by the low 19 bits of B or C.
+ */
+
+#define LUNA_MAX_REGISTERS (LUNA_MAX_A + 1)
+#define LUNA_MAX_CONSTANTS LUNA_RK_CONSTANT
+
+/*
+ * Jump offsets are signed 20-bit B operands, or
+ * signed 16-bit A operands for compare-and-branch.
+ */
+
+#define LUNA_MAX_JUMP 0x7ffff
+#define LUNA_MAX_SHORT_JUMP 0x7fff
+
+/*
+ *   8     16       20        20
+ * +-------------------------------+
+ * | op |  a  |     b    |    c    |
+ * +-------------------------------+
  */
 
-#define ABC(op, a, b, c) \
-  ( LUNA_OP_##op << 24 \
-  | (a) << 16 \
-  | (b) << 8 \
-  | (c) )
+#define ENCODE(op, a, b, c) \
+  ( (luna_instruction_t) (op) << 56 \
+  | (luna_instruction_t) ((a) & LUNA_MAX_A) << 40 \
+  | (luna_instruction_t) ((b) & LUNA_MAX_BC) << 20 \
+  | (luna_instruction_t) ((c) & LUNA_MAX_BC) )
 
 /*
- *   8    8    16
- * +----------------+
- * | op | a |   b   |
- * +----------------+
+ * Encode `op` with operands a, b and c.
  */
 
-#define AB(op, a, b) \
-  ( LUNA_OP_##op << 24 \
-  | (a) << 16 \
-  | (b) << 8 )
+#define ABC(op, a, b, c) ENCODE(LUNA_OP_##op, a, b, c)
+
+/*
+ * Encode `op` with operands a and b.
+ */
+
+#define AB(op, a, b) ENCODE(LUNA_OP_##op, a, b, 0)
 
 /*
  * Opcode.
  */
 
-#define OP(i) ((i) >> 24 & 0xff)
+#define OP(i) ((int) ((i) >> 56 & 0xff))
 
 /*
  * Operand A.
  */
 
-#define A(i) ((i) >> 16 & 0xff)
+#define A(i) ((int) ((i) >> 40 & LUNA_MAX_A))
+
+/*
+ * Operand A as a signed offset.
+ */
+
+#define SA(i) ((int) (int16_t) A(i))
 
 /*
  * Operand B.
  */
 
-#define B(i) ((i) >> 8 & 0xff)
+#define B(i) ((int) ((i) >> 20 & LUNA_MAX_BC))
+
+/*
+ * Operand B as a signed offset.
+ */
+
+#define SB(i) ((int32_t) ((uint32_t) B(i) << 12) >> 12)
 
 /*
  * Operand C.
  */
 
-#define C(i) ((i) & 0xff)
+#define C(i) ((int) ((i) & LUNA_MAX_BC))
+
+/*
+ * MSB of a B or C operand, flagging a constant.
+ */
+
+#define LUNA_RK_CONSTANT 0x80000
+
+/*
+ * Check if operand `n` is a constant.
+ */
+
+#define ISK(n) ((n) & LUNA_RK_CONSTANT)
+
+/*
+ * Constant index `n` as an RK operand.
+ */
+
+#define RKASK(n) ((n) | LUNA_RK_CONSTANT)
+
+/*
+ * Constant index of RK operand `n`.
+ */
+
+#define INDEXK(n) ((n) & ~LUNA_RK_CONSTANT)
 
 /*
  * Register n.
@@ -96,19 +180,18 @@ typedef struct {
  * Constant n.
  */
 
-#define K(n) vm->main->constants[(n) - 32]
+#define K(n) constants[n]
 
 /*
  * Register or constant.
  */
 
-// TODO: MSB
 #define RK(n) \
-   ((n) < 32 ? R(n) : K(n))
+   (ISK(n) ? K(INDEXK(n)) : R(n))
 
 // protoypes
 
-luna_object_t *
+luna_value_t
 luna_eval(luna_vm_t *vm);
 
 #endif /* __LUNA_VM__ */
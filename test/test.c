@@ -1,13 +1,40 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "khash.h"
 #include "state.h"
 #include "object.h"
 #include "hash.h"
 #include "vec.h"
+#include "arena.h"
+#include "parser.h"
+#include "visitor.h"
+#include "scheduler.h"
+#include "reactor.h"
+#include "stream.h"
+#include "search.h"
+#include "span.h"
+#include "codegen.h"
+#include "vm.h"
+#include "opcodes.h"
+#include "bytecode.h"
+#include "source.h"
+#include "utils.h"
+
+/*
+ * State shared by the compiled programs.
+ */
+
+static luna_state_t state;
 
 /*
  * Test luna_is_* macros.
@@ -15,12 +42,49 @@
 
 static void
 test_value_is() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  assert(luna_is_int(&one));
-  assert(!luna_is_string(&one));
+  luna_value_t one = luna_value_int(1);
+  assert(luna_is_int(one));
+  assert(!luna_is_float(one));
+  assert(!luna_is_string(one));
+
+  luna_value_t two = LUNA_NULL;
+  assert(luna_is_null(two));
+  assert(!luna_is_bool(two));
+
+  luna_value_t three = luna_value_float(1.5);
+  assert(luna_is_float(three));
+  assert(!luna_is_int(three));
+
+  assert(luna_is_bool(LUNA_TRUE));
+  assert(luna_is_bool(luna_value_bool(0)));
+  assert(LUNA_TYPE_NODE == luna_value_type(luna_value_pointer(&one)));
+}
+
+/*
+ * Test boxing and unboxing values.
+ */
 
-  luna_object_t two = { .type = LUNA_TYPE_NULL };
-  assert(luna_is_null(&two));
+static void
+test_value_box() {
+  assert(1 == luna_value_as_int(luna_value_int(1)));
+  assert(-5 == luna_value_as_int(luna_value_int(-5)));
+  assert(INT32_MIN == luna_value_as_int(luna_value_int(INT32_MIN)));
+  assert(1.5 == luna_value_as_float(luna_value_float(1.5)));
+  assert(-0.25 == luna_value_as_float(luna_value_float(-0.25)));
+  assert(luna_is_float(luna_value_float(0.0 / 0.0)));
+  assert(luna_value_as_bool(LUNA_TRUE));
+  assert(!luna_value_as_bool(LUNA_FALSE));
+  assert(3.0 == luna_value_to_float(luna_value_int(3)));
+  assert(2 == luna_value_to_int(luna_value_float(2.9)));
+  assert(-2 == luna_value_to_int(luna_value_float(-2.9)));
+  assert(-1294967296 == luna_value_to_int(luna_value_float(3000000000.0)));
+  assert(5 == luna_value_to_int(luna_value_float(-4294967291.0)));
+  assert(0 == luna_value_to_int(luna_value_float(1.0 / 0.0)));
+  assert(0 == luna_value_to_int(luna_value_float(0.0 / 0.0)));
+
+  int n;
+  assert(&n == luna_value_as_pointer(luna_value_pointer(&n)));
+  assert(&n == luna_value_as_pointer(luna_value_object(&n)));
 }
 
 /*
@@ -32,19 +96,19 @@ test_array_length() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   assert(0 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &one);
+  luna_vec_push(&arr, one);
   assert(1 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &two);
+  luna_vec_push(&arr, two);
   assert(2 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &three);
+  luna_vec_push(&arr, three);
   assert(3 == luna_vec_length(&arr));
 }
 
@@ -57,32 +121,32 @@ test_array_push() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   assert(0 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &one);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &one);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &two);
-  luna_vec_push(&arr, &three);
-  assert(3 == luna_vec_pop(&arr)->value.as_int);
-  assert(2 == luna_vec_pop(&arr)->value.as_int);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-
-  assert(NULL == luna_vec_pop(&arr));
-  assert(NULL == luna_vec_pop(&arr));
-  assert(NULL == luna_vec_pop(&arr));
-  luna_vec_push(&arr, &one);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
+  luna_vec_push(&arr, one);
+  assert(1 == luna_value_as_int(luna_vec_pop(&arr)));
+
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, one);
+  assert(1 == luna_value_as_int(luna_vec_pop(&arr)));
+  assert(1 == luna_value_as_int(luna_vec_pop(&arr)));
+
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, two);
+  luna_vec_push(&arr, three);
+  assert(3 == luna_value_as_int(luna_vec_pop(&arr)));
+  assert(2 == luna_value_as_int(luna_vec_pop(&arr)));
+  assert(1 == luna_value_as_int(luna_vec_pop(&arr)));
+
+  assert(luna_is_null(luna_vec_pop(&arr)));
+  assert(luna_is_null(luna_vec_pop(&arr)));
+  assert(luna_is_null(luna_vec_pop(&arr)));
+  luna_vec_push(&arr, one);
+  assert(1 == luna_value_as_int(luna_vec_pop(&arr)));
 }
 
 /*
@@ -94,21 +158,21 @@ test_array_at() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &two);
-  luna_vec_push(&arr, &three);
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, two);
+  luna_vec_push(&arr, three);
 
-  assert(1 == luna_vec_at(&arr, 0)->value.as_int);
-  assert(2 == luna_vec_at(&arr, 1)->value.as_int);
-  assert(3 == luna_vec_at(&arr, 2)->value.as_int);
+  assert(1 == luna_value_as_int(luna_vec_at(&arr, 0)));
+  assert(2 == luna_value_as_int(luna_vec_at(&arr, 1)));
+  assert(3 == luna_value_as_int(luna_vec_at(&arr, 2)));
 
-  assert(NULL == luna_vec_at(&arr, -1123));
-  assert(NULL == luna_vec_at(&arr, 5));
-  assert(NULL == luna_vec_at(&arr, 1231231));
+  assert(luna_is_null(luna_vec_at(&arr, -1123)));
+  assert(luna_is_null(luna_vec_at(&arr, 5)));
+  assert(luna_is_null(luna_vec_at(&arr, 1231231)));
 }
 
 /*
@@ -120,18 +184,18 @@ test_array_iteration() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &two);
-  luna_vec_push(&arr, &three);
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, two);
+  luna_vec_push(&arr, three);
 
   int vals[3];
   int k = 0;
 
-  luna_vec_each(&arr, { vals[k++] = val->value.as_int; });
+  luna_vec_each(&arr, { vals[k++] = luna_value_as_int(val); });
   assert(1 == vals[0]);
   assert(2 == vals[1]);
   assert(3 == vals[2]);
@@ -143,27 +207,27 @@ test_array_iteration() {
 
 static void
 test_hash_set() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   luna_hash_t *obj = luna_hash_new();
 
   assert(0 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "one", &one);
+  luna_hash_set(obj, "one", one);
   assert(1 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "two", &two);
+  luna_hash_set(obj, "two", two);
   assert(2 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "three", &three);
+  luna_hash_set(obj, "three", three);
   assert(3 == luna_hash_size(obj));
 
-  assert(&one == luna_hash_get(obj, "one"));
-  assert(&two == luna_hash_get(obj, "two"));
-  assert(&three == luna_hash_get(obj, "three"));
-  assert(NULL == luna_hash_get(obj, "four"));
+  assert(one == luna_hash_get(obj, "one"));
+  assert(two == luna_hash_get(obj, "two"));
+  assert(three == luna_hash_get(obj, "three"));
+  assert(luna_is_null(luna_hash_get(obj, "four")));
 
   luna_hash_destroy(obj);
 }
@@ -174,11 +238,11 @@ test_hash_set() {
 
 static void
 test_hash_has() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
+  luna_value_t one = luna_value_int(1);
 
   luna_hash_t *obj = luna_hash_new();
 
-  luna_hash_set(obj, "one", &one);
+  luna_hash_set(obj, "one", one);
 
   assert(1 == luna_hash_has(obj, "one"));
   assert(0 == luna_hash_has(obj, "foo"));
@@ -192,21 +256,21 @@ test_hash_has() {
 
 static void
 test_hash_remove() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
+  luna_value_t one = luna_value_int(1);
 
   luna_hash_t *obj = luna_hash_new();
 
-  luna_hash_set(obj, "one", &one);
-  assert(&one == luna_hash_get(obj, "one"));
+  luna_hash_set(obj, "one", one);
+  assert(one == luna_hash_get(obj, "one"));
 
   luna_hash_remove(obj, "one");
-  assert(NULL == luna_hash_get(obj, "one"));
+  assert(luna_is_null(luna_hash_get(obj, "one")));
 
-  luna_hash_set(obj, "one", &one);
-  assert(&one == luna_hash_get(obj, "one"));
+  luna_hash_set(obj, "one", one);
+  assert(one == luna_hash_get(obj, "one"));
 
   luna_hash_remove(obj, "one");
-  assert(NULL == luna_hash_get(obj, "one"));
+  assert(luna_is_null(luna_hash_get(obj, "one")));
 
   luna_hash_destroy(obj);
 }
@@ -230,19 +294,19 @@ valid_slot(const char *slot) {
 
 static void
 test_hash_iteration() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   luna_hash_t *obj = luna_hash_new();
 
   assert(0 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "one", &one);
-  luna_hash_set(obj, "two", &two);
-  luna_hash_set(obj, "three", &three);
-  luna_hash_set(obj, "four", &three);
-  luna_hash_set(obj, "five", &three);
+  luna_hash_set(obj, "one", one);
+  luna_hash_set(obj, "two", two);
+  luna_hash_set(obj, "three", three);
+  luna_hash_set(obj, "four", three);
+  luna_hash_set(obj, "five", three);
 
   const char *slots[luna_hash_size(obj)];
   int i = 0;
@@ -268,7 +332,7 @@ test_hash_iteration() {
 
 static void
 test_hash_mixins() {
-  luna_object_t type = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
+  luna_value_t type = luna_value_int(1);
   luna_vec_t arr;
   luna_vec_init(&arr);
 }
@@ -294,6 +358,1567 @@ test_string() {
   assert(2 == kh_size(state.strs));
 }
 
+/*
+ * Test arena allocation.
+ */
+
+static void
+test_arena_alloc() {
+  luna_arena_t arena;
+  luna_arena_init(&arena);
+  assert(0 == arena.nchunks);
+
+  char *prev = luna_arena_alloc(&arena, 1);
+  for (int i = 0; i < 1000; ++i) {
+    char *ptr = luna_arena_alloc(&arena, 13);
+    assert(0 == (uintptr_t) ptr % LUNA_ARENA_ALIGN);
+    assert(ptr > prev);
+    prev = ptr;
+  }
+  assert(1 == arena.nchunks);
+
+  // large allocations leave the current chunk in place
+  char *big = luna_arena_alloc(&arena, LUNA_ARENA_CHUNK);
+  memset(big, 'x', LUNA_ARENA_CHUNK);
+  assert(2 == arena.nchunks);
+  assert(prev + 16 == (char *) luna_arena_alloc(&arena, 8));
+
+  char *str = luna_arena_strndup(&arena, "foobar", 3);
+  assert(0 == strcmp("foo", str));
+
+  luna_vec_t *vec = luna_arena_vec(&arena);
+  for (int i = 0; i < 100; ++i) luna_vec_push(vec, luna_value_int(i));
+  assert(99 == luna_value_as_int(luna_vec_at(vec, 99)));
+
+  luna_arena_free(&arena);
+  assert(0 == arena.nchunks);
+  assert(NULL == arena.chunk);
+}
+
+/*
+ * Test the ast is flat, 16 byte nodes with
+ * children gathered in extra.
+ */
+
+static void
+test_ast_flat() {
+  char source[4096] = "";
+  for (int i = 0; i < 200; ++i) strcat(source, "a = b + 1 * c\n");
+
+  luna_lexer_t lex;
+  luna_parser_t parser;
+  luna_ast_t ast;
+  luna_ast_init(&ast);
+  luna_lexer_init(&lex, source, "test", &state);
+  luna_parser_init(&parser, &lex, &ast);
+  luna_node_id_t root = luna_parse(&parser);
+  assert(root);
+  assert(16 == sizeof(luna_node_t));
+
+  // 7 nodes a statement, the block and none
+  luna_node_t *block = luna_ast_node(&ast, root);
+  assert(LUNA_NODE_BLOCK == block->type);
+  assert(200 == block->b);
+  assert(200 * 7 + 2 == kv_size(ast.nodes));
+  assert(200 == kv_size(ast.extra));
+  assert(0 == luna_ast_mark(&ast));
+
+  // (= (id a) (+ (id b) (* (int 1) (id c))))
+  luna_node_t *stmt = luna_ast_node(&ast, luna_ast_extra(&ast, block->a + 199));
+  assert(LUNA_NODE_BINARY_OP == stmt->type);
+  assert(LUNA_TOKEN_OP_ASSIGN == stmt->op);
+  assert(200 == stmt->lineno);
+  assert(0 == strcmp("a", luna_ast_name(&ast, luna_ast_node(&ast, stmt->a)->a)));
+  luna_node_t *mul = luna_ast_node(&ast, luna_ast_node(&ast, stmt->b)->b);
+  assert(LUNA_TOKEN_OP_MUL == mul->op);
+  assert(LUNA_NODE_INT == luna_ast_node(&ast, mul->a)->type);
+  assert(1 == luna_ast_node(&ast, mul->a)->a);
+
+  luna_ast_free(&ast);
+}
+
+/*
+ * Test parse errors name the operation missing
+ * an operand.
+ */
+
+static void
+test_ast_errors() {
+  char *sources[][2] = {
+    { "'s' != f(a) != -a ** -a / (a + b) ^ f(a)", "** operation" },
+    { "a ^", "^ operation" },
+    { "a + (b *)", "multiplicative operation" },
+    { "1 < 2 <", "relational operation" }
+  };
+
+  for (int i = 0; i < sizeof(sources) / sizeof(sources[0]); ++i) {
+    luna_lexer_t lex;
+    luna_parser_t parser;
+    luna_ast_t ast;
+    luna_ast_init(&ast);
+    luna_lexer_init(&lex, sources[i][0], "test", &state);
+    luna_parser_init(&parser, &lex, &ast);
+    assert(!luna_parse(&parser));
+    assert(0 == strcmp(sources[i][1], parser.ctx));
+    assert(0 == strcmp("missing right-hand expression", parser.err));
+    luna_ast_free(&ast);
+  }
+}
+
+/*
+ * Test nested lists are gathered without interleaving.
+ */
+
+static void
+test_ast_lists() {
+  char source[] = "if a\n  b = [1, [2, 3], 4]\nend else if c\n  d\nend else if e\n  f\nend else\n  g\nend";
+
+  luna_lexer_t lex;
+  luna_parser_t parser;
+  luna_ast_t ast;
+  luna_ast_init(&ast);
+  luna_lexer_init(&lex, source, "test", &state);
+  luna_parser_init(&parser, &lex, &ast);
+  luna_node_id_t root = luna_parse(&parser);
+  assert(root);
+  assert(0 == luna_ast_mark(&ast));
+
+  luna_node_t *block = luna_ast_node(&ast, root);
+  assert(1 == block->b);
+  luna_node_t *stmt = luna_ast_node(&ast, luna_ast_extra(&ast, block->a));
+  assert(LUNA_NODE_IF == stmt->type);
+  luna_if_extra_t *extra = luna_ast_record(&ast, stmt->b, luna_if_extra_t);
+  assert(2 == extra->else_ifs.len);
+  assert(extra->else_block);
+
+  // [1, [2, 3], 4]
+  luna_node_t *body = luna_ast_node(&ast, extra->block);
+  luna_node_t *assign = luna_ast_node(&ast, luna_ast_extra(&ast, body->a));
+  luna_node_t *arr = luna_ast_node(&ast, assign->b);
+  assert(LUNA_NODE_ARRAY == arr->type);
+  assert(3 == arr->b);
+  int ints[] = { 1, 0, 4 };
+  luna_list_each(&ast, luna_ast_list(arr), {
+    luna_node_t *val = luna_ast_node(&ast, id);
+    if (1 == i) {
+      assert(LUNA_NODE_ARRAY == val->type);
+      assert(2 == val->b);
+      assert(3 == luna_ast_node(&ast, luna_ast_extra(&ast, val->a + 1))->a);
+    } else {
+      assert(LUNA_NODE_INT == val->type);
+      assert(ints[i] == val->a);
+    }
+  });
+
+  // else ifs
+  const char *names[] = { "c", "e" };
+  luna_list_each(&ast, extra->else_ifs, {
+    luna_node_t *else_if = luna_ast_node(&ast, id);
+    assert(LUNA_NODE_IF == else_if->type);
+    assert(0 == strcmp(names[i], luna_ast_name(&ast, luna_ast_node(&ast, else_if->a)->a)));
+  });
+
+  luna_ast_free(&ast);
+}
+
+/*
+ * Append the names of id nodes entered to `data`.
+ */
+
+static void
+enter_id(luna_visitor_t *self, luna_node_t *node) {
+  if (LUNA_NODE_ID != node->type) return;
+  strcat(self->data, luna_ast_name(self->ast, node->a));
+}
+
+/*
+ * Append "." to `data` for each block left.
+ */
+
+static void
+leave_block(luna_visitor_t *self, luna_node_t *node) {
+  if (LUNA_NODE_BLOCK == node->type) strcat(self->data, ".");
+}
+
+/*
+ * Test nodes without callbacks are walked in source order.
+ */
+
+static void
+test_visit_order() {
+  char source[] = "if a\n  b(c)\nend else if f\n  [g, { h: i }]\nend else\n  j = -k\nend\nl";
+  char out[64] = "";
+
+  luna_lexer_t lex;
+  luna_parser_t parser;
+  luna_ast_t ast;
+  luna_ast_init(&ast);
+  luna_lexer_init(&lex, source, "test", &state);
+  luna_parser_init(&parser, &lex, &ast);
+  luna_node_id_t root = luna_parse(&parser);
+  assert(root);
+
+  luna_visitor_t visitor = {
+    .data = out,
+    .ast = &ast,
+    .enter = enter_id,
+    .leave = leave_block
+  };
+
+  luna_visit(&visitor, root);
+  assert(0 == strcmp("abc.fgi.jk.l.", out));
+  luna_ast_free(&ast);
+}
+
+/*
+ * Scan the next token of `lex`, expecting `type`.
+ */
+
+static void
+expect(luna_lexer_t *lex, luna_token type) {
+  luna_scan(lex);
+  assert(type == lex->tok.type);
+}
+
+/*
+ * Test tokens slice the source and ids are interned.
+ */
+
+static void
+test_lexer_slices() {
+  char source[] = "foo = 'bar'\nfoo + \"b\\x61r\\n\"";
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, source, "test", &state);
+
+  expect(&lex, LUNA_TOKEN_ID);
+  const char *foo = lex.tok.value.as_string;
+  assert(0 == strcmp("foo", foo));
+  assert(0 == lex.tok.offset && 3 == lex.tok.len);
+
+  expect(&lex, LUNA_TOKEN_OP_ASSIGN);
+  assert(4 == lex.tok.offset && 1 == lex.tok.len);
+
+  expect(&lex, LUNA_TOKEN_STRING);
+  const char *bar = lex.tok.value.as_string;
+  assert(0 == strcmp("bar", bar));
+  assert(6 == lex.tok.offset && 5 == lex.tok.len);
+
+  expect(&lex, LUNA_TOKEN_ID);
+  assert(foo == lex.tok.value.as_string);
+  assert(lex.tok.newline);
+
+  expect(&lex, LUNA_TOKEN_OP_PLUS);
+  expect(&lex, LUNA_TOKEN_STRING);
+  assert(0 == strcmp("bar\n", lex.tok.value.as_string));
+  assert(10 == lex.tok.len);
+
+  expect(&lex, LUNA_TOKEN_EOS);
+}
+
+/*
+ * Test number literals, with and without
+ * fractions and exponents.
+ */
+
+static void
+test_lexer_numbers() {
+  char source[] = "1_000 2e3 15e-1 1.5e2 0.25 3000000000.0";
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, source, "test", &state);
+
+  expect(&lex, LUNA_TOKEN_INT);
+  assert(1000 == lex.tok.value.as_int);
+  expect(&lex, LUNA_TOKEN_INT);
+  assert(2000 == lex.tok.value.as_int);
+  expect(&lex, LUNA_TOKEN_INT);
+  assert(1 == lex.tok.value.as_int);
+  expect(&lex, LUNA_TOKEN_FLOAT);
+  assert(150 == lex.tok.value.as_float);
+  expect(&lex, LUNA_TOKEN_FLOAT);
+  assert(0.25 == lex.tok.value.as_float);
+  expect(&lex, LUNA_TOKEN_FLOAT);
+  assert(3000000000.0 == lex.tok.value.as_float);
+  expect(&lex, LUNA_TOKEN_EOS);
+}
+
+/*
+ * Test keyword recognition.
+ */
+
+static void
+test_lexer_keywords() {
+  char source[] = "if for def end let and not else type while until return unless "
+    "i iff fo ends le nota elsa types whilst untl returns unles _if IF x";
+  luna_token types[] = {
+    LUNA_TOKEN_IF,
+    LUNA_TOKEN_FOR,
+    LUNA_TOKEN_DEF,
+    LUNA_TOKEN_END,
+    LUNA_TOKEN_LET,
+    LUNA_TOKEN_OP_BIT_AND,
+    LUNA_TOKEN_OP_LNOT,
+    LUNA_TOKEN_ELSE,
+    LUNA_TOKEN_TYPE,
+    LUNA_TOKEN_WHILE,
+    LUNA_TOKEN_UNTIL,
+    LUNA_TOKEN_RETURN,
+    LUNA_TOKEN_UNLESS
+  };
+
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, source, "test", &state);
+  for (int i = 0; i < sizeof(types) / sizeof(types[0]); ++i) expect(&lex, types[i]);
+  for (int i = 0; i < 15; ++i) expect(&lex, LUNA_TOKEN_ID);
+  expect(&lex, LUNA_TOKEN_EOS);
+}
+
+/*
+ * Test character class spans at every alignment.
+ */
+
+static void
+test_lexer_spans() {
+  static char buf[256] __attribute__((aligned(64)));
+  const char *runs[] = { " \t", "abcXYZ_09", "0123456789", "# foo \t bar" };
+  const char *stops[] = { "a\n", " -.\n\x80", "a_. ", "\n" };
+  size_t (*spans[])(const char *) = {
+    luna_span_blanks,
+    luna_span_ident,
+    luna_span_digits,
+    luna_span_line
+  };
+
+  for (int s = 0; s < 4; ++s) {
+    for (int off = 0; off < 40; ++off) {
+      for (int len = 0; len < 100; ++len) {
+        char *str = buf + off;
+        for (int i = 0; i < len; ++i) str[i] = runs[s][i % strlen(runs[s])];
+        for (const char *stop = stops[s]; *stop; ++stop) {
+          str[len] = *stop;
+          str[len + 1] = 0;
+          assert(len == spans[s](str));
+        }
+        str[len] = 0;
+        assert(len == spans[s](str));
+      }
+    }
+  }
+}
+
+/*
+ * Test the lexer never writes to the source.
+ */
+
+static void
+test_lexer_readonly() {
+  const char *source = "a = b <= 1 && c != 'd' # e\n0x1f >> 2.5 ||= f\n";
+  long page = sysconf(_SC_PAGESIZE);
+  char *buf = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(MAP_FAILED != buf);
+  strcpy(buf, source);
+  assert(0 == mprotect(buf, page, PROT_READ));
+
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, buf, "test", &state);
+  int n = 0;
+  while (luna_scan(&lex)) ++n;
+  assert(!lex.error);
+  assert(14 == n);
+
+  // stays at the end
+  assert(!luna_scan(&lex));
+  assert(LUNA_TOKEN_EOS == lex.tok.type);
+  munmap(buf, page);
+}
+
+/*
+ * Test sources mapped from files of page-sized
+ * lengths are nul-terminated.
+ */
+
+static void
+test_source_open() {
+  char path[] = "/tmp/luna-test-XXXXXX";
+  long page = sysconf(_SC_PAGESIZE);
+  int sizes[] = { 1, 100, page - 1, page, page + 1, 2 * page };
+  luna_source_t source;
+
+  int fd = mkstemp(path);
+  assert(fd > -1);
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    assert(0 == ftruncate(fd, 0));
+    for (int j = 0; j < sizes[i]; ++j) assert(1 == pwrite(fd, j % 80 ? "x" : "\n", 1, j));
+    assert(0 == luna_source_open(&source, path));
+    assert(source.mapped);
+    assert(sizes[i] == source.len);
+    assert(sizes[i] == strlen(source.data));
+    luna_source_free(&source);
+  }
+
+  // empty files are streamed
+  assert(0 == ftruncate(fd, 0));
+  assert(0 == luna_source_open(&source, path));
+  assert(!source.mapped);
+  assert(0 == source.len && !*source.data);
+  luna_source_free(&source);
+
+  close(fd);
+  unlink(path);
+  assert(-1 == luna_source_open(&source, path));
+}
+
+/*
+ * Test sources streamed from a pipe grow
+ * past the initial chunk.
+ */
+
+static void
+test_source_stream() {
+  int fds[2];
+  int len = 0;
+  luna_source_t source;
+  assert(0 == pipe(fds));
+
+  if (0 == fork()) {
+    char line[32];
+    close(fds[0]);
+    for (int i = 0; i < 5000; ++i) {
+      int n = sprintf(line, "a = %d\n", i);
+      assert(n == write(fds[1], line, n));
+    }
+    _exit(0);
+  }
+
+  for (int i = 0; i < 5000; ++i) len += snprintf(NULL, 0, "a = %d\n", i);
+  close(fds[1]);
+  assert(0 == luna_source_fd(&source, fds[0]));
+  close(fds[0]);
+  wait(NULL);
+
+  assert(!source.mapped);
+  assert(len == source.len);
+  assert(len == strlen(source.data));
+  assert(0 == strncmp(source.data, "a = 0\na = 1\n", 12));
+  assert(0 == strcmp(source.data + len - 9, "a = 4999\n"));
+  luna_source_free(&source);
+}
+
+/*
+ * Test literals longer than the scratch buffers.
+ */
+
+static void
+test_lexer_long_strings() {
+  int n = LUNA_BUF_SIZE * 2;
+  char *source = malloc(2 * n + 8);
+  char *p = source;
+  *p++ = '"';
+  for (int i = 0; i < n; ++i) *p++ = 'a' + i % 26;
+  *p++ = '"';
+  *p++ = '\'';
+  for (int i = 0; i < n / 2; ++i) *p++ = '\\', *p++ = 't';
+  *p++ = '\'';
+  *p = 0;
+
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, source, "test", &state);
+
+  expect(&lex, LUNA_TOKEN_STRING);
+  assert(n == strlen(lex.tok.value.as_string));
+  assert('z' == lex.tok.value.as_string[25]);
+
+  expect(&lex, LUNA_TOKEN_STRING);
+  assert(n / 2 == strlen(lex.tok.value.as_string));
+  assert('\t' == lex.tok.value.as_string[n / 2 - 1]);
+
+  char unterminated[] = "'foo";
+  luna_lexer_init(&lex, unterminated, "test", &state);
+  assert(!luna_scan(&lex));
+  assert(lex.error);
+  free(source);
+}
+
+/*
+ * Parse and generate code for `source`.
+ */
+
+static luna_vm_t *
+gen(char *source) {
+  luna_lexer_t lex;
+  luna_parser_t parser;
+  luna_ast_t ast;
+  luna_ast_init(&ast);
+  luna_lexer_init(&lex, source, "test", &state);
+  luna_parser_init(&parser, &lex, &ast);
+  luna_node_id_t root = luna_parse(&parser);
+  assert(root);
+  luna_codegen_t gen;
+  luna_codegen_init(&gen, &ast, &state);
+  luna_vm_t *vm = luna_gen(&gen, root);
+  luna_ast_free(&ast);
+  return vm;
+}
+
+/*
+ * Test shifts mask their count and bitwise ops
+ * wrap out of range floats.
+ */
+
+static void
+test_value_bitwise() {
+  char *exprs[][2] = {
+    { "a = 1\nb = 40\na << b", "256" },
+    { "a = 1\nb = 32\na << b", "1" },
+    { "a = 1\nb = -1\na << b", "-2147483648" },
+    { "a = -1\nb = 31\na << b", "-2147483648" },
+    { "a = -8\nb = 33\na >> b", "-4" },
+    { "a = 3000000000.0\na | 0", "-1294967296" },
+    { "a = 1.0 / 0\na | 0", "0" }
+  };
+
+  for (int i = 0; i < sizeof(exprs) / sizeof(exprs[0]); ++i) {
+    luna_value_t val = luna_eval(gen(exprs[i][0]));
+    assert(luna_is_int(val));
+    assert(atoi(exprs[i][1]) == luna_value_as_int(val));
+  }
+}
+
+/*
+ * Test constant pool deduplication.
+ */
+
+static void
+test_constants_dedupe() {
+  char source[] = "a = 1\na + 1 + 2 + 1";
+  luna_vm_t *vm = gen(source);
+  assert(2 == luna_vec_length(&vm->main->constants));
+  assert(5 == luna_value_as_int(luna_eval(vm)));
+
+  char cmp[] = "a = 1\na < 2";
+  vm = gen(cmp);
+  assert(4 == luna_vec_length(&vm->main->constants));
+  assert(LUNA_TRUE == luna_eval(vm));
+}
+
+/*
+ * Test constant pool growth.
+ */
+
+static void
+test_constants_growth() {
+  char source[8192];
+  int len = sprintf(source, "a = 0\na");
+  for (int i = 1; i < 1000; ++i) len += sprintf(source + len, " + %d", i);
+  luna_vm_t *vm = gen(source);
+  assert(1000 == luna_vec_length(&vm->main->constants));
+  assert(999 == luna_value_as_int(luna_vec_at(&vm->main->constants, 999)));
+  assert(499500 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Count `op` instructions in `vm`.
+ */
+
+static int
+count_op(luna_vm_t *vm, luna_op_t op) {
+  int n = 0;
+  for (int i = 0; i < kv_size(vm->main->code); ++i) {
+    if (op == OP(kv_A(vm->main->code, i))) ++n;
+  }
+  return n;
+}
+
+/*
+ * Test temporaries are released once consumed.
+ */
+
+static void
+test_registers_reuse() {
+  char source[] = "a = 1\n(a + 2) * (a + 4) + (a + 6) * (a + 8)";
+  luna_vm_t *vm = gen(source);
+  assert(4 == vm->main->nregisters);
+  assert(78 == luna_value_as_int(luna_eval(vm)));
+
+  char chain[4096];
+  int len = sprintf(chain, "a = 1\na");
+  for (int i = 0; i < 200; ++i) len += sprintf(chain + len, " + %d * 2", i);
+  vm = gen(chain);
+  assert(2 == vm->main->nregisters);
+  assert(39801 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Test locals are assigned in place.
+ */
+
+static void
+test_registers_locals() {
+  char source[] = "a = 1\nb = a + 2\nb = b * (a + 4)\nb -= a\nb";
+  luna_vm_t *vm = gen(source);
+  assert(0 == count_op(vm, LUNA_OP_MOVE));
+  assert(3 == vm->main->nregisters);
+  assert(14 == luna_value_as_int(luna_eval(vm)));
+
+  char incr[] = "a = 5\nb = a++\nc = ++a\nb * 10 + c";
+  vm = gen(incr);
+  assert(57 == luna_value_as_int(luna_eval(vm)));
+
+  // the postfix operand is its own target
+  char self_incr[] = "a = 1\na = a++\nb = 5\nb = b--\na * 10 + b";
+  vm = gen(self_incr);
+  assert(15 == luna_value_as_int(luna_eval(vm)));
+
+  // left operands read before the right writes them
+  char post[] = "b = 2\nc = b + b++\nc";
+  vm = gen(post);
+  assert(2 == count_op(vm, LUNA_OP_MOVE));
+  assert(4 == luna_value_as_int(luna_eval(vm)));
+
+  char compound[] = "b = 2\nc = b - (b += 10)\nc";
+  vm = gen(compound);
+  assert(-10 == luna_value_as_int(luna_eval(vm)));
+
+  char mul[] = "x = 3\ny = x * x++\ny";
+  vm = gen(mul);
+  assert(9 == luna_value_as_int(luna_eval(vm)));
+
+  char assign[] = "a = 1\nb = 2\nc = b + (b = a)\nc";
+  vm = gen(assign);
+  assert(3 == luna_value_as_int(luna_eval(vm)));
+
+  char self_assign[] = "b = 2\nb += (b = 5)\nb";
+  vm = gen(self_assign);
+  assert(7 == luna_value_as_int(luna_eval(vm)));
+
+  char cmp[] = "b = 0\nc = 0\nif b < (b = 5)\n  c = 1\nend\nc";
+  vm = gen(cmp);
+  assert(1 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Test more live locals than the old register file.
+ */
+
+static void
+test_registers_many() {
+  char source[8192];
+  int len = 0;
+  for (int i = 0; i < 100; ++i) len += sprintf(source + len, "v%d = %d\n", i, i);
+  len += sprintf(source + len, "v0");
+  for (int i = 1; i < 100; ++i) len += sprintf(source + len, " + v%d", i);
+  luna_vm_t *vm = gen(source);
+  assert(101 == vm->main->nregisters);
+  assert(4950 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Test trees deeper than the C stack could recurse.
+ */
+
+static void
+test_visit_deep() {
+  int n = 500000;
+  char *source = malloc(4 * n + 16);
+  char *p = source + sprintf(source, "a = 1\na");
+  for (int i = 0; i < n; ++i) p += sprintf(p, " + a");
+
+  luna_vm_t *vm = gen(source);
+  assert(vm);
+  assert(n + 1 == luna_value_as_int(luna_eval(vm)));
+
+  // folded to a single constant
+  p = source + sprintf(source, "1");
+  for (int i = 0; i < n; ++i) p += sprintf(p, " + 1");
+
+  vm = gen(source);
+  assert(vm);
+  assert(2 == kv_size(vm->main->code));
+  assert(n + 1 == luna_value_as_int(luna_eval(vm)));
+  free(source);
+}
+
+/*
+ * Test constant expressions evaluate at compile time.
+ */
+
+static void
+test_fold_constants() {
+  char source[] = "(1 + 2) * 3 - (-4 ** 2) + ~0 + 0.5";
+  luna_vm_t *vm = gen(source);
+  assert(2 == kv_size(vm->main->code));
+  assert(LUNA_OP_LOADK == OP(kv_A(vm->main->code, 0)));
+  assert(luna_value_float(24.5) == luna_eval(vm));
+
+  char partial[] = "a = 2\na * (3 + 4)";
+  vm = gen(partial);
+  assert(14 == luna_value_as_int(luna_eval(vm)));
+  assert(luna_value_int(7) == luna_vec_at(&vm->main->constants, 1));
+}
+
+/*
+ * Test folding agrees with the vm.
+ */
+
+static void
+test_fold_semantics() {
+  char *exprs[][2] = {
+    { "7", "/ 2" },
+    { "7", "/ 0" },
+    { "7", "% 0" },
+    { "7.5", "% 2" },
+    { "0 - 2147483647 - 1", "/ -1" },
+    { "2147483647", "+ 1" },
+    { "2", "** 31" },
+    { "2", "** 40" },
+    { "3", "** 4" },
+    { "1.5", "* 2" },
+    { "1", "< 2.5" },
+    { "3", ">= 3" },
+    { "2", "== 2.0" },
+    { "2", "!= 3" },
+    { "6", "| 3" },
+    { "6", "^ 3" },
+    { "1", "<< 4" },
+    { "-8", ">> 1" },
+    { "1", "<< 40" },
+    { "1", "<< 31" },
+    { "-1", "<< 31" },
+    { "1", "<< -1" },
+    { "-8", ">> 33" },
+    { "-8", ">> -30" },
+    { "3000000000.0", "| 0" },
+    { "-3000000000.5", "| 1" },
+    { "1.0 / 0", "^ 1" },
+    { "0.0 / 0", "<< 1" },
+    { "1", "<< 2.0 ** 40" }
+  };
+
+  for (int i = 0; i < sizeof(exprs) / sizeof(exprs[0]); ++i) {
+    char folded[64], runtime[64];
+    sprintf(folded, "(%s) %s", exprs[i][0], exprs[i][1]);
+    sprintf(runtime, "x = %s\nx %s", exprs[i][0], exprs[i][1]);
+    luna_vm_t *a = gen(folded);
+    luna_vm_t *b = gen(runtime);
+    assert(2 == kv_size(a->main->code));
+    assert(luna_eval(a) == luna_eval(b));
+  }
+
+  char *unary[][2] = {
+    { "~", "5" },
+    { "~", "-1" },
+    { "~", "2.5" },
+    { "~", "3000000000.0" },
+    { "-", "0 - 2147483647 - 1" },
+    { "-", "1.5" }
+  };
+
+  for (int i = 0; i < sizeof(unary) / sizeof(unary[0]); ++i) {
+    char folded[64], runtime[64];
+    sprintf(folded, "%s(%s)", unary[i][0], unary[i][1]);
+    sprintf(runtime, "x = %s\ny = %sx\ny", unary[i][1], unary[i][0]);
+    luna_vm_t *a = gen(folded);
+    luna_vm_t *b = gen(runtime);
+    assert(2 == kv_size(a->main->code));
+    assert(luna_eval(a) == luna_eval(b));
+  }
+}
+
+/*
+ * Test string literal folding.
+ */
+
+static void
+test_fold_strings() {
+  char source[] = "'foo' + \"bar\" + 'baz'";
+  luna_vm_t *vm = gen(source);
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_string(val));
+  assert(0 == strcmp("foobarbaz", ((luna_string_t *) luna_value_as_pointer(val))->val));
+
+  char cmp[] = "'foo' + 'bar' == 'foobar'";
+  vm = gen(cmp);
+  assert(LUNA_TRUE == luna_eval(vm));
+
+  // the vm concatenates likewise
+  char runtime[] = "x = 'foo'\nx + \"bar\" + 'baz'";
+  vm = gen(runtime);
+  val = luna_eval(vm);
+  assert(luna_is_string(val));
+  assert(0 == strcmp("foobarbaz", ((luna_string_t *) luna_value_as_pointer(val))->val));
+
+  char runtime_cmp[] = "x = 'foo'\nx + 'bar' == 'foobar'";
+  vm = gen(runtime_cmp);
+  assert(LUNA_TRUE == luna_eval(vm));
+
+  char runtime_neq[] = "x = 'foo'\nif x + 'bar' != 'foobaz'\n  1\nend";
+  vm = gen(runtime_neq);
+  assert(1 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Test compare-and-jump pairs fuse into branches.
+ */
+
+static void
+test_peephole_branches() {
+  char loop[] = "n = 10\ns = 0\nwhile n > 0\n  s += n\n  n -= 1\nend\ns";
+  luna_vm_t *vm = gen(loop);
+  assert(1 == count_op(vm, LUNA_OP_JLT));
+  assert(0 == count_op(vm, LUNA_OP_LT));
+  assert(55 == luna_value_as_int(luna_eval(vm)));
+
+  char cmp[] = "a = 1\nb = a < 2\nb";
+  vm = gen(cmp);
+  assert(1 == count_op(vm, LUNA_OP_JNLT));
+  assert(0 == count_op(vm, LUNA_OP_JMP));
+  assert(LUNA_TRUE == luna_eval(vm));
+
+  char nan[] = "n = 0.0 / 0\nr = 0\nif n < 1\n  r = 1\nend\nunless n >= 1\n  r += 2\nend\nr";
+  vm = gen(nan);
+  assert(2 == luna_value_as_int(luna_eval(vm)));
+
+  char test[] = "a = 1 < 2\nif a\n  a = 5\nend\na";
+  vm = gen(test);
+  assert(1 == count_op(vm, LUNA_OP_JFALSE));
+  assert(5 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Test jumps to jumps are threaded.
+ */
+
+static void
+test_peephole_threading() {
+  char source[] = "a = 1\nb = 1 > 2\nif a\n  if b\n    b = 2\n  end else\n    b = 3\n  end\nend else\n  b = 4\nend\nb";
+  luna_vm_t *vm = gen(source);
+  assert(3 == luna_value_as_int(luna_eval(vm)));
+
+  for (int pc = 0; pc < kv_size(vm->main->code); ++pc) {
+    luna_instruction_t i = kv_A(vm->main->code, pc);
+    if (LUNA_OP_JMP != OP(i)) continue;
+    assert(LUNA_OP_JMP != OP(kv_A(vm->main->code, pc + 1 + SB(i))));
+  }
+}
+
+/*
+ * Test overwritten loads are removed.
+ */
+
+static void
+test_peephole_stores() {
+  char source[] = "a = 1\na = 2\na";
+  luna_vm_t *vm = gen(source);
+  assert(2 == kv_size(vm->main->code));
+  assert(2 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Test bytecode survives a write and load.
+ */
+
+static void
+test_bytecode_roundtrip() {
+  char source[] = "s = 'foo' + 'bar'\nn = 3\nwhile n > 0\n  n -= 1\nend\ns == 'foobar'";
+  char path[] = "/tmp/luna-test.lunac";
+  uint64_t hash = luna_bytecode_hash(source, strlen(source));
+  luna_vm_t *vm = gen(source);
+  assert(0 == luna_bytecode_write(vm, hash, path));
+
+  luna_state_t state;
+  luna_state_init(&state);
+  luna_vm_t *loaded = luna_bytecode_load(path, hash, &state);
+  assert(loaded);
+  assert(kv_size(vm->main->code) == kv_size(loaded->main->code));
+  assert(0 == memcmp(vm->main->code.a, loaded->main->code.a, kv_size(vm->main->code) * 8));
+  assert(0 == memcmp(vm->main->lines.a, loaded->main->lines.a, kv_size(vm->main->lines) * 4));
+  for (int pc = 0; pc < kv_size(loaded->main->code); ++pc) {
+    if (LUNA_OP_JLT == OP(kv_A(loaded->main->code, pc))) {
+      assert(3 == kv_A(loaded->main->lines, pc));
+    }
+  }
+  assert(vm->main->nregisters == loaded->main->nregisters);
+  assert(LUNA_TRUE == luna_eval(loaded));
+
+  unlink(path);
+}
+
+/*
+ * Test stale or damaged bytecode is refused.
+ */
+
+static void
+test_bytecode_invalid() {
+  char source[] = "a = 1\na + 2";
+  char path[] = "/tmp/luna-test.lunac";
+  uint64_t hash = luna_bytecode_hash(source, strlen(source));
+  luna_state_t state;
+  luna_state_init(&state);
+  assert(!luna_bytecode_load(path, hash, &state));
+
+  luna_vm_t *vm = gen(source);
+  assert(0 == luna_bytecode_write(vm, hash, path));
+  assert(!luna_bytecode_load(path, hash + 1, &state));
+  assert(luna_bytecode_load(path, hash, &state));
+
+  // truncated
+  assert(0 == truncate(path, file_size(path) - 8));
+  assert(!luna_bytecode_load(path, hash, &state));
+
+  // written by an older compiler
+  assert(0 == luna_bytecode_write(vm, hash, path));
+  uint32_t version = LUNA_BYTECODE_VERSION - 1;
+  int fd = open(path, O_WRONLY);
+  assert(sizeof(version) == pwrite(fd, &version, sizeof(version), 4));
+  close(fd);
+  assert(!luna_bytecode_load(path, hash, &state));
+
+  unlink(path);
+}
+
+/*
+ * Parse `source` and append its code to `gen`.
+ */
+
+static luna_vm_t *
+append(luna_codegen_t *gen, char *source) {
+  luna_lexer_t lex;
+  luna_parser_t parser;
+  luna_ast_t ast;
+  luna_ast_init(&ast);
+  luna_lexer_init(&lex, source, "test", &state);
+  luna_parser_init(&parser, &lex, &ast);
+  luna_node_id_t root = luna_parse(&parser);
+  assert(root);
+  luna_vm_t *vm = luna_gen_append(gen, &ast, root);
+  luna_ast_free(&ast);
+  return vm;
+}
+
+/*
+ * Test appended code sees the locals of earlier code,
+ * and failed code leaves them as they were.
+ */
+
+static void
+test_append_locals() {
+  luna_codegen_t gen;
+  luna_codegen_init(&gen, NULL, &state);
+
+  assert(1 == luna_value_as_int(luna_eval(append(&gen, "a = 1"))));
+  assert(3 == luna_value_as_int(luna_eval(append(&gen, "b = a + 2"))));
+
+  int len = kv_size(gen.vm->main->code);
+  assert(!append(&gen, "c = d"));
+  assert(!append(&gen, "let a = e"));
+  assert(len == kv_size(gen.vm->main->code));
+  assert(!append(&gen, "c"));
+
+  char lines[][16] = { "a", "a + b", "let a = 5", "a * b", "b = 2", "a + b" };
+  int vals[] = { 1, 4, 5, 15, 2, 7 };
+  for (int i = 0; i < 6; ++i) {
+    assert(vals[i] == luna_value_as_int(luna_eval(append(&gen, lines[i]))));
+  }
+
+  luna_codegen_free(&gen);
+}
+
+/*
+ * Test the cost of a line does not grow
+ * with the code before it.
+ */
+
+static void
+test_append_growth() {
+  char buf[32];
+  luna_codegen_t gen;
+  luna_codegen_init(&gen, NULL, &state);
+
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(buf, sizeof(buf), "v%d = %d", i, i);
+    assert(i == luna_value_as_int(luna_eval(append(&gen, buf))));
+  }
+
+  luna_activation_t *fn = gen.vm->main;
+  int len = kv_size(fn->code);
+  int nconstants = luna_vec_length(&fn->constants);
+  int nregisters = fn->nregisters;
+
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(buf, sizeof(buf), "v%d + %d", i, 999 - i);
+    assert(999 == luna_value_as_int(luna_eval(append(&gen, buf))));
+  }
+
+  // add, halt
+  assert(len + 2000 == kv_size(fn->code));
+  assert(nconstants == luna_vec_length(&fn->constants));
+  assert(nregisters + 1 == fn->nregisters);
+
+  luna_codegen_free(&gen);
+}
+
+/*
+ * Test forked tasks see the locals they capture as
+ * they were when forked, and join returns their result.
+ */
+
+static void
+test_fork_join() {
+  char captures[] = "x = 10\na = x * 2 &\nb = (x + 1) &\nx = 0\njoin(a, b) + join(a) + x";
+  assert(31 == luna_value_as_int(luna_eval(gen(captures))));
+
+  char chain[] = "a = 3 &\nb = (join(a) + 4) &\nc = (join(b) * 2) &\njoin(c)";
+  assert(14 == luna_value_as_int(luna_eval(gen(chain))));
+
+  char nested[] = "x = 4\na = ((x + 1) &) &\nx = 0\njoin(join(a))";
+  assert(5 == luna_value_as_int(luna_eval(gen(nested))));
+
+  char values[] = "join(5)";
+  assert(5 == luna_value_as_int(luna_eval(gen(values))));
+
+  char none[] = "join()";
+  assert(LUNA_NULL == luna_eval(gen(none)));
+
+  char unjoined[] = "a = 1\nb = (a + 1) &\na";
+  luna_vm_t *vm = gen(unjoined);
+  assert(1 == luna_value_as_int(luna_eval(vm)));
+  assert(!luna_sched_pending(vm->sched));
+
+  luna_codegen_t gen;
+  luna_codegen_init(&gen, NULL, &state);
+  assert(1 == luna_value_as_int(luna_eval(append(&gen, "x = 1"))));
+  assert(!append(&gen, "a = (x + y) &"));
+  assert(2 == luna_value_as_int(luna_eval(append(&gen, "join((x + 1) &)"))));
+  luna_codegen_free(&gen);
+}
+
+/*
+ * Test arithmetic and ordering on tasks fail at
+ * runtime, the task failing ending with null.
+ */
+
+static void
+test_fork_arith() {
+  char *failing[][2] = {
+    { "a = 6 &\nb = 10 &\na + b", "3" },
+    { "x = 2.5\na = 1 &\nx * a", "3" },
+    { "a = 1 &\n-a", "2" },
+    { "a = 1 &\na << 1", "2" },
+    { "a = 1 &\nb = 0\nif a < 2\n  b = 1\nend\nb", "3" },
+    { "t = 5 &\nu = (t + 1) &\njoin(u)", "2" }
+  };
+
+  for (int i = 0; i < sizeof(failing) / sizeof(failing[0]); ++i) {
+    luna_vm_t *vm = gen(failing[i][0]);
+    assert(LUNA_NULL == luna_eval(vm));
+    assert(0 == strcmp("task used as a number, join() it first", vm->err));
+    assert(atoi(failing[i][1]) == vm->lineno);
+  }
+
+  // failing on another worker
+  luna_vm_t *vm = gen(failing[5][0]);
+  vm->sched = luna_sched_new(4);
+  assert(LUNA_NULL == luna_eval(vm));
+  assert(2 == vm->lineno);
+
+  char joined[] = "a = 6 &\nb = 10 &\njoin(a) + join(b)";
+  vm = gen(joined);
+  assert(16 == luna_value_as_int(luna_eval(vm)));
+  assert(!vm->err);
+
+  // tasks are equal to themselves only
+  char same[] = "a = 1 &\na == a";
+  assert(LUNA_TRUE == luna_eval(gen(same)));
+  char other[] = "a = 1 &\nb = 1 &\na == b";
+  assert(LUNA_FALSE == luna_eval(gen(other)));
+}
+
+/*
+ * Test task stacks are recycled.
+ */
+
+static void
+test_fork_pool() {
+  char source[] = "n = 0\nt = 0\nwhile n < 10000\n  p = t\n  t = (join(p) + 1) &\n  n += 1\nend\njoin(t)";
+  luna_vm_t *vm = gen(source);
+  assert(10000 == luna_value_as_int(luna_eval(vm)));
+  assert(10000 == kv_size(vm->sched->workers->stacks));
+  assert(10000 == luna_value_as_int(luna_eval(vm)));
+  assert(10000 == kv_size(vm->sched->workers->stacks));
+}
+
+/*
+ * Test the owner takes the newest task and
+ * thieves the oldest, across growth.
+ */
+
+static void
+test_deque() {
+  luna_task_t tasks[1000];
+  luna_deque_t deque;
+  assert(0 == luna_deque_init(&deque));
+
+  for (int i = 0; i < 1000; ++i) assert(0 == luna_deque_push(&deque, &tasks[i]));
+  assert(&tasks[999] == luna_deque_take(&deque));
+  assert(&tasks[0] == luna_deque_steal(&deque));
+  assert(&tasks[1] == luna_deque_steal(&deque));
+  assert(&tasks[998] == luna_deque_take(&deque));
+
+  for (int i = 2; i < 998; ++i) assert(&tasks[i] == luna_deque_steal(&deque));
+  assert(!luna_deque_steal(&deque));
+  assert(!luna_deque_take(&deque));
+}
+
+/*
+ * Test tasks run to the same results on
+ * several threads.
+ */
+
+static void
+test_fork_threads() {
+  char chain[] = "n = 0\nt = 0\nwhile n < 10000\n  p = t\n  t = (join(p) + 1) &\n  n += 1\nend\njoin(t)";
+  luna_vm_t *vm = gen(chain);
+  vm->sched = luna_sched_new(4);
+  assert(4 == vm->sched->nworkers);
+  for (int i = 0; i < 3; ++i) {
+    assert(10000 == luna_value_as_int(luna_eval(vm)));
+    assert(!luna_sched_pending(vm->sched));
+    assert(!vm->sched->running);
+  }
+
+  char fanout[] = "n = 0\ns = 0\nwhile n < 1000\n  a = (n * 2) &\n  b = (n + 1) &\n  s += join(a, b)\n  n += 1\nend\ns";
+  vm = gen(fanout);
+  vm->sched = luna_sched_new(4);
+  assert(500500 == luna_value_as_int(luna_eval(vm)));
+
+  char unjoined[] = "n = 0\nwhile n < 1000\n  t = (n * n) &\n  n += 1\nend\njoin(t)";
+  vm = gen(unjoined);
+  vm->sched = luna_sched_new(4);
+  assert(998001 == luna_value_as_int(luna_eval(vm)));
+}
+
+/*
+ * Milliseconds of the monotonic clock.
+ */
+
+static double
+now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Test sleeping tasks park, so a thousand of them
+ * sleep at once on a single thread.
+ */
+
+static void
+test_sleep() {
+  char source[] = "n = 0\nt = 0\nwhile n < 1000\n  t = sleep(50 + n % 10) &\n  n += 1\nend\njoin(t)\nn";
+  luna_vm_t *vm = gen(source);
+  double start = now_ms();
+  assert(1000 == luna_value_as_int(luna_eval(vm)));
+  double ms = now_ms() - start;
+  assert(ms >= 50 && ms < 1000);
+  assert(!luna_sched_pending(vm->sched));
+
+  vm = gen(source);
+  vm->sched = luna_sched_new(4);
+  assert(1000 == luna_value_as_int(luna_eval(vm)));
+  assert(!luna_sched_pending(vm->sched));
+
+  char main[] = "a = (sleep(30) + 1) &\nsleep(10)\njoin(a)";
+  assert(1 == luna_value_to_int(luna_eval(gen(main))));
+}
+
+/*
+ * Test sleep durations are clamped, NaN and negative
+ * ones ending now and huge ones at the latest deadline.
+ */
+
+static void
+test_sleep_clamp() {
+  luna_reactor_t *reactor = luna_reactor_new();
+  luna_task_t task;
+  assert(reactor);
+
+  luna_reactor_sleep(reactor, &task, 1e300);
+  luna_reactor_sleep(reactor, &task, 1e13);
+  assert(INT64_MAX == kv_A(reactor->timers, 0).deadline);
+  assert(INT64_MAX == kv_A(reactor->timers, 1).deadline);
+
+  luna_reactor_sleep(reactor, &task, -5);
+  luna_reactor_sleep(reactor, &task, 0.0 / 0.0);
+  double ms = now_ms();
+  assert(kv_A(reactor->timers, 0).deadline <= ms * 1e6);
+  assert(INT64_MAX > kv_A(reactor->timers, 1).deadline);
+  assert(4 == reactor->parked);
+
+  luna_reactor_free(reactor);
+}
+
+/*
+ * Test idle workers park rather than spin while
+ * main sleeps.
+ */
+
+static void
+test_sched_idle() {
+  char source[] = "a = 1 &\nsleep(200)\njoin(a)";
+  luna_vm_t *vm = gen(source);
+  vm->sched = luna_sched_new(4);
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  double start = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+  double wall = now_ms();
+  assert(1 == luna_value_as_int(luna_eval(vm)));
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  assert(now_ms() - wall >= 200);
+  assert(ts.tv_sec * 1e3 + ts.tv_nsec / 1e6 - start < 50);
+  assert(!vm->sched->running);
+}
+
+/*
+ * Write to the fifo after a while.
+ */
+
+static void *
+fifo_write(void *arg) {
+  int fd = *(int *) arg;
+  usleep(20000);
+  assert(5 == write(fd, "hello", 5));
+  close(fd);
+  return NULL;
+}
+
+/*
+ * Count the fds open on `path`.
+ */
+
+static int
+open_on(const char *path) {
+  char link[64], target[256];
+  int n = 0;
+  for (int fd = 0; fd < 1024; ++fd) {
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len < 0) continue;
+    target[len] = 0;
+    if (!strcmp(path, target)) ++n;
+  }
+  return n;
+}
+
+/*
+ * Test cat() reads files right away, and parks on
+ * fifos until the writer is done.
+ */
+
+static void
+test_cat() {
+  char path[] = "/tmp/luna-test-cat-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(3 == write(fd, "abc", 3));
+  close(fd);
+
+  char source[128];
+  snprintf(source, sizeof(source), "cat('%s')", path);
+  luna_value_t val = luna_eval(gen(source));
+  assert(luna_is_string(val));
+  assert(0 == strcmp("abc", ((luna_string_t *) luna_value_as_pointer(val))->val));
+
+  // closed though nothing polls after it
+  assert(0 == open_on(path));
+  snprintf(source, sizeof(source), "write('%s', 'abcd')", path);
+  assert(LUNA_TRUE == luna_eval(gen(source)));
+  assert(0 == open_on(path));
+  snprintf(source, sizeof(source), "cat('%s')", path);
+  unlink(path);
+  assert(LUNA_NULL == luna_eval(gen(source)));
+
+  // the writer holds the fifo open until done
+  assert(0 == mkfifo(path, 0600));
+  assert((fd = open(path, O_RDWR)) >= 0);
+  pthread_t writer;
+  pthread_create(&writer, NULL, fifo_write, &fd);
+  snprintf(source, sizeof(source), "a = cat('%s') &\nb = sleep(5) &\njoin(b)\njoin(a)", path);
+  val = luna_eval(gen(source));
+  pthread_join(writer, NULL);
+  assert(luna_is_string(val));
+  assert(0 == strcmp("hello", ((luna_string_t *) luna_value_as_pointer(val))->val));
+  unlink(path);
+}
+
+/*
+ * Test delete() removes files.
+ */
+
+static void
+test_delete() {
+  char path[] = "/tmp/luna-test-delete-XXXXXX";
+  close(mkstemp(path));
+  char source[128];
+  snprintf(source, sizeof(source), "delete('%s')", path);
+  assert(LUNA_TRUE == luna_eval(gen(source)));
+  assert(-1 == access(path, F_OK));
+  assert(LUNA_FALSE == luna_eval(gen(source)));
+}
+
+/*
+ * Test write() creates or truncates files, and
+ * stat() returns their size.
+ */
+
+static void
+test_write() {
+  char path[] = "/tmp/luna-test-write-XXXXXX";
+  close(mkstemp(path));
+  char source[256];
+  snprintf(source, sizeof(source), "write('%s', 'hello world')\nstat('%s')", path, path);
+  assert(11 == luna_value_to_int(luna_eval(gen(source))));
+  snprintf(source, sizeof(source), "write('%s', 'hi')\ncat('%s')", path, path);
+  luna_value_t val = luna_eval(gen(source));
+  assert(luna_is_string(val));
+  assert(0 == strcmp("hi", ((luna_string_t *) luna_value_as_pointer(val))->val));
+  snprintf(source, sizeof(source), "write('%s', 1)", path);
+  assert(LUNA_FALSE == luna_eval(gen(source)));
+  snprintf(source, sizeof(source), "rm('%s')\nstat('%s')", path, path);
+  assert(LUNA_NULL == luna_eval(gen(source)));
+  assert(LUNA_FALSE == luna_eval(gen("write('/nonexistent/luna', 'a')")));
+}
+
+/*
+ * Test file builtins read a path computed into the
+ * register they return to before overwriting it.
+ */
+
+static void
+test_file_operands() {
+  char path[] = "/tmp/luna-test-operands-XXXXXX";
+  close(mkstemp(path));
+  char source[256];
+  const char *steps[] = {
+    "write(join(p), 'hello')",
+    "stat(join(p))",
+    "cat(join(p))",
+    "delete(join(p))"
+  };
+  luna_value_t vals[4];
+
+  for (int i = 0; i < 4; ++i) {
+    snprintf(source, sizeof(source), "p = '%s'\n%s", path, steps[i]);
+    vals[i] = luna_eval(gen(source));
+  }
+
+  assert(LUNA_TRUE == vals[0]);
+  assert(5 == luna_value_to_int(vals[1]));
+  assert(luna_is_string(vals[2]));
+  assert(0 == strcmp("hello", ((luna_string_t *) luna_value_as_pointer(vals[2]))->val));
+  assert(LUNA_TRUE == vals[3]);
+  assert(-1 == access(path, F_OK));
+}
+
+/*
+ * Write, stat, cat and remove `n` files from as many
+ * forks on backend `io`, asserting it was used.
+ */
+
+static void
+file_forks(const char *io, luna_aio_backend_t backend, int n) {
+  char *source = malloc(n * 256);
+  char *p = source;
+  assert(source);
+  setenv("LUNA_IO", io, 1);
+
+  const char *steps[] = {
+    "w%d = write('/tmp/luna-test-aio-%d', 'abc') &\n",
+    "s%d = stat('/tmp/luna-test-aio-%d') &\n",
+    "c%d = cat('/tmp/luna-test-aio-%d') &\n",
+    "d%d = rm('/tmp/luna-test-aio-%d') &\n"
+  };
+
+  for (int s = 0; s < 4; ++s) {
+    p = source;
+    for (int i = 0; i < n; ++i) p += sprintf(p, steps[s], i, i);
+    for (int i = 0; i < n; ++i) p += sprintf(p, "join(%c%d)\n", steps[s][0], i);
+    luna_vm_t *vm = gen(source);
+    luna_value_t val = luna_eval(vm);
+    assert(backend == vm->sched->reactor->aio.backend);
+    switch (s) {
+      case 0:
+      case 3:
+        assert(LUNA_TRUE == val);
+        break;
+      case 1:
+        assert(3 == luna_value_to_int(val));
+        break;
+      case 2:
+        assert(luna_is_string(val));
+        assert(0 == strcmp("abc", ((luna_string_t *) luna_value_as_pointer(val))->val));
+        break;
+    }
+  }
+
+  char path[64];
+  for (int i = 0; i < n; ++i) {
+    snprintf(path, sizeof(path), "/tmp/luna-test-aio-%d", i);
+    assert(-1 == access(path, F_OK));
+  }
+
+  unsetenv("LUNA_IO");
+  free(source);
+}
+
+/*
+ * Test file builtins batched from many forks, through
+ * io_uring when available and the thread pool.
+ */
+
+static void
+test_aio() {
+  luna_aio_t aio;
+  assert(0 == luna_aio_init(&aio, LUNA_AIO_URING));
+  luna_aio_backend_t backend = aio.backend;
+  luna_aio_free(&aio);
+  file_forks("uring", backend, 300);
+  file_forks("threads", LUNA_AIO_THREADS, 300);
+}
+
+/*
+ * Naive search for `needle` in `buf`.
+ */
+
+static const char *
+naive_search(const char *buf, size_t len, const char *needle, size_t n) {
+  for (size_t i = 0; i + n <= len; ++i) {
+    if (!memcmp(buf + i, needle, n)) return buf + i;
+  }
+  return NULL;
+}
+
+/*
+ * Test searches agree with a naive one for needles
+ * on both sides of LUNA_SEARCH_SHORT, periodic or
+ * not, whatever their offset in the haystack.
+ */
+
+static void
+test_search() {
+  char buf[512];
+  char needle[96];
+  luna_search_t search;
+  srand(7);
+
+  for (int round = 0; round < 2000; ++round) {
+    // two letter alphabets favour periodic needles and near misses
+    int letters = round % 3 ? 2 : 4;
+    size_t len = rand() % sizeof(buf);
+    size_t n = rand() % sizeof(needle);
+    for (size_t i = 0; i < len; ++i) buf[i] = 'a' + rand() % letters;
+    for (size_t i = 0; i < n; ++i) needle[i] = 'a' + rand() % letters;
+    if (n <= len && round % 2) memcpy(buf + rand() % (len - n + 1), needle, n);
+
+    luna_search_init(&search, needle, n);
+    for (size_t off = 0; off < 4 && off <= len; ++off) {
+      const char *expected = naive_search(buf + off, len - off, needle, n);
+      assert(expected == luna_search_find(&search, buf + off, len - off));
+    }
+  }
+
+  // false candidates hand long needles over to Two-Way
+  size_t len = 1 << 16;
+  char *hay = malloc(len);
+  memset(hay, 'a', len);
+  memset(needle, 'a', 41);
+  needle[20] = 'b';
+  luna_search_init(&search, needle, 41);
+  assert(!luna_search_find(&search, hay, len));
+  hay[len - 21] = 'b';
+  assert(hay + len - 41 == luna_search_find(&search, hay, len));
+  free(hay);
+
+  luna_search_init(&search, "", 0);
+  assert(buf == luna_search_find(&search, buf, 0));
+  luna_search_init(&search, "\xff", 1);
+  assert(!luna_search_find(&search, buf, sizeof(buf)));
+}
+
+/*
+ * Test streams split lines across chunks, carrying
+ * no more than the line straddling them.
+ */
+
+static void
+test_stream() {
+  const char *text = "abc\nxyz\nbb\nlast b";
+  luna_stream_t *stream = luna_stream_new(LUNA_NULL, 0);
+  luna_stream_grep(stream, luna_value_object(luna_string(&state, "b")));
+  for (const char *p = text; *p; ++p) luna_stream_push(stream, p, 1);
+  assert(kv_max(stream->carry) <= 64);
+  luna_stream_end(stream);
+  luna_value_t val = luna_stream_result(stream);
+  assert(0 == strcmp("abc\nbb\nlast b", ((luna_string_t *) luna_value_as_pointer(val))->val));
+  luna_stream_free(stream);
+
+  // non-string patterns match nothing
+  stream = luna_stream_new(luna_value_object(luna_string(&state, "a\nb\n")), 0);
+  luna_stream_grep(stream, luna_value_int(1));
+  assert(!luna_stream_next(stream, NULL, NULL));
+  val = luna_stream_result(stream);
+  assert(0 == ((luna_string_t *) luna_value_as_pointer(val))->len);
+  luna_stream_free(stream);
+
+  // nor do patterns spanning lines
+  stream = luna_stream_new(luna_value_object(luna_string(&state, "a\nb\n")), 0);
+  luna_stream_grep(stream, luna_value_object(luna_string(&state, "a\nb")));
+  assert(!luna_stream_next(stream, NULL, NULL));
+  val = luna_stream_result(stream);
+  assert(0 == ((luna_string_t *) luna_value_as_pointer(val))->len);
+  luna_stream_free(stream);
+}
+
+/*
+ * Test chains of cat(), grep() and print() run in
+ * one pass over files spanning several chunks.
+ */
+
+static void
+test_pipeline() {
+  char path[] = "/tmp/luna-test-pipeline-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *file = fdopen(fd, "w");
+  char *expected = malloc(1 << 20);
+  char *p = expected;
+  assert(file && expected);
+  for (int i = 0; i < 40000; ++i) {
+    if (i % 1000) {
+      fprintf(file, "line %d\n", i);
+    } else {
+      fprintf(file, "match %d\n", i);
+      p += sprintf(p, "match %d\n", i);
+    }
+  }
+  fclose(file);
+
+  char source[256];
+  snprintf(source, sizeof(source), "cat('%s').grep('match')", path);
+  luna_value_t val = luna_eval(gen(source));
+  assert(luna_is_string(val));
+  assert(0 == strcmp(expected, ((luna_string_t *) luna_value_as_pointer(val))->val));
+
+  snprintf(source, sizeof(source), "a = cat('%s').grep('ma').grep('39') &\njoin(a)", path);
+  val = luna_eval(gen(source));
+  assert(0 == strcmp("match 39000\n", ((luna_string_t *) luna_value_as_pointer(val))->val));
+
+  val = luna_eval(gen("'a\\nb\\nab'.grep('a')"));
+  assert(0 == strcmp("a\nab", ((luna_string_t *) luna_value_as_pointer(val))->val));
+
+  unlink(path);
+  assert(LUNA_NULL == luna_eval(gen(source)));
+  free(expected);
+}
+
 /*
  * Test the given `fn`.
  */
@@ -323,11 +1948,15 @@ test_string() {
 int
 main(int argc, const char **argv){
   clock_t start = clock();
+  luna_state_init(&state);
 
   size(luna_object_t);
+  size(luna_value_t);
 
   suite("value");
   test(value_is);
+  test(value_box);
+  test(value_bitwise);
 
   suite("array");
   test(array_length);
@@ -345,6 +1974,79 @@ main(int argc, const char **argv){
   suite("string");
   test(string);
 
+  suite("lexer");
+  test(lexer_slices);
+  test(lexer_keywords);
+  test(lexer_numbers);
+  test(lexer_spans);
+  test(lexer_readonly);
+  test(lexer_long_strings);
+
+  suite("source");
+  test(source_open);
+  test(source_stream);
+
+  suite("arena");
+  test(arena_alloc);
+
+  suite("ast");
+  test(ast_flat);
+  test(ast_lists);
+  test(ast_errors);
+
+  suite("visitor");
+  test(visit_order);
+  test(visit_deep);
+
+  suite("constants");
+  test(constants_dedupe);
+  test(constants_growth);
+
+  suite("registers");
+  test(registers_reuse);
+  test(registers_locals);
+  test(registers_many);
+
+  suite("fold");
+  test(fold_constants);
+  test(fold_semantics);
+  test(fold_strings);
+
+  suite("peephole");
+  test(peephole_branches);
+  test(peephole_threading);
+  test(peephole_stores);
+
+  suite("bytecode");
+  test(bytecode_roundtrip);
+  test(bytecode_invalid);
+
+  suite("append");
+  test(append_locals);
+  test(append_growth);
+
+  suite("tasks");
+  test(fork_join);
+  test(fork_arith);
+  test(fork_pool);
+  test(deque);
+  test(fork_threads);
+
+  suite("reactor");
+  test(sleep);
+  test(sleep_clamp);
+  test(sched_idle);
+  test(cat);
+  test(delete);
+  test(write);
+  test(file_operands);
+  test(aio);
+
+  suite("stream");
+  test(search);
+  test(stream);
+  test(pipeline);
+
   printf("\n");
   printf("  \e[90mcompleted in \e[32m%.5fs\e[0m\n", (float) (clock() - start) / CLOCKS_PER_SEC);
   printf("\n");